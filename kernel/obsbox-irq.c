@@ -71,10 +71,32 @@ static int gncore_dma_fill(struct zio_dma_sg *zsg)
 	return 0;
 }
 
+/**
+ * Store in the block control the position of the marker within the page,
+ * so that user-space gets it together with the data
+ */
+static void ob_set_marker(struct ob_dev *ob, struct zio_cset *cset,
+			  struct zio_block *block, uint32_t acq_page)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	struct zio_attribute *zattr;
+	uint32_t mark, off;
+
+	mark = ob_readl(ob, ob->base_obs_core, &ob_regs[ACQ_MARK_ADDR]);
+	off = mark - acq_page;
+	if (mark < acq_page || off >= ob->cur_page_size)
+		off = OB_NO_MARKER;
+
+	zattr = &cset->chan[0].zattr_set.ext_zattr[OB_CHAN_ATTR_MARKER_OFFSET];
+	zattr->value = off;
+	ctrl->attr_channel.ext_val[OB_CHAN_ATTR_MARKER_OFFSET] = off;
+	ctrl->attr_channel.ext_mask |= (1 << OB_CHAN_ATTR_MARKER_OFFSET);
+}
+
 static void ob_run_dma(struct ob_dev *ob, struct zio_cset *cset)
 {
 	struct zio_block *blocks[1];
-	unsigned long flags;
+	struct zio_dma_sgt *zdma;
 	uint32_t acq_page;
 	int err;
 
@@ -85,18 +107,17 @@ static void ob_run_dma(struct ob_dev *ob, struct zio_cset *cset)
 		goto out;
 	}
 
-	/* If the hardware is busy, do not waste other time */
-	if(cset->flags & ZIO_CSET_HW_BUSY) {
+	/*
+	 * If the hardware is busy, do not waste other time. Otherwise we are
+	 * busy from now on: test and set in a single (fully ordered) atomic
+	 * operation, it pairs with clear_bit_unlock() on DMA completion.
+	 */
+	if (test_and_set_bit(OB_FLAG_DMA_BUSY, &ob->flags)) {
 		dev_warn(ob->fmc->hwdev,
 			 "PAGE LOST - DMA running\n");
 		goto out;
 	}
 
-	/* We are busy, we are starting DMA */
-	spin_lock_irqsave(&cset->lock, flags);
-	cset->flags |= ZIO_CSET_HW_BUSY;
-	spin_unlock_irqrestore(&cset->lock, flags);
-
 	/*
 	 * Get the address now so we can print it before the dma mapping.
 	 * So, on debugging we can still mesure the dma mapping time without
@@ -105,26 +126,34 @@ static void ob_run_dma(struct ob_dev *ob, struct zio_cset *cset)
 	acq_page = ob_readl(ob, ob->base_obs_core, &ob_regs[ACQ_PAGE_ADDR]);
 	dev_dbg(ob->fmc->hwdev,	"Acquisition of page 0x%x in block %p\n",
 		acq_page, blocks[0]);
+	ob_set_marker(ob, cset, blocks[0], acq_page);
 
 	/* There is only one channel, so one blocks to transfer */
-	ob->zdma = zio_dma_alloc_sg(&cset->chan[0], ob->fmc->hwdev,
-				    blocks, 1, GFP_ATOMIC);
-	if (IS_ERR(ob->zdma)) {
+	zdma = zio_dma_alloc_sg(&cset->chan[0], ob->fmc->hwdev,
+				blocks, 1, GFP_ATOMIC);
+	if (IS_ERR(zdma)) {
 		dev_err(ob->fmc->hwdev, "ZIO cannot allocate DMA memory\n");
 	        goto out_alloc;
 	}
 
 	/* Set the correct device memory offset
 	   (is a single shot state machine) */
-	ob->zdma->sg_blocks[0].dev_mem_off = acq_page;
+	zdma->sg_blocks[0].dev_mem_off = acq_page;
 
-	err = zio_dma_map_sg(ob->zdma, sizeof(struct gncore_dma_item),
+	err = zio_dma_map_sg(zdma, sizeof(struct gncore_dma_item),
 			     gncore_dma_fill);
 	if (err) {
 		dev_err(ob->fmc->hwdev, "ZIO cannot map DMA memory (%d)\n", err);
 	        goto out_map;
 	}
 
+	/*
+	 * Publish the descriptors before the transfer starts: from now on
+	 * they belong to whoever takes them first, the DMA interrupt or a
+	 * stop (ob_dma_abort)
+	 */
+	smp_store_release(&ob->zdma, zdma);
+
 	/* Configure Byte swapping */
 	ob_writel(ob, ob->base_dma_core, &ob_regs[DMA_CTL_SWP], 0x2);
 	/* Start DMA transfer */
@@ -134,11 +163,9 @@ static void ob_run_dma(struct ob_dev *ob, struct zio_cset *cset)
 	return;
 
 out_map:
-	zio_dma_free_sg(ob->zdma);
+	zio_dma_free_sg(zdma);
 out_alloc:
-	spin_lock(&cset->lock);
-	cset->flags &= ~ZIO_CSET_HW_BUSY;
-	spin_unlock(&cset->lock);
+	clear_bit_unlock(OB_FLAG_DMA_BUSY, &ob->flags);
 out:
 	zio_trigger_data_done(cset);
 	ob->errors++;
@@ -175,6 +202,26 @@ void ob_check_errors(struct ob_dev *ob)
 }
 
 
+/**
+ * Take back the descriptors of a DMA transfer that will not complete,
+ * because a stop disabled its interrupt. The engine is aborted before the
+ * memory is unmapped, it must not write there anymore.
+ */
+void ob_dma_abort(struct ob_dev *ob)
+{
+	struct zio_dma_sgt *zdma = xchg(&ob->zdma, NULL);
+
+	if (!zdma)
+		return;
+	dev_dbg(ob->fmc->hwdev, "Abort the DMA transfer in progress\n");
+	ob_writel(ob, ob->base_dma_core, &ob_regs[DMA_CTL_ABORT], 1);
+	/* the control register is read-modify-write, do not keep it */
+	ob_writel(ob, ob->base_dma_core, &ob_regs[DMA_CTL_ABORT], 0);
+	zio_dma_unmap_sg(zdma);
+	zio_dma_free_sg(zdma);
+	clear_bit_unlock(OB_FLAG_DMA_BUSY, &ob->flags);
+}
+
 /**
  * It handles the DMA interrupts. On DMA done, notify to ZIO that the
  * trigger run is over and store the block of data.
@@ -184,12 +231,20 @@ irqreturn_t ob_dma_irq_handler(int irq_core_base, void *dev_id)
 	struct fmc_device *fmc = dev_id;
 	struct ob_dev *ob = fmc_get_drvdata(fmc);
 	struct zio_cset *cset = ob->zdev->cset;
+	struct zio_dma_sgt *zdma;
 	uint32_t status;
 	int rearm;
 
 	ob_get_irq_status(ob, irq_core_base, IRQ_DMA_SRC, &status);
 	if (!status)
 		return IRQ_NONE;
+
+	/* A stop already took the transfer back and released it */
+	zdma = xchg(&ob->zdma, NULL);
+	if (unlikely(!zdma)) {
+		ob->fmc->op->irq_ack(ob->fmc);
+		return IRQ_HANDLED;
+	}
 	dev_dbg(ob->fmc->hwdev, "Page acquired in block %p\n",
 		cset->chan->active_block);
 
@@ -198,19 +253,20 @@ irqreturn_t ob_dma_irq_handler(int irq_core_base, void *dev_id)
 		ob->errors++;
 		ob->c_err++;
 	}
-	zio_dma_unmap_sg(ob->zdma);
-	zio_dma_free_sg(ob->zdma);
+	zio_dma_unmap_sg(zdma);
+	zio_dma_free_sg(zdma);
 
-	/* The block is not used anymore by the hardware */
-	spin_lock(&cset->lock);
-	cset->flags &= ~ZIO_CSET_HW_BUSY;
-	spin_unlock(&cset->lock);
+	/*
+	 * The block is not used anymore by the hardware. Release semantic:
+	 * the DMA descriptors are gone before a new transfer can start
+	 */
+	clear_bit_unlock(OB_FLAG_DMA_BUSY, &ob->flags);
 
 	/* The acquisition is over (error or not) */
 	rearm = zio_trigger_data_done(cset);
 
 	/* Do not re-arm when we have to stop the acquisition */
-	if (ob->flags & OB_FLAG_STOPPING)
+	if (test_bit(OB_FLAG_STOPPING, &ob->flags))
 		rearm = 0;
 
 	if (likely(status & GNCORE_IRQ_DMA_DONE)) {
@@ -246,7 +302,7 @@ irqreturn_t ob_core_irq_handler(int irq_core_base, void *dev_id)
 		return IRQ_NONE;
 
 	/* Stop acquisition if we have to do it */
-	if (ob->flags & OB_FLAG_STOPPING) {
+	if (test_bit(OB_FLAG_STOPPING, &ob->flags)) {
 		ob_acquisition_command(ob, 0);
 		return IRQ_HANDLED;
 	}
@@ -36,6 +36,18 @@ static struct zio_attribute ob_cset_ext_zattr[] = {
 	ZIO_PARAM_EXT("ob-streaming-enable", ZIO_RW_PERM, OB_PARM_STREAM, 1),
 };
 
+/*
+ * Byte offset, within the acquired page, of the last marker inserted by the
+ * gateware. OB_NO_MARKER when the page does not contain it. It is updated
+ * for every page and it travels with the block in its zio_control
+ */
+static struct zio_attribute ob_chan_ext_zattr[] = {
+	[OB_CHAN_ATTR_MARKER_OFFSET] = ZIO_ATTR_EXT("marker-offset",
+						    ZIO_RO_PERM,
+						    OB_MARKER_OFFSET,
+						    OB_NO_MARKER),
+};
+
 
 /**
  * Align the serdes
@@ -80,22 +92,27 @@ static int ob_wait_aligned(struct ob_dev *ob)
 int ob_acquisition_command(struct ob_dev *ob, uint32_t cmd)
 {
 	struct zio_cset *cset = &ob->zdev->cset[0];
-	unsigned long flags;
 	int err;
 
-	spin_lock_irqsave(&ob->lock, flags);
 	if (cmd == 0)
-		ob->flags &= ~OB_FLAG_RUNNING;
+		clear_bit(OB_FLAG_RUNNING, &ob->flags);
 	else
-		ob->flags |= OB_FLAG_RUNNING;
-	ob->flags &= ~OB_FLAG_STOPPING;
-	spin_unlock_irqrestore(&ob->lock, flags);
+		set_bit(OB_FLAG_RUNNING, &ob->flags);
+	/* Order the RUNNING update before the STOPPING one seen by the IRQs */
+	smp_mb__before_atomic();
+	clear_bit(OB_FLAG_STOPPING, &ob->flags);
 
 	/*
 	 * Disable the interrupt and abort any previous acquisition
 	 * in order to allow us to configure
 	 */
 	ob_disable_irq(ob);
+	/*
+	 * Interrupts are disabled: a DMA transfer in progress will never
+	 * complete. Abort it and release its descriptors before the block
+	 * it writes to goes away.
+	 */
+	ob_dma_abort(ob);
 	zio_trigger_abort_disable(cset, 0);
 	if (!cmd)
 		return 0;
@@ -142,7 +159,6 @@ static int ob_conf_set(struct device *dev, struct zio_attribute *zattr,
 {
 	struct zio_cset *cset = to_zio_cset(dev);
 	struct ob_dev *ob = cset->zdev->priv_d;
-	unsigned long flags;
 	int err = 0;
 
 	switch(zattr->id) {
@@ -152,15 +168,16 @@ static int ob_conf_set(struct device *dev, struct zio_attribute *zattr,
 		if (usr_val) {
 			err = ob_acquisition_command(ob, 1);
 		} else {
-			if (ob->flags & OB_FLAG_STOPPING) {
+			/*
+			 * The IRQ handlers will stop the acquisition on the
+			 * next page. test_and_set_bit() is fully ordered, so
+			 * two concurrent writers cannot both program the stop
+			 */
+			if (test_and_set_bit(OB_FLAG_STOPPING, &ob->flags)) {
 				err = -EBUSY;
 				dev_warn(ob->fmc->hwdev,
 					 "Acquisition stop already programmed\n");
-				break;
 			}
-			spin_lock_irqsave(&ob->lock, flags);
-			ob->flags |= OB_FLAG_STOPPING;
-			spin_unlock_irqrestore(&ob->lock, flags);
 		}
 		break;
 	case OB_PARM_STREAM: /* Enable/Disable streaming */
@@ -185,16 +202,24 @@ static int ob_conf_set(struct device *dev, struct zio_attribute *zattr,
 static int ob_info_get(struct device *dev, struct zio_attribute *zattr,
 		       uint32_t *usr_val)
 {
-	struct zio_cset *cset = to_zio_cset(dev);
-	struct ob_dev *ob = cset->zdev->priv_d;
+	struct zio_cset *cset;
+	struct ob_dev *ob;
+
+	/* Channel attribute: the value is updated on every page */
+	if (zattr->id == OB_MARKER_OFFSET) {
+		*usr_val = zattr->value;
+		return 0;
+	}
 
+	cset = to_zio_cset(dev);
+	ob = cset->zdev->priv_d;
 	switch(zattr->id) {
 	case OB_ALIGNED:
 		*usr_val = !!ob_readl(ob, ob->base_obs_core,
 				      &ob_regs[ACQ_STS_SFP_ALIGNED]);
 		break;
 	case OB_PARM_RUN:
-		*usr_val = !!(ob->flags & OB_FLAG_RUNNING);
+		*usr_val = test_bit(OB_FLAG_RUNNING, &ob->flags);
 		break;
 	case OB_PARM_STREAM: /* Enable/Disable streaming */
 		*usr_val = !!(cset->flags & ZIO_CSET_SELF_TIMED);
@@ -238,7 +263,7 @@ static int ob_probe(struct zio_device *zdev)
 
 	/* Save also the pointer to the real zio_device */
 	ob->zdev = zdev;
-	spin_lock_init(&ob->lock);
+	ob->flags = 0;
 
 	/* Enable streaming by default - let do it here to avoid autostart */
 	ob->zdev->cset[0].flags |= ZIO_CSET_SELF_TIMED;
@@ -268,6 +293,13 @@ static int ob_remove(struct zio_device *zdev)
 }
 
 
+static struct zio_channel ob_chan_tmpl = {
+	.zattr_set = {
+		.ext_zattr = ob_chan_ext_zattr,
+		.n_ext_attr = ARRAY_SIZE(ob_chan_ext_zattr),
+	},
+};
+
 /**
  * The OBS-BOX device hierarchy is really simple:
  * - 1 channel set
@@ -280,6 +312,7 @@ static struct zio_cset ob_cset[] = {
 		.raw_io = ob_input_cset,
 		.ssize = 1,
 		.n_chan = 1,
+		.chan_template = &ob_chan_tmpl,
 		.flags =  ZIO_CSET_TYPE_ANALOG |
 			  ZIO_DIR_INPUT,
 		.zattr_set = {
@@ -6,6 +6,7 @@
 
 #ifndef __OBS_BOX_H__
 #define __OBS_BOX_H__
+#include <linux/bitops.h>
 #include <linux/delay.h>
 #include <linux/fmc.h>
 #include <linux/zio.h>
@@ -13,10 +14,17 @@
 #define OB_DEFAULT_GATEWARE "fmc/spec-rf-obs-box.bin"
 #define OB_MAX_PAGE_SIZE 0x8000000 /* 128MB - half the SPEC memory */
 #define OB_MIN_PAGE_SIZE 0x0000800 /* 1MB  */
+#define OB_NO_MARKER 0xFFFFFFFF /* no marker within the page */
 
-#define OB_FLAG_RUNNING (1 << 0) /* Acquisition is running */
-#define OB_FLAG_STREAMING (1 << 1) /* Streaming is enabled */
-#define OB_FLAG_STOPPING (1 << 2) /* Streaming is enabled */
+/*
+ * Bit numbers within ob_dev->flags. They are modified only with the atomic
+ * bit operations (set_bit(), test_and_set_bit(), ...) so the interrupt
+ * handlers can test and update them without taking any lock.
+ */
+#define OB_FLAG_RUNNING 0 /* Acquisition is running */
+#define OB_FLAG_STREAMING 1 /* Streaming is enabled */
+#define OB_FLAG_STOPPING 2 /* Stop programmed, do it on next page */
+#define OB_FLAG_DMA_BUSY 3 /* A DMA transfer owns the active block */
 
 #define GNCORE_IRQ_DMA_DONE (1 << 0)
 #define GNCORE_IRQ_DMA_ERR (1 << 1)
@@ -42,17 +50,15 @@ struct ob_dev {
 	struct zio_device *hwzdev;
 	struct zio_device *zdev;
 
-	struct zio_dma_sgt *zdma;
+	struct zio_dma_sgt *zdma; /**< transfer in progress, see ob_dma_abort() */
 
 	unsigned int cur_page_size;
-	unsigned long flags;
+	unsigned long flags; /**< OB_FLAG_* bits, atomic access only */
 
 	unsigned int errors;
 	unsigned int c_err; /**< consectutive errors */
 	unsigned int done;
 
-	struct spinlock lock;
-
 	/* Base addresses */
 	unsigned int base_vic;
 	unsigned int base_dma_core;
@@ -71,6 +77,15 @@ enum obsbox_parameters {
 	OB_ALIGNED,
 	OB_PARM_RUN,
 	OB_PARM_STREAM,
+	OB_MARKER_OFFSET,
+};
+
+/*
+ * Index of the channel extended attributes. They are exported to user-space
+ * in zio_control.attr_channel.ext_val[]
+ */
+enum obsbox_chan_attributes {
+	OB_CHAN_ATTR_MARKER_OFFSET = 0,
 };
 
 enum obsbox_registers {
@@ -124,6 +139,7 @@ extern struct zio_driver ob_driver;
 /* obsbox-irq.c */
 extern int ob_init_irq(struct ob_dev *ob);
 extern void ob_exit_irq(struct ob_dev *ob);
+extern void ob_dma_abort(struct ob_dev *ob);
 /* obsbox-zio.c*/
 extern int ob_acquisition_command(struct ob_dev *ob, uint32_t cmd);
 
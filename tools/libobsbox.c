@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "libobsbox.h"
+
+static const char *obdev_path[__OBDEV_ATTR_N] = {
+	[OBDEV_RUN] = ZPATH_CMD_RUN,
+	[OBDEV_STREAMING] = ZPATH_ACQ_MODE,
+	[OBDEV_TRG_EN] = ZPATH_TRG_EN,
+	[OBDEV_PAGE_SIZE] = ZPATH_PAGE_SIZE,
+	[OBDEV_ALARMS] = ZPATH_ALARMS,
+	[OBDEV_BUF_TYPE] = ZPATH_BUF_SET,
+	[OBDEV_BUF_FLUSH] = ZPATH_BUF_FLUSH,
+	[OBDEV_VMALLOC_KB] = ZPATH_BUF_VMALLOC_SIZE,
+};
+
+static void obdev_attr_close(struct obdev *d, enum obdev_attr a)
+{
+	if (d->attr[a] >= 0)
+		close(d->attr[a]);
+	d->attr[a] = -1;
+}
+
+/**
+ * @return the descriptor of an attribute, opened the first time
+ */
+static int obdev_attr_fd(struct obdev *d, enum obdev_attr a)
+{
+	char path[128];
+
+	if (d->attr[a] >= 0)
+		return d->attr[a];
+	snprintf(path, sizeof(path), obdev_path[a], d->devid);
+	d->attr[a] = open(path, O_RDWR | O_CLOEXEC);
+	/* some attributes are write only */
+	if (d->attr[a] < 0 && errno == EACCES)
+		d->attr[a] = open(path, O_WRONLY | O_CLOEXEC);
+	return d->attr[a];
+}
+
+/**
+ * Write a value at the beginning of the attribute. A descriptor of an
+ * attribute that does not exist anymore (ZIO recreated it) is opened
+ * again once.
+ */
+static int obdev_attr_write_str(struct obdev *d, enum obdev_attr a,
+				const char *str)
+{
+	size_t len = strlen(str);
+	int retry = 1, fd;
+	ssize_t n;
+
+	while (1) {
+		fd = obdev_attr_fd(d, a);
+		if (fd < 0)
+			return -1;
+		n = pwrite(fd, str, len, 0);
+		if (n == len)
+			return 0;
+		if (n < 0 && (errno == ENODEV || errno == ENOENT) && retry--) {
+			obdev_attr_close(d, a);
+			continue;
+		}
+		if (n >= 0)
+			errno = EIO;
+		return -1;
+	}
+}
+
+static int obdev_attr_read_str(struct obdev *d, enum obdev_attr a,
+			       char *buf, size_t size)
+{
+	int retry = 1, fd;
+	ssize_t n;
+
+	while (1) {
+		fd = obdev_attr_fd(d, a);
+		if (fd < 0)
+			return -1;
+		n = pread(fd, buf, size - 1, 0);
+		if (n >= 0)
+			break;
+		if ((errno == ENODEV || errno == ENOENT) && retry--) {
+			obdev_attr_close(d, a);
+			continue;
+		}
+		return -1;
+	}
+	while (n && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		n--;
+	buf[n] = '\0';
+	return 0;
+}
+
+/**
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_attr_write(struct obdev *d, enum obdev_attr a, uint32_t v)
+{
+	char val[16];
+
+	snprintf(val, sizeof(val), "%u", v);
+	return obdev_attr_write_str(d, a, val);
+}
+
+/**
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_attr_read(struct obdev *d, enum obdev_attr a, uint32_t *v)
+{
+	char val[32], *end;
+
+	if (obdev_attr_read_str(d, a, val, sizeof(val)))
+		return -1;
+	errno = 0;
+	*v = strtoul(val, &end, 0);
+	if (end == val || errno) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+
+static void obdev_consumer_free(struct obdev *d)
+{
+	if (d->map) {
+		munmap(d->map, d->map_len);
+		d->map = NULL;
+	}
+	if (d->pipefd[0] >= 0) {
+		close(d->pipefd[0]);
+		close(d->pipefd[1]);
+		d->pipefd[0] = d->pipefd[1] = -1;
+	}
+	free(d->buf);
+	d->buf = NULL;
+	d->buf_size = 0;
+	d->pending = 0;
+}
+
+static void obdev_cdev_close(struct obdev *d)
+{
+	obdev_consumer_free(d);
+	if (d->fdd >= 0)
+		close(d->fdd);
+	if (d->fdc >= 0)
+		close(d->fdc);
+	d->fdd = d->fdc = -1;
+}
+
+/**
+ * Open a device: the ZIO char devices now, the attributes when used
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_open(struct obdev *d, uint32_t devid)
+{
+	int i;
+
+	memset(d, 0, sizeof(*d));
+	d->devid = devid;
+	for (i = 0; i < __OBDEV_ATTR_N; ++i)
+		d->attr[i] = -1;
+	d->pipefd[0] = d->pipefd[1] = -1;
+	return obsbox_open_cdev(devid, &d->fdd, &d->fdc);
+}
+
+void obdev_close(struct obdev *d)
+{
+	int i;
+
+	obdev_cdev_close(d);
+	for (i = 0; i < __OBDEV_ATTR_N; ++i)
+		obdev_attr_close(d, i);
+}
+
+
+/**
+ * Select the ZIO buffer: kmalloc when 'vmalloc_size' is 0, otherwise a
+ * vmalloc buffer of that size. The type is written only when it changes.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_buffer_set(struct obdev *d, uint32_t vmalloc_size)
+{
+	const char *type = vmalloc_size ? "vmalloc" : "kmalloc";
+	char cur[32];
+
+	if (obdev_attr_read_str(d, OBDEV_BUF_TYPE, cur, sizeof(cur)) ||
+	    strcmp(cur, type)) {
+		if (obdev_attr_write_str(d, OBDEV_BUF_TYPE, type))
+			return -1;
+		/* a new buffer instance, with its own attributes */
+		obdev_attr_close(d, OBDEV_BUF_FLUSH);
+		obdev_attr_close(d, OBDEV_VMALLOC_KB);
+	}
+	d->vmalloc_size = vmalloc_size;
+	if (!vmalloc_size)
+		return 0;
+	return obdev_attr_write(d, OBDEV_VMALLOC_KB, vmalloc_size / 1024);
+}
+
+/**
+ * Configure basic acquisition: buffer type and size, acquisition mode
+ * and page size, with the alarms and old blocks cleared. The consumer
+ * mode is set up again for the new page and buffer size.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_configure(struct obdev *d, int streaming, uint32_t page_size,
+		    uint32_t vmalloc_size)
+{
+	int ret = 0, reopen = 0;
+
+	/* Stop acquisition */
+	obdev_run(d, 0);
+	/* Disable the trigger for a safe configuration */
+	ret |= obdev_attr_write(d, OBDEV_TRG_EN, 0);
+	if (!!vmalloc_size != !!d->vmalloc_size || d->map) {
+		/* the buffer may change under the open char devices */
+		obdev_cdev_close(d);
+		reopen = 1;
+	}
+	ret |= obdev_buffer_set(d, vmalloc_size);
+	/* Clear previous alarms */
+	ret |= obdev_alarms_clear(d);
+	/* Remove blocks from previous acquisition */
+	ret |= obdev_attr_write(d, OBDEV_BUF_FLUSH, 1);
+	/* Configure acquisition mode: 1 streaming, 0 single shot */
+	ret |= obdev_attr_write(d, OBDEV_STREAMING, streaming);
+	/* Setting up page-size */
+	ret |= obdev_attr_write(d, OBDEV_PAGE_SIZE, page_size);
+	/* Enable trigger again so we can acquire */
+	ret |= obdev_attr_write(d, OBDEV_TRG_EN, 1);
+	d->streaming = streaming;
+	d->page_size = page_size;
+	d->seq.valid = 0;
+	if (ret)
+		return -1;
+
+	if (reopen) {
+		if (obsbox_open_cdev(d->devid, &d->fdd, &d->fdc))
+			return -1;
+		if (d->nonblock && obdev_nonblock_set(d, 1))
+			return -1;
+	}
+	return obdev_mode_set(d, d->mode);
+}
+
+
+/**
+ * Prepare the consumption of the pages
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_mode_set(struct obdev *d, enum obdev_mode mode)
+{
+	obdev_consumer_free(d);
+	d->mode = mode;
+	switch (mode) {
+	case OBDEV_MMAP:
+		/* ZIO exports through mmap(2) only the vmalloc buffer */
+		if (!d->vmalloc_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		d->map = mmap(0, d->vmalloc_size, PROT_READ, MAP_SHARED,
+			      d->fdd, 0);
+		if (d->map == MAP_FAILED) {
+			d->map = NULL;
+			return -1;
+		}
+		d->map_len = d->vmalloc_size;
+		/* fall through: the pipe releases the blocks */
+	case OBDEV_SPLICE:
+		return obsbox_splice_init(d->pipefd, d->page_size);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Make reading the control char device non-blocking, for event loops.
+ * The data char device stays blocking: the data of a block is there
+ * once its control has been read.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_nonblock_set(struct obdev *d, int nonblock)
+{
+	int flags = fcntl(d->fdc, F_GETFL);
+
+	if (flags < 0)
+		return -1;
+	flags = nonblock ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if (fcntl(d->fdc, F_SETFL, flags))
+		return -1;
+	d->nonblock = !!nonblock;
+	return 0;
+}
+
+/**
+ * Read the block control information and clear its alarms
+ * @return 0 on success, -1 on error and errno is appropriately set,
+ *         ENODATA at the end of a replay
+ */
+int obdev_ctrl_read(struct obdev *d, struct zio_control *zctrl)
+{
+	int n;
+
+	n = read(d->fdc, zctrl, sizeof(*zctrl));
+	if (n == 0) {
+		errno = ENODATA;
+		return -1;
+	}
+	if (n != sizeof(*zctrl)) {
+		if (n > 0)
+			errno = EIO;
+		return -1;
+	}
+	if (zctrl->zio_alarms & (ZIO_ALARM_LOST_BLOCK | ZIO_ALARM_LOST_TRIGGER)) {
+		d->alarms++;
+		obdev_alarms_clear(d);
+	}
+	return 0;
+}
+
+static int obdev_read_data(struct obdev *d, uint32_t len)
+{
+	uint32_t done = 0;
+	uint8_t *buf;
+	int n;
+
+	if (len > d->buf_size) {
+		buf = realloc(d->buf, len);
+		if (!buf)
+			return -1;
+		d->buf = buf;
+		d->buf_size = len;
+	}
+	while (done < len) {
+		n = read(d->fdd, d->buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (!n)
+				errno = EIO;
+			return -1;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * Wait for the next page, the previous one is released. In non-blocking
+ * mode 'timeout_ms' is not used.
+ * @return 1 with a page, 0 on timeout or no page, -1 on error and errno
+ *         is appropriately set
+ */
+int obdev_next(struct obdev *d, struct obdev_page *pg, int timeout_ms)
+{
+	uint64_t lost = d->seq.lost;
+	int n;
+
+	if (obdev_release(d))
+		return -1;
+	if (!d->nonblock) {
+		n = obsbox_ctrl_wait(d->fdc, timeout_ms);
+		if (n <= 0)
+			return n < 0 && errno != EINTR ? -1 : 0;
+	}
+	if (obdev_ctrl_read(d, &pg->zctrl))
+		return d->nonblock && errno == EAGAIN ? 0 : -1;
+	obsbox_seq_update(&d->seq, pg->zctrl.seq_num);
+	pg->lost = d->seq.lost != lost;
+	pg->len = obsbox_ctrl_len(&pg->zctrl);
+
+	switch (d->mode) {
+	case OBDEV_MMAP:
+		if (pg->zctrl.mem_offset + pg->len > d->map_len) {
+			errno = ERANGE;
+			return -1;
+		}
+		pg->data = d->map + pg->zctrl.mem_offset;
+		d->pending = pg->len;
+		break;
+	case OBDEV_SPLICE:
+		pg->data = NULL;
+		d->pending = pg->len;
+		break;
+	default:
+		if (obdev_read_data(d, pg->len))
+			return -1;
+		pg->data = d->buf;
+		break;
+	}
+	return 1;
+}
+
+/**
+ * Move the data of the current page to 'fdo' without copying it. When the
+ * char device does not support splice(2) it goes through a buffer.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_splice(struct obdev *d, int fdo)
+{
+	uint32_t len = d->pending, done = 0;
+	int n;
+
+	if (!len)
+		return 0;
+	if (d->pipefd[0] >= 0) {
+		if (!obsbox_splice_page(d->fdd, fdo, d->pipefd, len)) {
+			d->pending = 0;
+			return 0;
+		}
+		if (errno != EINVAL)
+			return -1;
+		/* nothing was moved, do not try again */
+		close(d->pipefd[0]);
+		close(d->pipefd[1]);
+		d->pipefd[0] = d->pipefd[1] = -1;
+	}
+	d->pending = 0;
+	if (obdev_read_data(d, len))
+		return -1;
+	while (done < len) {
+		n = write(fdo, d->buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/**
+ * Give the current page back to ZIO, see obsbox_mmap_release(). Without
+ * splice(2) the data of a mapped page stays where it is, while in
+ * OBDEV_SPLICE mode it must be read out of the char device.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obdev_release(struct obdev *d)
+{
+	uint32_t len = d->pending;
+
+	if (!len)
+		return 0;
+	d->pending = 0;
+	if (obsbox_mmap_release(d->fdd, d->pipefd, len))
+		return -1;
+	if (d->mode == OBDEV_SPLICE && d->pipefd[0] < 0)
+		return obdev_read_data(d, len);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __LIBOBSBOX_H__
+#define __LIBOBSBOX_H__
+
+#include <stdint.h>
+#include <linux/zio-user.h>
+
+#include "obsbox-common.h"
+
+/*
+ * Device handle. The sysfs attributes are opened the first time they are
+ * used and then kept open: a configuration change is a pwrite(2) on an
+ * open descriptor. The attributes of the ZIO buffer are opened again when
+ * the buffer type changes, because ZIO creates a new buffer instance.
+ *
+ * Pages are consumed with obdev_next(); how the data gets to the caller
+ * depends on the mode:
+ *   OBDEV_READ:   read(2) into a buffer of the handle
+ *   OBDEV_MMAP:   in place in the vmalloc buffer mapped once
+ *   OBDEV_SPLICE: it stays in the kernel, obdev_splice() moves it to a
+ *                 file descriptor
+ * A page is valid until the next call to obdev_next(), that releases it.
+ * In non-blocking mode the caller waits on fdc (poll, epoll) and
+ * obdev_next() returns 0 when there is no page.
+ */
+enum obdev_attr {
+	OBDEV_RUN = 0, /**< ob-run */
+	OBDEV_STREAMING, /**< ob-streaming-enable */
+	OBDEV_TRG_EN, /**< trigger/enable */
+	OBDEV_PAGE_SIZE, /**< trigger/post-samples */
+	OBDEV_ALARMS, /**< chan0/alarms */
+	OBDEV_BUF_TYPE, /**< current_buffer */
+	OBDEV_BUF_FLUSH, /**< chan0/buffer/flush */
+	OBDEV_VMALLOC_KB, /**< chan0/buffer/max-buffer-kb */
+	__OBDEV_ATTR_N,
+};
+
+enum obdev_mode {
+	OBDEV_READ = 0,
+	OBDEV_MMAP,
+	OBDEV_SPLICE,
+};
+
+struct obdev {
+	uint32_t devid;
+	int attr[__OBDEV_ATTR_N]; /**< sysfs descriptors, -1 until used */
+	int fdd, fdc;
+	int streaming;
+	uint32_t page_size;
+	uint32_t vmalloc_size; /**< 0 kmalloc */
+	enum obdev_mode mode;
+	int nonblock; /**< the caller polls fdc, obdev_next() does not wait */
+	uint8_t *map;
+	size_t map_len;
+	uint8_t *buf; /**< OBDEV_READ */
+	uint32_t buf_size;
+	int pipefd[2]; /**< splice(2) and mmap release */
+	uint32_t pending; /**< data of the last page still in the char device */
+	struct obsbox_seq seq;
+	uint64_t alarms; /**< pages with lost block or trigger alarms */
+};
+
+struct obdev_page {
+	struct zio_control zctrl;
+	const uint8_t *data; /**< NULL in OBDEV_SPLICE mode */
+	uint32_t len;
+	int lost; /**< pages lost before this one */
+};
+
+extern int obdev_open(struct obdev *d, uint32_t devid);
+extern void obdev_close(struct obdev *d);
+
+/* Attributes */
+extern int obdev_attr_write(struct obdev *d, enum obdev_attr a, uint32_t v);
+extern int obdev_attr_read(struct obdev *d, enum obdev_attr a, uint32_t *v);
+extern int obdev_buffer_set(struct obdev *d, uint32_t vmalloc_size);
+extern int obdev_configure(struct obdev *d, int streaming, uint32_t page_size,
+			   uint32_t vmalloc_size);
+
+static inline int obdev_run(struct obdev *d, int run)
+{
+	return obdev_attr_write(d, OBDEV_RUN, !!run);
+}
+
+static inline int obdev_page_size_get(struct obdev *d, uint32_t *size)
+{
+	return obdev_attr_read(d, OBDEV_PAGE_SIZE, size);
+}
+
+static inline int obdev_alarms_clear(struct obdev *d)
+{
+	return obdev_attr_write(d, OBDEV_ALARMS, 0xFF);
+}
+
+/* Pages */
+extern int obdev_mode_set(struct obdev *d, enum obdev_mode mode);
+extern int obdev_nonblock_set(struct obdev *d, int nonblock);
+extern int obdev_ctrl_read(struct obdev *d, struct zio_control *zctrl);
+extern int obdev_next(struct obdev *d, struct obdev_page *pg, int timeout_ms);
+extern int obdev_splice(struct obdev *d, int fdo);
+extern int obdev_release(struct obdev *d);
+
+#endif
@@ -0,0 +1,772 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "obsbox-common.h"
+#include "obsbox-capture.h"
+#include "obsbox-frame.h"
+#include "obsbox-stats.h"
+#include "obsbox-hist.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+#define OBAN_TURN_DEF 3564
+#define OBAN_THREADS_MAX 256
+#define OBAN_NONE UINT64_MAX
+
+struct oban;
+
+/**
+ * A page handed to the reductions, data decoded
+ * @off: position of the first sample since the beginning of the capture
+ * @slot: slot of the first sample
+ */
+struct oban_page {
+	uint64_t n;
+	const struct obcap_page_hdr *ph;
+	const uint8_t *data;
+	uint64_t off;
+	unsigned int slot;
+};
+
+/**
+ * A reduction. Every thread has its own partial result, 'size' bytes;
+ * after the run the partial results are merged in thread order, then
+ * 'finish' can walk what has been saved per page, in page order. Partial
+ * results are integers, so the outcome does not depend on which thread
+ * took which page.
+ */
+struct oban_reduce {
+	const char *name;
+	size_t size;
+	int (*init)(struct oban *an, void *part);
+	void (*page)(struct oban *an, void *part, const struct oban_page *pg);
+	void (*merge)(struct oban *an, void *dst, void *src);
+	void (*finish)(struct oban *an, void *part);
+	void (*report)(struct oban *an, void *part, FILE *f);
+	void (*free)(void *part);
+};
+
+/**
+ * Pages [lo, hi) left to a worker. They change under the lock, with
+ * atomic stores: the thieves look at them without the lock.
+ */
+struct oban_range {
+	pthread_mutex_t lock;
+	uint64_t lo, hi;
+};
+
+struct oban_worker {
+	pthread_t thread;
+	struct oban *an;
+	unsigned int id;
+	struct oban_range r;
+	void *part[8];
+	uint8_t *buf, *tmp; /**< decoded page */
+	uint64_t pages, bytes, steals;
+} __attribute__((aligned(64)));
+
+struct oban {
+	struct obcap_reader rd;
+	uint64_t x_first, x_last; /**< -x, 0:0 for all the pages */
+	uint64_t first, last;
+	unsigned int turn;
+	int pattern;
+	uint8_t mask, value;
+	unsigned int prbs;
+	const char *prefix; /**< csv output, NULL for none */
+	const struct oban_reduce *red[8];
+	unsigned int n_red;
+	/* per page, from the headers */
+	uint64_t *off;
+	unsigned int *slot;
+	uint32_t size_max;
+	/* per page, marker positions saved by the workers */
+	uint64_t *mk_first, *mk_last;
+	unsigned int n_workers;
+	struct oban_worker *w;
+	int err;
+};
+
+
+/* Per slot statistics */
+static int oban_stats_init(struct oban *an, void *part)
+{
+	return obst_init(part, an->turn);
+}
+
+static void oban_stats_page(struct oban *an, void *part,
+			    const struct oban_page *pg)
+{
+	struct obst *st = part;
+
+	/* slot 0 at 'offset' puts the first sample on 'slot' */
+	obst_align(st, (an->turn - pg->slot) % an->turn);
+	obst_fold(st, pg->data, pg->ph->size);
+}
+
+static void oban_stats_merge(struct oban *an, void *dst, void *src)
+{
+	obst_merge(dst, src);
+}
+
+static void oban_stats_report(struct oban *an, void *part, FILE *f)
+{
+	struct obst_slot *s;
+	unsigned int i, i_max = 0;
+	double mean = 0;
+	uint8_t min = 0xFF, max = 0;
+	FILE *csv = NULL;
+	char path[256];
+
+	s = calloc(an->turn, sizeof(*s));
+	if (!s)
+		return;
+	obst_read(part, s);
+	if (an->prefix) {
+		snprintf(path, sizeof(path), "%s-stats.csv", an->prefix);
+		csv = fopen(path, "w");
+		if (!csv)
+			fprintf(stderr, "Cannot create %s: %s\n", path,
+				strerror(errno));
+		else
+			fprintf(csv, "slot,count,mean,rms,std,min,max\n");
+	}
+	for (i = 0; i < an->turn; ++i) {
+		mean += s[i].mean;
+		if (s[i].count && s[i].min < min)
+			min = s[i].min;
+		if (s[i].count && s[i].max > max)
+			max = s[i].max;
+		if (s[i].std > s[i_max].std)
+			i_max = i;
+		if (csv)
+			fprintf(csv, "%u,%llu,%.3f,%.3f,%.3f,%u,%u\n", i,
+				(unsigned long long)s[i].count, s[i].mean,
+				s[i].rms, s[i].std, s[i].min, s[i].max);
+	}
+	fprintf(f, "stats: %llu turns of %u slots, mean %.3f, min %u max %u, largest std %.3f in slot %u\n",
+		(unsigned long long)((struct obst *)part)->turns, an->turn,
+		mean / an->turn, min, max, s[i_max].std, i_max);
+	if (csv)
+		fclose(csv);
+	free(s);
+}
+
+static void oban_stats_free(void *part)
+{
+	obst_free(part);
+}
+
+
+/* Histogram of the 8 bit sample codes */
+static void oban_hist_page(struct oban *an, void *part,
+			   const struct oban_page *pg)
+{
+	obhist_add(part, pg->data, pg->ph->size);
+}
+
+static void oban_hist_merge(struct oban *an, void *dst, void *src)
+{
+	obhist_merge(dst, src);
+}
+
+static void oban_hist_report(struct oban *an, void *part, FILE *f)
+{
+	struct obhist_limits lim = {OBHIST_SAT_DEF, OBHIST_SHIFT_DEF};
+	struct obhist *h = part;
+	struct obhist_summary s;
+	FILE *csv = NULL;
+	char path[256];
+	int i;
+
+	if (an->prefix) {
+		snprintf(path, sizeof(path), "%s-hist.csv", an->prefix);
+		csv = fopen(path, "w");
+		if (!csv)
+			fprintf(stderr, "Cannot create %s: %s\n", path,
+				strerror(errno));
+		else
+			fprintf(csv, "code,count\n");
+	}
+	for (i = 0; csv && i < 256; ++i)
+		fprintf(csv, "%d,%llu\n", i, (unsigned long long)h->bin[i]);
+	if (csv)
+		fclose(csv);
+	obhist_summary(h, NULL, &s);
+	obhist_print(&s, obhist_alarms(&s, &lim), f);
+}
+
+
+/*
+ * Marker timing: the in-band markers (-K) are searched in every page and
+ * the distance between two consecutive ones must be a turn. The first and
+ * the last marker of every page are saved, the distances across pages are
+ * measured at the end, in page order.
+ */
+struct oban_markers {
+	uint64_t markers;
+	uint64_t exact; /**< distance of one turn */
+	uint64_t off; /**< any other distance */
+	uint64_t d_min, d_max;
+	uint64_t pages_without;
+};
+
+static int oban_markers_init(struct oban *an, void *part)
+{
+	((struct oban_markers *)part)->d_min = OBAN_NONE;
+	return 0;
+}
+
+static void oban_markers_distance(struct oban_markers *m, unsigned int turn,
+				  uint64_t d)
+{
+	if (d == turn)
+		m->exact++;
+	else
+		m->off++;
+	if (d < m->d_min)
+		m->d_min = d;
+	if (d > m->d_max)
+		m->d_max = d;
+}
+
+static void oban_markers_page(struct oban *an, void *part,
+			      const struct oban_page *pg)
+{
+	struct oban_markers *m = part;
+	size_t len = pg->ph->size, p, prev = len;
+
+	an->mk_first[pg->n] = an->mk_last[pg->n] = OBAN_NONE;
+	for (p = obfr_find(pg->data, len, an->mask, an->value); p < len;
+	     p += 1 + obfr_find(pg->data + p + 1, len - p - 1, an->mask,
+				an->value)) {
+		m->markers++;
+		if (prev == len)
+			an->mk_first[pg->n] = pg->off + p;
+		else
+			oban_markers_distance(m, an->turn, p - prev);
+		prev = p;
+	}
+	if (prev == len)
+		m->pages_without++;
+	else
+		an->mk_last[pg->n] = pg->off + prev;
+}
+
+static void oban_markers_merge(struct oban *an, void *dst, void *src)
+{
+	struct oban_markers *d = dst, *s = src;
+
+	d->markers += s->markers;
+	d->exact += s->exact;
+	d->off += s->off;
+	d->pages_without += s->pages_without;
+	if (s->d_min < d->d_min)
+		d->d_min = s->d_min;
+	if (s->d_max > d->d_max)
+		d->d_max = s->d_max;
+}
+
+static void oban_markers_finish(struct oban *an, void *part)
+{
+	uint64_t i, last = OBAN_NONE;
+
+	for (i = an->first; i < an->last; ++i) {
+		/* no distance over lost pages */
+		if (obcap_page(&an->rd, i, NULL)->flags & OBCAP_PAGE_LOST)
+			last = OBAN_NONE;
+		if (an->mk_first[i] == OBAN_NONE)
+			continue;
+		if (last != OBAN_NONE)
+			oban_markers_distance(part, an->turn,
+					      an->mk_first[i] - last);
+		last = an->mk_last[i];
+	}
+}
+
+static void oban_markers_report(struct oban *an, void *part, FILE *f)
+{
+	struct oban_markers *m = part;
+
+	fprintf(f, "markers: %llu, distances %llu of one turn, %llu not (min %lld max %lld), %llu pages without\n",
+		(unsigned long long)m->markers, (unsigned long long)m->exact,
+		(unsigned long long)m->off,
+		m->d_min == OBAN_NONE ? -1LL : (long long)m->d_min,
+		m->exact + m->off ? (long long)m->d_max : -1LL,
+		(unsigned long long)m->pages_without);
+}
+
+
+/*
+ * PRBS check of the gateware test pattern: bits MSB first, with the
+ * polynomial x^n + x^k + 1 every bit is the xor of the bits n and k
+ * before it. A bit error gives three mismatches, as on a BERT. The first
+ * n bits of a page only feed the shift register.
+ */
+struct oban_prbs {
+	uint64_t bits;
+	uint64_t errors;
+	uint64_t pages_err;
+};
+
+static const struct {
+	unsigned int n, k;
+} oban_prbs_poly[] = {
+	{7, 6}, {9, 5}, {11, 9}, {15, 14}, {20, 3}, {23, 18}, {31, 28},
+};
+
+static int oban_prbs_tap(unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(oban_prbs_poly) / sizeof(oban_prbs_poly[0]); ++i)
+		if (oban_prbs_poly[i].n == n)
+			return oban_prbs_poly[i].k;
+	return -1;
+}
+
+static void oban_prbs_page(struct oban *an, void *part,
+			   const struct oban_page *pg)
+{
+	struct oban_prbs *p = part;
+	unsigned int n = an->prbs, k = oban_prbs_tap(n);
+	uint32_t i, skip = (n + 7) / 8;
+	uint64_t w = 0, e = 0;
+
+	for (i = 0; i < pg->ph->size; ++i) {
+		/* the newest bit is the LSB */
+		w = w << 8 | pg->data[i];
+		if (i < skip)
+			continue;
+		e += __builtin_popcount((w ^ w >> n ^ w >> k) & 0xFF);
+	}
+	if (pg->ph->size > skip)
+		p->bits += (pg->ph->size - skip) * 8ULL;
+	p->errors += e;
+	p->pages_err += !!e;
+}
+
+static void oban_prbs_merge(struct oban *an, void *dst, void *src)
+{
+	struct oban_prbs *d = dst, *s = src;
+
+	d->bits += s->bits;
+	d->errors += s->errors;
+	d->pages_err += s->pages_err;
+}
+
+static void oban_prbs_report(struct oban *an, void *part, FILE *f)
+{
+	struct oban_prbs *p = part;
+
+	fprintf(f, "prbs%u: %llu bits, %llu errors, ber %.3e, %llu pages with errors\n",
+		an->prbs, (unsigned long long)p->bits,
+		(unsigned long long)p->errors,
+		p->bits ? (double)p->errors / p->bits : 0.0,
+		(unsigned long long)p->pages_err);
+}
+
+
+static const struct oban_reduce oban_reductions[] = {
+	{"stats", sizeof(struct obst), oban_stats_init, oban_stats_page,
+	 oban_stats_merge, NULL, oban_stats_report, oban_stats_free},
+	{"hist", sizeof(struct obhist), NULL, oban_hist_page,
+	 oban_hist_merge, NULL, oban_hist_report, NULL},
+	{"markers", sizeof(struct oban_markers), oban_markers_init,
+	 oban_markers_page, oban_markers_merge, oban_markers_finish,
+	 oban_markers_report, NULL},
+	{"prbs", sizeof(struct oban_prbs), NULL, oban_prbs_page,
+	 oban_prbs_merge, NULL, oban_prbs_report, NULL},
+	{NULL},
+};
+
+static const struct oban_reduce *oban_reduce_find(const char *name)
+{
+	const struct oban_reduce *r;
+
+	for (r = oban_reductions; r->name; ++r)
+		if (!strcmp(r->name, name))
+			return r;
+	return NULL;
+}
+
+
+static int oban_take(struct oban_range *r, uint64_t *n)
+{
+	int ret = -1;
+
+	pthread_mutex_lock(&r->lock);
+	if (r->lo < r->hi) {
+		*n = r->lo;
+		__atomic_store_n(&r->lo, *n + 1, __ATOMIC_RELAXED);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return ret;
+}
+
+/**
+ * Move the back half of the biggest range left to the worker
+ * @return 0 on success, -1 when there is nothing left
+ */
+static int oban_steal(struct oban_worker *w)
+{
+	struct oban *an = w->an;
+	struct oban_range *v = NULL;
+	uint64_t left, best = 0, mid, lo, hi;
+	unsigned int i;
+
+	/* a hint without locks, the range is checked again below */
+	for (i = 0; i < an->n_workers; ++i) {
+		lo = __atomic_load_n(&an->w[i].r.lo, __ATOMIC_RELAXED);
+		hi = __atomic_load_n(&an->w[i].r.hi, __ATOMIC_RELAXED);
+		left = hi - lo;
+		if (i != w->id && lo < hi && left > best) {
+			best = left;
+			v = &an->w[i].r;
+		}
+	}
+	if (!v)
+		return -1;
+	pthread_mutex_lock(&v->lock);
+	if (v->lo >= v->hi) {
+		pthread_mutex_unlock(&v->lock);
+		return 0; /* taken meanwhile, look again */
+	}
+	mid = v->hi - (v->hi - v->lo + 1) / 2;
+	hi = v->hi;
+	__atomic_store_n(&v->hi, mid, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&v->lock);
+	/* never two locks at once: the others may be stealing too */
+	pthread_mutex_lock(&w->r.lock);
+	__atomic_store_n(&w->r.lo, mid, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->r.hi, hi, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&w->r.lock);
+	w->steals++;
+	return 0;
+}
+
+static void *oban_worker(void *arg)
+{
+	struct oban_worker *w = arg;
+	struct oban *an = w->an;
+	struct oban_page pg;
+	uint8_t *data;
+	unsigned int i;
+
+	while (!an->err) {
+		if (oban_take(&w->r, &pg.n)) {
+			if (oban_steal(w))
+				break;
+			continue;
+		}
+		pg.ph = obcap_page(&an->rd, pg.n, &data);
+		if (!pg.ph) {
+			an->err = 1;
+			break;
+		}
+		if (pg.ph->enc) {
+			if (obcap_page_decode(pg.ph, data, w->buf, w->tmp)) {
+				fprintf(stderr, "obsbox-analyze: page %llu: cannot decode\n",
+					(unsigned long long)pg.n);
+				an->err = 1;
+				break;
+			}
+			data = w->buf;
+		}
+		pg.data = data;
+		pg.off = an->off[pg.n];
+		pg.slot = an->slot[pg.n];
+		for (i = 0; i < an->n_red; ++i)
+			an->red[i]->page(an, w->part[i], &pg);
+		w->pages++;
+		w->bytes += pg.ph->size;
+	}
+	return NULL;
+}
+
+
+/**
+ * Sample positions and slot of every page, from the headers: a page with
+ * a marker (OBCAP_NO_MARKER otherwise) sets the phase, the others go on
+ * from the previous page
+ */
+static int oban_layout(struct oban *an)
+{
+	uint64_t n = an->last - an->first, i, off = 0;
+	struct obcap_page_hdr *ph;
+	unsigned int slot = 0;
+
+	an->off = calloc(an->last, sizeof(*an->off));
+	an->slot = calloc(an->last, sizeof(*an->slot));
+	an->mk_first = calloc(an->last, sizeof(*an->mk_first));
+	an->mk_last = calloc(an->last, sizeof(*an->mk_last));
+	if (!an->off || !an->slot || !an->mk_first || !an->mk_last)
+		return -1;
+	for (i = an->first; i < an->first + n; ++i) {
+		ph = obcap_page(&an->rd, i, NULL);
+		if (!ph)
+			return -1;
+		if (ph->marker != OBCAP_NO_MARKER && ph->marker < ph->size)
+			slot = (an->turn - ph->marker % an->turn) % an->turn;
+		an->off[i] = off;
+		an->slot[i] = slot;
+		off += ph->size;
+		slot = (slot + ph->size) % an->turn;
+		if (ph->size > an->size_max)
+			an->size_max = ph->size;
+	}
+	return 0;
+}
+
+static int oban_run(struct oban *an, const char *path)
+{
+	uint64_t n, t, bytes = 0, steals = 0;
+	struct oban_worker *w;
+	unsigned int i, k;
+	double dt;
+	int err = -1;
+
+	if (obcap_open(&an->rd, path)) {
+		fprintf(stderr, "Cannot open capture %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	an->first = an->x_first;
+	an->last = an->x_last;
+	if (an->last > an->rd.count || !an->last)
+		an->last = an->rd.count;
+	if (an->first > an->last)
+		an->first = an->last;
+	n = an->last - an->first;
+	if (oban_layout(an)) {
+		fprintf(stderr, "%s: cannot read the page headers\n", path);
+		goto out;
+	}
+
+	/* contiguous ranges of pages, the thieves balance them */
+	if (posix_memalign((void **)&an->w, 64, an->n_workers * sizeof(*w)))
+		goto out;
+	memset(an->w, 0, an->n_workers * sizeof(*w));
+	for (i = 0; i < an->n_workers; ++i) {
+		w = &an->w[i];
+		w->an = an;
+		w->id = i;
+		pthread_mutex_init(&w->r.lock, NULL);
+		w->r.lo = an->first + n * i / an->n_workers;
+		w->r.hi = an->first + n * (i + 1) / an->n_workers;
+		w->buf = malloc(an->size_max + 1);
+		w->tmp = malloc(an->size_max + 1);
+		if (!w->buf || !w->tmp)
+			goto out;
+		for (k = 0; k < an->n_red; ++k) {
+			w->part[k] = calloc(1, an->red[k]->size);
+			if (!w->part[k] || (an->red[k]->init &&
+					    an->red[k]->init(an, w->part[k])))
+				goto out;
+		}
+	}
+
+	t = obsbox_now_ns();
+	for (i = 0; i < an->n_workers; ++i) {
+		if (pthread_create(&an->w[i].thread, NULL, oban_worker,
+				   &an->w[i])) {
+			fprintf(stderr, "Cannot create thread\n");
+			an->err = 1;
+			an->n_workers = i;
+			break;
+		}
+	}
+	for (i = 0; i < an->n_workers; ++i) {
+		pthread_join(an->w[i].thread, NULL);
+		bytes += an->w[i].bytes;
+		steals += an->w[i].steals;
+	}
+	dt = (obsbox_now_ns() - t) / 1e9;
+	if (an->err)
+		goto out;
+
+	/* merge in thread order into the partial results of thread 0 */
+	for (k = 0; k < an->n_red; ++k) {
+		for (i = 1; i < an->n_workers; ++i)
+			an->red[k]->merge(an, an->w[0].part[k],
+					  an->w[i].part[k]);
+		if (an->red[k]->finish)
+			an->red[k]->finish(an, an->w[0].part[k]);
+	}
+
+	printf("%s: %llu pages, %.1f MB in %.3f s, %.1f MB/s, %u threads, %llu steals\n",
+	       path, (unsigned long long)n, bytes / 1e6, dt,
+	       dt > 0 ? bytes / dt / 1e6 : 0.0, an->n_workers,
+	       (unsigned long long)steals);
+	for (k = 0; k < an->n_red; ++k)
+		an->red[k]->report(an, an->w[0].part[k], stdout);
+	err = 0;
+
+out:
+	for (i = 0; an->w && i < an->n_workers; ++i) {
+		w = &an->w[i];
+		for (k = 0; k < an->n_red; ++k) {
+			if (w->part[k] && an->red[k]->free)
+				an->red[k]->free(w->part[k]);
+			free(w->part[k]);
+		}
+		free(w->buf);
+		free(w->tmp);
+		pthread_mutex_destroy(&w->r.lock);
+	}
+	free(an->w);
+	free(an->off);
+	free(an->slot);
+	free(an->mk_first);
+	free(an->mk_last);
+	an->w = NULL;
+	an->off = an->mk_first = an->mk_last = NULL;
+	an->slot = NULL;
+	an->size_max = 0;
+	obcap_release(&an->rd);
+	return err;
+}
+
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-analyze [OPTIONS] <capture-file> [<capture-file> ...]\"\n");
+	fprintf(stderr, " -r <list>: reductions, comma separated: stats, hist, markers, prbs\n"
+			"    (default stats,hist, plus markers with -K and prbs with -P)\n");
+	fprintf(stderr, " -j <number>: threads (default: online cpus)\n");
+	fprintf(stderr, " -T <number>: samples in a turn (default %d)\n",
+		OBAN_TURN_DEF);
+	fprintf(stderr, " -K <mask>:<value>: in-band marker, (sample & mask) == value\n");
+	fprintf(stderr, " -P <n>: PRBS polynomial degree: 7, 9, 11, 15, 20, 23 or 31\n");
+	fprintf(stderr, " -x <first>[:<last>]: only these pages, by page index\n");
+	fprintf(stderr, " -o <prefix>: write <prefix>-stats.csv and <prefix>-hist.csv\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "The pages of each capture are split across the threads and the\n"
+			"partial results are merged; the results do not depend on the\n"
+			"number of threads\n");
+	exit(1);
+}
+
+static void oban_reduce_add(struct oban *an, const char *name)
+{
+	const struct oban_reduce *r = oban_reduce_find(name);
+	unsigned int i;
+
+	if (!r)
+		help();
+	for (i = 0; i < an->n_red; ++i)
+		if (an->red[i] == r)
+			return;
+	an->red[an->n_red++] = r;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long a, b;
+	unsigned int mask, value, i;
+	char *list = NULL, *tok, *save;
+	struct oban an;
+	long cpus;
+	int c, ret, err = 0;
+
+	memset(&an, 0, sizeof(an));
+	an.turn = OBAN_TURN_DEF;
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	an.n_workers = cpus > 0 ? cpus : 1;
+	while ((c = getopt (argc, argv, "hr:j:T:K:P:x:o:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'r':
+			list = optarg;
+			break;
+		case 'j':
+			ret = sscanf(optarg, "%u", &an.n_workers);
+			if (ret != 1 || !an.n_workers ||
+			    an.n_workers > OBAN_THREADS_MAX)
+				help();
+			break;
+		case 'T':
+			ret = sscanf(optarg, "%u", &an.turn);
+			if (ret != 1 || !an.turn)
+				help();
+			break;
+		case 'K':
+			ret = sscanf(optarg, "%i:%i", &mask, &value);
+			if (ret != 2 || mask > 0xFF || value > 0xFF)
+				help();
+			an.pattern = 1;
+			an.mask = mask;
+			an.value = value & mask;
+			break;
+		case 'P':
+			ret = sscanf(optarg, "%u", &an.prbs);
+			if (ret != 1 || oban_prbs_tap(an.prbs) < 0)
+				help();
+			break;
+		case 'x':
+			ret = sscanf(optarg, "%llu:%llu", &a, &b);
+			if (ret < 1)
+				help();
+			an.x_first = a;
+			an.x_last = ret == 2 ? b + 1 : a + 1;
+			break;
+		case 'o':
+			an.prefix = optarg;
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (optind == argc)
+		help();
+
+	if (list) {
+		for (tok = strtok_r(list, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save)) {
+			if (an.n_red == sizeof(an.red) / sizeof(an.red[0]))
+				help();
+			oban_reduce_add(&an, tok);
+		}
+	} else {
+		oban_reduce_add(&an, "stats");
+		oban_reduce_add(&an, "hist");
+		if (an.pattern)
+			oban_reduce_add(&an, "markers");
+		if (an.prbs)
+			oban_reduce_add(&an, "prbs");
+	}
+	for (i = 0; i < an.n_red; ++i) {
+		if (an.red[i] == oban_reduce_find("markers") && !an.pattern) {
+			fprintf(stderr, "markers: the in-band marker is missing (-K)\n");
+			help();
+		}
+		if (an.red[i] == oban_reduce_find("prbs") && !an.prbs)
+			an.prbs = 31;
+	}
+
+	for (; optind < argc; ++optind) {
+		if (oban_run(&an, argv[optind]))
+			err = 1;
+		an.err = 0;
+	}
+	exit(err);
+}
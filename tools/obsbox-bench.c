@@ -0,0 +1,477 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBB_MAX_LIST 16
+#define OBB_SECONDS_DEF 5
+#define OBB_WARMUP_DEF 8
+#define OBB_MMAP_PAGES 8
+#define OBB_LAT_MAX (1 << 20) /* latency samples kept per run */
+#define OBB_TRY 10
+
+static const char *obb_pages_def = "65536,262144,1048576,2097152,4194304";
+static const char *obb_buffers_def = "kmalloc,vmalloc";
+static const char *obb_modes_def = "stream,single";
+static const char *obb_consumers_def = "read,mmap";
+
+enum obb_consumer {
+	OBB_READ,
+	OBB_MMAP,
+};
+
+/**
+ * One point of the sweep and what has been measured
+ */
+struct obb_run {
+	uint32_t page_size;
+	uint32_t vmalloc_size; /**< 0 for kmalloc */
+	int streaming;
+	enum obb_consumer consumer;
+
+	unsigned int warm; /**< pages seen while warming up */
+	uint64_t pages, bytes, lost, alarms;
+	double seconds;
+	uint64_t *lat; /**< ns, one per measured page */
+	unsigned int n_lat;
+	int err;
+};
+
+static volatile sig_atomic_t obb_stop;
+static uint32_t devid;
+static unsigned int seconds = OBB_SECONDS_DEF, warmup = OBB_WARMUP_DEF;
+static long max_pages = -1;
+static int touch;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-bench -d 0x<devid> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -p <size>[,<size>...]: page sizes (default %s)\n",
+		obb_pages_def);
+	fprintf(stderr, " -b <buffer>[,<buffer>...]: buffers, kmalloc or vmalloc[:<bytes>]\n"
+			"    (default %s, vmalloc of %d pages)\n",
+		obb_buffers_def, OBB_MMAP_PAGES);
+	fprintf(stderr, " -m <mode>[,<mode>...]: stream and/or single (default %s)\n",
+		obb_modes_def);
+	fprintf(stderr, " -c <consumer>[,<consumer>...]: read and/or mmap (default %s)\n",
+		obb_consumers_def);
+	fprintf(stderr, " -t <seconds>: duration of every run (default %d)\n",
+		OBB_SECONDS_DEF);
+	fprintf(stderr, " -n <number>: stop a run after this many pages\n");
+	fprintf(stderr, " -w <number>: pages not measured at the start of every run (default %d)\n",
+		OBB_WARMUP_DEF);
+	fprintf(stderr, " -T: read the page (a byte per cache line), as a consumer would\n");
+	fprintf(stderr, " -o <file>: write the results to file (default stdout)\n");
+	fprintf(stderr, " -F <csv|json>: results format (default csv)\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It runs every combination and measures MB/s, pages/s, the loss rate\n"
+			"(sequence holes) and the latency percentiles. The latency is the time\n"
+			"from the page being ready to its release in streaming mode, from the\n"
+			"start command to the release in single-shot mode. mmap runs only with\n"
+			"vmalloc buffers, the other combinations are skipped\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obb_sighandler(int sig)
+{
+	obb_stop = 1;
+}
+
+/**
+ * Split a comma separated list in place
+ * @return the number of items, -1 when there are too many
+ */
+static int obb_split(char *str, char **items)
+{
+	int n = 0;
+	char *s;
+
+	for (s = strtok(str, ","); s; s = strtok(NULL, ",")) {
+		if (n == OBB_MAX_LIST)
+			return -1;
+		items[n++] = s;
+	}
+	return n;
+}
+
+
+static int obb_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * @return the p-th percentile in us, the samples must be sorted
+ */
+static double obb_percentile(const struct obb_run *r, double p)
+{
+	unsigned int i;
+
+	if (!r->n_lat)
+		return 0;
+	i = p / 100 * (r->n_lat - 1) + 0.5;
+	return r->lat[i] / 1e3;
+}
+
+
+/**
+ * Consume one page
+ * @return the number of bytes, 0 on timeout, -1 on error
+ */
+static int obb_page(struct obb_run *r, struct obdev *d, uint64_t t_start)
+{
+	struct obdev_page pg;
+	uint32_t done;
+	uint64_t t;
+	int n, sum = 0;
+
+	n = obsbox_ctrl_wait(d->fdc, 1000);
+	if (n <= 0)
+		return n;
+	t = r->streaming ? obsbox_now_ns() : t_start;
+	n = obdev_next(d, &pg, 0);
+	if (n <= 0) {
+		fprintf(stderr, "obsbox-bench: cannot get a page: %s\n",
+			n < 0 ? strerror(errno) : "no data");
+		return -1;
+	}
+	if (touch) {
+		for (done = 0; done < pg.len; done += 64)
+			sum += pg.data[done];
+		/* keep the loop */
+		__asm__ volatile("" : : "r"(sum));
+	}
+	if (obdev_release(d)) {
+		fprintf(stderr, "obsbox-bench: cannot release block: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (r->warm < warmup) {
+		/* warming up: only follow the sequence number */
+		d->seq.lost = 0;
+		r->warm++;
+		return pg.len;
+	}
+	r->pages++;
+	r->bytes += pg.len;
+	if (r->n_lat < OBB_LAT_MAX)
+		r->lat[r->n_lat++] = obsbox_now_ns() - t;
+
+	return pg.len;
+}
+
+/**
+ * Configure the board for a point of the sweep and measure it. The device
+ * stays open across the sweep, only the configuration changes.
+ * @return 0 on success, -1 on error
+ */
+static int obb_run(struct obdev *d, struct obb_run *r)
+{
+	int try = OBB_TRY, ret;
+	uint64_t t_start, t_end, t_cmd = 0, t_first, alarms = d->alarms;
+
+	if (obdev_configure(d, r->streaming, r->page_size, r->vmalloc_size)) {
+		fprintf(stderr, "obsbox-bench: cannot configure: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	if (obdev_mode_set(d, r->consumer == OBB_MMAP ? OBDEV_MMAP : OBDEV_READ)) {
+		fprintf(stderr, "obsbox-bench: cannot %s buffer: %s\n",
+			r->consumer == OBB_MMAP ? "mmap" : "allocate",
+			strerror(errno));
+		goto out;
+	}
+
+	if (r->streaming && obdev_run(d, 1) < 0) {
+		fprintf(stderr, "obsbox-bench: cannot start acquisition: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	t_start = obsbox_now_ns();
+	t_end = t_start + seconds * 1000000000ULL;
+	t_first = warmup ? 0 : t_start;
+	while (!obb_stop && try && obsbox_now_ns() < t_end &&
+	       (max_pages < 0 || r->pages < max_pages)) {
+		if (!r->streaming) {
+			t_cmd = obsbox_now_ns();
+			if (obdev_run(d, 1) < 0) {
+				try--;
+				continue;
+			}
+		}
+		ret = obb_page(r, d, t_cmd);
+		if (ret < 0)
+			goto out;
+		if (!ret) {
+			try--;
+			continue;
+		}
+		try = OBB_TRY;
+		/* the clock starts after the warm up */
+		if (!t_first && r->warm == warmup)
+			t_first = obsbox_now_ns();
+	}
+	if (!try)
+		fprintf(stderr, "obsbox-bench: fail %d times to acquire a page\n",
+			OBB_TRY);
+	r->seconds = t_first ? (obsbox_now_ns() - t_first) / 1e9 : 0;
+	r->lost = d->seq.lost;
+	r->err = !try;
+
+out:
+	obdev_run(d, 0);
+	r->alarms = d->alarms - alarms;
+	qsort(r->lat, r->n_lat, sizeof(*r->lat), obb_cmp_u64);
+
+	return r->seconds ? 0 : -1;
+}
+
+
+static const char *obb_buffer_name(const struct obb_run *r)
+{
+	return r->vmalloc_size ? "vmalloc" : "kmalloc";
+}
+
+static const char *obb_consumer_name(const struct obb_run *r)
+{
+	return r->consumer == OBB_MMAP ? "mmap" : "read";
+}
+
+static void obb_print_csv_header(FILE *f)
+{
+	fprintf(f, "page_size,buffer,vmalloc_size,mode,consumer,pages,bytes,seconds,mb_s,pages_s,lost,loss_rate,alarms,lat_p50_us,lat_p90_us,lat_p99_us,lat_p999_us,lat_max_us,status\n");
+}
+
+static void obb_print_csv(FILE *f, const struct obb_run *r)
+{
+	fprintf(f, "%u,%s,%u,%s,%s,%llu,%llu,%.3f,%.1f,%.1f,%llu,%.6f,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%s\n",
+		r->page_size, obb_buffer_name(r), r->vmalloc_size,
+		r->streaming ? "stream" : "single", obb_consumer_name(r),
+		(unsigned long long)r->pages, (unsigned long long)r->bytes,
+		r->seconds, r->seconds ? r->bytes / r->seconds / 1e6 : 0,
+		r->seconds ? r->pages / r->seconds : 0,
+		(unsigned long long)r->lost,
+		r->pages + r->lost ? (double)r->lost / (r->pages + r->lost) : 0,
+		(unsigned long long)r->alarms,
+		obb_percentile(r, 50), obb_percentile(r, 90),
+		obb_percentile(r, 99), obb_percentile(r, 99.9),
+		obb_percentile(r, 100), r->err ? "error" : "ok");
+}
+
+static void obb_print_json(FILE *f, const struct obb_run *r, int first)
+{
+	fprintf(f, "%s\n    {\"page_size\": %u, \"buffer\": \"%s\", \"vmalloc_size\": %u, "
+		"\"mode\": \"%s\", \"consumer\": \"%s\", "
+		"\"pages\": %llu, \"bytes\": %llu, \"seconds\": %.3f, "
+		"\"mb_s\": %.1f, \"pages_s\": %.1f, \"lost\": %llu, "
+		"\"loss_rate\": %.6f, \"alarms\": %llu, "
+		"\"lat_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+		"\"p999\": %.1f, \"max\": %.1f}, \"status\": \"%s\"}",
+		first ? "" : ",",
+		r->page_size, obb_buffer_name(r), r->vmalloc_size,
+		r->streaming ? "stream" : "single", obb_consumer_name(r),
+		(unsigned long long)r->pages, (unsigned long long)r->bytes,
+		r->seconds, r->seconds ? r->bytes / r->seconds / 1e6 : 0,
+		r->seconds ? r->pages / r->seconds : 0,
+		(unsigned long long)r->lost,
+		r->pages + r->lost ? (double)r->lost / (r->pages + r->lost) : 0,
+		(unsigned long long)r->alarms,
+		obb_percentile(r, 50), obb_percentile(r, 90),
+		obb_percentile(r, 99), obb_percentile(r, 99.9),
+		obb_percentile(r, 100), r->err ? "error" : "ok");
+}
+
+
+int main(int argc, char **argv)
+{
+	char *pages_s = strdup(obb_pages_def), *buffers_s = strdup(obb_buffers_def);
+	char *modes_s = strdup(obb_modes_def), *consumers_s = strdup(obb_consumers_def);
+	char *pages[OBB_MAX_LIST], *buffers[OBB_MAX_LIST];
+	char *modes[OBB_MAX_LIST], *consumers[OBB_MAX_LIST];
+	int n_pages, n_buffers, n_modes, n_consumers, ip, ib, im, ic;
+	int c, ret, json = 0, first = 1, failed = 0;
+	char *out = NULL;
+	struct obb_run r;
+	struct obdev d;
+	uint64_t *lat;
+	FILE *f = stdout;
+
+	while ((c = getopt (argc, argv, "hd:p:b:m:c:t:n:w:To:F:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'p':
+			pages_s = optarg;
+			break;
+		case 'b':
+			buffers_s = optarg;
+			break;
+		case 'm':
+			modes_s = optarg;
+			break;
+		case 'c':
+			consumers_s = optarg;
+			break;
+		case 't':
+			ret = sscanf(optarg, "%u", &seconds);
+			if (ret != 1 || !seconds)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%ld", &max_pages);
+			if (ret != 1 || max_pages <= 0)
+				help();
+			break;
+		case 'w':
+			ret = sscanf(optarg, "%u", &warmup);
+			if (ret != 1)
+				help();
+			break;
+		case 'T':
+			touch = 1;
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'F':
+			if (!strcmp(optarg, "json"))
+				json = 1;
+			else if (strcmp(optarg, "csv"))
+				help();
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	n_pages = obb_split(pages_s, pages);
+	n_buffers = obb_split(buffers_s, buffers);
+	n_modes = obb_split(modes_s, modes);
+	n_consumers = obb_split(consumers_s, consumers);
+	if (n_pages <= 0 || n_buffers <= 0 || n_modes <= 0 || n_consumers <= 0)
+		help();
+	/* validate the whole sweep before touching the board */
+	for (ip = 0; ip < n_pages; ++ip)
+		if (sscanf(pages[ip], "%u", &r.page_size) != 1 || !r.page_size)
+			help();
+	for (ib = 0; ib < n_buffers; ++ib)
+		if (strcmp(buffers[ib], "kmalloc") &&
+		    strcmp(buffers[ib], "vmalloc") &&
+		    (sscanf(buffers[ib], "vmalloc:%u", &r.vmalloc_size) != 1 ||
+		     !r.vmalloc_size))
+			help();
+	for (im = 0; im < n_modes; ++im)
+		if (strcmp(modes[im], "stream") && strcmp(modes[im], "single"))
+			help();
+	for (ic = 0; ic < n_consumers; ++ic)
+		if (strcmp(consumers[ic], "read") && strcmp(consumers[ic], "mmap"))
+			help();
+
+	if (out) {
+		f = fopen(out, "w");
+		if (!f) {
+			fprintf(stderr, "Cannot open %s: %s\n", out,
+				strerror(errno));
+			exit(1);
+		}
+	}
+	lat = malloc(OBB_LAT_MAX * sizeof(*lat));
+	if (!lat)
+		exit(1);
+
+	if (obdev_open(&d, devid)) {
+		fprintf(stderr, "Cannot open device 0x%x: %s\n", devid,
+			strerror(errno));
+		exit(1);
+	}
+
+	signal(SIGINT, obb_sighandler);
+	signal(SIGTERM, obb_sighandler);
+
+	if (json)
+		fprintf(f, "{\"version\": \"%s\", \"zio_version\": \"%s\", \"devid\": \"0x%04x\",\n  \"runs\": [",
+			GIT_VERSION, ZIO_GIT_VERSION, devid);
+	else
+		obb_print_csv_header(f);
+	for (ip = 0; ip < n_pages && !obb_stop; ++ip)
+	for (ib = 0; ib < n_buffers && !obb_stop; ++ib)
+	for (im = 0; im < n_modes && !obb_stop; ++im)
+	for (ic = 0; ic < n_consumers && !obb_stop; ++ic) {
+		memset(&r, 0, sizeof(r));
+		r.lat = lat;
+		sscanf(pages[ip], "%u", &r.page_size);
+		if (!strcmp(buffers[ib], "vmalloc"))
+			r.vmalloc_size = OBB_MMAP_PAGES * r.page_size;
+		else
+			sscanf(buffers[ib], "vmalloc:%u", &r.vmalloc_size);
+		r.streaming = !strcmp(modes[im], "stream");
+		r.consumer = strcmp(consumers[ic], "mmap") ? OBB_READ : OBB_MMAP;
+		/* ZIO exports through mmap(2) only the vmalloc buffer */
+		if (r.consumer == OBB_MMAP && !r.vmalloc_size)
+			continue;
+		if (r.vmalloc_size && r.vmalloc_size < r.page_size) {
+			fprintf(stderr, "obsbox-bench: skip page %u, vmalloc %u is smaller\n",
+				r.page_size, r.vmalloc_size);
+			continue;
+		}
+
+		fprintf(stderr, "page %u %s %u %s %s ...\n", r.page_size,
+			obb_buffer_name(&r), r.vmalloc_size, modes[im],
+			consumers[ic]);
+		if (obb_run(&d, &r)) {
+			r.err = 1;
+			failed++;
+		}
+		if (json)
+			obb_print_json(f, &r, first);
+		else
+			obb_print_csv(f, &r);
+		first = 0;
+		fflush(f);
+	}
+	if (json)
+		fprintf(f, "\n  ]\n}\n");
+	if (f != stdout)
+		fclose(f);
+	obdev_close(&d);
+	free(lat);
+
+	exit(failed ? 1 : 0);
+}
@@ -0,0 +1,781 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "obsbox-common.h"
+#include "obsbox-capture.h"
+#include "obsbox-compress.h"
+
+/* CRC32C (Castagnoli), reflected polynomial */
+#define OBCAP_CRC_POLY 0x82F63B78
+
+static uint32_t obcap_crc_table[8][256];
+
+static uint32_t (*obcap_crc32c_fn)(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t obcap_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len);
+#if defined(__x86_64__)
+static uint32_t obcap_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len);
+#endif
+
+/**
+ * Build the tables and choose the implementation before main()
+ */
+__attribute__((constructor))
+static void obcap_crc_table_init(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; ++i) {
+		crc = i;
+		for (j = 0; j < 8; ++j)
+			crc = (crc >> 1) ^ (OBCAP_CRC_POLY & -(crc & 1));
+		obcap_crc_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; ++i)
+		for (j = 1; j < 8; ++j)
+			obcap_crc_table[j][i] =
+				(obcap_crc_table[j - 1][i] >> 8) ^
+				obcap_crc_table[0][obcap_crc_table[j - 1][i] & 0xFF];
+
+	obcap_crc32c_fn = obcap_crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+		obcap_crc32c_fn = obcap_crc32c_hw;
+#endif
+}
+
+/**
+ * Generic implementation, slicing by 8
+ */
+static uint32_t obcap_crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc = (crc >> 8) ^ obcap_crc_table[0][(crc ^ *p++) & 0xFF];
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		v ^= crc;
+		crc = obcap_crc_table[7][v & 0xFF] ^
+		      obcap_crc_table[6][(v >> 8) & 0xFF] ^
+		      obcap_crc_table[5][(v >> 16) & 0xFF] ^
+		      obcap_crc_table[4][(v >> 24) & 0xFF] ^
+		      obcap_crc_table[3][(v >> 32) & 0xFF] ^
+		      obcap_crc_table[2][(v >> 40) & 0xFF] ^
+		      obcap_crc_table[1][(v >> 48) & 0xFF] ^
+		      obcap_crc_table[0][v >> 56];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ obcap_crc_table[0][(crc ^ *p++) & 0xFF];
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.2 implementation, the CPU has a CRC32C instruction
+ */
+__attribute__((target("sse4.2")))
+static uint32_t obcap_crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc, v;
+
+	while (len && ((uintptr_t)p & 7)) {
+		crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&v, p, 8);
+		crc64 = __builtin_ia32_crc32di(crc64, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc64 = __builtin_ia32_crc32qi(crc64, *p++);
+
+	return crc64;
+}
+#endif
+
+/**
+ * It computes the CRC32C of a buffer
+ * @crc: 0 to start, the previous result to continue
+ */
+uint32_t obcap_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~obcap_crc32c_fn(~crc, buf, len);
+}
+
+
+void obcap_file_hdr_init(struct obcap_file_hdr *fh, uint32_t align,
+			 uint32_t devid)
+{
+	memset(fh, 0, sizeof(*fh));
+	memcpy(fh->magic, OBCAP_MAGIC, sizeof(fh->magic));
+	fh->version = OBCAP_VERSION;
+	fh->align = align;
+	fh->devid = devid;
+	fh->t_create = obsbox_realtime_ns();
+}
+
+
+/**
+ * Fill a page header from the ZIO control
+ * @data: stored bytes, used for the CRC. NULL when the data does not pass
+ *        through user-space (the header gets OBCAP_PAGE_NOCRC)
+ * @stored: bytes stored after the header
+ */
+void obcap_page_hdr_init(struct obcap_page_hdr *ph,
+			 const struct zio_control *zctrl,
+			 const void *data, uint32_t stored, uint16_t flags,
+			 uint32_t enc)
+{
+	memset(ph, 0, sizeof(*ph));
+	ph->magic = OBCAP_PAGE_MAGIC;
+	ph->seq_num = zctrl->seq_num;
+	ph->size = obsbox_ctrl_len(zctrl);
+	ph->stored = stored;
+	ph->alarms = zctrl->zio_alarms | (zctrl->drv_alarms << 8);
+	ph->marker = obsbox_ctrl_marker(zctrl);
+	ph->tstamp_s = zctrl->tstamp.secs;
+	ph->tstamp_t = zctrl->tstamp.ticks;
+	ph->t_host = obsbox_realtime_ns();
+	ph->ssize = zctrl->ssize;
+	ph->flags = flags;
+	ph->enc = enc;
+	if (data)
+		ph->crc = obcap_crc32c(0, data, stored);
+	else
+		ph->flags |= OBCAP_PAGE_NOCRC;
+	obcap_page_hdr_seal(ph);
+}
+
+/**
+ * Compute the header CRC, call it after any change to the header
+ */
+void obcap_page_hdr_seal(struct obcap_page_hdr *ph)
+{
+	ph->hdr_crc = obcap_crc32c(0, ph, offsetof(struct obcap_page_hdr,
+						   hdr_crc));
+}
+
+
+/**
+ * Append a page to the index, it grows when needed
+ * @return 0 on success, -1 on error
+ */
+int obcap_index_add(struct obcap_index *idx, uint64_t off,
+		    const struct obcap_page_hdr *ph)
+{
+	struct obcap_index_ent *e;
+
+	if (idx->count == idx->size) {
+		idx->size = idx->size ? idx->size * 2 : 4096;
+		e = realloc(idx->ent, idx->size * sizeof(*e));
+		if (!e)
+			return -1;
+		idx->ent = e;
+	}
+	e = &idx->ent[idx->count++];
+	e->off = off;
+	e->time = obcap_page_time(ph);
+	e->seq_num = ph->seq_num;
+	e->stored = ph->stored;
+
+	return 0;
+}
+
+
+/**
+ * Build the index block, entries and footer, to be written at the given
+ * offset. The buffer is aligned and padded to 'align', so it can be
+ * written with O_DIRECT; free it with free(3).
+ * @len: where to store the length of the block
+ * @return the block, NULL on error
+ */
+uint8_t *obcap_index_build(const struct obcap_index *idx, uint64_t off,
+			   uint32_t align, size_t *len)
+{
+	struct obcap_index_footer *ft;
+	size_t ilen;
+	uint8_t *buf;
+
+	ilen = idx->count * sizeof(*idx->ent);
+	*len = obcap_round(ilen + sizeof(*ft), align);
+	if (posix_memalign((void **)&buf, align, *len))
+		return NULL;
+	memset(buf, 0, *len);
+	memcpy(buf, idx->ent, ilen);
+	ft = (void *)(buf + ilen);
+	memcpy(ft->magic, OBCAP_IDX_MAGIC, sizeof(ft->magic));
+	ft->index_off = off;
+	ft->count = idx->count;
+	ft->crc = obcap_crc32c(0, idx->ent, ilen);
+
+	return buf;
+}
+
+/**
+ * Write the index at the given offset and update the file header. Buffers,
+ * offsets and lengths are aligned so it works also with O_DIRECT.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_index_write(int fd, struct obcap_index *idx, uint64_t off,
+		      const struct obcap_file_hdr *hdr)
+{
+	uint32_t align = hdr->align;
+	struct obcap_file_hdr *fh;
+	size_t len, ilen;
+	uint8_t *buf;
+	int err = -1;
+
+	ilen = idx->count * sizeof(*idx->ent);
+	buf = obcap_index_build(idx, off, align, &len);
+	if (!buf)
+		return -1;
+	if (pwrite(fd, buf, len, off) != len)
+		goto out;
+
+	/* The footer is at a known distance from the end */
+	if (ftruncate(fd, off + ilen + sizeof(struct obcap_index_footer)))
+		goto out;
+
+	memset(buf, 0, align);
+	fh = (void *)buf;
+	*fh = *hdr;
+	fh->index_off = off;
+	fh->count = idx->count;
+	if (pwrite(fd, buf, align, 0) != align)
+		goto out;
+	err = 0;
+out:
+	free(buf);
+	return err;
+}
+
+
+/**
+ * Write the set file of a striped capture
+ * @paths: the stripe files, in stripe order
+ * @map: the stripe of each page in stream order, NULL when count is 0
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_set_write(const char *path, char paths[][OBCAP_PATH_MAX],
+		    unsigned int stripes, const uint8_t *map, uint64_t count)
+{
+	struct obcap_set_hdr h;
+	int fd, err = -1;
+
+	if (!stripes || stripes > OBCAP_STRIPES_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OBCAP_SET_MAGIC, sizeof(h.magic));
+	h.version = OBCAP_VERSION;
+	h.stripes = stripes;
+	h.count = count;
+	h.crc = obcap_crc32c(0, map, count);
+	memcpy(h.path, paths, stripes * OBCAP_PATH_MAX);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (write(fd, &h, sizeof(h)) == sizeof(h) &&
+	    (!count || write(fd, map, count) == count))
+		err = 0;
+	if (close(fd))
+		err = -1;
+	return err;
+}
+
+
+/**
+ * Create a new capture file
+ * @align: record alignment, 0 for the default
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_create(struct obcap_writer *w, const char *path,
+		 uint32_t align, uint32_t devid)
+{
+	memset(w, 0, sizeof(*w));
+	w->align = align ? align : OBCAP_ALIGN_DEF;
+	if (w->align & (w->align - 1) || w->align < sizeof(struct obcap_file_hdr)) {
+		errno = EINVAL;
+		return -1;
+	}
+	w->hdr_buf = calloc(2, w->align);
+	if (!w->hdr_buf)
+		return -1;
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (w->fd < 0)
+		goto err;
+
+	obcap_file_hdr_init(&w->hdr, w->align, devid);
+	memcpy(w->hdr_buf, &w->hdr, sizeof(w->hdr));
+	if (write(w->fd, w->hdr_buf, w->align) != w->align)
+		goto err_close;
+	w->off = w->align;
+
+	return 0;
+
+err_close:
+	close(w->fd);
+err:
+	free(w->hdr_buf);
+	return -1;
+}
+
+
+/**
+ * Append a page: header, data and padding with a single system call
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_append(struct obcap_writer *w, const struct zio_control *zctrl,
+		 const void *data, uint32_t len, uint16_t flags, uint32_t enc)
+{
+	struct obcap_page_hdr *ph = (void *)w->hdr_buf;
+	struct iovec iov[3];
+	size_t pad, tot;
+	ssize_t ret;
+
+	memset(w->hdr_buf, 0, w->align);
+	obcap_page_hdr_init(ph, zctrl, data, len, flags, enc);
+	pad = obcap_round(len, w->align) - len;
+
+	iov[0].iov_base = w->hdr_buf;
+	iov[0].iov_len = w->align;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	/* the padding comes from the second unit, which stays zeroed */
+	iov[2].iov_base = w->hdr_buf + w->align;
+	iov[2].iov_len = pad;
+	tot = w->align + len + pad;
+	ret = pwritev(w->fd, iov, 3, w->off);
+	if (ret != tot) {
+		if (ret >= 0)
+			errno = EIO;
+		return -1;
+	}
+	if (obcap_index_add(&w->idx, w->off, ph))
+		return -1;
+	w->off += tot;
+
+	return 0;
+}
+
+
+/**
+ * Write the index and close the file
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_close(struct obcap_writer *w)
+{
+	int err;
+
+	err = obcap_index_write(w->fd, &w->idx, w->off, &w->hdr);
+	if (close(w->fd))
+		err = -1;
+	free(w->idx.ent);
+	free(w->hdr_buf);
+
+	return err;
+}
+
+
+static int obcap_page_hdr_valid(const struct obcap_page_hdr *ph)
+{
+	return ph->magic == OBCAP_PAGE_MAGIC &&
+	       ph->hdr_crc == obcap_crc32c(0, ph, offsetof(struct obcap_page_hdr,
+							   hdr_crc));
+}
+
+/**
+ * Check an index read from the file: the CRC of its entries, and every
+ * page within the file
+ */
+static int obcap_index_valid(const struct obcap_reader *r,
+			     const struct obcap_index_ent *ent, uint64_t count,
+			     uint32_t crc)
+{
+	uint32_t align = r->hdr->align;
+	uint64_t i;
+
+	if (crc != obcap_crc32c(0, ent, count * sizeof(*ent)))
+		return 0;
+	for (i = 0; i < count; ++i)
+		if (ent[i].off < align || ent[i].off > r->map_len ||
+		    r->map_len - ent[i].off < align + (uint64_t)ent[i].stored)
+			return 0;
+	return 1;
+}
+
+/**
+ * Walk the page headers to rebuild a missing index (the capture was not
+ * closed properly). It stops at the first invalid header.
+ */
+static int obcap_index_rebuild(struct obcap_reader *r)
+{
+	struct obcap_index idx = {0};
+	struct obcap_page_hdr *ph;
+	uint32_t align = r->hdr->align;
+	uint64_t off = align;
+
+	while (off + align <= r->map_len) {
+		ph = (void *)(r->map + off);
+		if (!obcap_page_hdr_valid(ph))
+			break;
+		if (off + align + ph->stored > r->map_len)
+			break; /* truncated page */
+		if (obcap_index_add(&idx, off, ph))
+			return -1;
+		off += align + obcap_round(ph->stored, align);
+	}
+	r->ent = idx.ent;
+	r->count = idx.count;
+	r->own_ent = 1;
+
+	return 0;
+}
+
+/**
+ * Open a stripe of a set. When its path does not exist anymore, it is
+ * looked for next to the set file: the files were copied together.
+ */
+static int obcap_stripe_open(struct obcap_reader *r, const char *path,
+			     const char *set)
+{
+	char alt[2 * OBCAP_PATH_MAX + 1024];
+	const char *base, *slash;
+
+	if (!obcap_open(r, path))
+		goto check;
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+	slash = strrchr(set, '/');
+	snprintf(alt, sizeof(alt), "%.*s%s",
+		 slash ? (int)(slash - set + 1) : 0, set, base);
+	if (obcap_open(r, alt))
+		return -1;
+check:
+	if (r->stripes) {
+		/* sets of sets are not supported */
+		obcap_release(r);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Open the stripes of a set file, already mapped in r, and merge their
+ * indexes following the map, by time when there is no valid map
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+static int obcap_set_open(struct obcap_reader *r, const char *path)
+{
+	const struct obcap_set_hdr *h = (void *)r->map;
+	const uint8_t *map = r->map + sizeof(*h);
+	char spath[OBCAP_PATH_MAX + 1];
+	uint64_t pos[OBCAP_STRIPES_MAX] = {0}, total = 0, n = 0, cnt;
+	struct obcap_reader *f;
+	unsigned int s, best;
+	int use_map;
+
+	if (r->map_len < sizeof(*h) || h->version != OBCAP_VERSION ||
+	    !h->stripes || h->stripes > OBCAP_STRIPES_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	r->stripe = calloc(h->stripes, sizeof(*r->stripe));
+	if (!r->stripe)
+		return -1;
+	for (s = 0; s < h->stripes; ++s, ++r->stripes) {
+		snprintf(spath, sizeof(spath), "%.*s", OBCAP_PATH_MAX,
+			 h->path[s]);
+		if (obcap_stripe_open(&r->stripe[s], spath, path))
+			goto err;
+		total += r->stripe[s].count;
+	}
+	r->ent = malloc(total * sizeof(*r->ent) + 1);
+	r->ent_stripe = malloc(total + 1);
+	if (!r->ent || !r->ent_stripe)
+		goto err;
+
+	cnt = h->count;
+	use_map = cnt && sizeof(*h) + cnt <= r->map_len &&
+		  h->crc == obcap_crc32c(0, map, cnt);
+	while (n < total) {
+		if (use_map) {
+			if (n == cnt)
+				break;
+			s = map[n];
+			if (s >= r->stripes || pos[s] == r->stripe[s].count)
+				break; /* a stripe was truncated */
+		} else {
+			for (s = r->stripes, best = 0; best < r->stripes; ++best) {
+				f = &r->stripe[best];
+				if (pos[best] < f->count &&
+				    (s == r->stripes ||
+				     f->ent[pos[best]].time <
+				     r->stripe[s].ent[pos[s]].time))
+					s = best;
+			}
+		}
+		r->ent[n] = r->stripe[s].ent[pos[s]++];
+		r->ent_stripe[n++] = s;
+	}
+	r->count = n;
+	r->own_ent = 1;
+	r->hdr = r->stripe[0].hdr;
+	/* the set file is not needed anymore */
+	munmap(r->map, r->map_len);
+	close(r->fd);
+	r->map = NULL;
+	r->fd = -1;
+	return 0;
+
+err:
+	while (r->stripes)
+		obcap_release(&r->stripe[--r->stripes]);
+	free(r->stripe);
+	free(r->ent);
+	free(r->ent_stripe);
+	return -1;
+}
+
+/**
+ * Open a capture file and map it. A set file opens the whole striped
+ * capture.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obcap_open(struct obcap_reader *r, const char *path)
+{
+	struct obcap_index_footer *ft;
+	struct stat st;
+	uint64_t ioff;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = open(path, O_RDONLY);
+	if (r->fd < 0)
+		return -1;
+	if (fstat(r->fd, &st))
+		goto err;
+	if (st.st_size < sizeof(struct obcap_file_hdr)) {
+		errno = EINVAL;
+		goto err;
+	}
+	r->map_len = st.st_size;
+	r->map = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, r->fd, 0);
+	if (r->map == MAP_FAILED)
+		goto err;
+	r->hdr = (void *)r->map;
+	if (!memcmp(r->hdr->magic, OBCAP_SET_MAGIC, sizeof(r->hdr->magic))) {
+		if (obcap_set_open(r, path))
+			goto err_map;
+		return 0;
+	}
+	if (memcmp(r->hdr->magic, OBCAP_MAGIC, sizeof(r->hdr->magic)) ||
+	    r->hdr->version != OBCAP_VERSION || !r->hdr->align ||
+	    r->hdr->align & (r->hdr->align - 1)) {
+		errno = EINVAL;
+		goto err_map;
+	}
+
+	/* a corrupted or truncated index is rebuilt from the page headers */
+	ioff = r->hdr->index_off;
+	if (ioff && ioff <= r->map_len &&
+	    r->hdr->count <= (r->map_len - ioff) / sizeof(*r->ent) &&
+	    ioff + r->hdr->count * sizeof(*r->ent) + sizeof(*ft) <=
+	    r->map_len) {
+		ft = (void *)(r->map + ioff +
+			      r->hdr->count * sizeof(*r->ent));
+		if (!memcmp(ft->magic, OBCAP_IDX_MAGIC, sizeof(ft->magic)) &&
+		    ft->count == r->hdr->count &&
+		    obcap_index_valid(r, (void *)(r->map + ioff), ft->count,
+				      ft->crc)) {
+			r->ent = (void *)(r->map + ioff);
+			r->count = ft->count;
+			return 0;
+		}
+	}
+	if (obcap_index_rebuild(r))
+		goto err_map;
+
+	return 0;
+
+err_map:
+	munmap(r->map, r->map_len);
+err:
+	close(r->fd);
+	return -1;
+}
+
+
+void obcap_release(struct obcap_reader *r)
+{
+	if (r->stripes) {
+		while (r->stripes)
+			obcap_release(&r->stripe[--r->stripes]);
+		free(r->stripe);
+		free(r->ent_stripe);
+		free(r->ent);
+		return;
+	}
+	if (r->own_ent)
+		free(r->ent);
+	munmap(r->map, r->map_len);
+	close(r->fd);
+}
+
+
+/**
+ * Get a page, without touching any other page
+ * @n: page index
+ * @data: where to store the pointer to the stored bytes
+ * @return the page header, NULL when n is out of range
+ */
+struct obcap_page_hdr *obcap_page(struct obcap_reader *r, uint64_t n,
+				  uint8_t **data)
+{
+	struct obcap_page_hdr *ph;
+	struct obcap_reader *f;
+
+	if (n >= r->count)
+		return NULL;
+	f = r->stripes ? &r->stripe[r->ent_stripe[n]] : r;
+	ph = (void *)(f->map + r->ent[n].off);
+	if (data)
+		*data = (uint8_t *)ph + f->hdr->align;
+
+	return ph;
+}
+
+/**
+ * Locate the stored bytes of a page in its file, for splice(2)
+ * @off: where to store their offset
+ * @return the file descriptor, -1 when n is out of range
+ */
+int obcap_page_fd(struct obcap_reader *r, uint64_t n, uint64_t *off)
+{
+	struct obcap_reader *f;
+
+	if (n >= r->count) {
+		errno = EINVAL;
+		return -1;
+	}
+	f = r->stripes ? &r->stripe[r->ent_stripe[n]] : r;
+	*off = r->ent[n].off + f->hdr->align;
+	return f->fd;
+}
+
+
+/**
+ * Rebuild the ZIO control of a stored page, for tools that replay
+ * captures through the live code paths
+ */
+void obcap_page_ctrl(const struct obcap_page_hdr *ph,
+		     struct zio_control *zctrl)
+{
+	memset(zctrl, 0, sizeof(*zctrl));
+	zctrl->seq_num = ph->seq_num;
+	zctrl->ssize = ph->ssize ? ph->ssize : 1;
+	zctrl->nsamples = ph->size / zctrl->ssize;
+	zctrl->zio_alarms = ph->alarms & 0xFF;
+	zctrl->drv_alarms = ph->alarms >> 8;
+	zctrl->tstamp.secs = ph->tstamp_s;
+	zctrl->tstamp.ticks = ph->tstamp_t;
+	if (ph->marker != OBCAP_NO_MARKER) {
+		zctrl->attr_channel.ext_mask = 1 << OBSBOX_CTRL_MARKER_OFFSET;
+		zctrl->attr_channel.ext_val[OBSBOX_CTRL_MARKER_OFFSET] =
+			ph->marker;
+	}
+}
+
+
+/**
+ * Binary search on the index
+ * @return the index of the first page with time >= t, the number of pages
+ *         when there is none
+ */
+uint64_t obcap_find_time(struct obcap_reader *r, uint64_t t)
+{
+	uint64_t lo = 0, hi = r->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (r->ent[mid].time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/**
+ * Check header and data CRC of a page
+ * @return 0 when valid, -1 otherwise
+ */
+int obcap_verify(struct obcap_reader *r, uint64_t n)
+{
+	struct obcap_page_hdr *ph;
+	uint8_t *data;
+
+	ph = obcap_page(r, n, &data);
+	if (!ph || !obcap_page_hdr_valid(ph) || ph->stored != r->ent[n].stored)
+		return -1;
+	if (ph->flags & OBCAP_PAGE_NOCRC)
+		return 0;
+
+	return ph->crc == obcap_crc32c(0, data, ph->stored) ? 0 : -1;
+}
+
+
+/**
+ * Get the page samples back from the stored bytes
+ * @out: at least ph->size bytes
+ * @tmp: at least ph->size bytes of scratch memory
+ * @return 0 on success, -1 on unknown encoding or corrupted data
+ */
+int obcap_page_decode(const struct obcap_page_hdr *ph, const uint8_t *data,
+		      uint8_t *out, uint8_t *tmp)
+{
+	struct obz_params p;
+
+	switch (OBCAP_ENC_CODEC(ph->enc)) {
+	case OBCAP_CODEC_NONE:
+		if (ph->stored != ph->size)
+			break;
+		memcpy(out, data, ph->size);
+		return 0;
+	case OBCAP_CODEC_LZ:
+		p.filter = OBCAP_ENC_FILTER(ph->enc);
+		p.stride = OBCAP_ENC_STRIDE(ph->enc);
+		return obz_decompress(&p, data, ph->stored, out, ph->size, tmp);
+	}
+	errno = EINVAL;
+	return -1;
+}
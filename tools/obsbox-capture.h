@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_CAPTURE_H__
+#define __OBSBOX_CAPTURE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/zio-user.h>
+
+/*
+ * Capture file layout. Every record starts on an 'align' boundary so the
+ * file can be written with O_DIRECT and the data can be used in place from
+ * an mmap(2) of the file.
+ *
+ *   +------------------------+ 0
+ *   | file header            |  one align unit
+ *   +------------------------+
+ *   | page header            |  one align unit
+ *   | page data + padding    |  'stored' bytes rounded up to align
+ *   +------------------------+
+ *   | ... more pages ...     |
+ *   +------------------------+ index_off
+ *   | index entries          |  count entries
+ *   | index footer           |
+ *   +------------------------+
+ *
+ * The index is written when the capture is closed; its position is also
+ * stored in the file header. When it is missing (crash) the reader
+ * rebuilds it by walking the page headers. All fields are little endian.
+ *
+ * A striped capture spreads the pages over several capture files (the
+ * stripes, flag OBCAP_FILE_STRIPE), usually on different devices. A set
+ * file lists the stripes and, for every page in stream order, the stripe
+ * which holds it: page i is the next page of stripe map[i]. obcap_open()
+ * on a set file opens the stripes and merges their indexes, so readers
+ * see one capture. Without the map (not closed) the pages are merged by
+ * time.
+ *
+ *   +------------------------+ 0
+ *   | set header             |  struct obcap_set_hdr, with the paths
+ *   +------------------------+
+ *   | map                    |  count bytes, the stripe of each page
+ *   +------------------------+
+ */
+#define OBCAP_MAGIC "OBSBOXC1"
+#define OBCAP_IDX_MAGIC "OBCAPIDX"
+#define OBCAP_SET_MAGIC "OBCAPSET"
+#define OBCAP_PAGE_MAGIC 0x4F425047 /* "OBPG" */
+#define OBCAP_VERSION 1
+#define OBCAP_ALIGN_DEF 4096
+#define OBCAP_NO_MARKER 0xFFFFFFFF
+
+#define OBCAP_PAGE_NOCRC (1 << 0) /* data CRC not computed */
+#define OBCAP_PAGE_LOST (1 << 1) /* pages lost just before this one */
+#define OBCAP_PAGE_EVENT (1 << 2) /* first page after a trigger */
+/* merged captures: index of the board in obcap_file_hdr.boards */
+#define OBCAP_PAGE_BOARD(b) ((b) << 8)
+#define OBCAP_PAGE_BOARD_GET(flags) (((flags) >> 8) & 0xFF)
+
+#define OBCAP_FILE_MERGED (1 << 0) /* pages of several boards */
+#define OBCAP_FILE_STRIPE (1 << 1) /* a stripe of a set */
+#define OBCAP_BOARDS_MAX 8
+#define OBCAP_STRIPES_MAX 16
+#define OBCAP_PATH_MAX 256
+
+/*
+ * Page data encoding: codec, filter (OBZ_* in obsbox-compress.h) and delta
+ * stride. 0 means raw samples, then 'stored' equals 'size'.
+ */
+#define OBCAP_CODEC_NONE 0
+#define OBCAP_CODEC_LZ 1
+#define OBCAP_ENC(codec, filter, stride) \
+	((codec) | (filter) << 8 | (uint32_t)(stride) << 16)
+#define OBCAP_ENC_CODEC(enc) ((enc) & 0xFF)
+#define OBCAP_ENC_FILTER(enc) (((enc) >> 8) & 0xFF)
+#define OBCAP_ENC_STRIDE(enc) ((enc) >> 16)
+
+struct obcap_file_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t align; /**< record alignment, power of 2 */
+	uint32_t devid; /**< merged: number of boards */
+	uint32_t flags; /**< OBCAP_FILE_* */
+	uint64_t t_create; /**< CLOCK_REALTIME ns */
+	uint64_t index_off; /**< 0 until the capture is closed */
+	uint64_t count; /**< number of pages, 0 until closed */
+	uint16_t boards[OBCAP_BOARDS_MAX]; /**< merged: devid of the boards */
+};
+
+struct obcap_page_hdr {
+	uint32_t magic;
+	uint32_t seq_num; /**< ZIO sequence number */
+	uint32_t size; /**< page size in bytes */
+	uint32_t stored; /**< bytes stored after the header */
+	uint32_t alarms; /**< zio_alarms | drv_alarms << 8 */
+	uint32_t marker; /**< marker offset in the page, OBCAP_NO_MARKER */
+	uint64_t tstamp_s; /**< ZIO time stamp, seconds */
+	uint64_t tstamp_t; /**< ZIO time stamp, ticks (ns) */
+	uint64_t t_host; /**< CLOCK_REALTIME ns when it was read */
+	uint16_t flags; /**< OBCAP_PAGE_* */
+	uint16_t ssize; /**< sample size */
+	uint32_t crc; /**< CRC32C of the stored bytes */
+	uint32_t enc; /**< OBCAP_ENC() */
+	uint32_t hdr_crc; /**< CRC32C of the header, up to this field */
+};
+
+struct obcap_index_ent {
+	uint64_t off; /**< page header offset */
+	uint64_t time; /**< obcap_page_time() */
+	uint32_t seq_num;
+	uint32_t stored;
+};
+
+struct obcap_set_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t stripes;
+	uint64_t count; /**< pages in the map, 0 until closed */
+	uint32_t crc; /**< CRC32C of the map */
+	uint32_t reserved;
+	char path[OBCAP_STRIPES_MAX][OBCAP_PATH_MAX]; /**< stripe files */
+};
+
+struct obcap_index_footer {
+	char magic[8];
+	uint64_t index_off;
+	uint64_t count;
+	uint32_t crc; /**< CRC32C of the index entries */
+	uint32_t reserved;
+};
+
+/**
+ * Growing index of the pages written so far
+ */
+struct obcap_index {
+	struct obcap_index_ent *ent;
+	uint64_t count, size;
+};
+
+/**
+ * Simple buffered writer for tools that do not need asynchronous I/O
+ */
+struct obcap_writer {
+	int fd;
+	uint32_t align;
+	uint64_t off;
+	struct obcap_file_hdr hdr;
+	struct obcap_index idx;
+	uint8_t *hdr_buf; /**< header unit and zeroed padding unit */
+};
+
+struct obcap_reader {
+	int fd;
+	uint8_t *map;
+	size_t map_len;
+	struct obcap_file_hdr *hdr;
+	struct obcap_index_ent *ent;
+	uint64_t count;
+	int own_ent; /**< index rebuilt in memory */
+	/* set file: the stripes, the pages come from stripe[ent_stripe[n]] */
+	struct obcap_reader *stripe;
+	unsigned int stripes;
+	uint8_t *ent_stripe;
+};
+
+extern uint32_t obcap_crc32c(uint32_t crc, const void *buf, size_t len);
+
+static inline uint64_t obcap_round(uint64_t v, uint32_t align)
+{
+	return (v + align - 1) & ~((uint64_t)align - 1);
+}
+
+/**
+ * @return the page time in ns: the ZIO time stamp, the host time when the
+ *         ZIO time stamp is missing
+ */
+static inline uint64_t obcap_page_time(const struct obcap_page_hdr *ph)
+{
+	if (ph->tstamp_s || ph->tstamp_t)
+		return ph->tstamp_s * 1000000000ULL + ph->tstamp_t;
+	return ph->t_host;
+}
+
+/* Encoding helpers, for writers with their own I/O */
+extern void obcap_file_hdr_init(struct obcap_file_hdr *fh, uint32_t align,
+				uint32_t devid);
+extern void obcap_page_hdr_init(struct obcap_page_hdr *ph,
+				const struct zio_control *zctrl,
+				const void *data, uint32_t stored,
+				uint16_t flags, uint32_t enc);
+extern void obcap_page_hdr_seal(struct obcap_page_hdr *ph);
+extern int obcap_index_add(struct obcap_index *idx, uint64_t off,
+			   const struct obcap_page_hdr *ph);
+extern uint8_t *obcap_index_build(const struct obcap_index *idx,
+				  uint64_t off, uint32_t align, size_t *len);
+extern int obcap_index_write(int fd, struct obcap_index *idx, uint64_t off,
+			     const struct obcap_file_hdr *hdr);
+
+extern int obcap_set_write(const char *path, char paths[][OBCAP_PATH_MAX],
+			   unsigned int stripes, const uint8_t *map,
+			   uint64_t count);
+
+/* Writer */
+extern int obcap_create(struct obcap_writer *w, const char *path,
+			uint32_t align, uint32_t devid);
+extern int obcap_append(struct obcap_writer *w,
+			const struct zio_control *zctrl,
+			const void *data, uint32_t len, uint16_t flags,
+			uint32_t enc);
+extern int obcap_close(struct obcap_writer *w);
+
+/* Reader */
+extern int obcap_open(struct obcap_reader *r, const char *path);
+extern void obcap_release(struct obcap_reader *r);
+extern struct obcap_page_hdr *obcap_page(struct obcap_reader *r, uint64_t n,
+					 uint8_t **data);
+extern int obcap_page_fd(struct obcap_reader *r, uint64_t n, uint64_t *off);
+extern void obcap_page_ctrl(const struct obcap_page_hdr *ph,
+			    struct zio_control *zctrl);
+extern uint64_t obcap_find_time(struct obcap_reader *r, uint64_t t);
+extern int obcap_verify(struct obcap_reader *r, uint64_t n);
+extern int obcap_page_decode(const struct obcap_page_hdr *ph,
+			     const uint8_t *data, uint8_t *out, uint8_t *tmp);
+
+#endif
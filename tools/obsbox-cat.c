@@ -0,0 +1,461 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "obsbox-capture.h"
+#include "obsbox-compress.h"
+#include "obsbox-export.h"
+#include "obsbox-frame.h"
+#include "obsbox-ring.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-cat [OPTIONS] <capture-file|ring-directory>\"\n");
+	fprintf(stderr, " -l: list the pages\n");
+	fprintf(stderr, " -x <first>[:<last>]: write pages data to stdout, by page index\n");
+	fprintf(stderr, " -t <from>:<to>: write pages data to stdout, by time in ns\n");
+	fprintf(stderr, " -F <raw|hex|csv|npy>: format of the data written by -x and -t (default raw)\n");
+	fprintf(stderr, " -w <number>: csv values per line, e.g. the samples in a turn (default %d)\n",
+		OBX_WIDTH_DEF);
+	fprintf(stderr, " -T <number>: write whole turns of this many samples, from the markers\n");
+	fprintf(stderr, " -K <mask>:<value>: the first sample of a turn has (sample & mask) == value\n");
+	fprintf(stderr, " -c: verify header and data CRC of all pages\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Without options it prints the capture summary. With -T the data\n"
+			"written by -x and -t is cut in turns: a csv line or a npy row\n"
+			"per turn, the samples before the first marker are dropped.\n"
+			"On a ring directory (obsbox-record -R) it lists the segments,\n"
+			"-t extracts a time window across them and -c verifies them\n");
+	exit(1);
+}
+
+/**
+ * Write the whole turns of a page
+ */
+static int obcat_turns(struct obx *x, struct obfr *fr,
+		       struct obcap_page_hdr *ph, const uint8_t *data)
+{
+	struct obfr_frame f;
+
+	if (ph->flags & OBCAP_PAGE_LOST)
+		obfr_reset(fr);
+	obfr_page(fr, data, ph->size, ph->marker);
+	while (obfr_next(fr, &f)) {
+		if (x->fmt == OBX_HEX)
+			obx_printf(x, "Turn %llu\n", (unsigned long long)f.turn);
+		if (obx_write(x, f.data, fr->turn_len, 0))
+			return -1;
+	}
+	return 0;
+}
+
+/* decoding buffers of compressed pages */
+static uint8_t *buf, *tmp;
+static uint32_t buf_size;
+
+/**
+ * Write the pages [first, last) of a capture
+ * @return 0 on success, -1 on error
+ */
+static int obcat_pages(struct obcap_reader *r, uint64_t first, uint64_t last,
+		       struct obx *x, struct obfr *fr)
+{
+	struct obcap_page_hdr *ph;
+	uint8_t *data;
+
+	if (last > r->count)
+		last = r->count;
+	for (; first < last; ++first) {
+		ph = obcap_page(r, first, &data);
+		if (!ph)
+			break;
+		if (ph->enc) {
+			/* compressed page, decode it in a private buffer */
+			if (ph->size > buf_size) {
+				free(buf);
+				free(tmp);
+				buf_size = ph->size;
+				buf = malloc(buf_size);
+				tmp = malloc(buf_size);
+				if (!buf || !tmp)
+					return -1;
+			}
+			if (obcap_page_decode(ph, data, buf, tmp)) {
+				fprintf(stderr, "obsbox-cat: page %llu: cannot decode\n",
+					(unsigned long long)first);
+				return -1;
+			}
+			data = buf;
+		}
+		if (x->fmt == OBX_HEX)
+			obx_printf(x, "Page %llu seq %u\n",
+				   (unsigned long long)first, ph->seq_num);
+		if (fr ? obcat_turns(x, fr, ph, data) :
+			 obx_write(x, data, ph->size, 0)) {
+			fprintf(stderr, "obsbox-cat: page %llu: %s\n",
+				(unsigned long long)first, strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @rows: pages to write, 0 with turns: the number of turns is known only
+ *        at the end
+ */
+static int obcat_open_out(struct obx *x, enum obx_format fmt,
+			  unsigned int width, struct obfr *fr, uint64_t rows)
+{
+	if (fr && !width)
+		width = fr->turn_len;
+	if (obx_init(x, STDOUT_FILENO, fmt, width, fr ? 0 : rows)) {
+		fprintf(stderr, "obsbox-cat: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int obcat_write(struct obcap_reader *r, uint64_t first, uint64_t last,
+		       enum obx_format fmt, unsigned int width, struct obfr *fr)
+{
+	struct obx x;
+	int err;
+
+	if (last > r->count)
+		last = r->count;
+	if (obcat_open_out(&x, fmt, width, fr, last > first ? last - first : 0))
+		return -1;
+	err = obcat_pages(r, first, last, &x, fr);
+	if (obx_close(&x))
+		err = -1;
+	return err;
+}
+
+static void obcat_turns_report(struct obfr *fr)
+{
+	fprintf(stderr, "%llu turns (%llu across pages), %llu samples skipped, %llu slips\n",
+		(unsigned long long)fr->frames,
+		(unsigned long long)fr->joined,
+		(unsigned long long)fr->skipped,
+		(unsigned long long)fr->slips);
+	obfr_free(fr);
+}
+
+
+/**
+ * Open a segment of a ring. The pages of a segment that was not closed,
+ * older than its first page, belong to its previous generation: they are
+ * dropped.
+ * @return 0 on success, -1 on error
+ */
+static int obcat_seg_open(struct obring *rg, unsigned int i,
+			  struct obcap_reader *r)
+{
+	char path[1200];
+	uint64_t n;
+
+	obring_seg_path(rg, i, path, sizeof(path));
+	if (obcap_open(r, path)) {
+		fprintf(stderr, "Cannot open segment %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+	for (n = 0; n < r->count && r->ent[n].time >= rg->seg[i].t_first; ++n)
+		;
+	r->count = n;
+	return 0;
+}
+
+/**
+ * Summary, time window extraction (extract 2) and verification of a ring
+ * directory. Only the segments overlapping the window are opened.
+ * @return 0 on success, -1 on error or corrupted pages
+ */
+static int obcat_ring(const char *dir, int extract, uint64_t from,
+		      uint64_t to, enum obx_format fmt, unsigned int width,
+		      struct obfr *fr, int verify)
+{
+	static const char *state[] = {"free", "open", "closed"};
+	struct obcap_reader *r;
+	struct obring_seg *e;
+	struct obring rg;
+	uint64_t *first, *last, rows = 0, p, bad = 0;
+	unsigned int *order, *open, n = 0, k, i;
+	struct obx x;
+	int err = -1;
+
+	if (obring_open(&rg, dir)) {
+		fprintf(stderr, "Cannot open ring %s: %s\n", dir,
+			strerror(errno));
+		return -1;
+	}
+	order = calloc(rg.hdr.n, sizeof(*order));
+	open = calloc(rg.hdr.n, sizeof(*open));
+	r = calloc(rg.hdr.n, sizeof(*r));
+	first = calloc(rg.hdr.n, sizeof(*first));
+	last = calloc(rg.hdr.n, sizeof(*last));
+	if (!order || !open || !r || !first || !last)
+		goto out;
+	n = obring_sorted(&rg, order);
+
+	for (k = 0; k < n; ++k) {
+		i = order[k];
+		e = &rg.seg[i];
+		if (extract && (e->t_first >= to ||
+				(e->state == OBRING_CLOSED && e->t_last < from)))
+			continue;
+		if (obcat_seg_open(&rg, i, &r[k]))
+			goto out;
+		open[k] = 1;
+		first[k] = extract ? obcap_find_time(&r[k], from) : 0;
+		last[k] = extract ? obcap_find_time(&r[k], to) : r[k].count;
+		rows += last[k] - first[k];
+	}
+
+	if (extract) {
+		if (obcat_open_out(&x, fmt, width, fr, rows))
+			goto out;
+		err = 0;
+		for (k = 0; k < n && !err; ++k)
+			if (open[k])
+				err = obcat_pages(&r[k], first[k], last[k], &x,
+						  fr);
+		if (obx_close(&x))
+			err = -1;
+		goto out;
+	}
+
+	printf("ring of %u segments of %llu MiB, device 0x%04x, %u written\n",
+	       rg.hdr.n, (unsigned long long)rg.hdr.seg_size >> 20,
+	       rg.hdr.devid, n);
+	printf("%6s %8s %7s %10s %10s %10s %22s %22s\n", "seg", "gen",
+	       "state", "pages", "seq-first", "seq-last", "time-first-ns",
+	       "time-last-ns");
+	for (k = 0; k < n; ++k) {
+		i = order[k];
+		printf("%6u %8llu %7s %10llu", i,
+		       (unsigned long long)rg.seg[i].gen,
+		       state[rg.seg[i].state % 3],
+		       (unsigned long long)r[k].count);
+		if (r[k].count)
+			printf(" %10u %10u %22llu %22llu", r[k].ent[0].seq_num,
+			       r[k].ent[r[k].count - 1].seq_num,
+			       (unsigned long long)r[k].ent[0].time,
+			       (unsigned long long)r[k].ent[r[k].count - 1].time);
+		printf("\n");
+		for (p = 0; verify && p < r[k].count; ++p) {
+			if (obcap_verify(&r[k], p) == 0)
+				continue;
+			fprintf(stderr, "segment %u page %llu: CRC mismatch\n",
+				i, (unsigned long long)p);
+			bad++;
+		}
+	}
+	printf("%llu pages\n", (unsigned long long)rows);
+	if (verify)
+		printf("%llu corrupted pages\n", (unsigned long long)bad);
+	err = bad ? -1 : 0;
+out:
+	for (k = 0; open && k < n; ++k)
+		if (open[k])
+			obcap_release(&r[k]);
+	free(order);
+	free(open);
+	free(r);
+	free(first);
+	free(last);
+	obring_close(&rg);
+	return err;
+}
+
+static void obcat_list(struct obcap_reader *r)
+{
+	struct obcap_page_hdr *ph;
+	uint64_t i;
+
+	printf("%10s %10s %10s %10s %22s %10s %6s %6s\n", "page", "seq", "size",
+	       "stored", "time-ns", "marker", "alarms", "flags");
+	for (i = 0; i < r->count; ++i) {
+		ph = obcap_page(r, i, NULL);
+		printf("%10llu %10u %10u %10u %22llu ", (unsigned long long)i,
+		       ph->seq_num, ph->size, ph->stored,
+		       (unsigned long long)obcap_page_time(ph));
+		if (ph->marker == OBCAP_NO_MARKER)
+			printf("%10s", "-");
+		else
+			printf("%10u", ph->marker);
+		printf(" 0x%04x 0x%04x\n", ph->alarms, ph->flags);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long a, b;
+	uint64_t first = 0, last = 0, i, bad = 0, size = 0, stored = 0;
+	int c, ret, list = 0, verify = 0, extract = 0, fmt = OBX_RAW;
+	unsigned int width = 0, turn = 0, mask, value;
+	int pattern = 0;
+	struct obcap_reader r;
+	struct obfr fr;
+	struct stat sb;
+
+	while ((c = getopt (argc, argv, "hlx:t:F:w:T:K:cV")) != -1)
+	{
+		switch(c)
+		{
+		case 'l':
+			list = 1;
+			break;
+		case 'x':
+			ret = sscanf(optarg, "%llu:%llu", &a, &b);
+			if (ret < 1)
+				help();
+			first = a;
+			last = ret == 2 ? b + 1 : a + 1;
+			extract = 1;
+			break;
+		case 't':
+			ret = sscanf(optarg, "%llu:%llu", &a, &b);
+			if (ret != 2)
+				help();
+			first = a;
+			last = b;
+			extract = 2;
+			break;
+		case 'F':
+			fmt = obx_parse(optarg);
+			if (fmt < 0)
+				help();
+			break;
+		case 'w':
+			ret = sscanf(optarg, "%u", &width);
+			if (ret != 1 || !width)
+				help();
+			break;
+		case 'T':
+			ret = sscanf(optarg, "%u", &turn);
+			if (ret != 1 || !turn)
+				help();
+			break;
+		case 'K':
+			ret = sscanf(optarg, "%i:%i", &mask, &value);
+			if (ret != 2 || mask > 0xFF || value > 0xFF)
+				help();
+			pattern = 1;
+			break;
+		case 'c':
+			verify = 1;
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (optind != argc - 1)
+		help();
+	if (extract && turn) {
+		if (obfr_init(&fr, turn))
+			exit(1);
+		if (pattern)
+			obfr_pattern(&fr, mask, value);
+	}
+
+	if (stat(argv[optind], &sb) == 0 && S_ISDIR(sb.st_mode)) {
+		if (extract == 1) {
+			fprintf(stderr, "obsbox-cat: a ring is extracted by time, use -t\n");
+			exit(1);
+		}
+		ret = obcat_ring(argv[optind], extract, first, last, fmt, width,
+				 turn ? &fr : NULL, verify);
+		if (extract && turn)
+			obcat_turns_report(&fr);
+		exit(!!ret);
+	}
+
+	if (obcap_open(&r, argv[optind])) {
+		fprintf(stderr, "Cannot open capture %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+
+	if (extract == 2) {
+		/* from time to page index, binary search on the index */
+		first = obcap_find_time(&r, first);
+		last = obcap_find_time(&r, last);
+	}
+	if (extract) {
+		ret = obcat_write(&r, first, last, fmt, width,
+				  turn ? &fr : NULL);
+		if (turn)
+			obcat_turns_report(&fr);
+		obcap_release(&r);
+		exit(!!ret);
+	}
+
+	if (list)
+		obcat_list(&r);
+	if (verify) {
+		for (i = 0; i < r.count; ++i) {
+			if (obcap_verify(&r, i) == 0)
+				continue;
+			fprintf(stderr, "page %llu: CRC mismatch\n",
+				(unsigned long long)i);
+			bad++;
+		}
+	}
+	if (!list) {
+		if (r.hdr->flags & OBCAP_FILE_MERGED) {
+			printf("merged boards");
+			for (i = 0; i < r.hdr->devid && i < OBCAP_BOARDS_MAX; ++i)
+				printf(" %llu:0x%04x", (unsigned long long)i,
+				       r.hdr->boards[i]);
+			printf(", ");
+		} else {
+			printf("device 0x%04x, ", r.hdr->devid);
+		}
+		if (r.stripes)
+			printf("striped over %u files, ", r.stripes);
+		printf("%llu pages, alignment %u, index %s\n",
+		       (unsigned long long)r.count, r.hdr->align,
+		       r.stripes ? "merged from the stripes" :
+		       r.own_ent ? "rebuilt (capture not closed, or index damaged)" : "present");
+		for (i = 0; i < r.count; ++i) {
+			size += obcap_page(&r, i, NULL)->size;
+			stored += r.ent[i].stored;
+		}
+		if (stored != size)
+			printf("compressed, ratio %.2f (%llu -> %llu bytes)\n",
+			       stored ? (double)size / stored : 0.0,
+			       (unsigned long long)size,
+			       (unsigned long long)stored);
+		if (r.count) {
+			printf("seq %u..%u, time %llu..%llu ns\n",
+			       r.ent[0].seq_num, r.ent[r.count - 1].seq_num,
+			       (unsigned long long)r.ent[0].time,
+			       (unsigned long long)r.ent[r.count - 1].time);
+		}
+		if (verify)
+			printf("%llu corrupted pages\n", (unsigned long long)bad);
+	}
+	obcap_release(&r);
+
+	exit(!!bad);
+}
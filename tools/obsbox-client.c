@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "obsbox-common.h"
+#include "obsbox-serve.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static volatile sig_atomic_t obcl_stop;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-client [OPTIONS]\"\n");
+	fprintf(stderr, " -t <host>[:<port>]: connect over TCP (default localhost:%d)\n",
+		OBSRV_PORT_DEF);
+	fprintf(stderr, " -u <path>: connect to a Unix socket\n");
+	fprintf(stderr, " -w <offset>:<length>: window of the page to receive (length 0: to the end)\n");
+	fprintf(stderr, " -e <number>: receive one page every <number>\n");
+	fprintf(stderr, " -q <number>: pages queued for us on the server\n");
+	fprintf(stderr, " -D <new|old|disconnect>: what the server does when our queue is full\n");
+	fprintf(stderr, " -n <number>: number of pages to receive (default: until SIGINT)\n");
+	fprintf(stderr, " -o <file>: write the received data to file ('-' for stdout)\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It subscribes to obsbox-serve and prints statistics every second\n");
+	exit(1);
+}
+
+static void obcl_sighandler(int sig)
+{
+	obcl_stop = 1;
+}
+
+static int obcl_connect_tcp(const char *spec)
+{
+	struct addrinfo hints = {0}, *ai, *a;
+	char host[128], port[16];
+	const char *sep = strrchr(spec, ':');
+	int fd = -1;
+
+	if (sep) {
+		snprintf(host, sizeof(host), "%.*s", (int)(sep - spec), spec);
+		snprintf(port, sizeof(port), "%s", sep + 1);
+	} else {
+		snprintf(host, sizeof(host), "%s", spec);
+		snprintf(port, sizeof(port), "%d", OBSRV_PORT_DEF);
+	}
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai)) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	for (a = ai; a; a = a->ai_next) {
+		fd = socket(a->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			continue;
+		if (!connect(fd, a->ai_addr, a->ai_addrlen))
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static int obcl_connect_unix(const char *path)
+{
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * @return 1 on success, 0 on end of stream, -1 on error
+ */
+static int obcl_read_all(int fd, void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, buf, len);
+		if (n < 0 && errno == EINTR && !obcl_stop)
+			continue;
+		if (n <= 0)
+			return n;
+		buf = (uint8_t *)buf + n;
+		len -= n;
+	}
+	return 1;
+}
+
+
+int main(int argc, char **argv)
+{
+	struct obsrv_hello hello = {
+		.magic = OBSRV_HELLO_MAGIC,
+		.version = OBSRV_VERSION,
+	};
+	struct obsrv_page_hdr hdr;
+	struct obsbox_seq seq = {0};
+	uint64_t pages = 0, bytes = 0, dropped = 0, t_start, t_last, p_last = 0;
+	uint64_t b_last = 0, lat_sum = 0;
+	char *tcp = NULL, *unix_path = NULL, *out = NULL;
+	uint32_t buf_size = 0;
+	uint8_t *buf = NULL;
+	int c, ret, fd, fdo = -1;
+	long n = -1;
+
+	while ((c = getopt (argc, argv, "ht:u:w:e:q:D:n:o:V")) != -1)
+	{
+		switch(c)
+		{
+		case 't':
+			tcp = optarg;
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'w':
+			ret = sscanf(optarg, "%u:%u", &hello.offset, &hello.length);
+			if (ret != 2)
+				help();
+			break;
+		case 'e':
+			ret = sscanf(optarg, "%u", &hello.every);
+			if (ret != 1)
+				help();
+			break;
+		case 'q':
+			ret = sscanf(optarg, "%u", &hello.queue);
+			if (ret != 1)
+				help();
+			break;
+		case 'D':
+			if (!strcmp(optarg, "new"))
+				hello.policy = OBSRV_DROP_NEW;
+			else if (!strcmp(optarg, "old"))
+				hello.policy = OBSRV_DROP_OLD;
+			else if (!strcmp(optarg, "disconnect"))
+				hello.policy = OBSRV_DISCONNECT;
+			else
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%ld", &n);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+
+	fd = unix_path ? obcl_connect_unix(unix_path) :
+			 obcl_connect_tcp(tcp ? tcp : "localhost");
+	if (fd < 0) {
+		fprintf(stderr, "Cannot connect to %s: %s\n",
+			unix_path ? unix_path : tcp ? tcp : "localhost",
+			strerror(errno));
+		exit(1);
+	}
+	if (out) {
+		fdo = strcmp(out, "-") ? open(out, O_WRONLY | O_CREAT | O_TRUNC,
+					      0644) : STDOUT_FILENO;
+		if (fdo < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", out,
+				strerror(errno));
+			exit(1);
+		}
+	}
+	if (write(fd, &hello, sizeof(hello)) != sizeof(hello)) {
+		fprintf(stderr, "Cannot subscribe: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	signal(SIGINT, obcl_sighandler);
+	signal(SIGTERM, obcl_sighandler);
+
+	t_start = t_last = obsbox_now_ns();
+	while (n && !obcl_stop) {
+		ret = obcl_read_all(fd, &hdr, sizeof(hdr));
+		if (ret <= 0)
+			break;
+		if (hdr.magic != OBSRV_PAGE_MAGIC) {
+			fprintf(stderr, "obsbox-client: protocol error\n");
+			exit(1);
+		}
+		if (hdr.len > buf_size) {
+			free(buf);
+			buf_size = hdr.len;
+			buf = malloc(buf_size);
+			if (!buf)
+				exit(1);
+		}
+		ret = obcl_read_all(fd, buf, hdr.len);
+		if (ret <= 0)
+			break;
+		if (fdo >= 0 && write(fdo, buf, hdr.len) != hdr.len) {
+			fprintf(stderr, "obsbox-client: write(): %s\n",
+				strerror(errno));
+			exit(1);
+		}
+
+		if (hello.every <= 1)
+			obsbox_seq_update(&seq, hdr.seq_num);
+		dropped += hdr.dropped;
+		pages++;
+		bytes += hdr.len;
+		/* from the server read to here, meaningful with synced clocks */
+		lat_sum += obsbox_realtime_ns() - hdr.t_host;
+		if (n > 0)
+			n--;
+
+		if (obsbox_now_ns() - t_last >= 1000000000ULL) {
+			double dt = (obsbox_now_ns() - t_last) / 1e9;
+
+			fprintf(stderr, "%.1f MB/s %.1f pages/s | pages %llu dropped by server %llu seq holes %llu | latency us %llu\n",
+				(bytes - b_last) / dt / 1e6,
+				(pages - p_last) / dt,
+				(unsigned long long)pages,
+				(unsigned long long)dropped,
+				(unsigned long long)seq.lost,
+				(unsigned long long)(pages > p_last ?
+					lat_sum / (pages - p_last) / 1000 : 0));
+			lat_sum = 0;
+			t_last = obsbox_now_ns();
+			b_last = bytes;
+			p_last = pages;
+		}
+	}
+	fprintf(stderr, "TOTAL: %.1f MB/s | pages %llu dropped by server %llu seq holes %llu\n",
+		bytes / ((obsbox_now_ns() - t_start) / 1e9) / 1e6,
+		(unsigned long long)pages, (unsigned long long)dropped,
+		(unsigned long long)seq.lost);
+	close(fd);
+
+	exit(0);
+}
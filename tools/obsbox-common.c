@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "obsbox-common.h"
+
+/**
+ * Open the ZIO char-devices
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obsbox_open_cdev(uint32_t devid, int *fdd, int *fdc)
+{
+	char path[128];
+
+	snprintf(path, 128, ZPATH_CDEV_DATA, devid);
+	*fdd = open(path, O_RDONLY);
+	if (*fdd < 0)
+		return -1;
+	snprintf(path, 128, ZPATH_CDEV_CTRL, devid);
+	*fdc = open(path, O_RDONLY);
+	if (*fdc < 0) {
+		close(*fdd);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Wait until a block is ready
+ * @return 1 when ready, 0 on timeout, -1 on error and errno is set
+ */
+int obsbox_ctrl_wait(int fdc, int timeout_ms)
+{
+	struct pollfd p = {.fd = fdc, .events = POLLIN};
+
+	return poll(&p, 1, timeout_ms);
+}
+
+
+/**
+ * Read the block control information from a replay (obsbox-player.h);
+ * devices use obdev_ctrl_read(), that also clears the alarms
+ * @return 0 on success, -1 on error
+ */
+int obsbox_ctrl_read(int fdc, struct zio_control *zctrl)
+{
+	int n;
+
+	n = read(fdc, zctrl, sizeof(struct zio_control));
+	if (n == 0) {
+		errno = ENODATA;
+		return -1;
+	}
+	if (n != sizeof(struct zio_control)) {
+		fprintf(stderr, "obsbox: cannot read zio control\n");
+		return -1;
+	}
+
+	/* check the status recorded with the page */
+	if (zctrl->zio_alarms & (ZIO_ALARM_LOST_BLOCK | ZIO_ALARM_LOST_TRIGGER))
+		fprintf(stderr,
+			"obsbox: something went wrong during acquisition\n");
+
+	return 0;
+}
+
+
+/**
+ * Prepare the pipe used to splice pages when the output is not a pipe
+ * @pipefd: the pipe to create
+ * @size: expected transfer size, used to enlarge the pipe
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obsbox_splice_init(int *pipefd, uint32_t size)
+{
+	if (pipe(pipefd))
+		return -1;
+	/*
+	 * The bigger the pipe the less splice(2) round trips. The kernel
+	 * caps it to /proc/sys/fs/pipe-max-size, that is not an error
+	 */
+	fcntl(pipefd[1], F_SETPIPE_SZ, size);
+
+	return 0;
+}
+
+
+/**
+ * Move a page from the data char device to fdo without copying it to
+ * user-space. When fdo is a pipe the data goes there directly, otherwise
+ * it passes through pipefd.
+ * @return 0 on success, -1 on error and errno is appropriately set. EINVAL
+ *         means that the data char device does not support splice(2)
+ */
+int obsbox_splice_page(int fdd, int fdo, int *pipefd, uint32_t len)
+{
+	struct stat sto;
+	ssize_t n, m;
+	int fdp;
+
+	if (fstat(fdo, &sto))
+		return -1;
+	fdp = S_ISFIFO(sto.st_mode) ? fdo : pipefd[1];
+
+	while (len) {
+		n = splice(fdd, NULL, fdp, NULL, len, SPLICE_F_MOVE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len -= n;
+		/* Drain the intermediate pipe into the output */
+		while (fdp != fdo && n) {
+			m = splice(pipefd[0], NULL, fdo, NULL, n,
+				   SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR)
+				continue;
+			if (m <= 0)
+				return -1;
+			n -= m;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * Release a block consumed in place through mmap(2)
+ *
+ * ZIO gives the block back to its buffer once the data char device has
+ * been consumed. We consume it with splice(2) towards /dev/null, so the data
+ * is never copied. When the data char device does not support splice(2)
+ * (EINVAL) the release is left to ZIO, which drops a block whose control
+ * has been read and whose data has not as soon as the next control is read.
+ * @pipefd: pipe created by obsbox_splice_init(), pipefd[0] set to -1 once
+ *          splice(2) turns out to be unsupported
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obsbox_mmap_release(int fdd, int *pipefd, uint32_t len)
+{
+	static int fdnull = -1;
+
+	if (pipefd[0] < 0)
+		return 0;
+	if (fdnull < 0) {
+		fdnull = open("/dev/null", O_WRONLY);
+		if (fdnull < 0)
+			return -1;
+	}
+	if (!obsbox_splice_page(fdd, fdnull, pipefd, len))
+		return 0;
+	if (errno != EINVAL)
+		return -1;
+	close(pipefd[0]);
+	close(pipefd[1]);
+	pipefd[0] = pipefd[1] = -1;
+
+	return 0;
+}
+
+
+/**
+ * Account pages lost by looking at holes in the sequence number
+ */
+void obsbox_seq_update(struct obsbox_seq *seq, uint32_t seq_num)
+{
+	if (seq->valid && seq_num != seq->last + 1)
+		seq->lost += (uint32_t)(seq_num - seq->last - 1);
+	seq->last = seq_num;
+	seq->valid = 1;
+}
+
+
+uint64_t obsbox_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Wall clock time, comparable with the ZIO time stamps and across hosts
+ */
+uint64_t obsbox_realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
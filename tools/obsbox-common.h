@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_COMMON_H__
+#define __OBSBOX_COMMON_H__
+
+#include <stdint.h>
+#include <linux/zio-user.h>
+
+#define ZPATH_BUF_SET "/sys/bus/zio/devices/obsbox-%04x/cset0/current_buffer"
+#define ZPATH_BUF_VMALLOC_SIZE "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/buffer/max-buffer-kb"
+#define ZPATH_PAGE_SIZE "/sys/bus/zio/devices/obsbox-%04x/cset0/trigger/post-samples"
+#define ZPATH_BUF_FLUSH "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/buffer/flush"
+#define ZPATH_ALARMS "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/alarms"
+#define ZPATH_CMD_RUN "/sys/bus/zio/devices/obsbox-%04x/cset0/ob-run"
+#define ZPATH_ACQ_MODE "/sys/bus/zio/devices/obsbox-%04x/cset0/ob-streaming-enable"
+#define ZPATH_TRG_EN "/sys/bus/zio/devices/obsbox-%04x/cset0/trigger/enable"
+
+#define ZPATH_CDEV_DATA "/dev/zio/obsbox-%04x-0-0-data"
+#define ZPATH_CDEV_CTRL "/dev/zio/obsbox-%04x-0-0-ctrl"
+
+/*
+ * Channel extended attributes exported by the driver in
+ * zio_control.attr_channel.ext_val[] (kernel/obsbox.h)
+ */
+#define OBSBOX_CTRL_MARKER_OFFSET 0
+#define OBSBOX_NO_MARKER 0xFFFFFFFF
+
+/**
+ * Page lost accounting based on the ZIO sequence number
+ */
+struct obsbox_seq {
+	int valid;
+	uint32_t last;
+	uint64_t lost;
+};
+
+extern int obsbox_open_cdev(uint32_t devid, int *fdd, int *fdc);
+extern int obsbox_ctrl_wait(int fdc, int timeout_ms);
+extern int obsbox_ctrl_read(int fdc, struct zio_control *zctrl);
+extern int obsbox_splice_init(int *pipefd, uint32_t size);
+extern int obsbox_splice_page(int fdd, int fdo, int *pipefd, uint32_t len);
+extern int obsbox_mmap_release(int fdd, int *pipefd, uint32_t len);
+extern void obsbox_seq_update(struct obsbox_seq *seq, uint32_t seq_num);
+extern uint64_t obsbox_now_ns(void);
+extern uint64_t obsbox_realtime_ns(void);
+
+static inline uint32_t obsbox_ctrl_len(const struct zio_control *zctrl)
+{
+	return zctrl->nsamples * zctrl->ssize;
+}
+
+/**
+ * @return the byte offset of the marker within the page, OBSBOX_NO_MARKER
+ *         when there is no marker or the driver does not export it
+ */
+static inline uint32_t obsbox_ctrl_marker(const struct zio_control *zctrl)
+{
+	if (!(zctrl->attr_channel.ext_mask & (1 << OBSBOX_CTRL_MARKER_OFFSET)))
+		return OBSBOX_NO_MARKER;
+	return zctrl->attr_channel.ext_val[OBSBOX_CTRL_MARKER_OFFSET];
+}
+
+#endif
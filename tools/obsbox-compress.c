@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "obsbox-compress.h"
+
+#define OBZ_HASH_LOG 14
+#define OBZ_MIN_MATCH 4
+#define OBZ_LAST_LITERALS 5 /* the stream ends with literals */
+#define OBZ_MFLIMIT 12 /* no match starts in the last bytes */
+#define OBZ_MAX_OFFSET 65535
+
+static inline uint32_t obz_read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t obz_read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t obz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - OBZ_HASH_LOG);
+}
+
+static inline uint8_t *obz_put_len(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * @return the bytes obz_put_len() writes after the token for a length
+ */
+static inline size_t obz_len_bytes(size_t len)
+{
+	return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+/**
+ * @return the number of equal bytes at p and r, not going beyond limit
+ */
+static inline size_t obz_match_len(const uint8_t *p, const uint8_t *r,
+				   const uint8_t *limit)
+{
+	const uint8_t *start = p;
+	uint64_t diff;
+
+	while (p + 8 <= limit) {
+		diff = obz_read64(p) ^ obz_read64(r);
+		if (diff)
+			return p - start + (__builtin_ctzll(diff) >> 3);
+		p += 8;
+		r += 8;
+	}
+	while (p < limit && *p == *r) {
+		p++;
+		r++;
+	}
+	return p - start;
+}
+
+
+/**
+ * Greedy LZ77 compression with a single entry hash table
+ * @return the compressed size, 0 when it does not fit cap
+ */
+size_t obz_lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+		       size_t cap)
+{
+	uint32_t table[1 << OBZ_HASH_LOG];
+	const uint8_t *ip = src, *anchor = src, *end = src + len;
+	const uint8_t *mflimit = end - OBZ_MFLIMIT;
+	const uint8_t *mlimit = end - OBZ_LAST_LITERALS;
+	uint8_t *op = dst, *oend = dst + cap, *token;
+	const uint8_t *ref;
+	size_t lit, mlen;
+	uint32_t seq, h, miss = 0;
+
+	memset(table, 0, sizeof(table));
+	if (len <= OBZ_MFLIMIT)
+		goto last;
+
+	ip++;
+	while (ip < mflimit) {
+		seq = obz_read32(ip);
+		h = obz_hash(seq);
+		ref = src + table[h];
+		table[h] = ip - src;
+		if (ip - ref > OBZ_MAX_OFFSET || obz_read32(ref) != seq) {
+			/* skip faster on data that does not compress */
+			ip += 1 + (miss++ >> 6);
+			continue;
+		}
+		while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+			ip--;
+			ref--;
+		}
+		mlen = obz_match_len(ip + OBZ_MIN_MATCH, ref + OBZ_MIN_MATCH,
+				     mlimit);
+		lit = ip - anchor;
+		miss = 0;
+
+		/* token, literals, offset and both length extensions */
+		if (oend - op < 1 + obz_len_bytes(lit) + lit + 2 +
+		    obz_len_bytes(mlen))
+			return 0;
+		token = op++;
+		*token = (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15);
+		if (lit >= 15)
+			op = obz_put_len(op, lit - 15);
+		memcpy(op, anchor, lit);
+		op += lit;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if (mlen >= 15)
+			op = obz_put_len(op, mlen - 15);
+
+		ip += OBZ_MIN_MATCH + mlen;
+		anchor = ip;
+		if (ip < mflimit)
+			table[obz_hash(obz_read32(ip - 2))] = ip - 2 - src;
+	}
+
+last:
+	lit = end - anchor;
+	if (oend - op < 1 + obz_len_bytes(lit) + lit)
+		return 0;
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if (lit >= 15)
+		op = obz_put_len(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return op - dst;
+}
+
+
+/**
+ * It decodes exactly dlen bytes, every length and offset is checked so
+ * corrupted input cannot write out of dst
+ * @return 0 on success, -1 on corrupted input
+ */
+int obz_lz_decompress(const uint8_t *src, size_t slen, uint8_t *dst,
+		      size_t dlen)
+{
+	const uint8_t *ip = src, *iend = src + slen, *match;
+	uint8_t *op = dst, *oend = dst + dlen;
+	size_t lit, mlen, off, d, i;
+	unsigned int token, b;
+
+	while (1) {
+		if (ip >= iend)
+			return -1;
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				lit += b;
+			} while (b == 255);
+		}
+		if (lit > iend - ip || lit > oend - op)
+			return -1;
+		memcpy(op, ip, lit);
+		op += lit;
+		ip += lit;
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (!off || off > op - dst)
+			return -1;
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += OBZ_MIN_MATCH;
+		if (mlen > oend - op)
+			return -1;
+
+		match = op - off;
+		if (off < 8) {
+			/*
+			 * Short period: copy one period multiple of at least 8
+			 * bytes, then copy 8 bytes at a time from there
+			 */
+			for (d = off; d < 8; d += off)
+				;
+			for (i = 0; mlen && i < d; ++i, --mlen)
+				*op++ = *match++;
+			match = op - d;
+		}
+		for (; mlen >= 8; mlen -= 8, op += 8, match += 8)
+			memcpy(op, match, 8);
+		while (mlen--)
+			*op++ = *match++;
+	}
+
+	return op == oend ? 0 : -1;
+}
+
+
+/**
+ * Transpose an 8x8 bit matrix, one byte per row
+ */
+static inline uint64_t obz_transpose8(uint64_t x)
+{
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+/**
+ * Bit-shuffle: bit b of every byte goes in plane b, len / 8 bytes per
+ * plane. The remaining len % 8 bytes are copied as they are.
+ */
+void obz_shuffle(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	size_t i, nb = len / 8;
+	uint64_t x;
+	int b;
+
+	for (i = 0; i < nb; ++i) {
+		x = obz_transpose8(obz_read64(src + i * 8));
+		for (b = 0; b < 8; ++b)
+			dst[b * nb + i] = x >> (8 * b);
+	}
+	memcpy(dst + nb * 8, src + nb * 8, len - nb * 8);
+}
+
+void obz_unshuffle(const uint8_t *src, uint8_t *dst, size_t len)
+{
+	size_t i, nb = len / 8;
+	uint64_t x;
+	int b;
+
+	for (i = 0; i < nb; ++i) {
+		x = 0;
+		for (b = 0; b < 8; ++b)
+			x |= (uint64_t)src[b * nb + i] << (8 * b);
+		x = obz_transpose8(x);
+		memcpy(dst + i * 8, &x, 8);
+	}
+	memcpy(dst + nb * 8, src + nb * 8, len - nb * 8);
+}
+
+
+static void obz_delta(const uint8_t *src, uint8_t *dst, size_t len,
+		      size_t stride)
+{
+	size_t i;
+
+	if (stride > len)
+		stride = len;
+	memcpy(dst, src, stride);
+	for (i = stride; i < len; ++i)
+		dst[i] = src[i] - src[i - stride];
+}
+
+/* It works in place */
+static void obz_undelta(const uint8_t *src, uint8_t *dst, size_t len,
+			size_t stride)
+{
+	size_t i;
+
+	if (stride > len)
+		stride = len;
+	memmove(dst, src, stride);
+	for (i = stride; i < len; ++i)
+		dst[i] = src[i] + dst[i - stride];
+}
+
+
+/**
+ * Parse a compression specification: "lz", "delta", "shuffle" or
+ * "delta+shuffle", optionally followed by ":<stride>" for the delta.
+ * @return 0 on success, -1 on invalid string
+ */
+int obz_parse(struct obz_params *p, const char *str)
+{
+	const char *sep = strchr(str, ':');
+	size_t n = sep ? sep - str : strlen(str);
+
+	memset(p, 0, sizeof(*p));
+	p->stride = 1;
+	if (n == 2 && !strncmp(str, "lz", n))
+		p->filter = 0;
+	else if (n == 5 && !strncmp(str, "delta", n))
+		p->filter = OBZ_DELTA;
+	else if (n == 7 && !strncmp(str, "shuffle", n))
+		p->filter = OBZ_SHUFFLE;
+	else if (n == 13 && !strncmp(str, "delta+shuffle", n))
+		p->filter = OBZ_DELTA | OBZ_SHUFFLE;
+	else
+		return -1;
+	if (sep && (sscanf(sep + 1, "%u", &p->stride) != 1 || !p->stride ||
+		    p->stride > 0xFFFF))
+		return -1;
+
+	return 0;
+}
+
+
+/**
+ * Filter and compress a page
+ * @dst: at least obz_bound(len) bytes
+ * @tmp: at least len bytes of scratch memory
+ * @return the compressed size, 0 when the page does not compress: the
+ *         caller stores it as it is
+ */
+size_t obz_compress(const struct obz_params *p, const uint8_t *src,
+		    size_t len, uint8_t *dst, uint8_t *tmp)
+{
+	const uint8_t *in = src;
+	size_t n;
+
+	switch (p->filter) {
+	case OBZ_DELTA:
+		obz_delta(src, tmp, len, p->stride);
+		in = tmp;
+		break;
+	case OBZ_SHUFFLE:
+		obz_shuffle(src, tmp, len);
+		in = tmp;
+		break;
+	case OBZ_DELTA | OBZ_SHUFFLE:
+		/* dst is free until the LZ stage */
+		obz_delta(src, dst, len, p->stride);
+		obz_shuffle(dst, tmp, len);
+		in = tmp;
+		break;
+	}
+
+	n = obz_lz_compress(in, len, dst, len);
+	return n < len ? n : 0;
+}
+
+
+/**
+ * Decompress and undo the filter of a page
+ * @tmp: at least dlen bytes of scratch memory
+ * @return 0 on success, -1 on corrupted input
+ */
+int obz_decompress(const struct obz_params *p, const uint8_t *src,
+		   size_t slen, uint8_t *dst, size_t dlen, uint8_t *tmp)
+{
+	if (!p->filter)
+		return obz_lz_decompress(src, slen, dst, dlen);
+
+	if (obz_lz_decompress(src, slen, tmp, dlen))
+		return -1;
+	if (p->filter & OBZ_SHUFFLE) {
+		obz_unshuffle(tmp, dst, dlen);
+		if (p->filter & OBZ_DELTA)
+			obz_undelta(dst, dst, dlen, p->stride);
+	} else {
+		obz_undelta(tmp, dst, dlen, p->stride);
+	}
+
+	return 0;
+}
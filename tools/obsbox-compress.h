@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_COMPRESS_H__
+#define __OBSBOX_COMPRESS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Lossless page compression: an optional preconditioning filter followed
+ * by a byte oriented LZ77 codec. The filters make the correlation between
+ * samples visible to the LZ stage:
+ *
+ * delta: each byte is replaced by its difference with the byte 'stride'
+ *        positions before. With the number of samples in a machine turn
+ *        as stride, this is the turn to turn difference.
+ * shuffle: bit-shuffle, the page is stored as 8 bit planes. Slowly
+ *          changing samples give long runs in the upper planes.
+ *
+ * The LZ format is a sequence of: token (4 bits literal length, 4 bits
+ * match length - 4), extra literal length bytes, literals, 16 bit little
+ * endian match offset, extra match length bytes. Lengths of 15 continue
+ * in the following bytes, 255 means one more byte. The last sequence has
+ * only literals.
+ */
+#define OBZ_DELTA (1 << 0)
+#define OBZ_SHUFFLE (1 << 1)
+
+struct obz_params {
+	unsigned int filter; /**< OBZ_DELTA | OBZ_SHUFFLE */
+	unsigned int stride; /**< delta distance in bytes, 1 to 65535 */
+};
+
+/**
+ * @return the output size needed by obz_compress() for len bytes
+ */
+static inline size_t obz_bound(size_t len)
+{
+	return len + len / 255 + 16;
+}
+
+extern int obz_parse(struct obz_params *p, const char *str);
+extern size_t obz_compress(const struct obz_params *p, const uint8_t *src,
+			   size_t len, uint8_t *dst, uint8_t *tmp);
+extern int obz_decompress(const struct obz_params *p, const uint8_t *src,
+			  size_t slen, uint8_t *dst, size_t dlen, uint8_t *tmp);
+
+/* Single steps, for benchmarks */
+extern size_t obz_lz_compress(const uint8_t *src, size_t len,
+			      uint8_t *dst, size_t cap);
+extern int obz_lz_decompress(const uint8_t *src, size_t slen,
+			     uint8_t *dst, size_t dlen);
+extern void obz_shuffle(const uint8_t *src, uint8_t *dst, size_t len);
+extern void obz_unshuffle(const uint8_t *src, uint8_t *dst, size_t len);
+
+#endif
@@ -0,0 +1,596 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "obsbox-convert.h"
+
+#define OBCV_ALWAYS_INLINE inline __attribute__((always_inline))
+
+/**
+ * A set of kernels. The type and the mode are dispatched once per call:
+ * the loops are instantiated for each of them by inlining a helper with
+ * a constant argument.
+ * @swap: undo a DMA_CTL_SWP swap over 'len' bytes, a multiple of 4
+ * @unpack: widen 'n' samples to 32 bit
+ * @tofloat: convert and calibrate 'n' samples, starting at channel 0
+ */
+struct obcv_kernel {
+	const char *name;
+	void (*swap)(uint8_t *dst, const uint8_t *src, size_t len,
+		     enum obcv_swap mode);
+	void (*unpack)(int32_t *dst, const uint8_t *src, size_t n,
+		       enum obcv_type t);
+	void (*tofloat)(float *dst, const uint8_t *src, size_t n,
+			enum obcv_type t, const struct obcv_cal *cal);
+};
+
+static const struct obcv_kernel *obcv_k;
+
+
+/**
+ * Generic implementation, a sample or a 32 bit word at a time
+ */
+static OBCV_ALWAYS_INLINE int32_t obcv_sample(const uint8_t *src, size_t i,
+					      enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		return src[i];
+	case OBCV_S8:
+		return (int8_t)src[i];
+	case OBCV_U16:
+		return src[2 * i] | (src[2 * i + 1] << 8);
+	case OBCV_S16:
+		return (int16_t)(src[2 * i] | (src[2 * i + 1] << 8));
+	}
+	return 0;
+}
+
+static OBCV_ALWAYS_INLINE uint32_t obcv_swap32(uint32_t v, enum obcv_swap mode)
+{
+	switch (mode) {
+	case OBCV_SWAP_NONE:
+		break;
+	case OBCV_SWAP_BYTES:
+		return ((v & 0x00ff00ff) << 8) | ((v >> 8) & 0x00ff00ff);
+	case OBCV_SWAP_WORDS:
+		return (v << 16) | (v >> 16);
+	case OBCV_SWAP_ALL:
+		return __builtin_bswap32(v);
+	}
+	return v;
+}
+
+static OBCV_ALWAYS_INLINE void obcv_swap_generic_m(uint8_t *dst,
+						   const uint8_t *src,
+						   size_t len,
+						   enum obcv_swap mode)
+{
+	uint32_t v;
+	size_t i;
+
+	for (i = 0; i < len; i += 4) {
+		memcpy(&v, src + i, 4);
+		v = obcv_swap32(v, mode);
+		memcpy(dst + i, &v, 4);
+	}
+}
+
+static void obcv_swap_generic(uint8_t *dst, const uint8_t *src, size_t len,
+			      enum obcv_swap mode)
+{
+	switch (mode) {
+	case OBCV_SWAP_NONE:
+		if (dst != src)
+			memmove(dst, src, len);
+		break;
+	case OBCV_SWAP_BYTES:
+		obcv_swap_generic_m(dst, src, len, OBCV_SWAP_BYTES);
+		break;
+	case OBCV_SWAP_WORDS:
+		obcv_swap_generic_m(dst, src, len, OBCV_SWAP_WORDS);
+		break;
+	case OBCV_SWAP_ALL:
+		obcv_swap_generic_m(dst, src, len, OBCV_SWAP_ALL);
+		break;
+	}
+}
+
+static OBCV_ALWAYS_INLINE void obcv_unpack_generic_t(int32_t *dst,
+						     const uint8_t *src,
+						     size_t n,
+						     enum obcv_type t)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = obcv_sample(src, i, t);
+}
+
+static void obcv_unpack_generic(int32_t *dst, const uint8_t *src, size_t n,
+				enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_unpack_generic_t(dst, src, n, OBCV_U8);
+		break;
+	case OBCV_S8:
+		obcv_unpack_generic_t(dst, src, n, OBCV_S8);
+		break;
+	case OBCV_U16:
+		obcv_unpack_generic_t(dst, src, n, OBCV_U16);
+		break;
+	case OBCV_S16:
+		obcv_unpack_generic_t(dst, src, n, OBCV_S16);
+		break;
+	}
+}
+
+/* 'k' is the position in the calibration period of the first sample */
+static OBCV_ALWAYS_INLINE void obcv_float_generic_t(float *dst,
+						    const uint8_t *src,
+						    size_t n, enum obcv_type t,
+						    const struct obcv_cal *cal,
+						    unsigned int k)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		dst[i] = (float)obcv_sample(src, i, t) * cal->gain[k] +
+			 cal->offset[k];
+		if (++k == cal->period)
+			k = 0;
+	}
+}
+
+static void obcv_float_run(float *dst, const uint8_t *src, size_t n,
+			   enum obcv_type t, const struct obcv_cal *cal,
+			   unsigned int k)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_float_generic_t(dst, src, n, OBCV_U8, cal, k);
+		break;
+	case OBCV_S8:
+		obcv_float_generic_t(dst, src, n, OBCV_S8, cal, k);
+		break;
+	case OBCV_U16:
+		obcv_float_generic_t(dst, src, n, OBCV_U16, cal, k);
+		break;
+	case OBCV_S16:
+		obcv_float_generic_t(dst, src, n, OBCV_S16, cal, k);
+		break;
+	}
+}
+
+static void obcv_float_generic(float *dst, const uint8_t *src, size_t n,
+			       enum obcv_type t, const struct obcv_cal *cal)
+{
+	obcv_float_run(dst, src, n, t, cal, 0);
+}
+
+#if defined(__x86_64__)
+/* pshufb masks of the swaps, the pattern repeats every 4 bytes */
+static const uint8_t obcv_shuf[4][16] __attribute__((aligned(16))) = {
+	[OBCV_SWAP_NONE] = {0, 1, 2, 3, 4, 5, 6, 7,
+			    8, 9, 10, 11, 12, 13, 14, 15},
+	[OBCV_SWAP_BYTES] = {1, 0, 3, 2, 5, 4, 7, 6,
+			     9, 8, 11, 10, 13, 12, 15, 14},
+	[OBCV_SWAP_WORDS] = {2, 3, 0, 1, 6, 7, 4, 5,
+			     10, 11, 8, 9, 14, 15, 12, 13},
+	[OBCV_SWAP_ALL] = {3, 2, 1, 0, 7, 6, 5, 4,
+			   11, 10, 9, 8, 15, 14, 13, 12},
+};
+
+/**
+ * SSE4.1 implementation, 16 bytes or 4 samples per vector
+ */
+__attribute__((target("sse4.1")))
+static void obcv_swap_sse41(uint8_t *dst, const uint8_t *src, size_t len,
+			    enum obcv_swap mode)
+{
+	__m128i m = _mm_load_si128((const __m128i *)obcv_shuf[mode]);
+	size_t i;
+
+	if (mode == OBCV_SWAP_NONE) {
+		obcv_swap_generic(dst, src, len, mode);
+		return;
+	}
+	for (i = 0; i + 16 <= len; i += 16)
+		_mm_store_si128((__m128i *)(dst + i), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(src + i)), m));
+	obcv_swap_generic(dst + i, src + i, len - i, mode);
+}
+
+__attribute__((target("sse4.1")))
+static OBCV_ALWAYS_INLINE __m128i obcv_load4_sse41(const uint8_t *src,
+						   enum obcv_type t)
+{
+	int32_t w;
+
+	switch (t) {
+	case OBCV_U8:
+		memcpy(&w, src, 4);
+		return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(w));
+	case OBCV_S8:
+		memcpy(&w, src, 4);
+		return _mm_cvtepi8_epi32(_mm_cvtsi32_si128(w));
+	case OBCV_U16:
+		return _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)src));
+	case OBCV_S16:
+		return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *)src));
+	}
+	return _mm_setzero_si128();
+}
+
+__attribute__((target("sse4.1")))
+static OBCV_ALWAYS_INLINE void obcv_unpack_sse41_t(int32_t *dst,
+						   const uint8_t *src,
+						   size_t n, enum obcv_type t)
+{
+	unsigned int ss = obcv_type_size(t);
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		_mm_store_si128((__m128i *)(dst + i),
+				obcv_load4_sse41(src + i * ss, t));
+	obcv_unpack_generic_t(dst + i, src + i * ss, n - i, t);
+}
+
+__attribute__((target("sse4.1")))
+static void obcv_unpack_sse41(int32_t *dst, const uint8_t *src, size_t n,
+			      enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_unpack_sse41_t(dst, src, n, OBCV_U8);
+		break;
+	case OBCV_S8:
+		obcv_unpack_sse41_t(dst, src, n, OBCV_S8);
+		break;
+	case OBCV_U16:
+		obcv_unpack_sse41_t(dst, src, n, OBCV_U16);
+		break;
+	case OBCV_S16:
+		obcv_unpack_sse41_t(dst, src, n, OBCV_S16);
+		break;
+	}
+}
+
+__attribute__((target("sse4.1")))
+static OBCV_ALWAYS_INLINE void obcv_float_sse41_t(float *dst,
+						  const uint8_t *src,
+						  size_t n, enum obcv_type t,
+						  const struct obcv_cal *cal)
+{
+	unsigned int ss = obcv_type_size(t), k = 0;
+	__m128 v;
+	size_t i;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		v = _mm_cvtepi32_ps(obcv_load4_sse41(src + i * ss, t));
+		v = _mm_add_ps(_mm_mul_ps(v, _mm_loadu_ps(cal->gain + k)),
+			       _mm_loadu_ps(cal->offset + k));
+		_mm_store_ps(dst + i, v);
+		k += 4;
+		if (k == cal->period)
+			k = 0;
+	}
+	obcv_float_generic_t(dst + i, src + i * ss, n - i, t, cal, k);
+}
+
+__attribute__((target("sse4.1")))
+static void obcv_float_sse41(float *dst, const uint8_t *src, size_t n,
+			     enum obcv_type t, const struct obcv_cal *cal)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_float_sse41_t(dst, src, n, OBCV_U8, cal);
+		break;
+	case OBCV_S8:
+		obcv_float_sse41_t(dst, src, n, OBCV_S8, cal);
+		break;
+	case OBCV_U16:
+		obcv_float_sse41_t(dst, src, n, OBCV_U16, cal);
+		break;
+	case OBCV_S16:
+		obcv_float_sse41_t(dst, src, n, OBCV_S16, cal);
+		break;
+	}
+}
+
+
+/**
+ * AVX2 implementation, 32 bytes or 8 samples per vector. The shuffle
+ * works within 128 bit lanes, which is fine because the swap pattern
+ * repeats every 4 bytes.
+ */
+__attribute__((target("avx2")))
+static void obcv_swap_avx2(uint8_t *dst, const uint8_t *src, size_t len,
+			   enum obcv_swap mode)
+{
+	__m256i m = _mm256_broadcastsi128_si256(
+		_mm_load_si128((const __m128i *)obcv_shuf[mode]));
+	size_t i;
+
+	if (mode == OBCV_SWAP_NONE) {
+		obcv_swap_generic(dst, src, len, mode);
+		return;
+	}
+	for (i = 0; i + 32 <= len; i += 32)
+		_mm256_store_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(
+			_mm256_loadu_si256((const __m256i *)(src + i)), m));
+	obcv_swap_generic(dst + i, src + i, len - i, mode);
+}
+
+__attribute__((target("avx2")))
+static OBCV_ALWAYS_INLINE __m256i obcv_load8_avx2(const uint8_t *src,
+						  enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		return _mm256_cvtepu8_epi32(
+			_mm_loadl_epi64((const __m128i *)src));
+	case OBCV_S8:
+		return _mm256_cvtepi8_epi32(
+			_mm_loadl_epi64((const __m128i *)src));
+	case OBCV_U16:
+		return _mm256_cvtepu16_epi32(
+			_mm_loadu_si128((const __m128i *)src));
+	case OBCV_S16:
+		return _mm256_cvtepi16_epi32(
+			_mm_loadu_si128((const __m128i *)src));
+	}
+	return _mm256_setzero_si256();
+}
+
+__attribute__((target("avx2")))
+static OBCV_ALWAYS_INLINE void obcv_unpack_avx2_t(int32_t *dst,
+						  const uint8_t *src,
+						  size_t n, enum obcv_type t)
+{
+	unsigned int ss = obcv_type_size(t);
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+		_mm256_store_si256((__m256i *)(dst + i),
+				   obcv_load8_avx2(src + i * ss, t));
+	obcv_unpack_generic_t(dst + i, src + i * ss, n - i, t);
+}
+
+__attribute__((target("avx2")))
+static void obcv_unpack_avx2(int32_t *dst, const uint8_t *src, size_t n,
+			     enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_unpack_avx2_t(dst, src, n, OBCV_U8);
+		break;
+	case OBCV_S8:
+		obcv_unpack_avx2_t(dst, src, n, OBCV_S8);
+		break;
+	case OBCV_U16:
+		obcv_unpack_avx2_t(dst, src, n, OBCV_U16);
+		break;
+	case OBCV_S16:
+		obcv_unpack_avx2_t(dst, src, n, OBCV_S16);
+		break;
+	}
+}
+
+__attribute__((target("avx2")))
+static OBCV_ALWAYS_INLINE void obcv_float_avx2_t(float *dst,
+						 const uint8_t *src,
+						 size_t n, enum obcv_type t,
+						 const struct obcv_cal *cal)
+{
+	unsigned int ss = obcv_type_size(t), k = 0;
+	__m256 v;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm256_cvtepi32_ps(obcv_load8_avx2(src + i * ss, t));
+		v = _mm256_add_ps(_mm256_mul_ps(v,
+						_mm256_loadu_ps(cal->gain + k)),
+				  _mm256_loadu_ps(cal->offset + k));
+		_mm256_store_ps(dst + i, v);
+		k += 8;
+		if (k == cal->period)
+			k = 0;
+	}
+	obcv_float_generic_t(dst + i, src + i * ss, n - i, t, cal, k);
+}
+
+__attribute__((target("avx2")))
+static void obcv_float_avx2(float *dst, const uint8_t *src, size_t n,
+			    enum obcv_type t, const struct obcv_cal *cal)
+{
+	switch (t) {
+	case OBCV_U8:
+		obcv_float_avx2_t(dst, src, n, OBCV_U8, cal);
+		break;
+	case OBCV_S8:
+		obcv_float_avx2_t(dst, src, n, OBCV_S8, cal);
+		break;
+	case OBCV_U16:
+		obcv_float_avx2_t(dst, src, n, OBCV_U16, cal);
+		break;
+	case OBCV_S16:
+		obcv_float_avx2_t(dst, src, n, OBCV_S16, cal);
+		break;
+	}
+}
+#endif
+
+static const struct obcv_kernel obcv_kernels[] = {
+	{"generic", obcv_swap_generic, obcv_unpack_generic, obcv_float_generic},
+#if defined(__x86_64__)
+	{"sse4.1", obcv_swap_sse41, obcv_unpack_sse41, obcv_float_sse41},
+	{"avx2", obcv_swap_avx2, obcv_unpack_avx2, obcv_float_avx2},
+#endif
+	{NULL},
+};
+
+static int obcv_kernel_supported(const struct obcv_kernel *k)
+{
+#if defined(__x86_64__)
+	if (k->swap == obcv_swap_sse41)
+		return __builtin_cpu_supports("sse4.1");
+	if (k->swap == obcv_swap_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+/* the last supported kernel in the table is the best one */
+static void obcv_kernel_init(void)
+{
+	const struct obcv_kernel *k;
+
+	if (obcv_k)
+		return;
+	for (k = obcv_kernels; k->name; ++k)
+		if (obcv_kernel_supported(k))
+			obcv_k = k;
+}
+
+const char *obcv_impl(void)
+{
+	obcv_kernel_init();
+	return obcv_k->name;
+}
+
+/**
+ * Force a kernel, for benchmarks
+ * @return 0 on success, -1 when it is unknown or the CPU lacks it
+ */
+int obcv_impl_set(const char *name)
+{
+	const struct obcv_kernel *k;
+
+	for (k = obcv_kernels; k->name; ++k) {
+		if (strcmp(k->name, name) || !obcv_kernel_supported(k))
+			continue;
+		obcv_k = k;
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+}
+
+
+/**
+ * Allocate a destination buffer, release it with free()
+ */
+void *obcv_alloc(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, OBCV_ALIGN, size ? size : OBCV_ALIGN)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return p;
+}
+
+/**
+ * Build the calibration tables of 'nch' interleaved channels
+ * @gain: one per channel, NULL for 1
+ * @offset: one per channel, NULL for 0
+ * @return 0 on success, -1 on error
+ */
+int obcv_cal_init(struct obcv_cal *cal, unsigned int nch,
+		  const float *gain, const float *offset)
+{
+	unsigned int i, a, b;
+
+	if (!nch || nch > OBCV_CH_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* period = lcm(8, nch) */
+	for (a = 8, b = nch; b; ) {
+		i = a % b;
+		a = b;
+		b = i;
+	}
+	cal->nch = nch;
+	cal->period = 8 * nch / a;
+	for (i = 0; i < cal->period; ++i) {
+		cal->gain[i] = gain ? gain[i % nch] : 1.0f;
+		cal->offset[i] = offset ? offset[i % nch] : 0.0f;
+	}
+
+	return 0;
+}
+
+static int obcv_check(const void *dst)
+{
+	if ((uintptr_t)dst % OBCV_ALIGN) {
+		errno = EINVAL;
+		return -1;
+	}
+	obcv_kernel_init();
+	return 0;
+}
+
+/**
+ * Undo the swap of the DMA engine, 'dst' can be 'src'
+ * @len: bytes, a multiple of 4
+ * @return 0 on success, -1 on error
+ */
+int obcv_swap(void *dst, const void *src, size_t len, enum obcv_swap mode)
+{
+	if (len % 4 || (unsigned int)mode > OBCV_SWAP_ALL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (obcv_check(dst))
+		return -1;
+	obcv_k->swap(dst, src, len, mode);
+	return 0;
+}
+
+/**
+ * Widen 'n' samples to 32 bit, with sign extension for the signed types
+ * @return 0 on success, -1 on error
+ */
+int obcv_unpack(int32_t *dst, const void *src, size_t n, enum obcv_type t)
+{
+	if ((unsigned int)t > OBCV_S16) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (obcv_check(dst))
+		return -1;
+	obcv_k->unpack(dst, src, n, t);
+	return 0;
+}
+
+/**
+ * Convert 'n' samples to float32 and apply the calibration
+ * @return 0 on success, -1 on error
+ */
+int obcv_float(float *dst, const void *src, size_t n, enum obcv_type t,
+	       const struct obcv_cal *cal)
+{
+	if ((unsigned int)t > OBCV_S16 || !cal || !cal->period) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (obcv_check(dst))
+		return -1;
+	obcv_k->tofloat(dst, src, n, t, cal);
+	return 0;
+}
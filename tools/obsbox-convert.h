@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_CONVERT_H__
+#define __OBSBOX_CONVERT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Conversion of raw pages to numbers. The DMA engine swaps the bytes on
+ * their way to memory as programmed in DMA_CTL_SWP (the driver writes
+ * 0x2); consumers undo it, then widen the samples to 32 bit integers or
+ * convert them to float32 with a per channel calibration:
+ *
+ *       out[i] = sample[i] * gain[i % nch] + offset[i % nch]
+ *
+ * Channels are interleaved and the first sample is channel 0. Samples are
+ * little endian once the swap is undone. Destination buffers must be
+ * aligned to OBCV_ALIGN, e.g. from obcv_alloc(), because the kernels use
+ * aligned stores; sources can have any alignment.
+ */
+#define OBCV_ALIGN 32
+#define OBCV_CH_MAX 16
+#define OBCV_PERIOD_MAX (8 * OBCV_CH_MAX)
+
+/* The DMA_CTL_SWP codes; every swap is its own inverse */
+enum obcv_swap {
+	OBCV_SWAP_NONE = 0, /**< ABCD */
+	OBCV_SWAP_BYTES, /**< BADC, bytes in 16 bit words */
+	OBCV_SWAP_WORDS, /**< CDAB, 16 bit words in 32 bit words */
+	OBCV_SWAP_ALL, /**< DCBA, bytes in 32 bit words */
+};
+
+enum obcv_type {
+	OBCV_U8 = 0,
+	OBCV_S8,
+	OBCV_U16,
+	OBCV_S16,
+};
+
+/**
+ * Calibration, the gain and the offset of each sample over a period of
+ * lcm(8, nch) samples: a vector of 8 samples always starts at the same
+ * place of the tables
+ */
+struct obcv_cal {
+	unsigned int nch;
+	unsigned int period;
+	float gain[OBCV_PERIOD_MAX];
+	float offset[OBCV_PERIOD_MAX];
+};
+
+static inline unsigned int obcv_type_size(enum obcv_type t)
+{
+	return t >= OBCV_U16 ? 2 : 1;
+}
+
+extern void *obcv_alloc(size_t size);
+extern int obcv_cal_init(struct obcv_cal *cal, unsigned int nch,
+			 const float *gain, const float *offset);
+
+extern int obcv_swap(void *dst, const void *src, size_t len,
+		     enum obcv_swap mode);
+extern int obcv_unpack(int32_t *dst, const void *src, size_t n,
+		       enum obcv_type t);
+extern int obcv_float(float *dst, const void *src, size_t n,
+		      enum obcv_type t, const struct obcv_cal *cal);
+
+/* Kernel selection: "generic", "sse4.1", "avx2"; the best one by default */
+extern const char *obcv_impl(void);
+extern int obcv_impl_set(const char *name);
+
+#endif
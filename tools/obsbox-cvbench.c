@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+
+#include "obsbox-common.h"
+#include "obsbox-convert.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+#define OBCB_PAGE_DEF (2 * 1024 * 1024)
+#define OBCB_NPAGES_DEF 64
+#define OBCB_ROUNDS_DEF 4
+
+static const char *obcb_kernels[] = {"generic", "sse4.1", "avx2", NULL};
+static const char *obcb_types[] = {"u8", "s8", "u16", "s16", NULL};
+
+enum obcb_op {
+	OBCB_SWAP = 0,
+	OBCB_UNPACK,
+	OBCB_FLOAT,
+	__OBCB_OP_MAX,
+};
+static const char *obcb_ops[] = {"swap", "unpack", "float"};
+
+struct obcb {
+	enum obcb_op op;
+	enum obcv_type type;
+	enum obcv_swap swap;
+	unsigned int ss;
+	float gain[OBCV_CH_MAX], offset[OBCV_CH_MAX];
+	struct obcv_cal cal;
+};
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-cvbench [OPTIONS]\"\n");
+	fprintf(stderr, " -f <file>: raw pages to use (default: random samples)\n");
+	fprintf(stderr, " -p <number>: page size, a multiple of 4 (default %d)\n",
+		OBCB_PAGE_DEF);
+	fprintf(stderr, " -n <number>: number of pages (default %d)\n",
+		OBCB_NPAGES_DEF);
+	fprintf(stderr, " -r <number>: rounds over the pages (default %d)\n",
+		OBCB_ROUNDS_DEF);
+	fprintf(stderr, " -t <type>: u8, s8, u16, s16 (default u8)\n");
+	fprintf(stderr, " -s <0-3>: DMA_CTL_SWP swap to undo (default 2)\n");
+	fprintf(stderr, " -c <number>: interleaved channels (default 1, max %d)\n",
+		OBCV_CH_MAX);
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It measures the conversion kernels against a plain scalar loop\n"
+			"and against reading the same memory, and checks the results\n");
+	exit(1);
+}
+
+
+/**
+ * The loops users write on top of obsbox-dump, the reference. A swap
+ * code is also the xor that maps a byte to its place in the word.
+ */
+static int32_t obcb_sample(const uint8_t *data, size_t i, enum obcv_type t)
+{
+	switch (t) {
+	case OBCV_U8:
+		return data[i];
+	case OBCV_S8:
+		return (int8_t)data[i];
+	case OBCV_U16:
+		return data[2 * i] | (data[2 * i + 1] << 8);
+	case OBCV_S16:
+		return (int16_t)(data[2 * i] | (data[2 * i + 1] << 8));
+	}
+	return 0;
+}
+
+static void obcb_scalar(struct obcb *b, void *out, const uint8_t *data,
+			size_t len)
+{
+	unsigned int nch = b->cal.nch;
+	size_t i, n = len / b->ss;
+	uint8_t *o8 = out;
+	int32_t *o32 = out;
+	float *of = out;
+
+	switch (b->op) {
+	case OBCB_SWAP:
+		for (i = 0; i < len; ++i)
+			o8[i] = data[i ^ b->swap];
+		break;
+	case OBCB_UNPACK:
+		for (i = 0; i < n; ++i)
+			o32[i] = obcb_sample(data, i, b->type);
+		break;
+	case OBCB_FLOAT:
+		for (i = 0; i < n; ++i)
+			of[i] = obcb_sample(data, i, b->type) *
+				b->gain[i % nch] + b->offset[i % nch];
+		break;
+	default:
+		break;
+	}
+}
+
+static int obcb_kernel(struct obcb *b, void *out, const uint8_t *data,
+		       size_t len)
+{
+	switch (b->op) {
+	case OBCB_SWAP:
+		return obcv_swap(out, data, len, b->swap);
+	case OBCB_UNPACK:
+		return obcv_unpack(out, data, len / b->ss, b->type);
+	case OBCB_FLOAT:
+		return obcv_float(out, data, len / b->ss, b->type, &b->cal);
+	default:
+		break;
+	}
+	return -1;
+}
+
+/**
+ * Compare a kernel output with the reference; floats can differ in the
+ * last bit when the compiler fuses the scalar multiply and add
+ */
+static int obcb_check(struct obcb *b, const void *out, const void *ref,
+		      size_t len)
+{
+	const float *of = out, *rf = ref;
+	size_t i, n = len / b->ss;
+
+	switch (b->op) {
+	case OBCB_SWAP:
+		return memcmp(out, ref, len);
+	case OBCB_UNPACK:
+		return memcmp(out, ref, n * sizeof(int32_t));
+	case OBCB_FLOAT:
+		for (i = 0; i < n; ++i)
+			if (fabsf(of[i] - rf[i]) > 1e-6f * fabsf(rf[i]))
+				return -1;
+		return 0;
+	default:
+		break;
+	}
+	return -1;
+}
+
+/**
+ * Read every byte, the bandwidth to compare with
+ */
+static uint64_t obcb_read(const uint8_t *data, size_t len)
+{
+	uint64_t acc = 0, v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, data + i, 8);
+		acc += v;
+	}
+	return acc;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int n_pages = OBCB_NPAGES_DEF, nch = 1, swap = OBCV_SWAP_WORDS;
+	unsigned int rounds = OBCB_ROUNDS_DEF, i, k;
+	size_t page_size = OBCB_PAGE_DEF, done;
+	uint64_t t, acc = 0;
+	uint8_t **pages;
+	void *out, *ref;
+	struct obcb b;
+	uint32_t rnd = 12345;
+	const char *file = NULL;
+	double bytes, base, scalar;
+	int c, ret, fd, err = 0;
+	ssize_t r;
+
+	memset(&b, 0, sizeof(b));
+	while ((c = getopt (argc, argv, "hf:p:n:r:t:s:c:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%zu", &page_size);
+			if (ret != 1 || !page_size || page_size % 4)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%u", &n_pages);
+			if (ret != 1 || !n_pages)
+				help();
+			break;
+		case 'r':
+			ret = sscanf(optarg, "%u", &rounds);
+			if (ret != 1 || !rounds)
+				help();
+			break;
+		case 't':
+			for (k = 0; obcb_types[k]; ++k)
+				if (!strcmp(optarg, obcb_types[k]))
+					break;
+			if (!obcb_types[k])
+				help();
+			b.type = k;
+			break;
+		case 's':
+			ret = sscanf(optarg, "%u", &swap);
+			if (ret != 1 || swap > OBCV_SWAP_ALL)
+				help();
+			break;
+		case 'c':
+			ret = sscanf(optarg, "%u", &nch);
+			if (ret != 1 || !nch || nch > OBCV_CH_MAX)
+				help();
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+
+	fd = file ? open(file, O_RDONLY) : -1;
+	if (file && fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	pages = calloc(n_pages, sizeof(*pages));
+	if (!pages)
+		exit(1);
+	for (i = 0; i < n_pages; ++i) {
+		if (posix_memalign((void **)&pages[i], 64, page_size))
+			exit(1);
+		for (done = 0; fd >= 0 && done < page_size; done += r) {
+			r = read(fd, pages[i] + done, page_size - done);
+			if (r <= 0) {
+				fprintf(stderr, "Cannot read %u pages from %s\n",
+					n_pages, file);
+				exit(1);
+			}
+		}
+		for (done = 0; fd < 0 && done < page_size; ++done) {
+			rnd = rnd * 1103515245 + 12345;
+			pages[i][done] = rnd >> 16;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	/* a calibration that changes every channel */
+	b.swap = swap;
+	b.ss = obcv_type_size(b.type);
+	for (k = 0; k < nch; ++k) {
+		b.gain[k] = 0.5f / (k + 1);
+		b.offset[k] = -0.25f * k;
+	}
+	out = obcv_alloc(page_size * sizeof(float));
+	ref = obcv_alloc(page_size * sizeof(float));
+	if (!out || !ref || obcv_cal_init(&b.cal, nch, b.gain, b.offset))
+		exit(1);
+
+	bytes = (double)n_pages * page_size * rounds;
+	printf("%u pages of %zu bytes, %s samples, swap %u, %u channels, %u rounds\n",
+	       n_pages, page_size, obcb_types[b.type], swap, nch, rounds);
+	printf("%-7s %-10s %10s %8s %8s %s\n", "op", "kernel", "MB/s",
+	       "x-read", "x-scalar", "check");
+
+	t = obsbox_now_ns();
+	for (k = 0; k < rounds; ++k)
+		for (i = 0; i < n_pages; ++i)
+			acc += obcb_read(pages[i], page_size);
+	base = bytes / ((obsbox_now_ns() - t) / 1e3);
+	printf("%-7s %-10s %10.1f %8.2f %8s (%llx)\n", "-", "read", base, 1.0,
+	       "", (unsigned long long)(acc & 0xF));
+
+	for (b.op = 0; b.op < __OBCB_OP_MAX; ++b.op) {
+		t = obsbox_now_ns();
+		for (k = 0; k < rounds; ++k)
+			for (i = 0; i < n_pages; ++i)
+				obcb_scalar(&b, out, pages[i], page_size);
+		t = obsbox_now_ns() - t;
+		scalar = bytes / (t / 1e3);
+		printf("%-7s %-10s %10.1f %8.2f %8.2f reference\n",
+		       obcb_ops[b.op], "scalar", scalar, scalar / base, 1.0);
+
+		for (c = 0; obcb_kernels[c]; ++c) {
+			if (obcv_impl_set(obcb_kernels[c])) {
+				printf("%-7s %-10s %10s\n", obcb_ops[b.op],
+				       obcb_kernels[c], "n/a");
+				continue;
+			}
+			t = obsbox_now_ns();
+			for (k = 0; k < rounds; ++k)
+				for (i = 0; i < n_pages; ++i)
+					obcb_kernel(&b, out, pages[i], page_size);
+			t = obsbox_now_ns() - t;
+
+			for (i = 0; i < n_pages; ++i) {
+				obcb_scalar(&b, ref, pages[i], page_size);
+				if (obcb_kernel(&b, out, pages[i], page_size) ||
+				    obcb_check(&b, out, ref, page_size))
+					break;
+			}
+			printf("%-7s %-10s %10.1f %8.2f %8.2f %s\n",
+			       obcb_ops[b.op], obcb_kernels[c],
+			       bytes / (t / 1e3), bytes / (t / 1e3) / base,
+			       bytes / (t / 1e3) / scalar,
+			       i == n_pages ? "ok" : "MISMATCH");
+			if (i != n_pages)
+				err = 1;
+		}
+	}
+
+	exit(err);
+}
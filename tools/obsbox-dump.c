@@ -11,32 +11,21 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <sys/mman.h>
 #include <getopt.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/select.h>
 #include <linux/zio-user.h>
 
-#define ZPATH_BUF_SET "/sys/bus/zio/devices/obsbox-%04x/cset0/current_buffer"
-#define ZPATH_BUF_VMALLOC_SIZE "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/buffer/max-buffer-kb"
-#define ZPATH_PAGE_SIZE "/sys/bus/zio/devices/obsbox-%04x/cset0/trigger/post-samples"
-#define ZPATH_BUF_FLUSH "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/buffer/flush"
-#define ZPATH_ALARMS "/sys/bus/zio/devices/obsbox-%04x/cset0/chan0/alarms"
-#define ZPATH_CMD_RUN "/sys/bus/zio/devices/obsbox-%04x/cset0/ob-run"
-#define ZPATH_ACQ_MODE "/sys/bus/zio/devices/obsbox-%04x/cset0/ob-streaming-enable"
-#define ZPATH_TRG_EN "/sys/bus/zio/devices/obsbox-%04x/cset0/trigger/enable"
-
-#define ZPATH_CDEV_DATA "/dev/zio/obsbox-%04x-0-0-data"
-#define ZPATH_CDEV_CTRL "/dev/zio/obsbox-%04x-0-0-ctrl"
+#include "libobsbox.h"
+#include "obsbox-export.h"
 
 static char git_version[] = "version: " GIT_VERSION;
 static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
 
-/* Where the buffer will be mapped */
-static void *mmapaddr;
 static uint32_t vmalloc_size = 0;
 static int raw = 0;
+static int zerocopy = 0;
+static int quiet = 0;
+static uint64_t stat_pages, stat_bytes;
+static struct obx out;
 
 static void help()
 {
@@ -48,8 +37,13 @@ static void help()
 	fprintf(stderr, " -n <number>: number of blocks to acquire\n");
 	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
 	fprintf(stderr, " -s: enable streaming\n");
-	fprintf(stderr, " -m: use mmap to read data from a vmalloc buffer (it will not work with kmalloc)\n");
+	fprintf(stderr, " -m: process data in place through mmap(2), it is the fastest way (it implies vmalloc)\n");
 	fprintf(stderr, " -R: dump binary data\n");
+	fprintf(stderr, " -Z: dump binary data with splice(2), data does not pass through user-space\n");
+	fprintf(stderr, " -q: do not print data, only the throughput at the end\n");
+	fprintf(stderr, " -F <hex|csv|npy>: data format on stdout (default hex)\n");
+	fprintf(stderr, " -w <number>: csv values per line, e.g. the samples in a turn (default %d)\n",
+		OBX_WIDTH_DEF);
 	fprintf(stderr, " -V: print version\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "vmalloc\n");
@@ -58,115 +52,13 @@ static void help()
 }
 
 /**
- * it writes to sysfs attribute
- */
-#define OBD_W_BUF_LEN 16
-static int obd_write_cfg(const char *fmt, uint32_t devid, uint32_t value)
-{
-	char path[128], val[OBD_W_BUF_LEN] = {0};
-	int fd, ret;
-
-	snprintf(path, 128, fmt, devid);
-	fd = open(path, O_WRONLY);
-	if (!fd)
-		return -1;
-
-	snprintf(val, OBD_W_BUF_LEN, "%d", value);
-	ret = write(fd, val, OBD_W_BUF_LEN);
-	close(fd);
-
-	return (ret == OBD_W_BUF_LEN ? 0 : -1);
-}
-
-/**
- * Set the buffer type ((k|v)malloc)
- */
-static int obd_buffer_type_set(const char *fmt, uint32_t devid, char *type)
-{
-	char path[128];
-	int fd, ret;
-
-	snprintf(path, 128, fmt, devid);
-	fd = open(path, O_WRONLY);
-	if (!fd)
-		return -1;
-
-	ret = write(fd, type, strlen(type));
-	close(fd);
-
-	return (ret == strlen(type) ? 0 : -1);
-}
-
-
-/**
- * Setup vmalloc allocation
+ * Print data from buffer, with a single write
  */
-static int obd_set_vmalloc(uint32_t devid, uint32_t size)
+static int print_buffer(const uint8_t *buf, int start, int end)
 {
-	int err;
-
-	err = obd_buffer_type_set(ZPATH_BUF_SET, devid, "vmalloc");
-	if (err)
+	if (obx_write(&out, buf + start, end - start, start))
 		return -1;
-	return obd_write_cfg(ZPATH_BUF_VMALLOC_SIZE, devid, size/1024);
-}
-
-static int obd_set_kmalloc(uint32_t devid)
-{
-	return obd_buffer_type_set(ZPATH_BUF_SET, devid, "kmalloc");
-}
-
-/**
- * Configure basic acquisition
- */
-static int obd_configuration(uint32_t devid, int streaming, uint32_t size,
-			     uint32_t vmalloc_size)
-{
-	int ret = 0;
-
-	/* Stop acquisition */
-	obd_write_cfg(ZPATH_CMD_RUN, devid, 0);
-	/* Disable the trigger for a safe configuration */
-	ret |= obd_write_cfg(ZPATH_TRG_EN, devid, 0);
-	if (vmalloc_size)
-		ret |= obd_set_vmalloc(devid, vmalloc_size);
-	else
-		ret |= obd_set_kmalloc(devid);
-	if (ret) {
-		fprintf(stderr, "Cannot set buffer type: %s\n",
-			strerror(errno));
-		goto out;
-	}
-	/* Clear previous alarms */
-	ret |= obd_write_cfg(ZPATH_ALARMS, devid, 0xFF);
-	/* Remove blocks from previous acquisition */
-	ret |= obd_write_cfg(ZPATH_BUF_FLUSH, devid, 1);
-	/* Configure acquisition mode: 1 streaming, 0 single shot */
-	ret |= obd_write_cfg(ZPATH_ACQ_MODE, devid, streaming);
-	/* Setting up page-size */
-	ret |= obd_write_cfg(ZPATH_PAGE_SIZE, devid, size);
-	/* Enable trigger again so we can acquire */
-	ret |= obd_write_cfg(ZPATH_TRG_EN, devid, 1);
-out:
-	return ret;
-}
-
-
-/**
- * Print data from buffer
- */
-void print_buffer(uint8_t *buf, int start, int end)
-{
-	int j;
-
-	for (j = start; j < end; j++) {
-		if (!(j & 0xf) || j == start)
-			printf("Data [0x%08x]:", j * 16);
-		printf(" %02x", buf[j]);
-		if ((j & 0xf) == 0xf || j == end - 1)
-			putchar('\n');
-	}
-	putchar('\n');
+	return out.fmt == OBX_HEX ? obx_printf(&out, "\n") : 0;
 }
 
 
@@ -174,82 +66,74 @@ void print_buffer(uint8_t *buf, int start, int end)
  * Read and dump data from the driver
  * @return number of byte read, -1 on error and errno is appropriately set.
  */
-static int obd_block_dump(uint32_t devid, int fdd, int fdc,
-			  unsigned int reduce, unsigned int dommap)
+static int obd_block_dump(struct obdev *d, unsigned int reduce)
 {
-	struct zio_control zctrl;
-	struct timeval tv = {1, 0};
-	fd_set ctrl_set;
-	uint8_t *buf;
-	int n, i;
+	struct obdev_page pg;
+	uint64_t alarms = d->alarms;
+	int n, w, done, err = 0;
 
 	/* Wait until a block is ready */
-	FD_ZERO(&ctrl_set);
-	FD_SET(fdc, &ctrl_set);
-	i = select(fdc + 1, &ctrl_set, NULL, NULL, &tv);
-	if (i < 0) {
-		fprintf(stderr, "obd-dump: select(): %s\n",strerror(errno));
+	n = obdev_next(d, &pg, 1000);
+	if (n < 0) {
+		fprintf(stderr, "obd-dump: cannot get a block: %s\n",
+			strerror(errno));
 		return -1;
 	}
-	if (i == 0) /* timeout */
+	if (n == 0) /* timeout */
 		return 0;
 
-
-	/* Read the block control information */
-	n = read(fdc, &zctrl, sizeof(struct zio_control));
-	if (n != sizeof(struct zio_control)) {
-		fprintf(stderr, "obd-dump: cannot read zio control\n");
-	        return -1;
-	}
-
-	/* check the status */
-	if (zctrl.zio_alarms & (ZIO_ALARM_LOST_BLOCK | ZIO_ALARM_LOST_TRIGGER)) {
+	/* check the status, the alarm is already clear */
+	if (d->alarms != alarms)
 		fprintf(stderr,
 			"obd-dump: something went wrong during acquisition\n");
-		/* clear the alarm */
-		obd_write_cfg(ZPATH_ALARMS, devid, 0xFF);
-	}
 
-	/* read data */
-	if (dommap) {
-		/* mmap way */
-		buf = mmapaddr + zctrl.mem_offset;
-		n = zctrl.nsamples * zctrl.ssize;
-		printf("mmap %p offset 0x%x n %d - buf %p\n",
-		       mmapaddr, zctrl.mem_offset, n, buf);
+	n = pg.len;
+	stat_pages++;
+	stat_bytes += n;
 
-		fprintf(stderr, "mmap out of range %d >= %d\n",
-				zctrl.mem_offset + n, vmalloc_size);
-	} else {
-		/* read way */
-		buf = malloc(zctrl.nsamples * zctrl.ssize);
-		if (!buf) {
-			fprintf(stderr, "obd-dump: cannot allocate buffer\n");
-			return -1;
-		}
-		n = read(fdd, buf, zctrl.nsamples * zctrl.ssize);
+	/* Move raw binary data without copying it */
+	if (d->mode == OBDEV_SPLICE) {
+		if (!obdev_splice(d, STDOUT_FILENO))
+			return n;
+		fprintf(stderr, "obd-dump: splice(): %s\n", strerror(errno));
+		return -1;
 	}
 
 	/* Print raw binary data */
 	if (raw) {
-		write(STDOUT_FILENO, buf, zctrl.nsamples * zctrl.ssize);
-		goto out;
+		for (done = 0; done < n; done += w) {
+			w = write(STDOUT_FILENO, pg.data + done, n - done);
+			if (w < 0 && errno == EINTR) {
+				w = 0;
+				continue;
+			}
+			if (w <= 0) {
+				fprintf(stderr, "obd-dump: cannot write data: %s\n",
+					w < 0 ? strerror(errno) : "short write");
+				return -1;
+			}
+		}
+		return n;
 	}
+	/* Consume only: used to measure the acquisition throughput */
+	if (quiet)
+		return n;
 
 	/* report data to stdout */
-	fprintf(stdout, "Page number %d\n", zctrl.seq_num);
-	if (reduce == -1) {
-		print_buffer(buf, 0, n);
+	if (out.fmt == OBX_HEX)
+		obx_printf(&out, "Page number %d\n", pg.zctrl.seq_num);
+	if (reduce == -1 || out.fmt != OBX_HEX) {
+		err = print_buffer(pg.data, 0, n);
 	} else {
-		print_buffer(buf, 0, reduce);
-		printf("    ...\n\n");
-		print_buffer(buf, n - reduce, n);
+		err = print_buffer(pg.data, 0, reduce);
+		obx_printf(&out, "    ...\n\n");
+		err |= print_buffer(pg.data, n - reduce, n);
 	}
- out:
-	if (!dommap)
-		free(buf);
+	if (err)
+		fprintf(stderr, "obd-dump: cannot write data: %s\n",
+			strerror(errno));
 
-	return n;
+	return err ? -1 : n;
 }
 
 static void print_version(char *pname)
@@ -259,15 +143,18 @@ static void print_version(char *pname)
 }
 
 #define DUMP_TRY 10
+#define OBD_MMAP_PAGES 8
 int main(int argc, char **argv)
 {
-	char c, path[128];
-	int ret, streaming = 0, dommap = 0, n = -1, fdd, fdc;
-	int reduce, try = DUMP_TRY;
+	char c;
+	int ret, streaming = 0, dommap = 0, n = -1;
+	int reduce = -1, try = DUMP_TRY, fmt = OBX_HEX, width = 0;
 	uint32_t devid, page_size;
+	uint64_t t_start;
+	struct obdev d;
 
 	/* Parse options */
-	while ((c = getopt (argc, argv, "hd:r:p:n:sv:mRV")) != -1)
+	while ((c = getopt (argc, argv, "hd:r:p:n:sv:mqRZF:w:V")) != -1)
 	{
 		switch(c)
 		{
@@ -305,9 +192,26 @@ int main(int argc, char **argv)
 		case 'm':
 			dommap = 1;
 			break;
+		case 'q':
+			quiet = 1;
+			break;
 		case 'R':
 			raw = 1;
 			break;
+		case 'Z':
+			raw = 1;
+			zerocopy = 1;
+			break;
+		case 'F':
+			fmt = obx_parse(optarg);
+			if (fmt < 0 || fmt == OBX_RAW)
+				help();
+			break;
+		case 'w':
+			ret = sscanf(optarg, "%d", &width);
+			if (ret != 1 || width <= 0)
+				help();
+			break;
 		case 'V':
 			print_version(argv[0]);
 			exit(0);;
@@ -316,55 +220,63 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * ZIO exports through mmap(2) only the vmalloc buffer. When the user
+	 * does not size it, make room for a few pages
+	 */
+	if (dommap && !vmalloc_size)
+		vmalloc_size = OBD_MMAP_PAGES * page_size;
+
+	if (obdev_open(&d, devid)) {
+		fprintf(stderr, "Cannot open device 0x%x: %s\n", devid,
+			strerror(errno));
+		exit(1);
+	}
+
 	/* Configure the acquisition */
-	ret = obd_configuration(devid, streaming, page_size, vmalloc_size);
+	ret = obdev_configure(&d, streaming, page_size, vmalloc_size);
 	if (ret){
 		fprintf(stderr,
 			"Something wrong during the configuration: %s\n",
 			strerror(errno));
-		exit(1);
+		goto out;
 	}
 
 	if (!streaming && n == -1)
 		n = 1;
 
-	/* Open ZIO char-devices */
-	snprintf(path, 128, ZPATH_CDEV_DATA, devid);
-	fdd = open(path, O_RDONLY);
-	snprintf(path, 128, ZPATH_CDEV_CTRL, devid);
-	fdc = open(path, O_RDONLY);
-
-	if (!fdd || !fdc)
+	if (obx_init(&out, STDOUT_FILENO, fmt, width, n > 0 ? n : 0)) {
+		fprintf(stderr, "npy on a pipe needs the number of blocks (-n)\n");
 		goto out;
+	}
 
-	if (dommap) {
-		if (!vmalloc_size) {
-			fprintf(stderr,
-				"mmap(2) works only with vmalloc allocation\n");
-			goto out;
-		}
-		mmapaddr = mmap(0, vmalloc_size, PROT_READ, MAP_SHARED,
-				fdd, 0);
-		if (mmapaddr == MAP_FAILED) {
-			fprintf(stderr, "Cannot mmap buffer: %s\n",
-				strerror(errno));
-			goto out;
-		}
+	/* mmap: the whole buffer is mapped once, blocks are found by offset */
+	ret = obdev_mode_set(&d, dommap ? OBDEV_MMAP :
+			     (zerocopy ? OBDEV_SPLICE : OBDEV_READ));
+	if (ret) {
+		fprintf(stderr, "Cannot prepare the %s consumer: %s\n",
+			dommap ? "mmap" : (zerocopy ? "splice" : "read"),
+			strerror(errno));
+		goto out;
 	}
 
+	t_start = obsbox_now_ns();
+
 	if (streaming) {
 		/*
 		 * In streaming mode we start the acquisition only one time
 		 * before the acquisition
 		 */
-		ret = obd_write_cfg(ZPATH_CMD_RUN, devid, 1);
+		ret = obdev_run(&d, 1);
 		if (ret < 0) {
 			fprintf(stderr, "Cannot start acquisition: %s\n",
 				strerror(errno));
 			goto out;
 		}
-		if (!raw)
+		if (!raw && fmt == OBX_HEX) {
 			fprintf(stdout, "Start acquisition in streaming mode\n");
+			fflush(stdout);
+		}
 	}
 	while (n && try) {
 		if (!streaming) {
@@ -372,7 +284,7 @@ int main(int argc, char **argv)
 			 * In case of single-shot mode we have to start
 			 * the acquisition for every block
 			 */
-			ret = obd_write_cfg(ZPATH_CMD_RUN, devid, 1);
+			ret = obdev_run(&d, 1);
 			if (ret < 0) {
 				fprintf(stderr,
 					"Cannot start acquisition (%d): %s\n",
@@ -382,7 +294,7 @@ int main(int argc, char **argv)
 			}
 		}
 
-		ret = obd_block_dump(devid, fdd, fdc, reduce, dommap);
+		ret = obd_block_dump(&d, reduce);
 		if (ret < 0)
 			break;
 		if (ret == 0) {
@@ -398,14 +310,23 @@ int main(int argc, char **argv)
 
 	if (!try)
 		fprintf(stderr, "Fail %d times to acquire a page\n", DUMP_TRY);
-	if (dommap && vmalloc_size)
-		munmap(mmapaddr, vmalloc_size);
-	close(fdd);
-	close(fdc);
-	obd_write_cfg(ZPATH_CMD_RUN, devid, 0);
+	if (quiet) {
+		t_start = obsbox_now_ns() - t_start;
+		fprintf(stderr,
+			"%s: %llu pages, %llu bytes in %.3f s: %.1f MB/s %.1f pages/s\n",
+			dommap ? "mmap" : (zerocopy ? "splice" : "read"),
+			(unsigned long long)stat_pages,
+			(unsigned long long)stat_bytes, t_start / 1e9,
+			stat_bytes * 1e3 / t_start, stat_pages * 1e9 / t_start);
+	}
+	if (!raw && !quiet)
+		obx_close(&out);
+	obdev_run(&d, 0);
+	obdev_close(&d);
 	exit(0);
 
 out:
-	obd_write_cfg(ZPATH_CMD_RUN, devid, 0);
+	obdev_run(&d, 0);
+	obdev_close(&d);
 	exit(1);
 }
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "obsbox-envelope.h"
+#include "obsbox-common.h"
+
+/**
+ * A set of kernels: minimum and maximum of a run of samples
+ */
+struct obenv_kernel {
+	const char *name;
+	void (*run)(const uint8_t *data, size_t len, uint8_t *min,
+		    uint8_t *max);
+};
+
+static const struct obenv_kernel *obenv_k;
+
+static void obenv_run_generic(const uint8_t *data, size_t len, uint8_t *min,
+			      uint8_t *max)
+{
+	uint8_t mn = 0xFF, mx = 0;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (data[i] < mn)
+			mn = data[i];
+		if (data[i] > mx)
+			mx = data[i];
+	}
+	*min = mn;
+	*max = mx;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse2")))
+static inline void obenv_reduce_sse2(__m128i mn, __m128i mx, uint8_t *min,
+				     uint8_t *max)
+{
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 8));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 4));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 2));
+	mn = _mm_min_epu8(mn, _mm_srli_si128(mn, 1));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 8));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 4));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 2));
+	mx = _mm_max_epu8(mx, _mm_srli_si128(mx, 1));
+	*min = _mm_cvtsi128_si32(mn);
+	*max = _mm_cvtsi128_si32(mx);
+}
+
+/**
+ * SSE2 implementation, 32 samples per iteration in two accumulators
+ */
+__attribute__((target("sse2")))
+static void obenv_run_sse2(const uint8_t *data, size_t len, uint8_t *min,
+			   uint8_t *max)
+{
+	__m128i mn0 = _mm_set1_epi8(-1), mx0 = _mm_setzero_si128();
+	__m128i mn1 = mn0, mx1 = mx0, a, b;
+	uint8_t tmn, tmx;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		a = _mm_loadu_si128((const __m128i *)(data + i));
+		b = _mm_loadu_si128((const __m128i *)(data + i + 16));
+		mn0 = _mm_min_epu8(mn0, a);
+		mx0 = _mm_max_epu8(mx0, a);
+		mn1 = _mm_min_epu8(mn1, b);
+		mx1 = _mm_max_epu8(mx1, b);
+	}
+	obenv_reduce_sse2(_mm_min_epu8(mn0, mn1), _mm_max_epu8(mx0, mx1),
+			  min, max);
+	obenv_run_generic(data + i, len - i, &tmn, &tmx);
+	if (tmn < *min)
+		*min = tmn;
+	if (tmx > *max)
+		*max = tmx;
+}
+
+/**
+ * AVX2 implementation, 64 samples per iteration
+ */
+__attribute__((target("avx2")))
+static void obenv_run_avx2(const uint8_t *data, size_t len, uint8_t *min,
+			   uint8_t *max)
+{
+	__m256i mn0 = _mm256_set1_epi8(-1), mx0 = _mm256_setzero_si256();
+	__m256i mn1 = mn0, mx1 = mx0, a, b;
+	uint8_t tmn, tmx;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		a = _mm256_loadu_si256((const __m256i *)(data + i));
+		b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+		mn0 = _mm256_min_epu8(mn0, a);
+		mx0 = _mm256_max_epu8(mx0, a);
+		mn1 = _mm256_min_epu8(mn1, b);
+		mx1 = _mm256_max_epu8(mx1, b);
+	}
+	mn0 = _mm256_min_epu8(mn0, mn1);
+	mx0 = _mm256_max_epu8(mx0, mx1);
+	obenv_reduce_sse2(_mm_min_epu8(_mm256_castsi256_si128(mn0),
+				       _mm256_extracti128_si256(mn0, 1)),
+			  _mm_max_epu8(_mm256_castsi256_si128(mx0),
+				       _mm256_extracti128_si256(mx0, 1)),
+			  min, max);
+	obenv_run_sse2(data + i, len - i, &tmn, &tmx);
+	if (tmn < *min)
+		*min = tmn;
+	if (tmx > *max)
+		*max = tmx;
+}
+#endif
+
+static const struct obenv_kernel obenv_kernels[] = {
+	{"generic", obenv_run_generic},
+#if defined(__x86_64__)
+	{"sse2", obenv_run_sse2},
+	{"avx2", obenv_run_avx2},
+#endif
+};
+
+/**
+ * Choose the implementation before main()
+ */
+__attribute__((constructor))
+static void obenv_kernel_init(void)
+{
+	obenv_k = &obenv_kernels[0];
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse2"))
+		obenv_k = &obenv_kernels[1];
+	if (__builtin_cpu_supports("avx2"))
+		obenv_k = &obenv_kernels[2];
+#endif
+}
+
+const char *obenv_impl(void)
+{
+	return obenv_k->name;
+}
+
+/**
+ * Reduce 'len' samples to 'n' points: point i is the minimum and the
+ * maximum of the samples [i * len / n, (i + 1) * len / n). With fewer
+ * samples than points some points are empty (min 0xFF, max 0).
+ */
+void obenv_minmax(const uint8_t *data, size_t len, unsigned int n,
+		  uint8_t *min, uint8_t *max)
+{
+	size_t a, b;
+	unsigned int i;
+
+	for (i = 0, a = 0; i < n; ++i, a = b) {
+		b = (size_t)(((unsigned __int128)len * (i + 1)) / n);
+		obenv_k->run(data + a, b - a, &min[i], &max[i]);
+	}
+}
+
+
+static int obenv_open_file(struct obenv *e, const char *path)
+{
+	e->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (e->fd < 0)
+		return -1;
+	if (ftruncate(e->fd, e->len))
+		goto err;
+	e->map = mmap(NULL, e->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      e->fd, 0);
+	if (e->map == MAP_FAILED)
+		goto err;
+	memset(e->map, 0, e->len);
+	return 0;
+err:
+	close(e->fd);
+	return -1;
+}
+
+static int obenv_open_udp(struct obenv *e, const char *hostport)
+{
+	struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+	struct addrinfo *res;
+	char host[256], *port;
+
+	snprintf(host, sizeof(host), "%s", hostport);
+	port = strrchr(host, ':');
+	if (!port) {
+		errno = EINVAL;
+		return -1;
+	}
+	*port++ = '\0';
+	if (getaddrinfo(host, port, &hints, &res)) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+	memcpy(&e->addr, res->ai_addr, sizeof(e->addr));
+	freeaddrinfo(res);
+	e->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	return e->fd < 0 ? -1 : 0;
+}
+
+/**
+ * Open the side channel, see obsbox-envelope.h for 'dest'
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obenv_open(struct obenv *e, const char *dest, unsigned int n)
+{
+	int err;
+
+	memset(e, 0, sizeof(*e));
+	e->fd = -1;
+	if (!n || n > OBENV_POINTS_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	e->n = n;
+	e->len = sizeof(struct obenv_hdr) + 2 * n;
+	e->rec = calloc(1, e->len);
+	if (!e->rec)
+		return -1;
+
+	if (!strncmp(dest, "file:", 5)) {
+		e->type = OBENV_FILE;
+		err = obenv_open_file(e, dest + 5);
+	} else if (!strncmp(dest, "udp:", 4)) {
+		e->type = OBENV_UDP;
+		err = obenv_open_udp(e, dest + 4);
+	} else if (!strncmp(dest, "shm:", 4)) {
+		e->type = OBENV_SHM;
+		err = obshm_create(&e->shm, dest + 4, OBENV_SHM_SLOTS, e->len,
+				   8, OBSHM_MODE_DEF);
+	} else {
+		errno = EINVAL;
+		err = -1;
+	}
+	if (err) {
+		free(e->rec);
+		e->rec = NULL;
+	}
+	return err;
+}
+
+/**
+ * Reduce a page and publish its envelope. It never waits: when the
+ * channel is busy the envelope is dropped and counted.
+ * @return 0 on success or drop, -1 on error
+ */
+int obenv_publish(struct obenv *e, const struct zio_control *zctrl,
+		  const uint8_t *data, size_t len)
+{
+	struct obenv_hdr *h = (void *)e->rec;
+	int slot;
+
+	h->magic = OBENV_MAGIC;
+	h->n = e->n;
+	h->page_len = len;
+	h->seq_num = zctrl->seq_num;
+	h->marker = obsbox_ctrl_marker(zctrl);
+	h->tstamp = zctrl->tstamp.secs * 1000000000ULL + zctrl->tstamp.ticks;
+	h->t_host = obsbox_realtime_ns();
+	h->count = ++e->count;
+	obenv_minmax(data, len, e->n, e->rec + sizeof(*h),
+		     e->rec + sizeof(*h) + e->n);
+
+	switch (e->type) {
+	case OBENV_FILE:
+		/* the readers retry while gen is odd or it changed */
+		h->gen = e->map->gen + 1;
+		__atomic_store_n(&e->map->gen, h->gen, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy((uint8_t *)e->map + sizeof(h->magic) + sizeof(h->gen),
+		       e->rec + sizeof(h->magic) + sizeof(h->gen),
+		       e->len - sizeof(h->magic) - sizeof(h->gen));
+		e->map->magic = OBENV_MAGIC;
+		__atomic_store_n(&e->map->gen, h->gen + 1, __ATOMIC_RELEASE);
+		break;
+	case OBENV_UDP:
+		if (sendto(e->fd, e->rec, e->len, MSG_DONTWAIT,
+			   (struct sockaddr *)&e->addr, sizeof(e->addr)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != ECONNREFUSED)
+				return -1;
+			e->drops++;
+		}
+		break;
+	case OBENV_SHM:
+		slot = obshm_claim(&e->shm);
+		if (slot < 0) {
+			e->drops++;
+			break;
+		}
+		memcpy(obshm_slot_data(&e->shm, slot), e->rec, e->len);
+		obshm_publish(&e->shm, slot, zctrl, e->len, 0);
+		break;
+	}
+	return 0;
+}
+
+void obenv_close(struct obenv *e)
+{
+	switch (e->type) {
+	case OBENV_FILE:
+		if (e->map && e->map != MAP_FAILED)
+			munmap(e->map, e->len);
+		break;
+	case OBENV_SHM:
+		obshm_destroy(&e->shm);
+		break;
+	default:
+		break;
+	}
+	if (e->fd >= 0 && e->type != OBENV_SHM)
+		close(e->fd);
+	free(e->rec);
+	e->rec = NULL;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_ENVELOPE_H__
+#define __OBSBOX_ENVELOPE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <linux/zio-user.h>
+
+#include "obsbox-shm.h"
+
+/*
+ * Live view: a page reduced to 'n' points, the minimum and the maximum of
+ * each of 'n' equal runs of 8 bit samples, so that a spike is still
+ * visible on the display. Envelopes are published at a low rate on a
+ * side channel, never blocking the caller:
+ *   file:<path>       the last envelope, rewritten in place in a mapped
+ *                     file. 'gen' is odd while it is written: readers copy
+ *                     the record and retry if 'gen' changed meanwhile
+ *   udp:<host>:<port> a datagram per envelope, dropped when the socket
+ *                     buffer is full
+ *   shm:<name>        a page ring of obsbox-shm.h, one envelope per page
+ * A record is struct obenv_hdr followed by min[n] and max[n].
+ */
+#define OBENV_MAGIC 0x564E4542 /* "BENV" */
+#define OBENV_POINTS_MAX 16384 /* a record fits in a datagram */
+#define OBENV_SHM_SLOTS 4
+
+struct obenv_hdr {
+	uint32_t magic;
+	uint32_t gen; /**< file: odd while written */
+	uint32_t n; /**< points */
+	uint32_t page_len; /**< samples in the page */
+	uint32_t seq_num; /**< ZIO sequence number */
+	uint32_t marker; /**< marker offset in the page, OBSBOX_NO_MARKER */
+	uint64_t tstamp; /**< ZIO time stamp, ns */
+	uint64_t t_host; /**< CLOCK_REALTIME ns */
+	uint64_t count; /**< envelopes published so far */
+};
+
+enum obenv_type {
+	OBENV_FILE = 0,
+	OBENV_UDP,
+	OBENV_SHM,
+};
+
+struct obenv {
+	enum obenv_type type;
+	unsigned int n;
+	size_t len; /**< record length */
+	uint8_t *rec; /**< record being built */
+	/* file */
+	int fd;
+	struct obenv_hdr *map;
+	/* udp */
+	struct sockaddr_in addr;
+	/* shm */
+	struct obshm shm;
+	/* statistics */
+	uint64_t count;
+	uint64_t drops; /**< channel busy or full */
+};
+
+extern void obenv_minmax(const uint8_t *data, size_t len, unsigned int n,
+			 uint8_t *min, uint8_t *max);
+extern const char *obenv_impl(void);
+
+extern int obenv_open(struct obenv *e, const char *dest, unsigned int n);
+extern int obenv_publish(struct obenv *e, const struct zio_control *zctrl,
+			 const uint8_t *data, size_t len);
+extern void obenv_close(struct obenv *e);
+
+#endif
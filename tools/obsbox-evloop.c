@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "obsbox-evloop.h"
+
+/**
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obev_init(struct obev *ev)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->budget = OBEV_BUDGET_DEF;
+	ev->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return ev->epfd < 0 ? -1 : 0;
+}
+
+void obev_exit(struct obev *ev)
+{
+	close(ev->epfd);
+}
+
+/**
+ * Register an open and configured board. Its control char device becomes
+ * non-blocking. It starts on the ready list: the blocks already there
+ * would not generate an edge.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obev_add(struct obev *ev, struct obev_board *b)
+{
+	struct epoll_event e = {.events = EPOLLIN | EPOLLET, .data.ptr = b};
+
+	if (ev->n == OBEV_BOARDS_MAX) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (obdev_nonblock_set(&b->dev, 1))
+		return -1;
+	if (epoll_ctl(ev->epfd, EPOLL_CTL_ADD, b->dev.fdc, &e))
+		return -1;
+	ev->boards[ev->n++] = b;
+	b->ready = 1;
+	ev->ready[ev->n_ready++] = b;
+	return 0;
+}
+
+/**
+ * Serve a board up to the budget
+ * @return 1 when it may have more pages, 0 when it is empty, -1 on error
+ */
+static int obev_drain(struct obev *ev, struct obev_board *b)
+{
+	struct obdev_page pg;
+	unsigned int i;
+	int n;
+
+	b->rounds++;
+	for (i = 0; i < ev->budget; ++i) {
+		n = obdev_next(&b->dev, &pg, 0);
+		if (n < 0) {
+			fprintf(stderr, "obsbox-evloop: board 0x%04x: %s\n",
+				b->dev.devid, strerror(errno));
+			return -1;
+		}
+		if (!n) /* the previous block has been given back */
+			return 0;
+		b->pages++;
+		b->bytes += pg.len;
+		n = b->handler ? b->handler(b, &pg) : 0;
+		if (n < 0)
+			return -1;
+		if (n) {
+			obdev_release(&b->dev);
+			epoll_ctl(ev->epfd, EPOLL_CTL_DEL, b->dev.fdc, NULL);
+			b->removed = 1;
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Wait for events, at most 'timeout_ms' and not at all when a board is
+ * still ready, then serve every ready board once.
+ * @return the number of ready boards left, -1 on error or when a handler
+ *         asks to stop
+ */
+int obev_poll(struct obev *ev, int timeout_ms)
+{
+	struct epoll_event evs[OBEV_BOARDS_MAX];
+	struct obev_board *b;
+	unsigned int i, n_ready;
+	int n, ret;
+
+	n = epoll_wait(ev->epfd, evs, OBEV_BOARDS_MAX,
+		       ev->n_ready ? 0 : timeout_ms);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	if (n)
+		ev->wakeups++;
+	for (i = 0; i < n; ++i) {
+		b = evs[i].data.ptr;
+		b->events++;
+		if (!b->ready && !b->removed) {
+			b->ready = 1;
+			ev->ready[ev->n_ready++] = b;
+		}
+	}
+
+	/* one round, the boards with pages left stay on the list in order */
+	for (i = 0, n_ready = 0; i < ev->n_ready && !ev->stop; ++i) {
+		b = ev->ready[i];
+		ret = obev_drain(ev, b);
+		if (ret < 0)
+			return -1;
+		if (ret)
+			ev->ready[n_ready++] = b;
+		else
+			b->ready = 0;
+	}
+	/* on stop the boards not served are kept */
+	for (; i < ev->n_ready; ++i)
+		ev->ready[n_ready++] = ev->ready[i];
+	ev->n_ready = n_ready;
+	return n_ready;
+}
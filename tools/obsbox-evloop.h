@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_EVLOOP_H__
+#define __OBSBOX_EVLOOP_H__
+
+#include <stdint.h>
+
+#include "libobsbox.h"
+
+/*
+ * One thread serving several boards. The control char devices are
+ * non-blocking and registered edge-triggered in one epoll instance: an
+ * event means "new blocks", and the board is drained until obdev_next()
+ * finds nothing. To be fair a board gets at most 'budget' pages per round;
+ * when the budget runs out before the board is empty it stays on the
+ * ready list and it is served again without waiting for another event
+ * (edge-triggered epoll would not report it again).
+ */
+#define OBEV_BOARDS_MAX 16
+#define OBEV_BUDGET_DEF 8
+
+struct obev_board;
+
+/**
+ * Called for every page of a board. pg->data is NULL in OBDEV_SPLICE mode,
+ * the handler moves the data with obdev_splice().
+ * @return 0 to go on, 1 to remove the board from the loop, -1 to stop
+ *         the loop
+ */
+typedef int (*obev_handler_t)(struct obev_board *b, struct obdev_page *pg);
+
+struct obev_board {
+	struct obdev dev;
+	obev_handler_t handler;
+	void *priv;
+	int ready; /**< on the ready list */
+	int removed;
+	/* statistics */
+	uint64_t pages;
+	uint64_t bytes;
+	uint64_t events; /**< epoll events */
+	uint64_t rounds; /**< times it has been drained, partially or not */
+};
+
+struct obev {
+	int epfd;
+	unsigned int n;
+	struct obev_board *boards[OBEV_BOARDS_MAX];
+	struct obev_board *ready[OBEV_BOARDS_MAX];
+	unsigned int n_ready;
+	unsigned int budget; /**< pages per board per round */
+	volatile int stop;
+	uint64_t wakeups; /**< epoll_wait() that returned events */
+};
+
+extern int obev_init(struct obev *ev);
+extern void obev_exit(struct obev *ev);
+extern int obev_add(struct obev *ev, struct obev_board *b);
+extern int obev_poll(struct obev *ev, int timeout_ms);
+
+#endif
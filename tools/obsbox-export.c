@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "obsbox-export.h"
+
+/*
+ * Lookup tables: " xx" for every byte, "xx" for the offsets and ",ddd"
+ * for the decimal values. Entries are copied 4 or 8 bytes at a time and
+ * the output pointer advances only by the meaningful length.
+ */
+static char obx_hex3[256][4];
+static char obx_hex2[256][2];
+static char obx_dec[256][8];
+static uint8_t obx_dec_len[256];
+static int obx_tables_ready;
+
+static void obx_tables_init(void)
+{
+	static const char digits[] = "0123456789abcdef";
+	int i;
+
+	if (obx_tables_ready)
+		return;
+	for (i = 0; i < 256; ++i) {
+		obx_hex2[i][0] = digits[i >> 4];
+		obx_hex2[i][1] = digits[i & 0xF];
+		obx_hex3[i][0] = ' ';
+		obx_hex3[i][1] = digits[i >> 4];
+		obx_hex3[i][2] = digits[i & 0xF];
+		obx_dec_len[i] = snprintf(obx_dec[i], sizeof(obx_dec[i]),
+					  ",%d", i);
+	}
+	obx_tables_ready = 1;
+}
+
+/**
+ * @return the format for a name, -1 if unknown
+ */
+int obx_parse(const char *str)
+{
+	if (!strcmp(str, "raw"))
+		return OBX_RAW;
+	if (!strcmp(str, "hex"))
+		return OBX_HEX;
+	if (!strcmp(str, "csv"))
+		return OBX_CSV;
+	if (!strcmp(str, "npy"))
+		return OBX_NPY;
+	return -1;
+}
+
+
+size_t obx_hex_bound(size_t len)
+{
+	/* rows of 16 bytes, an extra row when the offset is not aligned */
+	return (len / 16 + 2) * (19 + 16 * 3) + 4;
+}
+
+/**
+ * Format rows of 16 bytes, 'off' is the offset of data[0]
+ * @return the number of characters
+ */
+size_t obx_hex(char *out, const uint8_t *data, size_t len, uint64_t off)
+{
+	char *p = out;
+	size_t i = 0, end;
+	uint32_t a;
+
+	obx_tables_init();
+	while (i < len) {
+		a = off + i;
+		end = i + 16 - (a & 0xF);
+		if (end > len)
+			end = len;
+		memcpy(p, "Data [0x", 8);
+		memcpy(p + 8, obx_hex2[a >> 24], 2);
+		memcpy(p + 10, obx_hex2[(a >> 16) & 0xFF], 2);
+		memcpy(p + 12, obx_hex2[(a >> 8) & 0xFF], 2);
+		memcpy(p + 14, obx_hex2[a & 0xFF], 2);
+		memcpy(p + 16, "]:", 2);
+		p += 18;
+		for (; i < end; ++i, p += 3)
+			memcpy(p, obx_hex3[data[i]], 4);
+		*p++ = '\n';
+	}
+
+	return p - out;
+}
+
+size_t obx_csv_bound(size_t len, unsigned int width)
+{
+	return len * 4 + len / (width ? width : 1) + 8;
+}
+
+/**
+ * Format decimal values, 'width' per line
+ * @col: column of the first value, updated
+ * @return the number of characters
+ */
+size_t obx_csv(char *out, const uint8_t *data, size_t len,
+	       unsigned int width, unsigned int *col)
+{
+	unsigned int c = *col, skip;
+	char *p = out;
+	size_t i;
+
+	obx_tables_init();
+	for (i = 0; i < len; ++i) {
+		/* no comma before the first value of a line */
+		skip = !c;
+		memcpy(p, obx_dec[data[i]] + skip, 4);
+		p += obx_dec_len[data[i]] - skip;
+		if (++c == width) {
+			*p++ = '\n';
+			c = 0;
+		}
+	}
+	*col = c;
+
+	return p - out;
+}
+
+/**
+ * NumPy format 1.0 header for a rows x cols uint8 array
+ * @return OBX_NPY_HDR_LEN
+ */
+size_t obx_npy_header(char *out, uint64_t rows, uint32_t cols)
+{
+	int n;
+
+	memcpy(out, "\x93NUMPY\x01\x00", 8);
+	out[8] = (OBX_NPY_HDR_LEN - 10) & 0xFF;
+	out[9] = (OBX_NPY_HDR_LEN - 10) >> 8;
+	n = snprintf(out + 10, OBX_NPY_HDR_LEN - 10,
+		     "{'descr': '|u1', 'fortran_order': False, 'shape': (%llu, %u), }",
+		     (unsigned long long)rows, cols);
+	memset(out + 10 + n, ' ', OBX_NPY_HDR_LEN - 10 - n);
+	out[OBX_NPY_HDR_LEN - 1] = '\n';
+
+	return OBX_NPY_HDR_LEN;
+}
+
+
+static int obx_reserve(struct obx *x, size_t more)
+{
+	char *buf;
+
+	if (x->len + more <= x->cap)
+		return 0;
+	buf = realloc(x->buf, x->len + more);
+	if (!buf)
+		return -1;
+	x->buf = buf;
+	x->cap = x->len + more;
+	return 0;
+}
+
+/**
+ * Write the pending buffer followed by 'data', with as few system calls
+ * as possible
+ */
+static int obx_writev(struct obx *x, const uint8_t *data, size_t len)
+{
+	struct iovec iov[2] = {
+		{.iov_base = x->buf, .iov_len = x->len},
+		{.iov_base = (void *)data, .iov_len = len},
+	};
+	struct iovec *v = iov;
+	int cnt = 2;
+	ssize_t n;
+
+	while (cnt) {
+		if (!v->iov_len) {
+			v++;
+			cnt--;
+			continue;
+		}
+		n = writev(x->fd, v, cnt);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		while (cnt && n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (cnt) {
+			v->iov_base = (uint8_t *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+	x->len = 0;
+	return 0;
+}
+
+/**
+ * @rows_hint: npy only, number of pages that will be written. It is
+ *             mandatory when the output is not seekable
+ * @return 0 on success, -1 on error
+ */
+int obx_init(struct obx *x, int fd, enum obx_format fmt, unsigned int width,
+	     uint64_t rows_hint)
+{
+	memset(x, 0, sizeof(*x));
+	x->fd = fd;
+	x->fmt = fmt;
+	x->width = width ? width : OBX_WIDTH_DEF;
+	x->rows_hint = rows_hint;
+	x->hdr_off = lseek(fd, 0, SEEK_CUR);
+	if (fmt == OBX_NPY && !rows_hint && x->hdr_off < 0) {
+		errno = ESPIPE;
+		return -1;
+	}
+	obx_tables_init();
+	return 0;
+}
+
+/**
+ * Append text, it goes out with the next page
+ */
+int obx_printf(struct obx *x, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0 || obx_reserve(x, n + 1))
+		return -1;
+	va_start(ap, fmt);
+	vsnprintf(x->buf + x->len, n + 1, fmt, ap);
+	va_end(ap);
+	x->len += n;
+	return 0;
+}
+
+/**
+ * Format and write a page, or a part of it
+ * @off: offset of data[0] in the page, for the hex rows
+ * @return 0 on success, -1 on error
+ */
+int obx_write(struct obx *x, const uint8_t *data, size_t len, uint64_t off)
+{
+	switch (x->fmt) {
+	case OBX_HEX:
+		if (obx_reserve(x, obx_hex_bound(len)))
+			return -1;
+		x->len += obx_hex(x->buf + x->len, data, len, off);
+		return obx_writev(x, NULL, 0);
+	case OBX_CSV:
+		if (obx_reserve(x, obx_csv_bound(len, x->width)))
+			return -1;
+		x->len += obx_csv(x->buf + x->len, data, len, x->width,
+				  &x->col);
+		return obx_writev(x, NULL, 0);
+	case OBX_NPY:
+		if (!x->rows) {
+			x->cols = len;
+			if (obx_reserve(x, OBX_NPY_HDR_LEN))
+				return -1;
+			x->len += obx_npy_header(x->buf + x->len, x->rows_hint,
+						 x->cols);
+		} else if (len != x->cols) {
+			/* rows of a NumPy array have the same length */
+			errno = EINVAL;
+			return -1;
+		}
+		x->rows++;
+		return obx_writev(x, data, len);
+	default:
+		return obx_writev(x, data, len);
+	}
+}
+
+int obx_flush(struct obx *x)
+{
+	return x->len ? obx_writev(x, NULL, 0) : 0;
+}
+
+/**
+ * Terminate the output: the last csv line, the real npy shape
+ * @return 0 on success, -1 on error, the buffer is released anyway
+ */
+int obx_close(struct obx *x)
+{
+	char hdr[OBX_NPY_HDR_LEN];
+	int err = 0;
+
+	if (x->fmt == OBX_CSV && x->col)
+		err |= obx_printf(x, "\n");
+	err |= obx_flush(x);
+	if (x->fmt == OBX_NPY && x->rows != x->rows_hint) {
+		obx_npy_header(hdr, x->rows, x->cols);
+		if (x->hdr_off < 0 ||
+		    pwrite(x->fd, hdr, sizeof(hdr), x->hdr_off) != sizeof(hdr)) {
+			fprintf(stderr, "obsbox: npy shape is wrong, %llu pages written\n",
+				(unsigned long long)x->rows);
+			err = -1;
+		}
+	}
+	free(x->buf);
+	x->buf = NULL;
+	x->cap = x->len = 0;
+
+	return err ? -1 : 0;
+}
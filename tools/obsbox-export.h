@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_EXPORT_H__
+#define __OBSBOX_EXPORT_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Text and NumPy export of 8 bit samples. Every page is formatted with
+ * lookup tables into one buffer and written with a single write(2).
+ *
+ * hex: "Data [0x<offset>]: xx xx ..." rows of 16 bytes, as print_buffer()
+ * csv: decimal values, 'width' values per line; lines go on across pages
+ *      so with the number of samples in a turn as width there is one turn
+ *      per line
+ * npy: NumPy array of uint8, one row per page. The shape is in the header:
+ *      it is written at the end when the output is seekable, otherwise the
+ *      number of pages must be known in advance.
+ */
+enum obx_format {
+	OBX_RAW = 0,
+	OBX_HEX,
+	OBX_CSV,
+	OBX_NPY,
+};
+
+#define OBX_NPY_HDR_LEN 128
+#define OBX_WIDTH_DEF 32
+
+struct obx {
+	int fd;
+	enum obx_format fmt;
+	unsigned int width; /**< csv: values per line */
+	unsigned int col; /**< csv: column of the next value */
+	char *buf;
+	size_t cap; /**< buffer size */
+	size_t len; /**< pending bytes in the buffer */
+	/* npy */
+	uint64_t rows; /**< pages written */
+	uint64_t rows_hint; /**< pages announced in the header, 0 unknown */
+	int64_t hdr_off; /**< where the header is, -1 not seekable */
+	uint32_t cols; /**< page size */
+};
+
+extern int obx_parse(const char *str);
+extern int obx_init(struct obx *x, int fd, enum obx_format fmt,
+		    unsigned int width, uint64_t rows_hint);
+extern int obx_printf(struct obx *x, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+extern int obx_write(struct obx *x, const uint8_t *data, size_t len,
+		     uint64_t off);
+extern int obx_flush(struct obx *x);
+extern int obx_close(struct obx *x);
+
+/* Formatters, the output must have room for the bound */
+extern size_t obx_hex_bound(size_t len);
+extern size_t obx_hex(char *out, const uint8_t *data, size_t len,
+		      uint64_t off);
+extern size_t obx_csv_bound(size_t len, unsigned int width);
+extern size_t obx_csv(char *out, const uint8_t *data, size_t len,
+		      unsigned int width, unsigned int *col);
+extern size_t obx_npy_header(char *out, uint64_t rows, uint32_t cols);
+
+#endif
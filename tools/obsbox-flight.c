@@ -0,0 +1,629 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-capture.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBFL_PRE_DEF 256
+#define OBFL_POST_DEF 64
+
+/**
+ * A page in the ring, the data is in the ring memory at the same index
+ */
+struct obfl_slot {
+	struct zio_control zctrl;
+	uint32_t len;
+	uint16_t flags; /**< OBCAP_PAGE_* */
+};
+
+/**
+ * The event being persisted: pages [first, last), 'done' is the next
+ * page to write. Page numbers count the pages stored in the ring.
+ */
+struct obfl_event {
+	uint64_t first, trig, last;
+	uint64_t done;
+	uint64_t t_trig; /**< CLOCK_REALTIME ns */
+	int active;
+	char why[64];
+};
+
+static volatile sig_atomic_t obfl_stop, obfl_sigtrig;
+static struct obfl_slot *slots;
+static uint8_t *ring, *drop_buf, *tmp_buf;
+static unsigned int n_pre = OBFL_PRE_DEF, n_post = OBFL_POST_DEF, n_slots;
+static uint32_t page_max, devid;
+static uint64_t head; /**< pages stored so far */
+static struct obfl_event ev;
+static sem_t ev_sem;
+static const char *prefix = "flight";
+static struct obsbox_seq seq;
+static uint16_t lost_flag;
+static uint64_t st_events, st_ignored, st_drops, st_errors;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-flight -d 0x<devid> -p <page_size> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -f <file>: take the pages from a capture file instead of the device\n");
+	fprintf(stderr, " -R <number>: with -f, pages per second (default: 100)\n");
+	fprintf(stderr, " -N <number>: pages kept before the trigger (default %d)\n",
+		OBFL_PRE_DEF);
+	fprintf(stderr, " -M <number>: pages stored after the trigger (default %d)\n",
+		OBFL_POST_DEF);
+	fprintf(stderr, " -o <prefix>: event files prefix (default \"%s\")\n",
+		prefix);
+	fprintf(stderr, " -t <file>: trigger when the file is touched\n");
+	fprintf(stderr, " -u <port>: trigger on any UDP datagram to the port\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It keeps the last pages in a locked memory ring. SIGUSR1, -t or -u\n"
+			"trigger an event: the ring and the following pages are written\n"
+			"in <prefix>-<time>-<n>.obc while the acquisition goes on\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obfl_sighandler(int sig)
+{
+	if (sig == SIGUSR1)
+		obfl_sigtrig = 1;
+	else
+		obfl_stop = 1;
+}
+
+static inline uint8_t *obfl_data(uint64_t page)
+{
+	return ring + (page % n_slots) * (size_t)page_max;
+}
+
+/**
+ * The ring and the slot table, allocated and locked once
+ * @return 0 on success, -1 on error
+ */
+static int obfl_ring_alloc(void)
+{
+	size_t len = (size_t)n_slots * page_max;
+
+	slots = calloc(n_slots, sizeof(*slots));
+	drop_buf = malloc(page_max);
+	tmp_buf = malloc(page_max);
+	if (!slots || !drop_buf || !tmp_buf)
+		return -1;
+	ring = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (ring == MAP_FAILED)
+		return -1;
+	if (mlock(ring, len) || mlock(slots, n_slots * sizeof(*slots)))
+		fprintf(stderr, "obsbox-flight: cannot lock %zu MiB: %s (ulimit -l)\n",
+			len >> 20, strerror(errno));
+	return 0;
+}
+
+
+/**
+ * Writer thread: it persists the pages of an event as soon as they are
+ * in the ring, the pre-event pages first
+ */
+static void *obfl_writer(void *arg)
+{
+	struct obcap_writer w;
+	struct obfl_slot *s;
+	char path[512], tbuf[32];
+	uint64_t page, h;
+	struct tm tm;
+	time_t t;
+	int err;
+
+	while (1) {
+		if (!__atomic_load_n(&ev.active, __ATOMIC_ACQUIRE)) {
+			if (obfl_stop)
+				break;
+			sem_wait(&ev_sem);
+			continue;
+		}
+
+		t = ev.t_trig / 1000000000ULL;
+		localtime_r(&t, &tm);
+		strftime(tbuf, sizeof(tbuf), "%Y%m%d-%H%M%S", &tm);
+		snprintf(path, sizeof(path), "%s-%s-%llu.obc", prefix, tbuf,
+			 (unsigned long long)st_events);
+		err = obcap_create(&w, path, OBCAP_ALIGN_DEF, devid);
+		if (err)
+			fprintf(stderr, "obsbox-flight: cannot create %s: %s\n",
+				path, strerror(errno));
+
+		page = ev.first;
+		while (page < __atomic_load_n(&ev.last, __ATOMIC_ACQUIRE)) {
+			h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+			if (page >= h) {
+				sem_wait(&ev_sem);
+				continue;
+			}
+			s = &slots[page % n_slots];
+			if (!err && obcap_append(&w, &s->zctrl, obfl_data(page),
+						 s->len, s->flags, 0)) {
+				fprintf(stderr, "obsbox-flight: %s: %s\n", path,
+					strerror(errno));
+				err = 1;
+			}
+			/* from now on the slot can be reused */
+			__atomic_store_n(&ev.done, ++page, __ATOMIC_RELEASE);
+		}
+		if (!err && obcap_close(&w))
+			err = 1;
+		if (err)
+			__atomic_add_fetch(&st_errors, 1, __ATOMIC_RELAXED);
+		else
+			fprintf(stderr, "event %llu (%s): %llu + %llu pages in %s\n",
+				(unsigned long long)st_events, ev.why,
+				(unsigned long long)(ev.trig - ev.first),
+				(unsigned long long)(ev.last - ev.trig), path);
+		__atomic_store_n(&ev.active, 0, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * Freeze the last pages and start persisting them, a trigger during an
+ * event is ignored
+ */
+static void obfl_trigger(const char *why)
+{
+	if (__atomic_load_n(&ev.active, __ATOMIC_ACQUIRE)) {
+		st_ignored++;
+		return;
+	}
+	st_events++;
+	ev.trig = head;
+	ev.first = head > n_pre ? head - n_pre : 0;
+	ev.done = ev.first;
+	ev.last = head + n_post;
+	ev.t_trig = obsbox_realtime_ns();
+	snprintf(ev.why, sizeof(ev.why), "%s", why);
+	__atomic_store_n(&ev.active, 1, __ATOMIC_RELEASE);
+	sem_post(&ev_sem);
+}
+
+
+/**
+ * @return the slot for the next page, -1 when it belongs to an event not
+ *         yet written
+ */
+static int obfl_slot_get(void)
+{
+	uint64_t old;
+
+	if (head < n_slots || !__atomic_load_n(&ev.active, __ATOMIC_ACQUIRE))
+		return head % n_slots;
+	old = head - n_slots;
+	if (old >= __atomic_load_n(&ev.done, __ATOMIC_ACQUIRE) &&
+	    old < ev.last)
+		return -1;
+	return head % n_slots;
+}
+
+static void obfl_store(int slot, struct zio_control *zctrl, uint32_t len)
+{
+	uint64_t lost = seq.lost;
+	struct obfl_slot *s;
+
+	obsbox_seq_update(&seq, zctrl->seq_num);
+	if (seq.lost != lost || slot < 0)
+		lost_flag = OBCAP_PAGE_LOST;
+	if (slot < 0) {
+		st_drops++;
+		return;
+	}
+	s = &slots[slot];
+	s->zctrl = *zctrl;
+	s->len = len;
+	s->flags = lost_flag;
+	if (ev.active && head == ev.trig)
+		s->flags |= OBCAP_PAGE_EVENT;
+	lost_flag = 0;
+	__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+	if (ev.active)
+		sem_post(&ev_sem);
+}
+
+/**
+ * Read a page from the device directly into the ring
+ * @return 0 on success, -1 on error
+ */
+static int obfl_dev_read(struct obdev *d)
+{
+	struct zio_control zctrl;
+	uint32_t len, done = 0;
+	uint8_t *buf;
+	int slot, n;
+
+	if (obdev_ctrl_read(d, &zctrl))
+		return -1;
+	len = obsbox_ctrl_len(&zctrl);
+	if (len > page_max) {
+		fprintf(stderr, "obsbox-flight: page of %u bytes, max is %u\n",
+			len, page_max);
+		return -1;
+	}
+	slot = obfl_slot_get();
+	buf = slot < 0 ? drop_buf : obfl_data(head);
+	while (done < len) {
+		n = read(d->fdd, buf + done, len - done);
+		if (n <= 0) {
+			fprintf(stderr, "obsbox-flight: cannot read data: %s\n",
+				n < 0 ? strerror(errno) : "EOF");
+			return -1;
+		}
+		done += n;
+	}
+	obfl_store(slot, &zctrl, len);
+	return 0;
+}
+
+/**
+ * Take the next page of the capture file, in loop
+ * @return 0 on success, -1 on error
+ */
+static int obfl_file_read(struct obcap_reader *r, uint64_t *next)
+{
+	struct obcap_page_hdr *ph;
+	struct zio_control zctrl;
+	uint8_t *data;
+	int slot;
+
+	ph = obcap_page(r, *next % r->count, &data);
+	obcap_page_ctrl(ph, &zctrl);
+	zctrl.seq_num += (*next / r->count) * r->count;
+	(*next)++;
+
+	slot = obfl_slot_get();
+	if (slot >= 0 && obcap_page_decode(ph, data, obfl_data(head), tmp_buf)) {
+		fprintf(stderr, "obsbox-flight: cannot use page %llu\n",
+			(unsigned long long)((*next - 1) % r->count));
+		return -1;
+	}
+	obfl_store(slot, &zctrl, ph->size);
+	return 0;
+}
+
+
+/**
+ * Watch the directory of the trigger file, touch(1) creates it or
+ * changes its attributes
+ * @return the inotify descriptor, -1 on error
+ */
+static int obfl_touch_open(const char *path, char **name)
+{
+	char *d = strdup(path), *b = strdup(path);
+	int fd;
+
+	if (!d || !b)
+		return -1;
+	*name = strdup(basename(b));
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd >= 0 && inotify_add_watch(fd, dirname(d), IN_ATTRIB |
+					 IN_CREATE | IN_CLOSE_WRITE |
+					 IN_MOVED_TO) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	free(d);
+	free(b);
+	return fd;
+}
+
+/**
+ * @return 1 when the trigger file was touched
+ */
+static int obfl_touch_check(int fd, const char *name)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	ssize_t n, i;
+	int hit = 0;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i += sizeof(*ie) + ie->len) {
+			ie = (void *)(buf + i);
+			if (ie->len && !strcmp(ie->name, name))
+				hit = 1;
+		}
+	}
+	return hit;
+}
+
+static int obfl_udp_open(uint16_t port)
+{
+	struct sockaddr_in sa = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && bind(fd, (void *)&sa, sizeof(sa))) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+/**
+ * @why: the text of the last datagram, printable characters only
+ * @return 1 when a datagram arrived
+ */
+static int obfl_udp_check(int fd, char *why, size_t len)
+{
+	char buf[48];
+	ssize_t n, i;
+	int hit = 0;
+
+	while ((n = recv(fd, buf, sizeof(buf) - 1, 0)) >= 0) {
+		for (i = 0; i < n; ++i)
+			if (buf[i] < 0x20 || buf[i] > 0x7E)
+				buf[i] = '_';
+		buf[n] = '\0';
+		snprintf(why, len, "udp %s", buf);
+		hit = 1;
+	}
+	return hit;
+}
+
+
+static void obfl_report(void)
+{
+	uint64_t done = __atomic_load_n(&ev.done, __ATOMIC_ACQUIRE);
+
+	fprintf(stderr, "pages %llu lost %llu | events %llu ignored %llu errors %llu | drops %llu",
+		(unsigned long long)head, (unsigned long long)seq.lost,
+		(unsigned long long)st_events, (unsigned long long)st_ignored,
+		(unsigned long long)st_errors, (unsigned long long)st_drops);
+	if (__atomic_load_n(&ev.active, __ATOMIC_ACQUIRE))
+		fprintf(stderr, " | writing %llu/%llu\n",
+			(unsigned long long)(done - ev.first),
+			(unsigned long long)(ev.last - ev.first));
+	else
+		fprintf(stderr, " | armed\n");
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t page_size = 0, vmalloc_size = 0, rate = 100;
+	int c, ret, err = 1, nfd, timeout;
+	struct obdev d;
+	int fdt = -1, fdu = -1, i_dev = -1, i_touch = -1, i_udp = -1;
+	char *file = NULL, *touch = NULL, *touch_name = NULL;
+	char why[64];
+	unsigned int port = 0;
+	uint64_t next = 0, t_next, t_last, now;
+	struct pollfd pfd[3];
+	struct obcap_reader r;
+	pthread_t tid;
+
+	while ((c = getopt (argc, argv, "hd:p:v:f:R:N:M:o:t:u:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'R':
+			ret = sscanf(optarg, "%u", &rate);
+			if (ret != 1 || !rate)
+				help();
+			break;
+		case 'N':
+			ret = sscanf(optarg, "%u", &n_pre);
+			if (ret != 1 || !n_pre)
+				help();
+			break;
+		case 'M':
+			ret = sscanf(optarg, "%u", &n_post);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		case 't':
+			touch = optarg;
+			break;
+		case 'u':
+			ret = sscanf(optarg, "%u", &port);
+			if (ret != 1 || !port || port > 0xFFFF)
+				help();
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (file) {
+		if (obcap_open(&r, file) || !r.count) {
+			fprintf(stderr, "Cannot use capture %s: %s\n", file,
+				r.count ? strerror(errno) : "empty");
+			exit(1);
+		}
+		for (next = 0; next < r.count; ++next)
+			if (obcap_page(&r, next, NULL)->size > page_size)
+				page_size = obcap_page(&r, next, NULL)->size;
+		next = 0;
+	}
+	if (!page_size)
+		help();
+
+	/* the post-event pages go in the slots of the oldest pages */
+	n_slots = n_pre + n_post;
+	page_max = page_size;
+	if (obfl_ring_alloc()) {
+		fprintf(stderr, "Cannot allocate %u pages of %u bytes: %s\n",
+			n_slots, page_max, strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "ring of %u pages of %u bytes (%u before, %u after the trigger)\n",
+		n_slots, page_max, n_pre, n_post);
+
+	nfd = 0;
+	if (touch) {
+		fdt = obfl_touch_open(touch, &touch_name);
+		if (fdt < 0) {
+			fprintf(stderr, "Cannot watch %s: %s\n", touch,
+				strerror(errno));
+			exit(1);
+		}
+		i_touch = nfd++;
+		pfd[i_touch].fd = fdt;
+	}
+	if (port) {
+		fdu = obfl_udp_open(port);
+		if (fdu < 0) {
+			fprintf(stderr, "Cannot bind UDP port %u: %s\n", port,
+				strerror(errno));
+			exit(1);
+		}
+		i_udp = nfd++;
+		pfd[i_udp].fd = fdu;
+	}
+
+	sem_init(&ev_sem, 0, 0);
+	if (pthread_create(&tid, NULL, obfl_writer, NULL))
+		exit(1);
+	signal(SIGINT, obfl_sighandler);
+	signal(SIGTERM, obfl_sighandler);
+	signal(SIGUSR1, obfl_sighandler);
+
+	if (!file) {
+		if (obdev_open(&d, devid)) {
+			fprintf(stderr, "Cannot open ZIO char devices: %s\n",
+				strerror(errno));
+			goto out_thread;
+		}
+		ret = obdev_configure(&d, 1, page_size, vmalloc_size);
+		if (ret) {
+			fprintf(stderr,
+				"Something wrong during the configuration: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		ret = obdev_run(&d, 1);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot start acquisition: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		i_dev = nfd++;
+		pfd[i_dev].fd = d.fdc;
+	}
+	for (c = 0; c < nfd; ++c)
+		pfd[c].events = POLLIN;
+
+	t_next = t_last = obsbox_now_ns();
+	while (!obfl_stop) {
+		now = obsbox_now_ns();
+		if (file)
+			timeout = t_next > now ? (t_next - now + 999999) / 1000000 : 0;
+		else
+			timeout = 1000;
+		ret = poll(pfd, nfd, timeout);
+		if (ret < 0 && errno != EINTR)
+			break;
+
+		/* triggers first, the next page is the first post-event page */
+		if (obfl_sigtrig) {
+			obfl_sigtrig = 0;
+			obfl_trigger("signal");
+		}
+		if (ret > 0 && i_touch >= 0 && pfd[i_touch].revents &&
+		    obfl_touch_check(fdt, touch_name))
+			obfl_trigger(touch);
+		if (ret > 0 && i_udp >= 0 && pfd[i_udp].revents &&
+		    obfl_udp_check(fdu, why, sizeof(why)))
+			obfl_trigger(why);
+
+		if (file && obsbox_now_ns() >= t_next) {
+			t_next += 1000000000ULL / rate;
+			if (obfl_file_read(&r, &next))
+				break;
+		} else if (ret > 0 && i_dev >= 0 && pfd[i_dev].revents) {
+			if (obfl_dev_read(&d))
+				break;
+		}
+
+		if (obsbox_now_ns() - t_last >= 1000000000ULL) {
+			t_last = obsbox_now_ns();
+			obfl_report();
+		}
+	}
+	err = !obfl_stop;
+
+out:
+	if (!file) {
+		obdev_run(&d, 0);
+		obdev_close(&d);
+	}
+out_thread:
+	/* an event in progress ends with the pages acquired so far */
+	if (__atomic_load_n(&ev.active, __ATOMIC_ACQUIRE) && ev.last > head)
+		__atomic_store_n(&ev.last, head, __ATOMIC_RELEASE);
+	obfl_stop = 1;
+	sem_post(&ev_sem);
+	pthread_join(tid, NULL);
+	obfl_report();
+	exit(err);
+}
@@ -0,0 +1,296 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "obsbox-frame.h"
+
+static size_t (*obfr_find_fn)(const uint8_t *data, size_t len, uint8_t mask,
+			      uint8_t value);
+
+static size_t obfr_find_generic(const uint8_t *data, size_t len,
+				uint8_t mask, uint8_t value);
+#if defined(__x86_64__)
+static size_t obfr_find_sse2(const uint8_t *data, size_t len,
+			     uint8_t mask, uint8_t value);
+static size_t obfr_find_avx2(const uint8_t *data, size_t len,
+			     uint8_t mask, uint8_t value);
+#endif
+
+/**
+ * Choose the search implementation before main()
+ */
+__attribute__((constructor))
+static void obfr_find_init(void)
+{
+	obfr_find_fn = obfr_find_generic;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse2"))
+		obfr_find_fn = obfr_find_sse2;
+	if (__builtin_cpu_supports("avx2"))
+		obfr_find_fn = obfr_find_avx2;
+#endif
+}
+
+/**
+ * Generic implementation, 8 samples at a time
+ */
+static size_t obfr_find_generic(const uint8_t *data, size_t len,
+				uint8_t mask, uint8_t value)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t high = 0x8080808080808080ULL;
+	uint64_t v, m = mask * ones, x = value * ones;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, data + i, 8);
+		v = (v & m) ^ x;
+		/* a zero byte is a match */
+		if ((v - ones) & ~v & high)
+			break;
+	}
+	for (; i < len; ++i)
+		if ((data[i] & mask) == value)
+			return i;
+
+	return len;
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE2 implementation, 16 samples at a time
+ */
+__attribute__((target("sse2")))
+static size_t obfr_find_sse2(const uint8_t *data, size_t len,
+			     uint8_t mask, uint8_t value)
+{
+	__m128i m = _mm_set1_epi8(mask), x = _mm_set1_epi8(value), v;
+	unsigned int bits;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(data + i));
+		v = _mm_cmpeq_epi8(_mm_and_si128(v, m), x);
+		bits = _mm_movemask_epi8(v);
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+
+	return i + obfr_find_generic(data + i, len - i, mask, value);
+}
+
+/**
+ * AVX2 implementation, 64 samples per iteration
+ */
+__attribute__((target("avx2")))
+static size_t obfr_find_avx2(const uint8_t *data, size_t len,
+			     uint8_t mask, uint8_t value)
+{
+	__m256i m = _mm256_set1_epi8(mask), x = _mm256_set1_epi8(value);
+	__m256i a, b;
+	uint64_t bits;
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		a = _mm256_loadu_si256((const __m256i *)(data + i));
+		b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+		a = _mm256_cmpeq_epi8(_mm256_and_si256(a, m), x);
+		b = _mm256_cmpeq_epi8(_mm256_and_si256(b, m), x);
+		if (_mm256_testz_si256(_mm256_or_si256(a, b),
+				       _mm256_or_si256(a, b)))
+			continue;
+		bits = (uint32_t)_mm256_movemask_epi8(a) |
+		       (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << 32;
+		return i + __builtin_ctzll(bits);
+	}
+
+	return i + obfr_find_sse2(data + i, len - i, mask, value);
+}
+#endif
+
+size_t obfr_find(const uint8_t *data, size_t len, uint8_t mask,
+		 uint8_t value)
+{
+	return obfr_find_fn(data, len, mask, value);
+}
+
+
+/**
+ * @return 0 on success, -1 on error
+ */
+int obfr_init(struct obfr *fr, unsigned int turn_len)
+{
+	memset(fr, 0, sizeof(*fr));
+	if (!turn_len) {
+		errno = EINVAL;
+		return -1;
+	}
+	fr->turn_len = turn_len;
+	fr->carry = malloc(turn_len);
+	return fr->carry ? 0 : -1;
+}
+
+void obfr_free(struct obfr *fr)
+{
+	free(fr->carry);
+	fr->carry = NULL;
+}
+
+/**
+ * Enable the in-band search: the first sample of a turn satisfies
+ * (sample & mask) == value
+ */
+void obfr_pattern(struct obfr *fr, uint8_t mask, uint8_t value)
+{
+	fr->scan = 1;
+	fr->mask = mask;
+	fr->value = value & mask;
+}
+
+/**
+ * Forget the phase and the partial turn, e.g. when pages were lost
+ */
+void obfr_reset(struct obfr *fr)
+{
+	fr->locked = 0;
+	fr->carry_len = 0;
+}
+
+static inline int obfr_match(struct obfr *fr, const uint8_t *p)
+{
+	return (*p & fr->mask) == fr->value;
+}
+
+/**
+ * Start decoding a page, the frames come from obfr_next()
+ * @marker: offset of a turn marker in the page, OBFR_NO_MARKER if unknown
+ */
+void obfr_page(struct obfr *fr, const uint8_t *data, size_t len,
+	       uint32_t marker)
+{
+	unsigned int phase;
+
+	fr->page = data;
+	fr->len = len;
+	fr->off = 0;
+	if (marker == OBFR_NO_MARKER || marker >= len)
+		return;
+	/* a marker that does not look like one is not trusted */
+	if (fr->scan && !obfr_match(fr, data + marker))
+		return;
+
+	phase = marker % fr->turn_len;
+	if (fr->locked) {
+		/* where the current turn ends */
+		if ((fr->turn_len - fr->carry_len) % fr->turn_len == phase)
+			return;
+		fr->slips++;
+	}
+	/* (re)lock on the marker */
+	fr->locked = 1;
+	fr->locks++;
+	fr->carry_len = 0;
+	fr->off = phase;
+	fr->skipped += phase;
+}
+
+/**
+ * Look for the next marker in the page, the candidate is confirmed by
+ * the marker of the following turn when it is in the page
+ * @return 0 when locked, -1 when the rest of the page has no marker
+ */
+static int obfr_lock(struct obfr *fr)
+{
+	size_t p, off = fr->off;
+
+	while (off < fr->len) {
+		p = off + obfr_find(fr->page + off, fr->len - off, fr->mask,
+				    fr->value);
+		if (p == fr->len)
+			break;
+		if (p + fr->turn_len < fr->len &&
+		    !obfr_match(fr, fr->page + p + fr->turn_len)) {
+			off = p + 1;
+			continue;
+		}
+		fr->skipped += p - fr->off;
+		fr->off = p;
+		fr->locked = 1;
+		fr->locks++;
+		return 0;
+	}
+	fr->skipped += fr->len - fr->off;
+	fr->off = fr->len;
+	return -1;
+}
+
+/**
+ * @return 1 and a frame, 0 when the page is done
+ */
+int obfr_next(struct obfr *fr, struct obfr_frame *f)
+{
+	size_t avail, n;
+
+	while (1) {
+		if (!fr->locked) {
+			if (!fr->scan) {
+				/* no phase until a page brings a marker */
+				fr->skipped += fr->len - fr->off;
+				fr->off = fr->len;
+				return 0;
+			}
+			if (obfr_lock(fr))
+				return 0;
+		}
+
+		avail = fr->len - fr->off;
+		if (fr->carry_len) {
+			n = fr->turn_len - fr->carry_len;
+			if (n > avail)
+				n = avail;
+			memcpy(fr->carry + fr->carry_len, fr->page + fr->off, n);
+			fr->carry_len += n;
+			fr->off += n;
+			if (fr->carry_len < fr->turn_len)
+				return 0;
+			fr->carry_len = 0;
+			f->data = fr->carry;
+			f->flags = OBFR_FRAME_JOINED;
+			fr->joined++;
+			break;
+		}
+		if (!avail)
+			return 0;
+		if (fr->scan && !obfr_match(fr, fr->page + fr->off)) {
+			/* the marker moved, search it again from here */
+			fr->locked = 0;
+			fr->slips++;
+			continue;
+		}
+		if (avail < fr->turn_len) {
+			/* the turn goes on in the next page */
+			memcpy(fr->carry, fr->page + fr->off, avail);
+			fr->carry_len = avail;
+			fr->off = fr->len;
+			return 0;
+		}
+		f->data = fr->page + fr->off;
+		f->flags = 0;
+		fr->off += fr->turn_len;
+		break;
+	}
+	f->turn = fr->frames++;
+
+	return 1;
+}
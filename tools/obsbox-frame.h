@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_FRAME_H__
+#define __OBSBOX_FRAME_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Turn decoder: it cuts the stream of pages into frames of one machine
+ * turn, 'turn_len' samples starting at a turn marker.
+ *
+ * The phase comes from the marker offset of the page (ACQ_MARK_ADDR, see
+ * obsbox_ctrl_marker()) when the driver exports it. Otherwise, when the
+ * gateware marks the first sample of a turn in the data, the samples are
+ * scanned for the in-band pattern (sample & mask) == value; the pattern
+ * is also used to check every frame and to lock again after a slip.
+ *
+ * Frames inside a page point into the page (no copy). A turn across two
+ * pages is completed in a private buffer: that frame is valid until the
+ * next call to obfr_next().
+ */
+#define OBFR_NO_MARKER 0xFFFFFFFF
+
+#define OBFR_FRAME_JOINED (1 << 0) /* assembled from two or more pages */
+
+struct obfr_frame {
+	const uint8_t *data; /**< turn_len samples, slot 0 first */
+	uint64_t turn; /**< frame number since the decoder init */
+	unsigned int flags; /**< OBFR_FRAME_* */
+};
+
+struct obfr {
+	unsigned int turn_len;
+	int scan; /**< in-band pattern set */
+	uint8_t mask, value;
+	int locked; /**< the phase is known */
+	uint8_t *carry; /**< the beginning of a turn from previous pages */
+	unsigned int carry_len;
+	const uint8_t *page; /**< current page */
+	size_t len, off;
+	/* counters */
+	uint64_t frames;
+	uint64_t joined; /**< frames assembled across pages */
+	uint64_t skipped; /**< samples before the first marker */
+	uint64_t slips; /**< marker not where expected, lock lost */
+	uint64_t locks;
+};
+
+extern int obfr_init(struct obfr *fr, unsigned int turn_len);
+extern void obfr_free(struct obfr *fr);
+extern void obfr_pattern(struct obfr *fr, uint8_t mask, uint8_t value);
+extern void obfr_reset(struct obfr *fr);
+extern void obfr_page(struct obfr *fr, const uint8_t *data, size_t len,
+		      uint32_t marker);
+extern int obfr_next(struct obfr *fr, struct obfr_frame *f);
+
+/* First sample with (sample & mask) == value, 'len' when there is none */
+extern size_t obfr_find(const uint8_t *data, size_t len, uint8_t mask,
+			uint8_t value);
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "obsbox-hist.h"
+
+/* samples per round, a 32 bit sub-histogram bin cannot overflow */
+#define OBHIST_ROUND (1UL << 30)
+
+void obhist_reset(struct obhist *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static void obhist_round(struct obhist *h, const uint8_t *data, size_t len)
+{
+	uint32_t c[OBHIST_SUB][256];
+	uint64_t v, w;
+	unsigned int k;
+	size_t i;
+
+	memset(c, 0, sizeof(c));
+	/* 16 samples per iteration, 4 per sub-histogram */
+	for (i = 0; i + 16 <= len; i += 16) {
+		memcpy(&v, data + i, 8);
+		memcpy(&w, data + i + 8, 8);
+		c[0][v & 0xFF]++;
+		c[1][(v >> 8) & 0xFF]++;
+		c[2][(v >> 16) & 0xFF]++;
+		c[3][(v >> 24) & 0xFF]++;
+		c[0][(v >> 32) & 0xFF]++;
+		c[1][(v >> 40) & 0xFF]++;
+		c[2][(v >> 48) & 0xFF]++;
+		c[3][v >> 56]++;
+		c[0][w & 0xFF]++;
+		c[1][(w >> 8) & 0xFF]++;
+		c[2][(w >> 16) & 0xFF]++;
+		c[3][(w >> 24) & 0xFF]++;
+		c[0][(w >> 32) & 0xFF]++;
+		c[1][(w >> 40) & 0xFF]++;
+		c[2][(w >> 48) & 0xFF]++;
+		c[3][w >> 56]++;
+	}
+	for (; i < len; ++i)
+		c[i & 3][data[i]]++;
+	for (k = 0; k < 256; ++k)
+		h->bin[k] += (uint64_t)c[0][k] + c[1][k] + c[2][k] + c[3][k];
+	h->n += len;
+}
+
+/**
+ * Count the samples of a buffer
+ */
+void obhist_add(struct obhist *h, const uint8_t *data, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = len < OBHIST_ROUND ? len : OBHIST_ROUND;
+		obhist_round(h, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+void obhist_merge(struct obhist *dst, const struct obhist *src)
+{
+	unsigned int k;
+
+	for (k = 0; k < 256; ++k)
+		dst->bin[k] += src->bin[k];
+	dst->n += src->n;
+}
+
+/**
+ * @ref: reference distribution for the shift, NULL for none
+ */
+void obhist_summary(const struct obhist *h, const struct obhist *ref,
+		    struct obhist_summary *s)
+{
+	uint64_t ones[8] = {0};
+	double sum = 0, sum2 = 0, d = 0;
+	unsigned int k, b;
+
+	memset(s, 0, sizeof(*s));
+	s->n = h->n;
+	s->lo = s->hi = -1;
+	if (!h->n)
+		return;
+	for (k = 0; k < 256; ++k) {
+		if (!h->bin[k])
+			continue;
+		if (s->lo < 0)
+			s->lo = k;
+		s->hi = k;
+		sum += (double)h->bin[k] * k;
+		sum2 += (double)h->bin[k] * k * k;
+		for (b = 0; b < 8; ++b)
+			if (k & (1 << b))
+				ones[b] += h->bin[k];
+	}
+	for (k = s->lo + 1; k < s->hi; ++k)
+		s->missing += !h->bin[k] && h->bin[k - 1] && h->bin[k + 1];
+	for (b = 0; b < 8; ++b) {
+		if (!ones[b])
+			s->stuck0 |= 1 << b;
+		else if (ones[b] == h->n)
+			s->stuck1 |= 1 << b;
+	}
+	s->mean = sum / h->n;
+	s->std = sum2 / h->n - s->mean * s->mean;
+	s->std = s->std > 0 ? sqrt(s->std) : 0;
+	s->sat_lo = (double)h->bin[0] / h->n;
+	s->sat_hi = (double)h->bin[255] / h->n;
+	if (!ref || !ref->n)
+		return;
+	/* total variation distance */
+	for (k = 0; k < 256; ++k)
+		d += fabs((double)h->bin[k] / h->n - (double)ref->bin[k] / ref->n);
+	s->shift = d / 2;
+}
+
+/**
+ * @return OBHIST_ALARM_* flags
+ */
+unsigned int obhist_alarms(const struct obhist_summary *s,
+			   const struct obhist_limits *l)
+{
+	unsigned int a = 0, x;
+
+	if (!s->n)
+		return 0;
+	if (s->sat_lo > l->sat || s->sat_hi > l->sat)
+		a |= OBHIST_ALARM_SAT;
+	if (s->shift > l->shift)
+		a |= OBHIST_ALARM_SHIFT;
+	/*
+	 * A narrow distribution does not toggle its high bits; the bits up to
+	 * the highest one that differs between lo and hi must toggle
+	 */
+	x = s->lo ^ s->hi;
+	if (s->hi - s->lo >= 2 &&
+	    ((s->stuck0 | s->stuck1) & ((2U << (31 - __builtin_clz(x))) - 1)))
+		a |= OBHIST_ALARM_STUCK;
+	if (s->missing)
+		a |= OBHIST_ALARM_MISSING;
+	return a;
+}
+
+void obhist_print(const struct obhist_summary *s, unsigned int alarms,
+		  FILE *f)
+{
+	fprintf(f, "hist: %llu samples, codes %d..%d, mean %.3f std %.3f, at 0 %.2e at 255 %.2e, shift %.4f, missing %u, stuck bits 0x%02x/0x%02x%s%s%s%s\n",
+		(unsigned long long)s->n, s->lo, s->hi, s->mean, s->std,
+		s->sat_lo, s->sat_hi, s->shift, s->missing, s->stuck0,
+		s->stuck1,
+		alarms & OBHIST_ALARM_SAT ? " SATURATION" : "",
+		alarms & OBHIST_ALARM_SHIFT ? " SHIFT" : "",
+		alarms & OBHIST_ALARM_STUCK ? " STUCK-BIT" : "",
+		alarms & OBHIST_ALARM_MISSING ? " MISSING-CODES" : "");
+}
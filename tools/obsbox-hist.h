@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_HIST_H__
+#define __OBSBOX_HIST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Histogram of the 8 bit sample codes (ssize 1). Consecutive samples are
+ * counted in different sub-histograms: with a single table, runs of the
+ * same code (a flat signal, a saturated front-end) make every increment
+ * wait for the previous store to the same counter. The sub-histograms
+ * are 32 bit and they are added to the 64 bit bins at the end of every
+ * call.
+ *
+ * A summary compares the histogram with a reference one (e.g. the first
+ * snapshot) and raises alarms on:
+ *   saturation  too many samples at code 0 or 255
+ *   shift       total variation distance from the reference, 0 (same
+ *               distribution) to 1 (disjoint)
+ *   stuck bit   a bit that never toggles
+ *   missing     isolated codes never seen while both their neighbours
+ *               are, the mark of a bad bit or a bad comparator
+ */
+#define OBHIST_SUB 4
+#define OBHIST_SAT_DEF 1e-3
+#define OBHIST_SHIFT_DEF 0.05
+
+#define OBHIST_ALARM_SAT (1 << 0)
+#define OBHIST_ALARM_SHIFT (1 << 1)
+#define OBHIST_ALARM_STUCK (1 << 2)
+#define OBHIST_ALARM_MISSING (1 << 3)
+
+struct obhist {
+	uint64_t bin[256];
+	uint64_t n;
+};
+
+struct obhist_summary {
+	uint64_t n;
+	double mean, std;
+	int lo, hi; /**< lowest and highest code seen, -1 without samples */
+	double sat_lo, sat_hi; /**< fraction of samples at 0 and 255 */
+	unsigned int missing; /**< isolated codes never seen */
+	uint8_t stuck0, stuck1; /**< bits always 0, always 1 */
+	double shift; /**< distance from the reference, 0 without */
+};
+
+struct obhist_limits {
+	double sat;
+	double shift;
+};
+
+extern void obhist_reset(struct obhist *h);
+extern void obhist_add(struct obhist *h, const uint8_t *data, size_t len);
+extern void obhist_merge(struct obhist *dst, const struct obhist *src);
+extern void obhist_summary(const struct obhist *h, const struct obhist *ref,
+			   struct obhist_summary *s);
+extern unsigned int obhist_alarms(const struct obhist_summary *s,
+				  const struct obhist_limits *l);
+extern void obhist_print(const struct obhist_summary *s, unsigned int alarms,
+			 FILE *f);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "obsbox-merge.h"
+#include "obsbox-capture.h"
+
+/**
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obmg_init(struct obmg *m, unsigned int n, uint32_t page_size,
+	      unsigned int depth, enum obmg_key key)
+{
+	uint64_t now = obsbox_now_ns();
+	unsigned int i, k;
+
+	if (!n || n > OBMG_BOARDS_MAX || !depth) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(m, 0, sizeof(*m));
+	m->key = key;
+	m->n = n;
+	m->depth = depth;
+	m->page_size = page_size;
+	m->hold_ns = OBMG_HOLD_DEF_NS;
+	for (i = 0; i < n; ++i) {
+		m->b[i].q = calloc(depth, sizeof(*m->b[i].q));
+		if (!m->b[i].q)
+			goto err;
+		for (k = 0; k < depth; ++k) {
+			m->b[i].q[k].data = malloc(page_size);
+			if (!m->b[i].q[k].data)
+				goto err;
+		}
+		/* a board that has not started yet gets the same grace */
+		m->b[i].t_in = now;
+	}
+	return 0;
+
+err:
+	obmg_exit(m);
+	errno = ENOMEM;
+	return -1;
+}
+
+void obmg_exit(struct obmg *m)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < m->n; ++i) {
+		if (!m->b[i].q)
+			continue;
+		for (k = 0; k < m->depth; ++k)
+			free(m->b[i].q[k].data);
+		free(m->b[i].q);
+		m->b[i].q = NULL;
+	}
+}
+
+
+static uint64_t obmg_key_of(struct obmg *m, struct obmg_board *b,
+			    const struct zio_control *zctrl)
+{
+	uint64_t t;
+
+	if (m->key == OBMG_KEY_SEQ) {
+		if (b->seq.valid)
+			b->seq_ext += (uint32_t)(zctrl->seq_num - b->seq.last);
+		return b->seq_ext;
+	}
+	t = zctrl->tstamp.secs * 1000000000ULL + zctrl->tstamp.ticks;
+	if (t)
+		return t;
+	return obsbox_realtime_ns();
+}
+
+/**
+ * Emit the first page queued by a board
+ */
+static int obmg_emit(struct obmg *m, unsigned int i)
+{
+	struct obmg_board *b = &m->b[i];
+	struct obmg_page *p = &b->q[b->head];
+	int err;
+
+	if (m->started && p->key < m->key_out)
+		b->late++;
+	else
+		m->key_out = p->key;
+	m->started = 1;
+	err = m->emit ? m->emit(m, i, p) : 0;
+	b->head = (b->head + 1) % m->depth;
+	b->count--;
+	b->out++;
+	m->out++;
+	return err;
+}
+
+/**
+ * @return the board with the smallest key queued, -1 when all are empty
+ */
+static int obmg_min(struct obmg *m)
+{
+	int i, best = -1;
+	uint64_t key = 0;
+
+	for (i = 0; i < m->n; ++i) {
+		if (!m->b[i].count)
+			continue;
+		if (best < 0 || m->b[i].q[m->b[i].head].key < key) {
+			best = i;
+			key = m->b[i].q[m->b[i].head].key;
+		}
+	}
+	return best;
+}
+
+/**
+ * Queue a page of a board and emit what can be emitted
+ * @return 0 on success, -1 on error from the emit callback
+ */
+int obmg_push(struct obmg *m, unsigned int board,
+	      const struct zio_control *zctrl, const void *data, uint32_t len)
+{
+	struct obmg_board *b = &m->b[board];
+	struct obmg_page *p;
+	uint64_t lost = b->seq.lost;
+
+	if (len > m->page_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	/* no room: the smallest page goes, whatever the other boards do */
+	while (b->count == m->depth) {
+		b = &m->b[obmg_min(m)];
+		b->forced++;
+		if (obmg_emit(m, b - m->b))
+			return -1;
+		b = &m->b[board];
+	}
+
+	p = &b->q[(b->head + b->count) % m->depth];
+	p->key = obmg_key_of(m, b, zctrl);
+	obsbox_seq_update(&b->seq, zctrl->seq_num);
+	p->zctrl = *zctrl;
+	p->len = len;
+	p->flags = b->seq.lost != lost ? OBCAP_PAGE_LOST : 0;
+	memcpy(p->data, data, len);
+	b->count++;
+	b->in++;
+	b->t_in = obsbox_now_ns();
+	b->key_in = p->key;
+
+	return obmg_run(m, 0);
+}
+
+/**
+ * Emit the pages that no board can precede anymore, all of them when
+ * 'flush' is set (end of the acquisition)
+ * @return 0 on success, -1 on error from the emit callback
+ */
+int obmg_run(struct obmg *m, int flush)
+{
+	uint64_t now = obsbox_now_ns(), key;
+	int i, best;
+
+	while ((best = obmg_min(m)) >= 0) {
+		key = m->b[best].q[m->b[best].head].key;
+		for (i = 0; i < m->n && !flush; ++i) {
+			/* an empty board may still deliver a smaller key */
+			if (!m->b[i].count && m->b[i].key_in <= key &&
+			    now - m->b[i].t_in < m->hold_ns)
+				break;
+		}
+		if (!flush && i < m->n)
+			break;
+		if (obmg_emit(m, best))
+			return -1;
+	}
+	return 0;
+}
+
+void obmg_report(struct obmg *m, FILE *f)
+{
+	struct obmg_board *b;
+	unsigned int i;
+
+	for (i = 0; i < m->n; ++i) {
+		b = &m->b[i];
+		fprintf(f, "merge 0x%04x: in %llu out %llu lost %llu late %llu forced %llu\n",
+			b->devid, (unsigned long long)b->in,
+			(unsigned long long)b->out,
+			(unsigned long long)b->seq.lost,
+			(unsigned long long)b->late,
+			(unsigned long long)b->forced);
+	}
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_MERGE_H__
+#define __OBSBOX_MERGE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/zio-user.h>
+
+#include "obsbox-common.h"
+
+/*
+ * Incremental merge of the streams of several boards. Pages are pushed as
+ * they arrive and queued per board; the page with the smallest key is
+ * emitted as soon as no other board can still deliver a smaller one, that
+ * is when every other board has a page queued, or its last page already
+ * has a bigger key, or it is silent since 'hold_ns'. The key is:
+ *   OBMG_KEY_TIME: the ZIO time stamp (the host time when there is none)
+ *   OBMG_KEY_SEQ:  the sequence number counted from the first page of the
+ *                  board, for boards started together on the same trigger
+ * A full queue forces the emission of the smallest page queued; a page
+ * that arrives afterwards with a smaller key is emitted late, out of
+ * order, and counted.
+ */
+#define OBMG_BOARDS_MAX 16
+#define OBMG_DEPTH_DEF 16
+#define OBMG_HOLD_DEF_NS 100000000ULL
+
+enum obmg_key {
+	OBMG_KEY_TIME = 0,
+	OBMG_KEY_SEQ,
+};
+
+struct obmg_page {
+	struct zio_control zctrl;
+	uint8_t *data;
+	uint32_t len;
+	uint16_t flags; /**< OBCAP_PAGE_LOST when pages were lost before */
+	uint64_t key;
+};
+
+/**
+ * Queue and gap accounting of a board
+ */
+struct obmg_board {
+	uint32_t devid;
+	struct obmg_page *q;
+	unsigned int head, count;
+	uint64_t t_in; /**< obsbox_now_ns() of the last page pushed */
+	uint64_t key_in; /**< key of the last page pushed */
+	struct obsbox_seq seq;
+	uint64_t seq_ext; /**< sequence number from the first page, 64 bit */
+	uint64_t in, out;
+	uint64_t late; /**< emitted after a page with a bigger key */
+	uint64_t forced; /**< emitted because a queue was full */
+};
+
+struct obmg;
+typedef int (*obmg_emit_t)(struct obmg *m, unsigned int board,
+			   struct obmg_page *p);
+
+struct obmg {
+	enum obmg_key key;
+	unsigned int n;
+	unsigned int depth; /**< pages queued per board */
+	uint32_t page_size;
+	uint64_t hold_ns;
+	struct obmg_board b[OBMG_BOARDS_MAX];
+	int started;
+	uint64_t key_out; /**< key of the last page emitted */
+	obmg_emit_t emit;
+	void *priv;
+	uint64_t out;
+};
+
+extern int obmg_init(struct obmg *m, unsigned int n, uint32_t page_size,
+		     unsigned int depth, enum obmg_key key);
+extern void obmg_exit(struct obmg *m);
+extern int obmg_push(struct obmg *m, unsigned int board,
+		     const struct zio_control *zctrl, const void *data,
+		     uint32_t len);
+extern int obmg_run(struct obmg *m, int flush);
+extern void obmg_report(struct obmg *m, FILE *f);
+
+#endif
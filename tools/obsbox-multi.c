@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <getopt.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-evloop.h"
+#include "obsbox-capture.h"
+#include "obsbox-merge.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBM_MMAP_PAGES 8
+
+static struct obev ev;
+
+/**
+ * Per board state of the tool
+ */
+struct obm_board {
+	struct obev_board b;
+	struct obcap_writer w;
+	int opened;
+	int capture;
+	int64_t left; /**< pages still to acquire, -1 forever */
+	uint64_t p_last, b_last, lost_last;
+};
+
+static struct obm_board boards[OBEV_BOARDS_MAX];
+static unsigned int n_boards, n_done;
+
+/* merged output: a capture file, or the ZIO stream on a descriptor */
+static struct obmg mg;
+static struct obcap_writer mw;
+static int merge, merge_fd = -1;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-multi -d 0x<devid>[,0x<devid>...] -p <page_size> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device ids, up to %d\n", OBEV_BOARDS_MAX);
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -m: process data in place through mmap(2) (it implies vmalloc)\n");
+	fprintf(stderr, " -o <prefix>: store every board in <prefix>-<devid>.obc\n");
+	fprintf(stderr, " -n <number>: number of pages per board (default: until SIGINT)\n");
+	fprintf(stderr, " -b <number>: pages per board before serving the next one (default %d)\n",
+		OBEV_BUDGET_DEF);
+	fprintf(stderr, " -M <file>: merge the boards in one time ordered capture file, '-'\n"
+			"    for the ZIO stream on stdout (control and data, addr.dev_id is the board)\n");
+	fprintf(stderr, " -k <time|seq>: merge key, time stamp or sequence number (default time)\n");
+	fprintf(stderr, " -H <number>: ms to wait for a silent board before merging without it\n"
+			"    (default %llu)\n", OBMG_HOLD_DEF_NS / 1000000);
+	fprintf(stderr, " -q: no report every second\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "One thread acquires in streaming mode from all the boards. It waits\n"
+			"on their control char devices with edge-triggered epoll(7) and reads\n"
+			"every board until it has no more pages, a few at a time.\n"
+			"The boards are started together, their ob-run written back to back.\n"
+			"With -M the pages are merged as they arrive: by time stamp, or by\n"
+			"sequence number counted from the first page of each board when they\n"
+			"share the trigger. The gaps of every board are reported at the end\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obm_sighandler(int sig)
+{
+	ev.stop = 1;
+}
+
+
+static int obm_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int obm_emit(struct obmg *mg, unsigned int i, struct obmg_page *p)
+{
+	if (merge_fd < 0)
+		return obcap_append(&mw, &p->zctrl, p->data, p->len,
+				    p->flags | OBCAP_PAGE_BOARD(i), 0);
+	p->zctrl.addr.dev_id = mg->b[i].devid;
+	return obm_write_all(merge_fd, &p->zctrl, sizeof(p->zctrl)) ||
+	       obm_write_all(merge_fd, p->data, p->len) ? -1 : 0;
+}
+
+static int obm_page(struct obev_board *b, struct obdev_page *pg)
+{
+	struct obm_board *m = (struct obm_board *)b;
+
+	if (merge && obmg_push(&mg, m - boards, &pg->zctrl, pg->data,
+			       pg->len)) {
+		fprintf(stderr, "obsbox-multi: cannot merge: %s\n",
+			strerror(errno));
+		return -1;
+	}
+	if (m->capture && obcap_append(&m->w, &pg->zctrl, pg->data, pg->len,
+				       pg->lost ? OBCAP_PAGE_LOST : 0, 0)) {
+		fprintf(stderr, "obsbox-multi: board 0x%04x: cannot write: %s\n",
+			b->dev.devid, strerror(errno));
+		return -1;
+	}
+	if (m->left > 0 && !--m->left) {
+		/* this board is done, the others go on */
+		obdev_run(&b->dev, 0);
+		if (++n_done == n_boards)
+			ev.stop = 1;
+		return 1;
+	}
+	return 0;
+}
+
+static void obm_report(uint64_t dt_ns, int final)
+{
+	struct obm_board *m;
+	struct obdev *d;
+	double dt = dt_ns / 1e9;
+	unsigned int i;
+
+	if (dt <= 0)
+		dt = 1e-9;
+	for (i = 0; i < n_boards; ++i) {
+		m = &boards[i];
+		d = &m->b.dev;
+		fprintf(stderr, "%s0x%04x: %.1f MB/s %.1f pages/s | pages %llu lost %llu alarms %llu | %.2f pages/round\n",
+			final ? "TOTAL " : "", d->devid,
+			(m->b.bytes - m->b_last) / dt / 1e6,
+			(m->b.pages - m->p_last) / dt,
+			(unsigned long long)m->b.pages,
+			(unsigned long long)(d->seq.lost - m->lost_last),
+			(unsigned long long)d->alarms,
+			m->b.rounds ? (double)m->b.pages / m->b.rounds : 0);
+		if (final)
+			continue;
+		m->b_last = m->b.bytes;
+		m->p_last = m->b.pages;
+		m->lost_last = d->seq.lost;
+	}
+	if (final)
+		fprintf(stderr, "TOTAL %llu wakeups\n",
+			(unsigned long long)ev.wakeups);
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t page_size = 0, vmalloc_size = 0, devid;
+	uint64_t t_start = 0, t_last, now, hold = OBMG_HOLD_DEF_NS;
+	char *prefix = NULL, *merge_out = NULL, *tok, path[512];
+	enum obmg_key key = OBMG_KEY_TIME;
+	int c, ret, dommap = 0, quiet = 0, err = 1;
+	long long n = -1;
+	unsigned long long a;
+	unsigned int i, budget = OBEV_BUDGET_DEF;
+	struct obm_board *m;
+
+	while ((c = getopt (argc, argv, "hd:p:v:mo:n:b:M:k:H:qV")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			for (tok = strtok(optarg, ","); tok;
+			     tok = strtok(NULL, ",")) {
+				ret = sscanf(tok, "0x%x", &devid);
+				if (ret != 1 || n_boards == OBEV_BOARDS_MAX)
+					help();
+				boards[n_boards++].b.dev.devid = devid;
+			}
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'm':
+			dommap = 1;
+			break;
+		case 'o':
+			prefix = optarg;
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%lld", &n);
+			if (ret != 1 || n <= 0)
+				help();
+			break;
+		case 'b':
+			ret = sscanf(optarg, "%u", &budget);
+			if (ret != 1 || !budget)
+				help();
+			break;
+		case 'M':
+			merge_out = optarg;
+			break;
+		case 'k':
+			if (!strcmp(optarg, "seq"))
+				key = OBMG_KEY_SEQ;
+			else if (strcmp(optarg, "time"))
+				help();
+			break;
+		case 'H':
+			ret = sscanf(optarg, "%llu", &a);
+			if (ret != 1)
+				help();
+			hold = a * 1000000ULL;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (!n_boards || !page_size)
+		help();
+	/* ZIO exports through mmap(2) only the vmalloc buffer */
+	if (dommap && !vmalloc_size)
+		vmalloc_size = OBM_MMAP_PAGES * page_size;
+
+	if (obev_init(&ev)) {
+		fprintf(stderr, "Cannot create epoll: %s\n", strerror(errno));
+		exit(1);
+	}
+	ev.budget = budget;
+	if (merge_out) {
+		if (obmg_init(&mg, n_boards, page_size, OBMG_DEPTH_DEF, key)) {
+			fprintf(stderr, "Cannot prepare the merge: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		mg.hold_ns = hold;
+		mg.emit = obm_emit;
+		for (i = 0; i < n_boards; ++i)
+			mg.b[i].devid = boards[i].b.dev.devid;
+		if (!strcmp(merge_out, "-")) {
+			merge_fd = STDOUT_FILENO;
+		} else if (n_boards > OBCAP_BOARDS_MAX) {
+			fprintf(stderr, "A merged capture holds up to %d boards\n",
+				OBCAP_BOARDS_MAX);
+			exit(1);
+		} else if (obcap_create(&mw, merge_out, OBCAP_ALIGN_DEF,
+					n_boards)) {
+			fprintf(stderr, "Cannot create %s: %s\n", merge_out,
+				strerror(errno));
+			exit(1);
+		} else {
+			/* the header is written again when it is closed */
+			mw.hdr.flags |= OBCAP_FILE_MERGED;
+			for (i = 0; i < n_boards; ++i)
+				mw.hdr.boards[i] = boards[i].b.dev.devid;
+		}
+		merge = 1;
+	}
+
+	for (i = 0; i < n_boards; ++i) {
+		m = &boards[i];
+		devid = m->b.dev.devid;
+		if (obdev_open(&m->b.dev, devid)) {
+			fprintf(stderr, "Cannot open board 0x%04x: %s\n", devid,
+				strerror(errno));
+			goto out;
+		}
+		m->opened = 1;
+		if (obdev_configure(&m->b.dev, 1, page_size, vmalloc_size) ||
+		    obdev_mode_set(&m->b.dev, dommap ? OBDEV_MMAP : OBDEV_READ)) {
+			fprintf(stderr, "Cannot configure board 0x%04x: %s\n",
+				devid, strerror(errno));
+			goto out;
+		}
+		if (prefix) {
+			snprintf(path, sizeof(path), "%s-%04x.obc", prefix,
+				 devid);
+			if (obcap_create(&m->w, path, OBCAP_ALIGN_DEF, devid)) {
+				fprintf(stderr, "Cannot create %s: %s\n", path,
+					strerror(errno));
+				goto out;
+			}
+			m->capture = 1;
+		}
+		m->left = n;
+		m->b.handler = obm_page;
+		if (obev_add(&ev, &m->b)) {
+			fprintf(stderr, "Cannot add board 0x%04x: %s\n", devid,
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	signal(SIGINT, obm_sighandler);
+	signal(SIGTERM, obm_sighandler);
+
+	/*
+	 * Start together: everything is configured and the ob-run
+	 * attributes are open, the commands go back to back
+	 */
+	t_start = obsbox_now_ns();
+	for (i = 0; i < n_boards; ++i) {
+		if (obdev_run(&boards[i].b.dev, 1) < 0) {
+			fprintf(stderr, "Cannot start board 0x%04x: %s\n",
+				boards[i].b.dev.devid, strerror(errno));
+			goto out;
+		}
+	}
+	fprintf(stderr, "%u boards started in %.1f us\n", n_boards,
+		(obsbox_now_ns() - t_start) / 1e3);
+
+	t_start = t_last = obsbox_now_ns();
+	while (!ev.stop) {
+		if (obev_poll(&ev, merge ? 10 : 1000) < 0)
+			goto out;
+		/* silent boards do not hold the merge forever */
+		if (merge && obmg_run(&mg, 0)) {
+			fprintf(stderr, "obsbox-multi: cannot write the merge: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		now = obsbox_now_ns();
+		if (!quiet && now - t_last >= 1000000000ULL) {
+			obm_report(now - t_last, 0);
+			t_last = now;
+		}
+	}
+	err = 0;
+
+out:
+	if (merge) {
+		if (obmg_run(&mg, 1))
+			err = 1;
+		if (merge_fd < 0 && obcap_close(&mw)) {
+			fprintf(stderr, "Cannot close %s: %s\n", merge_out,
+				strerror(errno));
+			err = 1;
+		}
+		obmg_report(&mg, stderr);
+		obmg_exit(&mg);
+	}
+	for (i = 0; i < n_boards; ++i) {
+		m = &boards[i];
+		if (!m->opened)
+			continue;
+		obdev_run(&m->b.dev, 0);
+		if (m->capture && obcap_close(&m->w)) {
+			fprintf(stderr, "Cannot close the capture of 0x%04x: %s\n",
+				m->b.dev.devid, strerror(errno));
+			err = 1;
+		}
+		obdev_close(&m->b.dev);
+	}
+	if (!err) {
+		for (i = 0; i < n_boards; ++i)
+			boards[i].b_last = boards[i].p_last =
+				boards[i].lost_last = 0;
+		obm_report(obsbox_now_ns() - t_start, 1);
+	}
+	obev_exit(&ev);
+	exit(err);
+}
@@ -0,0 +1,577 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-pipeline.h"
+#include "obsbox-capture.h"
+#include "obsbox-compress.h"
+#include "obsbox-player.h"
+#include "obsbox-envelope.h"
+#include "obsbox-hist.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBPIPE_NPAGES_DEF 16
+
+/**
+ * Compression stage: buffers and counters of one lane, on their own cache
+ * line
+ */
+struct obpipe_zlane {
+	uint8_t *out, *tmp;
+	uint64_t in_bytes, out_bytes;
+} __attribute__((aligned(OBP_CACHELINE)));
+
+struct obpipe_z {
+	struct obz_params p;
+	uint32_t enc;
+	struct obpipe_zlane lane[OBP_MAX_WIDTH];
+};
+
+/**
+ * Live view stage: an envelope every 'period_ns' at most
+ */
+struct obpipe_env {
+	struct obenv e;
+	uint64_t period_ns;
+	uint64_t t_last;
+};
+
+/**
+ * Histogram stage: a snapshot every 'period_ns', compared with the first
+ * one
+ */
+struct obpipe_hist {
+	struct obhist cur, ref;
+	struct obhist_limits lim;
+	uint64_t period_ns;
+	uint64_t t_last;
+	uint64_t snapshots, alarms;
+	FILE *csv;
+};
+
+static volatile sig_atomic_t obpipe_stop;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-pipe -d 0x<devid> -p <page_size> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -n <number>: number of blocks to acquire (default: until SIGINT)\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -b <number>: pages in the pipeline pool (default %d)\n",
+		OBPIPE_NPAGES_DEF);
+	fprintf(stderr, " -q <number>: queue depth between two stages (default: pool size); when\n"
+			"    the first queue is full the reader drops pages\n");
+	fprintf(stderr, " -o <file>: write pages to file ('-' for stdout)\n");
+	fprintf(stderr, " -C <file>: write pages to an indexed capture file\n");
+	fprintf(stderr, " -z <filter>[:<stride>]: compress pages written with -C; filter\n"
+			"    is lz (none), delta, shuffle or delta+shuffle\n");
+	fprintf(stderr, " -j <number>: compression threads (default 1)\n");
+	fprintf(stderr, " -f <file>: replay a capture file instead of the device\n");
+	fprintf(stderr, " -m <recorded|x<speed>|<number>|max>: with -f, recorded cadence, scaled\n"
+			"    cadence, pages per second or as fast as possible (default recorded)\n");
+	fprintf(stderr, " -E <points>:<hz>:<dest>: publish a min/max envelope of the pages at <hz>,\n"
+			"    on file:<path>, udp:<host>:<port> or shm:<name>\n");
+	fprintf(stderr, " -H <seconds>[:<file>]: histogram of the sample codes, a snapshot every\n"
+			"    <seconds> on stderr with alarms, and as a csv row in <file>\n");
+	fprintf(stderr, " -X <spec>: hardened mode, e.g. cpu=2,workers=3-5,prio=80,lock,huge,busy\n"
+			"    (see README)\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "One thread reads pages from the driver and pushes them through the\n"
+			"stages, each stage runs in its own thread. Statistics per stage are\n"
+			"printed every second on stderr. With -f -m max the reader never\n"
+			"drops a page, the rate is the one of the slowest stage.\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obpipe_sighandler(int sig)
+{
+	obpipe_stop = 1;
+}
+
+
+/**
+ * Sink stage: write the page to a file descriptor
+ */
+static int obpipe_write(struct obp_stage *stage, struct obp_page *page)
+{
+	int fd = (long)stage->priv;
+	uint32_t done = 0;
+	int n;
+
+	while (done < page->len) {
+		n = write(fd, page->data + done, page->len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			fprintf(stderr, "obsbox-pipe: write(): %s\n",
+				strerror(errno));
+			return -1;
+		}
+		done += n;
+	}
+
+	return 0;
+}
+
+/**
+ * Sink stage: append the page to a capture file
+ */
+static int obpipe_capture(struct obp_stage *stage, struct obp_page *page)
+{
+	struct obcap_writer *w = stage->priv;
+	uint16_t flags = 0;
+
+	if (page->flags & OBP_PAGE_LOST)
+		flags |= OBCAP_PAGE_LOST;
+	if (obcap_append(w, &page->zctrl, page->data, page->len, flags,
+			 page->enc)) {
+		fprintf(stderr, "obsbox-pipe: capture write: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Compression stage, it runs in parallel: every lane has its buffers.
+ * Pages that do not compress are kept as they are.
+ */
+static int obpipe_compress(struct obp_stage *stage, struct obp_page *page)
+{
+	struct obpipe_z *z = stage->priv;
+	struct obpipe_zlane *l = &z->lane[stage->lane];
+	size_t n;
+
+	n = obz_compress(&z->p, page->data, page->len, l->out, l->tmp);
+	l->in_bytes += page->len;
+	if (n) {
+		memcpy(page->data, l->out, n);
+		page->len = n;
+		page->enc = z->enc;
+	}
+	l->out_bytes += page->len;
+
+	return 0;
+}
+
+static void obpipe_compress_report(struct obpipe_z *z, unsigned int width)
+{
+	uint64_t in = 0, out = 0;
+	unsigned int i;
+
+	for (i = 0; i < width; ++i) {
+		in += z->lane[i].in_bytes;
+		out += z->lane[i].out_bytes;
+	}
+	if (out)
+		fprintf(stderr, "compression ratio %.2f\n", (double)in / out);
+}
+
+/**
+ * Live view stage: most pages only pass through, one in a while is
+ * reduced to its envelope and published without waiting
+ */
+static int obpipe_envelope(struct obp_stage *stage, struct obp_page *page)
+{
+	struct obpipe_env *env = stage->priv;
+	uint64_t now = obsbox_now_ns();
+
+	if (page->enc || now - env->t_last < env->period_ns)
+		return 0;
+	env->t_last = now;
+	if (obenv_publish(&env->e, &page->zctrl, page->data, page->len)) {
+		fprintf(stderr, "obsbox-pipe: envelope: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static void obpipe_hist_snapshot(struct obpipe_hist *hs)
+{
+	struct obhist_summary s;
+	unsigned int a, k;
+
+	if (!hs->cur.n)
+		return;
+	if (!hs->ref.n)
+		hs->ref = hs->cur;
+	obhist_summary(&hs->cur, &hs->ref, &s);
+	a = obhist_alarms(&s, &hs->lim);
+	hs->snapshots++;
+	hs->alarms += !!a;
+	obhist_print(&s, a, stderr);
+	if (hs->csv) {
+		fprintf(hs->csv, "%llu,%llu,%.3f,%.3f,%.3e,%.3e,%.4f,%u,%u,%u,%u",
+			(unsigned long long)obsbox_now_ns(),
+			(unsigned long long)s.n, s.mean, s.std, s.sat_lo,
+			s.sat_hi, s.shift, s.missing, s.stuck0, s.stuck1, a);
+		for (k = 0; k < 256; ++k)
+			fprintf(hs->csv, ",%llu",
+				(unsigned long long)hs->cur.bin[k]);
+		fprintf(hs->csv, "\n");
+		fflush(hs->csv);
+	}
+	obhist_reset(&hs->cur);
+}
+
+/**
+ * Histogram stage: every raw page is counted
+ */
+static int obpipe_hist(struct obp_stage *stage, struct obp_page *page)
+{
+	struct obpipe_hist *hs = stage->priv;
+	uint64_t now;
+
+	if (!page->enc)
+		obhist_add(&hs->cur, page->data, page->len);
+	now = obsbox_now_ns();
+	if (!hs->t_last)
+		hs->t_last = now;
+	if (now - hs->t_last >= hs->period_ns) {
+		hs->t_last = now;
+		obpipe_hist_snapshot(hs);
+	}
+	return 0;
+}
+
+/**
+ * Counter stage: it stops the pipeline after the requested pages. The
+ * pages already in flight behind the last one are dropped, so the sinks
+ * get exactly the requested pages.
+ */
+static int obpipe_count(struct obp_stage *stage, struct obp_page *page)
+{
+	long *n = stage->priv;
+
+	if (!*n)
+		return OBP_DROP;
+	if (*n > 0 && --(*n) == 0)
+		obp_stop(stage->pipe);
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t page_size = 0, vmalloc_size = 0;
+	unsigned int n_pages = OBPIPE_NPAGES_DEF, depth = 0;
+	struct obp_src_dev dev = {.timeout_ms = 1000};
+	struct obdev d;
+	struct obp_pipeline pipe;
+	struct obcap_writer cap;
+	char *out = NULL, *capture = NULL, *zspec = NULL, *file = NULL;
+	char *pace = NULL;
+	unsigned int width = 1, i;
+	struct obpipe_z z;
+	struct obrp rp;
+	struct obrt rt, *prt = NULL;
+	struct obpipe_env env;
+	char *envspec = NULL, *histcsv = NULL;
+	struct obpipe_hist hs;
+	double hist_s = 0;
+	unsigned int env_n, env_hz;
+	int pos = 0;
+	long n = -1;
+	int c, ret, fdo = -1;
+
+	while ((c = getopt (argc, argv, "hd:p:n:v:b:q:o:C:z:j:f:m:E:H:X:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &dev.devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%ld", &n);
+			if (ret != 1 || !n)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'b':
+			ret = sscanf(optarg, "%u", &n_pages);
+			if (ret != 1 || !n_pages)
+				help();
+			break;
+		case 'q':
+			ret = sscanf(optarg, "%u", &depth);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'C':
+			capture = optarg;
+			break;
+		case 'z':
+			zspec = optarg;
+			break;
+		case 'j':
+			ret = sscanf(optarg, "%u", &width);
+			if (ret != 1 || !width || width > OBP_MAX_WIDTH)
+				help();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'm':
+			pace = optarg;
+			break;
+		case 'E':
+			ret = sscanf(optarg, "%u:%u:%n", &env_n, &env_hz, &pos);
+			if (ret != 2 || !env_hz || !pos)
+				help();
+			envspec = optarg + pos;
+			break;
+		case 'H':
+			pos = 0;
+			ret = sscanf(optarg, "%lf%n", &hist_s, &pos);
+			if (ret != 1 || hist_s <= 0)
+				help();
+			if (optarg[pos] == ':')
+				histcsv = optarg + pos + 1;
+			else if (optarg[pos])
+				help();
+			break;
+		case 'X':
+			if (obrt_parse(&rt, optarg))
+				help();
+			prt = &rt;
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (file) {
+		if (obrp_open(&rp, file)) {
+			fprintf(stderr, "Cannot use capture %s: %s\n", file,
+				strerror(errno));
+			exit(1);
+		}
+		if (pace && obrp_pace_parse(&rp, pace))
+			help();
+		if (rp.page_max > page_size)
+			page_size = rp.page_max;
+	}
+	if (!page_size)
+		help();
+	if (prt && obrt_setup(prt)) {
+		fprintf(stderr, "Cannot lock the memory: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (zspec) {
+		if (!capture || obz_parse(&z.p, zspec))
+			help();
+		z.enc = OBCAP_ENC(OBCAP_CODEC_LZ, z.p.filter, z.p.stride);
+		for (i = 0; i < width; ++i) {
+			z.lane[i].out = malloc(obz_bound(page_size));
+			z.lane[i].tmp = malloc(page_size);
+			if (!z.lane[i].out || !z.lane[i].tmp)
+				exit(1);
+			z.lane[i].in_bytes = z.lane[i].out_bytes = 0;
+		}
+	}
+
+	if (out) {
+		fdo = strcmp(out, "-") ? open(out, O_WRONLY | O_CREAT | O_TRUNC,
+					      0644) : STDOUT_FILENO;
+		if (fdo < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", out,
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (envspec) {
+		if (obenv_open(&env.e, envspec, env_n)) {
+			fprintf(stderr, "Cannot open the envelope channel %s: %s\n",
+				envspec, strerror(errno));
+			exit(1);
+		}
+		env.period_ns = 1000000000ULL / env_hz;
+		env.t_last = 0;
+	}
+
+	if (hist_s) {
+		memset(&hs, 0, sizeof(hs));
+		hs.period_ns = hist_s * 1e9;
+		hs.lim.sat = OBHIST_SAT_DEF;
+		hs.lim.shift = OBHIST_SHIFT_DEF;
+		if (histcsv) {
+			hs.csv = fopen(histcsv, "w");
+			if (!hs.csv) {
+				fprintf(stderr, "Cannot create %s: %s\n",
+					histcsv, strerror(errno));
+				exit(1);
+			}
+			fprintf(hs.csv, "time,n,mean,std,at0,at255,shift,missing,stuck0,stuck1,alarms");
+			for (i = 0; i < 256; ++i)
+				fprintf(hs.csv, ",c%u", i);
+			fprintf(hs.csv, "\n");
+		}
+	}
+
+	if (capture && obcap_create(&cap, capture, OBCAP_ALIGN_DEF, dev.devid)) {
+		fprintf(stderr, "Cannot create %s: %s\n", capture,
+			strerror(errno));
+		exit(1);
+	}
+
+	if (obp_init(&pipe, n_pages, depth, page_size, obp_src_dev_read,
+		     &dev, prt)) {
+		fprintf(stderr, "Cannot allocate the pipeline\n");
+		exit(1);
+	}
+	obp_stage_add(&pipe, "count", obpipe_count, &n);
+	if (hist_s)
+		obp_stage_add(&pipe, "hist", obpipe_hist, &hs);
+	if (envspec)
+		obp_stage_add(&pipe, "envelope", obpipe_envelope, &env);
+	if (out)
+		obp_stage_add(&pipe, "write", obpipe_write, (void *)(long)fdo);
+	if (zspec)
+		obp_stage_add_parallel(&pipe, "compress", obpipe_compress, &z,
+				       width);
+	if (capture)
+		obp_stage_add(&pipe, "capture", obpipe_capture, &cap);
+
+	signal(SIGINT, obpipe_sighandler);
+	signal(SIGTERM, obpipe_sighandler);
+
+	if (file) {
+		pipe.lossless = rp.pace == OBRP_MAX;
+		if (obrp_pipes(&rp, &dev.fdd, &dev.fdc) || obp_start(&pipe)) {
+			fprintf(stderr, "Cannot start the replay: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		while (!pipe.stop) {
+			sleep(1);
+			if (obpipe_stop)
+				obp_stop(&pipe);
+			obp_report(&pipe, stderr);
+		}
+		ret = obp_wait(&pipe);
+		close(dev.fdc);
+		close(dev.fdd);
+		if (obrp_wait(&rp))
+			ret = -1;
+		fprintf(stderr, "replay: %llu pages in %.3f s, %llu late (avg %llu us, max %llu us)\n",
+			(unsigned long long)rp.pages,
+			(rp.t_end - rp.t_start) / 1e9,
+			(unsigned long long)rp.late_n,
+			(unsigned long long)(rp.late_n ? rp.late_sum / rp.late_n / 1000 : 0),
+			(unsigned long long)rp.late_max / 1000);
+		goto out_replay;
+	}
+
+	if (obdev_open(&d, dev.devid)) {
+		fprintf(stderr, "Cannot open ZIO char devices: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	/* Configure the acquisition */
+	ret = obdev_configure(&d, 1, page_size, vmalloc_size);
+	if (ret){
+		fprintf(stderr,
+			"Something wrong during the configuration: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	dev.d = &d;
+	dev.fdd = d.fdd;
+	dev.fdc = d.fdc;
+
+	ret = obdev_run(&d, 1);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot start acquisition: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	if (obp_start(&pipe)) {
+		fprintf(stderr, "Cannot start the pipeline: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	while (!pipe.stop) {
+		sleep(1);
+		if (obpipe_stop)
+			obp_stop(&pipe);
+		obp_report(&pipe, stderr);
+	}
+	ret = obp_wait(&pipe);
+	obdev_run(&d, 0);
+	obdev_close(&d);
+out_replay:
+	obp_report(&pipe, stderr);
+	if (zspec)
+		obpipe_compress_report(&z, width);
+	if (hist_s) {
+		obpipe_hist_snapshot(&hs);
+		fprintf(stderr, "hist: %llu snapshots, %llu with alarms\n",
+			(unsigned long long)hs.snapshots,
+			(unsigned long long)hs.alarms);
+		if (hs.csv)
+			fclose(hs.csv);
+	}
+	if (envspec) {
+		fprintf(stderr, "envelope: %llu published, %llu dropped (%s)\n",
+			(unsigned long long)env.e.count,
+			(unsigned long long)env.e.drops, obenv_impl());
+		obenv_close(&env.e);
+	}
+	obp_exit(&pipe);
+	if (capture && obcap_close(&cap)) {
+		fprintf(stderr, "Cannot close %s: %s\n", capture,
+			strerror(errno));
+		ret = -1;
+	}
+	exit(!!ret);
+
+out:
+	obdev_run(&d, 0);
+	obdev_close(&d);
+	exit(1);
+}
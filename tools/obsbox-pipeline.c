@@ -0,0 +1,684 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "obsbox-pipeline.h"
+
+#define OBP_SPIN 256 /* polls before sleeping on an empty/full ring */
+#define OBP_SLEEP_NS 10000000 /* upper bound of a sleep, lost wake-up safety */
+
+static void obp_futex_wait(unsigned int *addr, unsigned int val)
+{
+	struct timespec ts = {0, OBP_SLEEP_NS};
+
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+static void obp_futex_wake(unsigned int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+
+static int obp_ring_init(struct obp_ring *r, unsigned int size)
+{
+	unsigned int n = 1;
+
+	while (n < size)
+		n <<= 1;
+	memset(r, 0, sizeof(*r));
+	r->slot = calloc(n, sizeof(*r->slot));
+	if (!r->slot)
+		return -1;
+	r->mask = n - 1;
+
+	return 0;
+}
+
+/**
+ * Producer side
+ * @return 1 on success, 0 when the ring is full
+ */
+static int obp_ring_push(struct obp_ring *r, struct obp_page *page)
+{
+	unsigned int tail = r->tail;
+
+	if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask)
+		return 0;
+	r->slot[tail & r->mask] = page;
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	/* Order the tail store before looking at the consumer sleep flag */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->sleep_pop, __ATOMIC_RELAXED))
+		obp_futex_wake(&r->tail);
+
+	return 1;
+}
+
+/**
+ * Producer side, only the producer fills the ring
+ * @return 1 when a push would fail
+ */
+static int obp_ring_full(const struct obp_ring *r)
+{
+	return r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) > r->mask;
+}
+
+/**
+ * Consumer side
+ * @return the page, NULL when the ring is empty
+ */
+static struct obp_page *obp_ring_pop(struct obp_ring *r)
+{
+	unsigned int head = r->head;
+	struct obp_page *page;
+
+	if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	page = r->slot[head & r->mask];
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->sleep_push, __ATOMIC_RELAXED))
+		obp_futex_wake(&r->head);
+
+	return page;
+}
+
+/**
+ * Wait until the ring is not empty anymore, spin first then sleep
+ */
+static void obp_ring_wait_pop(struct obp_ring *r)
+{
+	unsigned int tail;
+	int i;
+
+	for (i = 0; i < OBP_SPIN; ++i)
+		if (r->head != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+			return;
+
+	__atomic_store_n(&r->sleep_pop, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	if (tail == r->head)
+		obp_futex_wait(&r->tail, tail);
+	__atomic_store_n(&r->sleep_pop, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Wait until the ring is not full anymore, spin first then sleep
+ */
+static void obp_ring_wait_push(struct obp_ring *r)
+{
+	unsigned int head;
+	int i;
+
+	for (i = 0; i < OBP_SPIN; ++i)
+		if (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) <= r->mask)
+			return;
+
+	__atomic_store_n(&r->sleep_push, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if (r->tail - head > r->mask)
+		obp_futex_wait(&r->head, head);
+	__atomic_store_n(&r->sleep_push, 0, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @return the next page from the stage input, NULL when it is empty
+ */
+static struct obp_page *obp_stage_pop(struct obp_stage *stage)
+{
+	struct obp_page *page;
+
+	page = obp_ring_pop(&stage->in[stage->i_in]);
+	if (page && ++stage->i_in == stage->n_in)
+		stage->i_in = 0;
+
+	return page;
+}
+
+/**
+ * Push a page to the stage output, wait while it is full
+ */
+static void obp_stage_push(struct obp_stage *stage, struct obp_page *page)
+{
+	struct obp_ring *r = &stage->out[stage->i_out];
+
+	while (!obp_ring_push(r, page)) {
+		stage->st.wait_out++;
+		obp_ring_wait_push(r);
+	}
+	if (++stage->i_out == stage->n_out)
+		stage->i_out = 0;
+}
+
+/**
+ * @return 1 when the stage, all its lanes when parallel, terminated
+ */
+static int obp_stage_done(struct obp_stage *stage)
+{
+	unsigned int i;
+
+	if (stage->width <= 1)
+		return __atomic_load_n(&stage->done, __ATOMIC_ACQUIRE);
+	for (i = 0; i < stage->width; ++i)
+		if (!__atomic_load_n(&stage->lanes[i].done, __ATOMIC_ACQUIRE))
+			return 0;
+	return 1;
+}
+
+/**
+ * Mark the stage as terminated and wake up the downstream consumers
+ */
+static void obp_stage_finish(struct obp_stage *stage)
+{
+	unsigned int i;
+
+	__atomic_store_n(&stage->done, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < stage->n_out; ++i)
+		obp_futex_wake(&stage->out[i].tail);
+}
+
+
+/**
+ * Apply the hardened mode to the thread of a stage
+ */
+static void obp_thread_rt(struct obp_stage *stage)
+{
+	if (stage->pipe->rt && obrt_thread(stage->pipe->rt, stage->cpu))
+		fprintf(stderr, "obsbox: %s: cannot pin or prioritize the thread: %s\n",
+			stage->name, strerror(errno));
+}
+
+/**
+ * The reader is the only producer of the pipeline. It never blocks on the
+ * downstream stages: when there are no free pages, or the input of the
+ * first stage is full, the page is read into the drop page and accounted
+ * as dropped, so the driver keeps flowing. A free page already taken is
+ * kept for the next read.
+ */
+static void *obp_reader(void *arg)
+{
+	struct obp_stage *stage = arg;
+	struct obp_pipeline *pipe = stage->pipe;
+	struct obp_page *page = NULL;
+	uint64_t lost;
+	int ret, full, dropped = 0;
+
+	obp_thread_rt(stage);
+
+	while (!pipe->stop) {
+		if (!page)
+			page = obp_stage_pop(stage);
+		if (!page && pipe->lossless) {
+			/* the source can wait, do not drop */
+			stage->st.wait_in++;
+			obp_ring_wait_pop(&stage->in[stage->i_in]);
+			continue;
+		}
+		if (!page)
+			stage->st.wait_in++;
+		/* only the reader pushes there, a free slot stays free */
+		full = page && !pipe->lossless &&
+		       obp_ring_full(&stage->out[stage->i_out]);
+		if (full)
+			stage->st.wait_out++;
+
+		ret = pipe->read(pipe, page && !full ? page : &pipe->drop);
+		if (ret == OBP_END)
+			break;
+		if (ret < 0) {
+			pipe->error = ret;
+			break;
+		}
+		if (ret == 0)
+			continue;
+
+		if (!page || full) {
+			obsbox_seq_update(&pipe->seq, pipe->drop.zctrl.seq_num);
+			stage->st.drops++;
+			dropped = 1;
+			continue;
+		}
+		lost = pipe->seq.lost;
+		obsbox_seq_update(&pipe->seq, page->zctrl.seq_num);
+		page->flags = pipe->seq.lost != lost || dropped ?
+			      OBP_PAGE_LOST : 0;
+		dropped = 0;
+		page->enc = 0;
+		stage->st.pages++;
+		stage->st.bytes += page->len;
+		obp_stage_push(stage, page);
+		page = NULL;
+	}
+
+	/* A page we were holding stays out of the rings, obp_exit() frees it */
+	obp_stage_finish(stage);
+	pipe->stop = 1;
+
+	return NULL;
+}
+
+
+static void *obp_worker(void *arg)
+{
+	struct obp_stage *stage = arg;
+	struct obp_page *page;
+	uint64_t t;
+	int ret;
+
+	obp_thread_rt(stage);
+	while (1) {
+		page = obp_stage_pop(stage);
+		if (!page) {
+			/* upstream may push and terminate, so check again */
+			if (obp_stage_done(stage->up)) {
+				page = obp_stage_pop(stage);
+				if (!page)
+					break;
+			} else {
+				stage->st.wait_in++;
+				obp_ring_wait_pop(&stage->in[stage->i_in]);
+				continue;
+			}
+		}
+
+		if (!(page->flags & OBP_PAGE_DROPPED) && !stage->pipe->error) {
+			t = obsbox_now_ns();
+			ret = stage->process(stage, page);
+			stage->st.busy_ns += obsbox_now_ns() - t;
+			if (ret < 0) {
+				stage->pipe->error = ret;
+				stage->pipe->stop = 1;
+			} else if (ret == OBP_DROP) {
+				page->flags |= OBP_PAGE_DROPPED;
+				stage->st.drops++;
+			}
+		}
+		stage->st.pages++;
+		stage->st.bytes += page->len;
+		obp_stage_push(stage, page);
+	}
+	obp_stage_finish(stage);
+
+	return NULL;
+}
+
+
+/**
+ * Allocate all the pipeline resources
+ * @n_pages: number of pages in the pool
+ * @depth: capacity of the ring between two stages
+ * @page_max: the biggest page we can get
+ * @read: page source
+ * @src: page source private data
+ * @rt: hardened mode (obsbox-rt.h), NULL for none. It must stay valid
+ * @return 0 on success, -1 on error
+ */
+int obp_init(struct obp_pipeline *pipe, unsigned int n_pages,
+	     unsigned int depth, uint32_t page_max,
+	     obp_read_t read, void *src, const struct obrt *rt)
+{
+	size_t stride = (page_max + 4095) & ~4095UL;
+	unsigned int i;
+
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->n_pages = n_pages;
+	pipe->page_max = page_max;
+	pipe->read = read;
+	pipe->src = src;
+	pipe->rt = rt;
+	/* depth 0 means no limit: every ring can hold all the pages */
+	if (!depth || depth > n_pages)
+		depth = n_pages;
+	pipe->depth = depth;
+
+	pipe->pages = calloc(n_pages, sizeof(*pipe->pages));
+	if (!pipe->pages)
+		return -1;
+	/* Pre-faulted now, not while streaming; the drop page is the last */
+	pipe->pool_len = stride * (n_pages + 1);
+	pipe->pool = obrt_alloc(rt, pipe->pool_len);
+	if (!pipe->pool)
+		return -1;
+	for (i = 0; i < n_pages; ++i)
+		pipe->pages[i].data = pipe->pool + i * stride;
+	pipe->drop.data = pipe->pool + n_pages * stride;
+
+	/* ring[0] is the free pool: it must hold all the pages */
+	if (obp_ring_init(&pipe->ring[0], n_pages))
+		return -1;
+	for (i = 0; i < n_pages; ++i)
+		obp_ring_push(&pipe->ring[0], &pipe->pages[i]);
+	for (i = 0; i <= OBP_MAX_STAGES; ++i)
+		pipe->stage[i].cpu = -1;
+	for (i = 1; i <= OBP_MAX_STAGES; ++i)
+		if (obp_ring_init(&pipe->ring[i], depth))
+			return -1;
+
+	pipe->stage[0].name = "reader";
+	pipe->stage[0].pipe = pipe;
+	pipe->stage[0].width = 1;
+
+	return 0;
+}
+
+
+/**
+ * Append a processing stage, it will run in its own thread
+ * @return 0 on success, -1 when there are too many stages
+ */
+int obp_stage_add(struct obp_pipeline *pipe, const char *name,
+		  obp_process_t process, void *priv)
+{
+	return obp_stage_add_parallel(pipe, name, process, priv, 1);
+}
+
+
+/**
+ * Append a processing stage running in 'width' threads. Pages are
+ * distributed to the threads in round-robin and collected in the same
+ * order, so the stage can be slow as long as pages are independent. The
+ * process callback finds its thread index in stage->lane.
+ *
+ * A parallel stage cannot be the last one, and it cannot be next to
+ * another parallel stage: obp_start() fails.
+ * @return 0 on success, -1 on error
+ */
+int obp_stage_add_parallel(struct obp_pipeline *pipe, const char *name,
+			   obp_process_t process, void *priv,
+			   unsigned int width)
+{
+	struct obp_stage *stage;
+
+	if (pipe->n_stages >= OBP_MAX_STAGES) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (!width || width > OBP_MAX_WIDTH) {
+		errno = EINVAL;
+		return -1;
+	}
+	stage = &pipe->stage[++pipe->n_stages];
+	stage->name = name;
+	stage->process = process;
+	stage->priv = priv;
+	stage->pipe = pipe;
+	stage->width = width;
+
+	return 0;
+}
+
+
+/**
+ * Allocate the lanes of a parallel stage and connect them to the
+ * neighbour stages
+ * @return 0 on success, -1 on error
+ */
+static int obp_lanes_init(struct obp_stage *stage)
+{
+	unsigned int i, w = stage->width;
+	struct obp_stage *lane;
+
+	stage->lanes = calloc(w, sizeof(*stage->lanes));
+	stage->lane_ring = calloc(2 * w, sizeof(*stage->lane_ring));
+	if (!stage->lanes || !stage->lane_ring)
+		return -1;
+	for (i = 0; i < 2 * w; ++i)
+		if (obp_ring_init(&stage->lane_ring[i], stage->pipe->depth))
+			return -1;
+
+	for (i = 0; i < w; ++i) {
+		lane = &stage->lanes[i];
+		lane->name = stage->name;
+		lane->process = stage->process;
+		lane->priv = stage->priv;
+		lane->pipe = stage->pipe;
+		lane->up = stage->up;
+		lane->in = &stage->lane_ring[i];
+		lane->out = &stage->lane_ring[w + i];
+		lane->n_in = lane->n_out = 1;
+		lane->width = 1;
+		lane->lane = i;
+	}
+	(stage - 1)->out = stage->lane_ring;
+	(stage - 1)->n_out = w;
+	(stage + 1)->in = stage->lane_ring + w;
+	(stage + 1)->n_in = w;
+
+	return 0;
+}
+
+
+/**
+ * Connect the stages and start all the threads
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obp_start(struct obp_pipeline *pipe)
+{
+	struct obp_stage *thr[OBP_MAX_STAGES * OBP_MAX_WIDTH + 1];
+	unsigned int i, j, n = pipe->n_stages, n_thr = 0;
+	struct obp_stage *stage;
+	int err;
+
+	if (!n || pipe->stage[n].width > 1) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 1; i < n; ++i) {
+		if (pipe->stage[i].width > 1 && (pipe->stage[i - 1].width > 1 ||
+						 pipe->stage[i + 1].width > 1)) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	/*
+	 * reader: ring[0] (free) -> ring[1]
+	 * stage i: ring[i] -> ring[i + 1], the last one back to ring[0]
+	 */
+	for (i = 0; i <= n; ++i) {
+		stage = &pipe->stage[i];
+		stage->up = &pipe->stage[i ? i - 1 : n];
+		stage->in = &pipe->ring[i];
+		stage->out = &pipe->ring[i == n ? 0 : i + 1];
+		stage->n_in = stage->n_out = 1;
+	}
+	/* a parallel stage replaces the two rings around it with its lanes */
+	for (i = 1; i < n; ++i) {
+		if (pipe->stage[i].width > 1 && obp_lanes_init(&pipe->stage[i])) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* downstream first, so nobody finds its upstream terminated */
+	for (i = n; i > 0; --i) {
+		stage = &pipe->stage[i];
+		if (stage->width == 1)
+			thr[n_thr++] = stage;
+		else
+			for (j = 0; j < stage->width; ++j)
+				thr[n_thr++] = &stage->lanes[j];
+	}
+	thr[n_thr++] = &pipe->stage[0];
+	if (pipe->rt) {
+		for (i = 0; i < n_thr - 1; ++i)
+			thr[i]->cpu = obrt_worker_cpu(pipe->rt, i);
+		pipe->stage[0].cpu = pipe->rt->cpu;
+	}
+
+	for (i = 0; i < n_thr; ++i) {
+		err = pthread_create(&thr[i]->thread, NULL,
+				     thr[i] == &pipe->stage[0] ?
+				     obp_reader : obp_worker, thr[i]);
+		if (err)
+			goto err;
+	}
+
+	return 0;
+
+err:
+	/* The threads not started are upstream: let the others terminate */
+	for (j = i; j < n_thr; ++j)
+		obp_stage_finish(thr[j]);
+	for (j = 0; j < i; ++j)
+		pthread_join(thr[j]->thread, NULL);
+	errno = err;
+	return -1;
+}
+
+
+/**
+ * Ask the reader to stop, the stages terminate once they are empty
+ */
+void obp_stop(struct obp_pipeline *pipe)
+{
+	pipe->stop = 1;
+}
+
+
+/**
+ * Wait for the termination of all the threads
+ * @return 0 on success, the error of the stage that failed otherwise
+ */
+int obp_wait(struct obp_pipeline *pipe)
+{
+	struct obp_stage *stage;
+	unsigned int i, j;
+
+	for (i = 0; i <= pipe->n_stages; ++i) {
+		stage = &pipe->stage[i];
+		if (stage->width == 1)
+			pthread_join(stage->thread, NULL);
+		else
+			for (j = 0; j < stage->width; ++j)
+				pthread_join(stage->lanes[j].thread, NULL);
+	}
+
+	return pipe->error;
+}
+
+
+void obp_exit(struct obp_pipeline *pipe)
+{
+	struct obp_stage *stage;
+	unsigned int i, j;
+
+	for (i = 1; i <= pipe->n_stages; ++i) {
+		stage = &pipe->stage[i];
+		if (stage->exit)
+			stage->exit(stage);
+		if (stage->lane_ring)
+			for (j = 0; j < 2 * stage->width; ++j)
+				free(stage->lane_ring[j].slot);
+		free(stage->lane_ring);
+		free(stage->lanes);
+	}
+	for (i = 0; i <= OBP_MAX_STAGES; ++i)
+		free(pipe->ring[i].slot);
+	obrt_free(pipe->rt, pipe->pool, pipe->pool_len);
+	free(pipe->pages);
+}
+
+
+/**
+ * Print per stage statistics. Counters are read without synchronization,
+ * they can be slightly out of date.
+ */
+void obp_report(struct obp_pipeline *pipe, FILE *f)
+{
+	struct obp_stage *stage;
+	struct obp_stats sum, *st;
+	unsigned int i, j;
+
+	fprintf(f, "%-12s %5s %12s %10s %10s %10s %10s %10s\n",
+		"stage", "width", "pages", "MB", "drops", "wait-in", "wait-out",
+		"busy-ms");
+	for (i = 0; i <= pipe->n_stages; ++i) {
+		stage = &pipe->stage[i];
+		st = &stage->st;
+		if (stage->width > 1 && stage->lanes) {
+			/* busy time is the sum over the lanes: CPU time */
+			memset(&sum, 0, sizeof(sum));
+			for (j = 0; j < stage->width; ++j) {
+				st = &stage->lanes[j].st;
+				sum.pages += st->pages;
+				sum.bytes += st->bytes;
+				sum.drops += st->drops;
+				sum.wait_in += st->wait_in;
+				sum.wait_out += st->wait_out;
+				sum.busy_ns += st->busy_ns;
+			}
+			st = &sum;
+		}
+		fprintf(f, "%-12s %5u %12llu %10llu %10llu %10llu %10llu %10llu\n",
+			stage->name, stage->width,
+			(unsigned long long)st->pages,
+			(unsigned long long)(st->bytes / 1000000),
+			(unsigned long long)st->drops,
+			(unsigned long long)st->wait_in,
+			(unsigned long long)st->wait_out,
+			(unsigned long long)(st->busy_ns / 1000000));
+	}
+	fprintf(f, "sequence number holes: %llu\n",
+		(unsigned long long)pipe->seq.lost);
+	if (pipe->lat.n)
+		obrt_lat_report(&pipe->lat, f);
+}
+
+
+/**
+ * Read a page from the ZIO char devices
+ */
+int obp_src_dev_read(struct obp_pipeline *pipe, struct obp_page *page)
+{
+	struct obp_src_dev *dev = pipe->src;
+	uint32_t len, done = 0;
+	int n;
+
+	n = obrt_wait(pipe->rt, dev->fdc, dev->timeout_ms);
+	if (n < 0 && errno != EINTR)
+		return -1;
+	if (n <= 0)
+		return 0;
+	if (dev->d ? obdev_ctrl_read(dev->d, &page->zctrl) :
+		     obsbox_ctrl_read(dev->fdc, &page->zctrl))
+		return errno == ENODATA ? OBP_END : -1;
+	obrt_lat_page(&pipe->lat, &page->zctrl);
+
+	len = obsbox_ctrl_len(&page->zctrl);
+	if (len > pipe->page_max) {
+		fprintf(stderr, "obsbox: page of %u bytes, max is %u\n",
+			len, pipe->page_max);
+		return -1;
+	}
+	while (done < len) {
+		n = read(dev->fdd, page->data + done, len - done);
+		if (n <= 0) {
+			fprintf(stderr, "obsbox: cannot read data: %s\n",
+				n < 0 ? strerror(errno) : "EOF");
+			return -1;
+		}
+		done += n;
+	}
+	page->len = len;
+	page->t_acq = obsbox_now_ns();
+
+	return 1;
+}
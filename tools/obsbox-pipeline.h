@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_PIPELINE_H__
+#define __OBSBOX_PIPELINE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-rt.h"
+
+#define OBP_CACHELINE 64
+#define OBP_MAX_STAGES 16
+#define OBP_MAX_WIDTH 64
+
+#define OBP_PAGE_DROPPED (1 << 0) /* a stage dropped it, others skip it */
+#define OBP_PAGE_LOST (1 << 1) /* pages lost, or dropped, just before this one */
+
+/**
+ * A page travels the whole pipeline by pointer, the memory is allocated
+ * once by obp_init() and recycled.
+ */
+struct obp_page {
+	struct zio_control zctrl;
+	uint8_t *data; /**< page aligned, obp_pipeline.page_max bytes */
+	uint32_t len; /**< valid bytes in data */
+	uint32_t flags;
+	uint32_t enc; /**< data encoding (OBCAP_ENC()), 0 for raw samples */
+	uint64_t t_acq; /**< CLOCK_MONOTONIC ns when it was read */
+};
+
+/**
+ * Single producer single consumer ring of page pointers. head and tail
+ * are free running, on separate cache lines.
+ */
+struct obp_ring {
+	unsigned int mask;
+	struct obp_page **slot;
+	unsigned int head __attribute__((aligned(OBP_CACHELINE)));
+	unsigned int sleep_pop; /**< the consumer waits on tail */
+	unsigned int tail __attribute__((aligned(OBP_CACHELINE)));
+	unsigned int sleep_push; /**< the producer waits on head */
+};
+
+/**
+ * Per stage statistics. Written only by the stage thread, read at any time
+ * for reporting.
+ */
+struct obp_stats {
+	uint64_t pages;
+	uint64_t bytes;
+	uint64_t drops; /**< pages dropped by this stage */
+	uint64_t wait_in; /**< times the input ring was empty */
+	uint64_t wait_out; /**< times the output ring was full (backpressure) */
+	uint64_t busy_ns; /**< time spent in the stage callback */
+};
+
+struct obp_pipeline;
+struct obp_stage;
+
+/**
+ * It processes a page in place
+ * @return 0 to pass the page on, OBP_DROP to drop it, -1 on error (the
+ *         whole pipeline stops)
+ */
+#define OBP_DROP 1
+typedef int (*obp_process_t)(struct obp_stage *stage, struct obp_page *page);
+
+struct obp_stage {
+	const char *name;
+	obp_process_t process;
+	void (*exit)(struct obp_stage *stage); /**< optional, on obp_exit() */
+	void *priv;
+
+	struct obp_pipeline *pipe;
+	struct obp_stage *up; /**< upstream stage */
+	/*
+	 * Input and output rings. Next to a parallel stage there is one ring
+	 * per lane, used in round-robin so the page order is preserved.
+	 */
+	struct obp_ring *in, *out;
+	unsigned int n_in, n_out;
+	unsigned int i_in, i_out; /**< next ring to use */
+	pthread_t thread;
+	int cpu; /**< pinned to this cpu, -1 anywhere */
+	int done; /**< the thread terminated */
+	struct obp_stats st;
+
+	/* Parallel stage: 'width' threads (lanes), each with its own rings */
+	unsigned int width;
+	unsigned int lane; /**< index of this lane in its stage */
+	struct obp_stage *lanes;
+	struct obp_ring *lane_ring; /**< width inputs, then width outputs */
+};
+
+/**
+ * Page source of the pipeline reader
+ * @return 1 when the page is valid, 0 on timeout, OBP_END when there are no
+ *         more pages, -1 on error
+ */
+#define OBP_END 2
+typedef int (*obp_read_t)(struct obp_pipeline *pipe, struct obp_page *page);
+
+struct obp_pipeline {
+	unsigned int n_pages;
+	unsigned int depth;
+	uint32_t page_max;
+	struct obp_page *pages;
+	struct obp_page drop; /**< target of pages dropped by the reader */
+	uint8_t *pool; /**< data of all the pages, one mapping */
+	size_t pool_len;
+	const struct obrt *rt; /**< hardened mode, NULL when not used */
+	struct obrt_lat lat; /**< wakeup latency seen by the reader */
+
+	obp_read_t read;
+	void *src; /**< source private data */
+
+	/* reader is stage 0, it gets free pages back from the last stage */
+	struct obp_stage stage[OBP_MAX_STAGES + 1];
+	unsigned int n_stages;
+	struct obp_ring ring[OBP_MAX_STAGES + 1];
+
+	int lossless; /**< wait for a free page instead of dropping one */
+	volatile int stop;
+	int error;
+	struct obsbox_seq seq; /**< sequence number holes seen by the reader */
+};
+
+/**
+ * Source reading from the ZIO char devices, or from a replay of them
+ */
+struct obp_src_dev {
+	struct obdev *d; /**< the device, NULL for a replay */
+	uint32_t devid;
+	int fdd, fdc; /**< the device char devices or the replay pipes */
+	int timeout_ms;
+};
+
+extern int obp_init(struct obp_pipeline *pipe, unsigned int n_pages,
+		    unsigned int depth, uint32_t page_max,
+		    obp_read_t read, void *src, const struct obrt *rt);
+extern int obp_stage_add(struct obp_pipeline *pipe, const char *name,
+			 obp_process_t process, void *priv);
+extern int obp_stage_add_parallel(struct obp_pipeline *pipe, const char *name,
+				  obp_process_t process, void *priv,
+				  unsigned int width);
+extern int obp_start(struct obp_pipeline *pipe);
+extern void obp_stop(struct obp_pipeline *pipe);
+extern int obp_wait(struct obp_pipeline *pipe);
+extern void obp_exit(struct obp_pipeline *pipe);
+extern void obp_report(struct obp_pipeline *pipe, FILE *f);
+extern int obp_src_dev_read(struct obp_pipeline *pipe, struct obp_page *page);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+
+#include "obsbox-common.h"
+#include "obsbox-player.h"
+
+/**
+ * Open a capture to replay, by default all the pages once at the
+ * recorded cadence
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obrp_open(struct obrp *rp, const char *path)
+{
+	struct obcap_page_hdr *ph;
+	int enc = 0;
+	uint64_t i;
+
+	memset(rp, 0, sizeof(*rp));
+	rp->fdc = rp->fdd = -1;
+	if (obcap_open(&rp->r, path))
+		return -1;
+	if (!rp->r.count) {
+		obcap_release(&rp->r);
+		errno = ENODATA;
+		return -1;
+	}
+	for (i = 0; i < rp->r.count; ++i) {
+		ph = obcap_page(&rp->r, i, NULL);
+		if (ph->size > rp->page_max)
+			rp->page_max = ph->size;
+		enc |= !!ph->enc;
+	}
+	if (enc) {
+		rp->buf = malloc(rp->page_max);
+		rp->tmp = malloc(rp->page_max);
+		if (!rp->buf || !rp->tmp) {
+			obrp_close(rp);
+			return -1;
+		}
+	}
+	rp->last = rp->r.count;
+	rp->loops = 1;
+	rp->speed = 1.0;
+	rp->rate = 100;
+
+	return 0;
+}
+
+void obrp_close(struct obrp *rp)
+{
+	free(rp->buf);
+	free(rp->tmp);
+	obcap_release(&rp->r);
+}
+
+/**
+ * "recorded", "x<speed>" (recorded cadence scaled), "<pages/s>" or "max"
+ * @return 0 on success, -1 on invalid string
+ */
+int obrp_pace_parse(struct obrp *rp, const char *str)
+{
+	if (!strcmp(str, "recorded")) {
+		rp->pace = OBRP_RECORDED;
+		rp->speed = 1.0;
+	} else if (!strcmp(str, "max")) {
+		rp->pace = OBRP_MAX;
+	} else if (str[0] == 'x') {
+		if (sscanf(str + 1, "%lf", &rp->speed) != 1 || rp->speed <= 0)
+			return -1;
+		rp->pace = OBRP_RECORDED;
+	} else {
+		if (sscanf(str, "%u", &rp->rate) != 1 || !rp->rate)
+			return -1;
+		rp->pace = OBRP_RATE;
+	}
+	return 0;
+}
+
+
+static int obrp_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Move the stored bytes from the capture file to a pipe
+ * @return 0 on success, -1 on error, errno EINVAL when 'fd' is not a pipe
+ */
+static int obrp_splice_all(int fd_in, loff_t off, int fd, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = splice(fd_in, &off, fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Send a page: its control, then its samples
+ */
+static int obrp_page_send(struct obrp *rp, uint64_t n, uint32_t loop)
+{
+	struct obcap_page_hdr *ph;
+	struct zio_control zctrl;
+	uint64_t off;
+	uint8_t *data;
+	int fd;
+
+	ph = obcap_page(&rp->r, n, &data);
+	if (!ph) {
+		errno = EINVAL;
+		return -1;
+	}
+	obcap_page_ctrl(ph, &zctrl);
+	/* the sequence number goes on from a loop to the next */
+	zctrl.seq_num += loop * (rp->last - rp->first);
+	if (obrp_write_all(rp->fdc, &zctrl, sizeof(zctrl)))
+		return -1;
+
+	if (ph->enc) {
+		if (obcap_page_decode(ph, data, rp->buf, rp->tmp))
+			return -1;
+		return obrp_write_all(rp->fdd, rp->buf, ph->size);
+	}
+	if (!rp->nosplice) {
+		fd = obcap_page_fd(&rp->r, n, &off);
+		if (fd < 0)
+			return -1;
+		if (!obrp_splice_all(fd, off, rp->fdd, ph->size))
+			return 0;
+		if (errno != EINVAL)
+			return -1;
+		rp->nosplice = 1;
+	}
+	return obrp_write_all(rp->fdd, data, ph->size);
+}
+
+/**
+ * @return the time between two pages in ns, at the replay speed
+ */
+static uint64_t obrp_gap(struct obrp *rp, uint64_t prev, uint64_t n)
+{
+	struct obcap_index_ent *e = rp->r.ent;
+	uint64_t dt = 0;
+
+	switch (rp->pace) {
+	case OBRP_RECORDED:
+		if (n > prev && e[n].time > e[prev].time)
+			dt = e[n].time - e[prev].time;
+		else if (n <= prev && rp->last - rp->first > 1 &&
+			 e[rp->last - 1].time > e[rp->first].time)
+			/* back to the first page: the average gap */
+			dt = (e[rp->last - 1].time - e[rp->first].time) /
+			     (rp->last - rp->first - 1);
+		return dt / rp->speed;
+	case OBRP_RATE:
+		return 1000000000ULL / rp->rate;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Play the pages on 'fdc' and 'fdd' until the end or obrp->stop
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obrp_run(struct obrp *rp)
+{
+	uint64_t n, prev, t_sched, now;
+	struct timespec ts;
+	uint32_t loop;
+	int err = 0;
+
+	rp->t_start = t_sched = obsbox_now_ns();
+	prev = rp->first;
+	for (loop = 0; !rp->loops || loop < rp->loops; ++loop) {
+		for (n = rp->first; n < rp->last && !rp->stop; ++n) {
+			if (rp->pace != OBRP_MAX) {
+				if (rp->pages)
+					t_sched += obrp_gap(rp, prev, n);
+				ts.tv_sec = t_sched / 1000000000ULL;
+				ts.tv_nsec = t_sched % 1000000000ULL;
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&ts, NULL);
+				now = obsbox_now_ns();
+				/* the consumer did not keep the pace */
+				if (now > t_sched + 1000000) {
+					rp->late_n++;
+					rp->late_sum += now - t_sched;
+					if (now - t_sched > rp->late_max)
+						rp->late_max = now - t_sched;
+				}
+			}
+			prev = n;
+			if (obrp_page_send(rp, n, loop)) {
+				err = -1;
+				break;
+			}
+			rp->pages++;
+			rp->bytes += obcap_page(&rp->r, n, NULL)->size;
+		}
+		if (err || rp->stop)
+			break;
+	}
+	rp->t_end = obsbox_now_ns();
+	/* a write fails also when the consumer stops on purpose */
+	if (err && !rp->stop)
+		rp->error = errno;
+
+	return err;
+}
+
+
+static void *obrp_thread(void *arg)
+{
+	struct obrp *rp = arg;
+
+	obrp_run(rp);
+	if (rp->own_fds) {
+		/* the consumer gets the end of file */
+		close(rp->fdc);
+		close(rp->fdd);
+	}
+	rp->done = 1;
+	return NULL;
+}
+
+/**
+ * Play in a thread
+ * @return 0 on success, -1 on error
+ */
+int obrp_start(struct obrp *rp, int fdc, int fdd)
+{
+	/* a consumer that goes away must not kill the process */
+	signal(SIGPIPE, SIG_IGN);
+	rp->fdc = fdc;
+	rp->fdd = fdd;
+	return pthread_create(&rp->tid, NULL, obrp_thread, rp) ? -1 : 0;
+}
+
+/**
+ * Play in a thread on new pipes, the consumer gets the read ends as they
+ * were the ZIO char devices
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obrp_pipes(struct obrp *rp, int *fdd, int *fdc)
+{
+	int pc[2], pd[2];
+
+	if (pipe2(pc, O_CLOEXEC))
+		return -1;
+	if (pipe2(pd, O_CLOEXEC)) {
+		close(pc[0]);
+		close(pc[1]);
+		return -1;
+	}
+	/* a whole page in the pipe, when allowed (fs.pipe-max-size) */
+	fcntl(pd[1], F_SETPIPE_SZ, rp->page_max);
+	rp->own_fds = 1;
+	if (obrp_start(rp, pc[1], pd[1])) {
+		close(pc[0]);
+		close(pc[1]);
+		close(pd[0]);
+		close(pd[1]);
+		return -1;
+	}
+	*fdc = pc[0];
+	*fdd = pd[0];
+	return 0;
+}
+
+/**
+ * Stop the replay and wait for the thread. A thread blocked on a full
+ * pipe ends when the consumer closes the read ends.
+ * @return 0 on success, the errno of the replay on error
+ */
+int obrp_wait(struct obrp *rp)
+{
+	rp->stop = 1;
+	pthread_join(rp->tid, NULL);
+	return rp->error;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_PLAYER_H__
+#define __OBSBOX_PLAYER_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "obsbox-capture.h"
+
+/*
+ * Capture replay. The pages of a capture file are played with the same
+ * protocol as the ZIO char devices: a struct zio_control on the control
+ * descriptor, then the page on the data descriptor. Consumers use
+ * obsbox_ctrl_wait(), obsbox_ctrl_read() and read(2) as with the device,
+ * and the end of the replay is an end of file on the control descriptor.
+ *
+ * The two descriptors can be the same one (a single stream of control and
+ * data) and they are usually pipes: the data is spliced from the file when
+ * the page is not compressed, so it is never copied in user-space.
+ */
+enum obrp_pace {
+	OBRP_RECORDED = 0, /**< the recorded cadence, scaled by 'speed' */
+	OBRP_RATE, /**< 'rate' pages per second */
+	OBRP_MAX, /**< as fast as the consumer reads */
+};
+
+struct obrp {
+	struct obcap_reader r;
+	uint64_t first, last; /**< pages to play, [first, last) */
+	unsigned int loops; /**< 0 forever */
+	enum obrp_pace pace;
+	double speed;
+	uint32_t rate;
+	uint32_t page_max; /**< largest page in the capture */
+	int fdc, fdd; /**< where the pages go */
+	int own_fds; /**< write ends created by obrp_pipes() */
+	uint8_t *buf, *tmp; /**< decoding of compressed pages */
+	int nosplice;
+	pthread_t tid;
+	volatile int stop;
+	volatile int done;
+	int error;
+	/* statistics */
+	uint64_t pages, bytes;
+	uint64_t t_start, t_end;
+	uint64_t late_n, late_sum, late_max; /**< pages behind the schedule, ns */
+};
+
+extern int obrp_open(struct obrp *rp, const char *path);
+extern void obrp_close(struct obrp *rp);
+extern int obrp_pace_parse(struct obrp *rp, const char *str);
+extern int obrp_run(struct obrp *rp);
+extern int obrp_start(struct obrp *rp, int fdc, int fdd);
+extern int obrp_pipes(struct obrp *rp, int *fdd, int *fdc);
+extern int obrp_wait(struct obrp *rp);
+
+#endif
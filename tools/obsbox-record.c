@@ -0,0 +1,1229 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-uring.h"
+#include "obsbox-capture.h"
+#include "obsbox-rt.h"
+#include "obsbox-ring.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBR_ALIGN 4096 /* O_DIRECT alignment for offset, length and memory */
+#define OBR_CHUNK_DEF (8 * 1024 * 1024)
+#define OBR_NBUF_DEF 8
+#define OBR_LAT_BUCKETS 32
+
+/**
+ * A chunk collects consecutive pages and it is written with a single
+ * O_DIRECT request. The memory is allocated once at start-up.
+ */
+struct obr_chunk {
+	uint8_t *buf;
+	size_t fill; /**< valid bytes in buf */
+	uint64_t t_submit;
+	int busy; /**< the kernel owns the buffer */
+	unsigned int seg; /**< segment of the write, segmented mode */
+};
+
+/*
+ * Segmented mode: a segment is written by chunks while OPEN. When it is
+ * FULL its index and header are written as soon as its chunk writes
+ * complete (SEAL), then it is synced (SYNC) and it becomes IDLE, ready to
+ * be reused. Everything goes through io_uring, the reader never waits for
+ * the disk unless it wraps around to a segment which is not IDLE yet.
+ */
+enum obr_seg_state {
+	OBR_SEG_IDLE = 0,
+	OBR_SEG_OPEN,
+	OBR_SEG_FULL,
+	OBR_SEG_SEAL,
+	OBR_SEG_SYNC,
+};
+
+struct obr_seg {
+	int fd;
+	enum obr_seg_state state;
+	unsigned int inflight; /**< chunk writes, then index and header */
+	uint64_t end; /**< end of the data, where the index goes */
+	struct obcap_file_hdr fh;
+	struct obcap_index idx;
+	uint8_t *ibuf, *hbuf; /**< index and header blocks */
+	size_t ilen;
+};
+
+/* io_uring user_data of the segment requests, the others are chunks */
+#define OBR_UD_SEG (1ULL << 63)
+#define OBR_UD(op, seg) (OBR_UD_SEG | (uint64_t)(op) << 32 | (seg))
+#define OBR_UD_OP(ud) (((ud) >> 32) & 0xFF)
+#define OBR_UD_NSEG(ud) ((uint32_t)(ud))
+
+enum obr_seg_op {
+	OBR_OP_INDEX,
+	OBR_OP_HDR,
+	OBR_OP_SYNC,
+	OBR_OP_RING, /**< fsync of ring.idx */
+};
+
+struct obr_stats {
+	uint64_t pages;
+	uint64_t bytes; /**< bytes acquired */
+	uint64_t written; /**< bytes completed on disk */
+	uint64_t alarms;
+	uint64_t wait_buf; /**< times the reader waited for a free chunk */
+	uint64_t wait_seg; /**< times it waited for a segment to be synced */
+	uint64_t segs; /**< segments closed */
+	uint64_t lat_min, lat_max, lat_sum, lat_n;
+	uint64_t lat_hist[OBR_LAT_BUCKETS]; /**< log2(us) buckets */
+	struct obsbox_seq seq;
+};
+
+/**
+ * An output file with its own chunks and its own I/O queue. With striping
+ * every stripe is an output: pages skip a stripe whose disk is behind.
+ */
+struct obr_out {
+	int fd;
+	struct obu_ring ring;
+	struct obr_chunk *chunks;
+	unsigned int cur; /**< chunk being filled */
+	unsigned int inflight;
+	uint64_t off; /**< file offset of the beginning of the current chunk */
+	struct obcap_file_hdr fh;
+	struct obcap_index idx;
+	uint64_t pages;
+	uint64_t wait_buf; /**< pages that found all its chunks in flight */
+};
+
+enum obr_stripe_policy {
+	OBR_STRIPE_RR = 0, /**< round-robin */
+	OBR_STRIPE_LOAD, /**< the stripe with fewer writes in flight */
+};
+
+static volatile sig_atomic_t obr_stop;
+static struct obr_out *outs; /**< stripes, segmented mode uses the first */
+static unsigned int n_out = 1, nchunks;
+static size_t chunk_size = OBR_CHUNK_DEF;
+static struct obr_stats st;
+static int zerocopy, pipefd[2];
+static int raw; /**< raw byte stream instead of the capture container */
+static struct obrt rt, *prt; /**< hardened mode, NULL when not used */
+static struct obrt_lat wakeup;
+static uint8_t *smap; /**< striping: the stripe of each page */
+static uint64_t smap_n, smap_size;
+static struct obring rg; /**< segmented mode */
+static struct obr_seg *segs;
+static unsigned int cur_seg, seg_ops; /**< segment requests in flight */
+static uint64_t seg_gen;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-record -d 0x<devid> -o <file> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -o <file>: output capture file (O_DIRECT)\n");
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -n <number>: number of blocks to record (default: until SIGINT)\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -c <number>: write chunk size in MiB (default %d)\n",
+		OBR_CHUNK_DEF / (1024 * 1024));
+	fprintf(stderr, " -b <number>: number of chunks, that is writes in flight (default %d)\n",
+		OBR_NBUF_DEF);
+	fprintf(stderr, " -P <number>: preallocate <number>MiB for the output file\n");
+	fprintf(stderr, " -Z: splice(2) pages to the file, data does not pass through user-space\n");
+	fprintf(stderr, " -r: write a raw byte stream instead of the capture container\n");
+	fprintf(stderr, " -X <spec>: hardened mode, e.g. cpu=2,prio=80,lock,huge,busy (see README)\n");
+	fprintf(stderr, " -R <number>:<MiB>: segmented mode, -o is a directory of <number> segments of <MiB>\n");
+	fprintf(stderr, " -S <dir>[,<dir>...]: stripe the pages over files in these directories, -o is the set file\n");
+	fprintf(stderr, " -L: stripe by load, to the stripe with fewer writes in flight (default round-robin)\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Pages are acquired in streaming mode and stored in an indexed capture\n"
+			"file, use obsbox-cat to read it. With -R the segments are reused\n"
+			"round-robin and the directory keeps the most recent data\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obr_sighandler(int sig)
+{
+	obr_stop = 1;
+}
+
+
+static void obr_lat_account(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int b = 0;
+
+	if (!st.lat_n || ns < st.lat_min)
+		st.lat_min = ns;
+	if (ns > st.lat_max)
+		st.lat_max = ns;
+	st.lat_sum += ns;
+	st.lat_n++;
+	while (us && b < OBR_LAT_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	st.lat_hist[b]++;
+}
+
+/**
+ * @return the upper bound in us of the bucket holding the given percentile
+ */
+static uint64_t obr_lat_percentile(unsigned int pct)
+{
+	uint64_t target, acc = 0;
+	int b;
+
+	target = (st.lat_n * pct + 99) / 100;
+	for (b = 0; b < OBR_LAT_BUCKETS; ++b) {
+		acc += st.lat_hist[b];
+		if (acc >= target)
+			return 1ULL << b;
+	}
+	return 1ULL << (OBR_LAT_BUCKETS - 1);
+}
+
+
+/**
+ * Write index and header of a full segment, its chunks are on disk
+ * @return 0 on success, -1 on error
+ */
+static int obr_seg_seal(unsigned int i)
+{
+	struct obr_seg *s = &segs[i];
+	struct obcap_file_hdr *fh = (void *)s->hbuf;
+	struct io_uring_sqe *sqe[2];
+
+	free(s->ibuf);
+	s->ibuf = obcap_index_build(&s->idx, s->end, OBR_ALIGN, &s->ilen);
+	if (!s->ibuf)
+		return -1;
+	memset(s->hbuf, 0, OBR_ALIGN);
+	*fh = s->fh;
+	fh->index_off = s->end;
+	fh->count = s->idx.count;
+
+	sqe[0] = obu_get_sqe(&outs->ring);
+	sqe[1] = sqe[0] ? obu_get_sqe(&outs->ring) : NULL;
+	if (!sqe[1]) {
+		fprintf(stderr, "obsbox-record: submission queue full\n");
+		return -1;
+	}
+	obu_prep_write(sqe[0], s->fd, s->ibuf, s->ilen, s->end,
+		       OBR_UD(OBR_OP_INDEX, i));
+	obu_prep_write(sqe[1], s->fd, s->hbuf, OBR_ALIGN, 0,
+		       OBR_UD(OBR_OP_HDR, i));
+	s->state = OBR_SEG_SEAL;
+	s->inflight = 2;
+	seg_ops += 2;
+
+	return obu_submit(&outs->ring, 0) < 0 ? -1 : 0;
+}
+
+static int obr_seg_fsync(int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = obu_get_sqe(&outs->ring);
+
+	if (!sqe) {
+		fprintf(stderr, "obsbox-record: submission queue full\n");
+		return -1;
+	}
+	obu_prep_fsync(sqe, fd, user_data);
+	seg_ops++;
+
+	return obu_submit(&outs->ring, 0) < 0 ? -1 : 0;
+}
+
+/**
+ * Move a segment on when its requests complete: SEAL to SYNC to IDLE,
+ * then its entry in ring.idx says it is closed
+ * @return 0 on success, -1 on error
+ */
+static int obr_seg_complete(const struct io_uring_cqe *cqe)
+{
+	unsigned int i = OBR_UD_NSEG(cqe->user_data);
+	unsigned int op = OBR_UD_OP(cqe->user_data);
+	struct obr_seg *s = &segs[i];
+
+	seg_ops--;
+	if (cqe->res < 0 || (op == OBR_OP_INDEX && cqe->res != s->ilen) ||
+	    (op == OBR_OP_HDR && cqe->res != OBR_ALIGN)) {
+		fprintf(stderr, "obsbox-record: segment %u: %s failed: %s\n",
+			i, op >= OBR_OP_SYNC ? "fsync" : "write",
+			cqe->res < 0 ? strerror(-cqe->res) : "short write");
+		return -1;
+	}
+
+	switch (op) {
+	case OBR_OP_INDEX:
+	case OBR_OP_HDR:
+		if (--s->inflight)
+			return 0;
+		s->state = OBR_SEG_SYNC;
+		return obr_seg_fsync(s->fd, OBR_UD(OBR_OP_SYNC, i));
+	case OBR_OP_SYNC:
+		s->state = OBR_SEG_IDLE;
+		st.segs++;
+		rg.seg[i].state = OBRING_CLOSED;
+		if (obring_update(&rg, i)) {
+			fprintf(stderr, "obsbox-record: cannot update %s: %s\n",
+				OBRING_INDEX, strerror(errno));
+			return -1;
+		}
+		return obr_seg_fsync(rg.fd, OBR_UD(OBR_OP_RING, 0));
+	}
+	return 0;
+}
+
+/**
+ * Collect the completed writes of an output
+ * @return 0 on success, -1 on write error
+ */
+static int obr_reap(struct obr_out *o, unsigned int wait_nr)
+{
+	struct io_uring_cqe cqe;
+	struct obr_chunk *c;
+	struct obr_seg *s;
+
+	if (wait_nr && obu_submit(&o->ring, wait_nr) < 0) {
+		fprintf(stderr, "obsbox-record: io_uring_enter(): %s\n",
+			strerror(errno));
+		return -1;
+	}
+	while (obu_peek_cqe(&o->ring, &cqe)) {
+		if (cqe.user_data & OBR_UD_SEG) {
+			if (obr_seg_complete(&cqe))
+				return -1;
+			continue;
+		}
+		c = &o->chunks[cqe.user_data];
+		if (cqe.res < 0 || cqe.res != c->fill) {
+			fprintf(stderr, "obsbox-record: write failed: %s\n",
+				cqe.res < 0 ? strerror(-cqe.res) : "short write");
+			return -1;
+		}
+		obr_lat_account(obsbox_now_ns() - c->t_submit);
+		st.written += cqe.res;
+		c->busy = 0;
+		c->fill = 0;
+		o->inflight--;
+		if (!segs)
+			continue;
+		s = &segs[c->seg];
+		if (!--s->inflight && s->state == OBR_SEG_FULL &&
+		    obr_seg_seal(c->seg))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Submit the aligned part of the current chunk and move the tail to the
+ * next one, which must be free. The caller makes it the current one.
+ * @last: pad the chunk instead, there is no next one
+ * @return 0 on success, -1 on error
+ */
+static int obr_flush(struct obr_out *o, unsigned int next, int last)
+{
+	struct obr_chunk *c = &o->chunks[o->cur], *n = &o->chunks[next];
+	struct io_uring_sqe *sqe;
+	size_t wlen, tail;
+
+	if (last) {
+		/* pad the last write, the file is truncated at the end */
+		wlen = (c->fill + OBR_ALIGN - 1) & ~(OBR_ALIGN - 1);
+		memset(c->buf + c->fill, 0, wlen - c->fill);
+		tail = 0;
+	} else {
+		wlen = c->fill & ~(OBR_ALIGN - 1);
+		tail = c->fill - wlen;
+		memcpy(n->buf, c->buf + wlen, tail);
+		n->fill = tail;
+	}
+	c->fill = wlen;
+	if (!wlen)
+		return 0;
+
+	sqe = obu_get_sqe(&o->ring);
+	if (!sqe) {
+		fprintf(stderr, "obsbox-record: submission queue full\n");
+		return -1;
+	}
+	obu_prep_write(sqe, o->fd, c->buf, wlen, o->off, o->cur);
+	c->busy = 1;
+	c->t_submit = obsbox_now_ns();
+	c->seg = cur_seg;
+	o->off += wlen;
+	o->inflight++;
+	if (segs)
+		segs[cur_seg].inflight++;
+
+	return obu_submit(&o->ring, 0) < 0 ? -1 : 0;
+}
+
+
+static void obr_report(uint64_t t_start, uint64_t *t_last, uint64_t *b_last,
+		       uint64_t *p_last, int final)
+{
+	uint64_t now = obsbox_now_ns();
+	unsigned int i, inflight = 0;
+	double dt;
+
+	if (!final && now - *t_last < 1000000000ULL)
+		return;
+
+	for (i = 0; i < n_out; ++i)
+		inflight += outs[i].inflight;
+	dt = final ? (now - t_start) / 1e9 : (now - *t_last) / 1e9;
+	fprintf(stderr,
+		"%s%.1f MB/s %.1f pages/s | pages %llu lost %llu alarms %llu | in flight %u waits %llu | write lat us min %llu avg %llu p50 <%llu p99 <%llu max %llu\n",
+		final ? "TOTAL: " : "",
+		(final ? st.written : st.written - *b_last) / dt / 1e6,
+		(final ? st.pages : st.pages - *p_last) / dt,
+		(unsigned long long)st.pages,
+		(unsigned long long)st.seq.lost,
+		(unsigned long long)st.alarms, inflight,
+		(unsigned long long)st.wait_buf,
+		(unsigned long long)st.lat_min / 1000,
+		(unsigned long long)(st.lat_n ? st.lat_sum / st.lat_n / 1000 : 0),
+		(unsigned long long)obr_lat_percentile(50),
+		(unsigned long long)obr_lat_percentile(99),
+		(unsigned long long)st.lat_max / 1000);
+	*t_last = now;
+	*b_last = st.written;
+	*p_last = st.pages;
+}
+
+
+/**
+ * @return the room a page of the given size takes in a chunk
+ */
+static size_t obr_page_room(uint32_t len)
+{
+	return raw ? len : OBR_ALIGN + obcap_round(len, OBR_ALIGN);
+}
+
+
+/**
+ * @return non zero when one more page fits the current segment, with the
+ *         room for the index
+ * @end: where the page would go
+ */
+static int obr_seg_fits(uint64_t end, uint32_t len)
+{
+	uint64_t ilen;
+
+	ilen = obcap_round((outs->idx.count + 1) *
+			   sizeof(struct obcap_index_ent) +
+			   sizeof(struct obcap_index_footer), OBR_ALIGN);
+	return end + obr_page_room(len) + ilen <= rg.hdr.seg_size;
+}
+
+/**
+ * Start the current segment: its header goes first in the current chunk
+ */
+static void obr_seg_open(uint32_t devid)
+{
+	struct obr_seg *s = &segs[cur_seg];
+	struct obr_chunk *c = &outs->chunks[outs->cur];
+
+	outs->fd = s->fd;
+	outs->off = 0;
+	s->state = OBR_SEG_OPEN;
+	obcap_file_hdr_init(&s->fh, OBR_ALIGN, devid);
+	memset(c->buf, 0, OBR_ALIGN);
+	memcpy(c->buf, &s->fh, sizeof(s->fh));
+	c->fill = OBR_ALIGN;
+}
+
+/**
+ * The first page of the current segment is in memory, nothing of this
+ * generation is on disk yet: from now on readers ignore the older pages
+ * @return 0 on success, -1 on error
+ */
+static int obr_seg_first(void)
+{
+	struct obring_seg *e = &rg.seg[cur_seg];
+
+	memset(e, 0, sizeof(*e));
+	e->gen = ++seg_gen;
+	e->state = OBRING_OPEN;
+	e->t_first = outs->idx.ent[0].time;
+	e->seq_first = outs->idx.ent[0].seq_num;
+	if (obring_update(&rg, cur_seg)) {
+		fprintf(stderr, "obsbox-record: cannot update %s: %s\n",
+			OBRING_INDEX, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * No more pages in the current segment, it is sealed when its writes
+ * complete. Its index is kept by the segment, the current one restarts
+ * from the buffer of the previous generation.
+ * @return 0 on success, -1 on error
+ */
+static int obr_seg_full(void)
+{
+	struct obr_seg *s = &segs[cur_seg];
+	struct obring_seg *e = &rg.seg[cur_seg];
+	struct obcap_index t;
+
+	t = s->idx;
+	s->idx = outs->idx;
+	outs->idx = t;
+	outs->idx.count = 0;
+
+	/* after the last write, padded */
+	s->end = outs->off;
+	s->state = OBR_SEG_FULL;
+	e->count = s->idx.count;
+	e->t_last = s->idx.ent[s->idx.count - 1].time;
+	e->seq_last = s->idx.ent[s->idx.count - 1].seq_num;
+	if (!s->inflight)
+		return obr_seg_seal(cur_seg);
+	return 0;
+}
+
+/**
+ * Close the current segment and continue on the next one
+ * @return 0 on success, -1 on error
+ */
+static int obr_seg_switch(uint32_t devid)
+{
+	struct obr_out *o = outs;
+	unsigned int next = (o->cur + 1) % nchunks;
+
+	if (obr_flush(o, o->cur, 1) || obr_seg_full())
+		return -1;
+	while (o->chunks[next].busy) {
+		o->wait_buf++;
+		st.wait_buf++;
+		if (obr_reap(o, 1))
+			return -1;
+	}
+	o->cur = next;
+
+	cur_seg = (cur_seg + 1) % rg.hdr.n;
+	while (segs[cur_seg].state != OBR_SEG_IDLE) {
+		/* wrapped around faster than the disk syncs */
+		st.wait_seg++;
+		if (obr_reap(o, 1))
+			return -1;
+	}
+	obr_seg_open(devid);
+	return 0;
+}
+
+/**
+ * Allocate the chunks of an output and its io_uring
+ * @extra: submission entries on top of the chunk writes
+ * @return 0 on success, -1 on error
+ */
+static int obr_out_init(struct obr_out *o, unsigned int extra)
+{
+	unsigned int i;
+
+	o->fd = -1;
+	o->chunks = calloc(nchunks, sizeof(*o->chunks));
+	if (!o->chunks)
+		return -1;
+	for (i = 0; i < nchunks; ++i) {
+		/* Pre-faulted now, not while streaming */
+		o->chunks[i].buf = obrt_alloc(prt, chunk_size + OBR_ALIGN);
+		if (!o->chunks[i].buf)
+			return -1;
+	}
+	return obu_init(&o->ring, nchunks + extra);
+}
+
+/**
+ * @return non zero when a page of the given size can go to an output
+ *         without waiting for its disk
+ */
+static int obr_out_ready(const struct obr_out *o, uint32_t len)
+{
+	return o->chunks[o->cur].fill + obr_page_room(len) <= chunk_size ||
+	       !o->chunks[(o->cur + 1) % nchunks].busy;
+}
+
+/**
+ * Wait for the completions of any output
+ * @return 0 on success, -1 on write error
+ */
+static int obr_reap_any(void)
+{
+	struct pollfd p[OBCAP_STRIPES_MAX];
+	unsigned int i;
+	int n;
+
+	for (i = 0; i < n_out; ++i) {
+		p[i].fd = outs[i].ring.fd;
+		p[i].events = POLLIN;
+	}
+	n = poll(p, n_out, 1000);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (i = 0; i < n_out; ++i)
+		if (p[i].revents && obr_reap(&outs[i], 0))
+			return -1;
+	return 0;
+}
+
+/**
+ * Choose the output of the next page. A stripe with all its chunks in
+ * flight is skipped, so a slow disk gets fewer pages and does not stall
+ * the others; the reader waits only when all the stripes are busy.
+ * @rr: the stripe after the last used one
+ * @return the output, NULL on write error
+ */
+static struct obr_out *obr_stripe_pick(enum obr_stripe_policy policy,
+				       unsigned int rr, uint32_t len)
+{
+	struct obr_out *o, *best;
+	unsigned int i, first = 1;
+
+	for (;; first = 0) {
+		best = NULL;
+		for (i = 0; i < n_out; ++i) {
+			o = &outs[(rr + i) % n_out];
+			if (!obr_out_ready(o, len)) {
+				if (first)
+					o->wait_buf++;
+				continue;
+			}
+			if (policy == OBR_STRIPE_RR)
+				return o;
+			/* fewer writes in flight, round-robin order on ties */
+			if (!best || o->inflight < best->inflight)
+				best = o;
+		}
+		if (best)
+			return best;
+		st.wait_buf++;
+		if (obr_reap_any())
+			return NULL;
+	}
+}
+
+/**
+ * Flush when the next page may not fit the current chunk of an output.
+ * When all its chunks are in flight it waits for its disk;
+ * obr_stripe_pick() does not choose such an output.
+ * @return 0 on success, -1 on error
+ */
+static int obr_chunk_room(struct obr_out *o, uint32_t len)
+{
+	unsigned int next;
+
+	if (o->chunks[o->cur].fill + obr_page_room(len) <= chunk_size)
+		return 0;
+	next = (o->cur + 1) % nchunks;
+	while (o->chunks[next].busy) {
+		o->wait_buf++;
+		st.wait_buf++;
+		if (obr_reap(o, 1))
+			return -1;
+	}
+	if (obr_flush(o, next, 0))
+		return -1;
+	o->cur = next;
+	return 0;
+}
+
+/**
+ * Record the stripe of a page, in stream order
+ * @return 0 on success, -1 on error
+ */
+static int obr_map_add(unsigned int stripe)
+{
+	uint8_t *m;
+
+	if (smap_n == smap_size) {
+		smap_size = smap_size ? smap_size * 2 : 65536;
+		m = realloc(smap, smap_size);
+		if (!m)
+			return -1;
+		smap = m;
+	}
+	smap[smap_n++] = stripe;
+	return 0;
+}
+
+/**
+ * Build the stripe paths: <dir>/<name of the set file>.<stripe>
+ * @return the number of stripes, 0 on error
+ */
+static unsigned int obr_stripe_paths(const char *dirs, const char *out,
+				     char paths[][OBCAP_PATH_MAX])
+{
+	char list[OBCAP_STRIPES_MAX * OBCAP_PATH_MAX], *dir, *save;
+	char abs[PATH_MAX];
+	const char *base = strrchr(out, '/');
+	unsigned int n = 0;
+	int len;
+
+	base = base ? base + 1 : out;
+	snprintf(list, sizeof(list), "%s", dirs);
+	for (dir = strtok_r(list, ",", &save); dir;
+	     dir = strtok_r(NULL, ",", &save)) {
+		/* absolute, the set file can be read from anywhere */
+		if (n == OBCAP_STRIPES_MAX || !realpath(dir, abs))
+			return 0;
+		len = snprintf(paths[n], OBCAP_PATH_MAX, "%s/%s.%u", abs, base,
+			       n);
+		if (len >= OBCAP_PATH_MAX)
+			return 0;
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Wait for the next page. The completions of the writes arriving in the
+ * meantime are reaped as they come, so their latency does not include the
+ * wait for the page.
+ * @return as poll(2) on the control char device, -1 also on write error
+ */
+static int obr_wait_page(struct obdev *d, int timeout_ms)
+{
+	struct pollfd p[1 + OBCAP_STRIPES_MAX];
+	uint64_t t_end = obsbox_now_ns() + timeout_ms * 1000000ULL, now;
+	unsigned int i;
+	int n;
+
+	if (prt && prt->busy) {
+		do {
+			for (i = 0; i < n_out; ++i)
+				if (obr_reap(&outs[i], 0))
+					goto err_write;
+			n = obrt_wait(prt, d->fdc, 0);
+		} while (!n && obsbox_now_ns() < t_end);
+		return n;
+	}
+
+	p[0].fd = d->fdc;
+	p[0].events = POLLIN;
+	for (i = 0; i < n_out; ++i) {
+		/* readable when completions are waiting */
+		p[1 + i].fd = outs[i].ring.fd;
+		p[1 + i].events = POLLIN;
+	}
+	for (now = obsbox_now_ns(); now < t_end; now = obsbox_now_ns()) {
+		n = poll(p, 1 + n_out, (t_end - now + 999999) / 1000000);
+		if (n <= 0)
+			return n;
+		for (i = 0; i < n_out; ++i)
+			if (p[1 + i].revents && obr_reap(&outs[i], 0))
+				goto err_write;
+		if (p[0].revents)
+			return 1;
+	}
+	return 0;
+
+err_write:
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * Read one page from the driver and append it to the current chunk of an
+ * output. In container mode the page header goes first, in its own
+ * alignment unit.
+ * @return number of byte read, 0 on timeout, -1 on error
+ */
+static int obr_page_read(struct obdev *d, struct obr_out *o)
+{
+	struct obr_chunk *c = &o->chunks[o->cur];
+	struct zio_control zctrl;
+	uint32_t len, done = 0;
+	uint64_t lost = st.seq.lost;
+	uint8_t *data;
+	int n;
+
+	n = obr_wait_page(d, 1000);
+	if (n <= 0)
+		return n < 0 && errno != EINTR ? -1 : 0;
+	if (obdev_ctrl_read(d, &zctrl))
+		return -1;
+	obrt_lat_page(&wakeup, &zctrl);
+	if (zctrl.zio_alarms & (ZIO_ALARM_LOST_BLOCK | ZIO_ALARM_LOST_TRIGGER))
+		st.alarms++;
+	obsbox_seq_update(&st.seq, zctrl.seq_num);
+
+	len = obsbox_ctrl_len(&zctrl);
+	if (c->fill + obr_page_room(len) > chunk_size) {
+		fprintf(stderr, "obsbox-record: page of %u bytes does not fit the chunk\n",
+			len);
+		return -1;
+	}
+	data = c->buf + c->fill + (raw ? 0 : OBR_ALIGN);
+	while (done < len) {
+		n = read(d->fdd, data + done, len - done);
+		if (n <= 0) {
+			fprintf(stderr, "obsbox-record: cannot read data: %s\n",
+				n < 0 ? strerror(errno) : "EOF");
+			return -1;
+		}
+		done += n;
+	}
+	if (!raw) {
+		memset(c->buf + c->fill, 0, OBR_ALIGN);
+		memset(data + len, 0, obcap_round(len, OBR_ALIGN) - len);
+		obcap_page_hdr_init((void *)(c->buf + c->fill), &zctrl, data, len,
+				    st.seq.lost != lost ? OBCAP_PAGE_LOST : 0, 0);
+		if (obcap_index_add(&o->idx, o->off + c->fill,
+				    (void *)(c->buf + c->fill)))
+			return -1;
+	}
+	c->fill += obr_page_room(len);
+	o->pages++;
+	st.pages++;
+	st.bytes += len;
+
+	return len;
+}
+
+
+/**
+ * Write a buffer at the current file position
+ * @return 0 on success, -1 on error
+ */
+static int obr_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Move one page from the driver to the output file with splice(2). The
+ * write latency is the time spent in moving the page. In container mode the
+ * header and the padding are written around the page; the data never
+ * reaches user-space, so there is no data CRC.
+ * @return number of byte moved, 0 on timeout, -1 on error
+ */
+static int obr_page_splice(struct obdev *d, struct obr_out *o)
+{
+	static uint8_t unit[OBR_ALIGN];
+	struct zio_control zctrl;
+	uint64_t t, lost = st.seq.lost;
+	uint32_t len;
+	int n;
+
+	n = obrt_wait(prt, d->fdc, 1000);
+	if (n <= 0)
+		return n < 0 && errno != EINTR ? -1 : 0;
+	if (obdev_ctrl_read(d, &zctrl))
+		return -1;
+	obrt_lat_page(&wakeup, &zctrl);
+	if (zctrl.zio_alarms & (ZIO_ALARM_LOST_BLOCK | ZIO_ALARM_LOST_TRIGGER))
+		st.alarms++;
+	obsbox_seq_update(&st.seq, zctrl.seq_num);
+
+	len = obsbox_ctrl_len(&zctrl);
+	t = obsbox_now_ns();
+	if (!raw) {
+		memset(unit, 0, sizeof(unit));
+		obcap_page_hdr_init((void *)unit, &zctrl, NULL, len,
+				    st.seq.lost != lost ? OBCAP_PAGE_LOST : 0, 0);
+		if (obcap_index_add(&o->idx, o->off, (void *)unit) ||
+		    obr_write_all(o->fd, unit, OBR_ALIGN))
+			goto err_write;
+	}
+	if (obsbox_splice_page(d->fdd, o->fd, pipefd, len)) {
+		fprintf(stderr, "obsbox-record: splice(): %s%s\n",
+			strerror(errno), errno == EINVAL ?
+			" (not supported by the data char device, do not use -Z)" : "");
+		return -1;
+	}
+	if (!raw) {
+		memset(unit, 0, sizeof(unit));
+		if (obr_write_all(o->fd, unit,
+				  obcap_round(len, OBR_ALIGN) - len))
+			goto err_write;
+		o->off += obr_page_room(len);
+	}
+	obr_lat_account(obsbox_now_ns() - t);
+	st.pages++;
+	st.bytes += len;
+	st.written += len;
+
+	return len;
+
+err_write:
+	fprintf(stderr, "obsbox-record: write(): %s\n", strerror(errno));
+	return -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t devid = 0, page_size = 0, vmalloc_size = 0, prealloc = 0;
+	uint64_t t_start, t_last, b_last = 0, p_last = 0;
+	unsigned long long seg_mib = 0;
+	unsigned int i, n_seg = 0, stripes = 0, rr = 0;
+	enum obr_stripe_policy policy = OBR_STRIPE_RR;
+	char spaths[OBCAP_STRIPES_MAX][OBCAP_PATH_MAX];
+	int c, ret, n = -1, err = 1;
+	struct obr_out *o;
+	struct obdev d;
+	char *out = NULL, *dirs = NULL, path[1200];
+
+	nchunks = OBR_NBUF_DEF;
+	while ((c = getopt (argc, argv, "hd:o:p:n:v:c:b:P:ZrX:R:S:LV")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%d", &n);
+			if (ret != 1)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'c':
+			ret = sscanf(optarg, "%zu", &chunk_size);
+			if (ret != 1)
+				help();
+			chunk_size *= 1024 * 1024;
+			break;
+		case 'b':
+			ret = sscanf(optarg, "%u", &nchunks);
+			if (ret != 1 || nchunks < 2)
+				help();
+			break;
+		case 'P':
+			ret = sscanf(optarg, "%u", &prealloc);
+			if (ret != 1)
+				help();
+			break;
+		case 'Z':
+			zerocopy = 1;
+			break;
+		case 'r':
+			raw = 1;
+			break;
+		case 'X':
+			if (obrt_parse(&rt, optarg))
+				help();
+			prt = &rt;
+			break;
+		case 'R':
+			ret = sscanf(optarg, "%u:%llu", &n_seg, &seg_mib);
+			if (ret != 2 || !n_seg || !seg_mib)
+				help();
+			break;
+		case 'S':
+			dirs = optarg;
+			break;
+		case 'L':
+			policy = OBR_STRIPE_LOAD;
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (!out || !page_size || (n_seg && (raw || zerocopy)) ||
+	    (dirs && (raw || zerocopy || n_seg)))
+		help();
+	if (dirs) {
+		stripes = obr_stripe_paths(dirs, out, spaths);
+		if (!stripes) {
+			fprintf(stderr, "Invalid stripe directories (at most %d): %s\n",
+				OBCAP_STRIPES_MAX, strerror(errno));
+			exit(1);
+		}
+		n_out = stripes;
+	}
+	if (prt && obrt_setup(prt)) {
+		fprintf(stderr, "Cannot lock the memory: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/*
+	 * A chunk must hold at least one page plus the unaligned tail, or
+	 * the file header in container mode
+	 */
+	if (chunk_size < obr_page_room(page_size) + OBR_ALIGN)
+		chunk_size = obcap_round(obr_page_room(page_size) + OBR_ALIGN,
+					 OBR_ALIGN);
+
+	outs = calloc(n_out, sizeof(*outs));
+	if (!outs)
+		exit(1);
+	for (i = 0; i < n_out; ++i) {
+		/* segmented mode: index, header and fsync requests too */
+		if (obr_out_init(&outs[i], n_seg ? 8 : 0)) {
+			fprintf(stderr, "Cannot allocate buffers and io_uring: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+	}
+
+	if (zerocopy && obsbox_splice_init(pipefd, page_size)) {
+		fprintf(stderr, "Cannot create pipe: %s\n", strerror(errno));
+		exit(1);
+	}
+	if (n_seg) {
+		if (OBR_ALIGN + obr_page_room(page_size) +
+		    2 * OBR_ALIGN > seg_mib * 1024 * 1024) {
+			fprintf(stderr, "Segments too small for a page\n");
+			exit(1);
+		}
+		if (obring_create(&rg, out, n_seg, seg_mib * 1024 * 1024, devid,
+				  OBR_ALIGN)) {
+			fprintf(stderr, "Cannot create the segments in %s: %s\n",
+				out, strerror(errno));
+			exit(1);
+		}
+		segs = calloc(n_seg, sizeof(*segs));
+		if (!segs)
+			exit(1);
+		for (i = 0; i < n_seg; ++i) {
+			obring_seg_path(&rg, i, path, sizeof(path));
+			segs[i].fd = open(path, O_WRONLY | O_DIRECT);
+			if (segs[i].fd < 0 ||
+			    posix_memalign((void **)&segs[i].hbuf, OBR_ALIGN,
+					   OBR_ALIGN)) {
+				fprintf(stderr, "Cannot open %s: %s\n", path,
+					strerror(errno));
+				exit(1);
+			}
+			if (rg.seg[i].gen > seg_gen)
+				seg_gen = rg.seg[i].gen;
+		}
+		/* continue after the most recent segment */
+		cur_seg = obring_next(&rg);
+		obr_seg_open(devid);
+		goto open_dev;
+	}
+
+	for (i = 0; i < n_out; ++i) {
+		o = &outs[i];
+		if (stripes)
+			snprintf(path, sizeof(path), "%s", spaths[i]);
+		else
+			snprintf(path, sizeof(path), "%s", out);
+		/* splice(2) goes through the page cache, no O_DIRECT */
+		o->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC |
+			     (zerocopy ? 0 : O_DIRECT), 0644);
+		if (o->fd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", path,
+				strerror(errno));
+			exit(1);
+		}
+		if (prealloc && fallocate(o->fd, 0, 0,
+					  (off_t)prealloc * 1024 * 1024))
+			fprintf(stderr, "Cannot preallocate %uMiB: %s\n",
+				prealloc, strerror(errno));
+		if (raw)
+			continue;
+		/* the final header, with the index position, is written at close */
+		obcap_file_hdr_init(&o->fh, OBR_ALIGN, devid);
+		if (stripes)
+			o->fh.flags |= OBCAP_FILE_STRIPE;
+		memset(o->chunks[0].buf, 0, OBR_ALIGN);
+		memcpy(o->chunks[0].buf, &o->fh, sizeof(o->fh));
+		if (zerocopy) {
+			ret = obr_write_all(o->fd, o->chunks[0].buf, OBR_ALIGN);
+			o->off = OBR_ALIGN;
+		} else {
+			o->chunks[0].fill = OBR_ALIGN;
+			ret = 0;
+		}
+		if (ret) {
+			fprintf(stderr, "Cannot write %s: %s\n", path,
+				strerror(errno));
+			exit(1);
+		}
+	}
+	/* a set without map, until the end: readers merge the stripes by time */
+	if (stripes && obcap_set_write(out, spaths, stripes, NULL, 0)) {
+		fprintf(stderr, "Cannot write %s: %s\n", out, strerror(errno));
+		exit(1);
+	}
+
+open_dev:
+	if (obdev_open(&d, devid)) {
+		fprintf(stderr, "Cannot open ZIO char devices: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	/* Configure the acquisition */
+	ret = obdev_configure(&d, 1, page_size, vmalloc_size);
+	if (ret){
+		fprintf(stderr,
+			"Something wrong during the configuration: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	signal(SIGINT, obr_sighandler);
+	signal(SIGTERM, obr_sighandler);
+
+	ret = obdev_run(&d, 1);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot start acquisition: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	if (prt && obrt_thread(prt, prt->cpu))
+		fprintf(stderr, "Cannot pin or prioritize the reader: %s\n",
+			strerror(errno));
+	t_start = t_last = obsbox_now_ns();
+	while (n && !obr_stop) {
+		if (zerocopy) {
+			ret = obr_page_splice(&d, outs);
+			if (ret < 0)
+				goto out_stop;
+			if (ret > 0 && n > 0)
+				n--;
+			obr_report(t_start, &t_last, &b_last, &p_last, 0);
+			continue;
+		}
+
+		for (i = 0; i < n_out; ++i)
+			if (obr_reap(&outs[i], 0))
+				goto out_stop;
+
+		/* Next segment when the next page may not fit the current one */
+		if (segs && outs->idx.count &&
+		    !obr_seg_fits(outs->off + outs->chunks[outs->cur].fill,
+				  page_size) &&
+		    obr_seg_switch(devid))
+			goto out_stop;
+
+		o = obr_stripe_pick(policy, rr, page_size);
+		if (!o || obr_chunk_room(o, page_size))
+			goto out_stop;
+		ret = obr_page_read(&d, o);
+		if (ret < 0)
+			goto out_stop;
+		if (ret > 0 && stripes) {
+			if (obr_map_add(o - outs))
+				goto out_stop;
+			rr = (o - outs + 1) % n_out;
+		}
+		if (segs && ret > 0 && outs->idx.count == 1 && obr_seg_first())
+			goto out_stop;
+		if (ret > 0 && n > 0)
+			n--;
+		obr_report(t_start, &t_last, &b_last, &p_last, 0);
+	}
+	err = 0;
+
+out_stop:
+	obdev_run(&d, 0);
+	for (i = 0; i < n_out; ++i) {
+		o = &outs[i];
+		/* an empty segment is left as it is, with the previous generation */
+		if (!err && o->chunks[o->cur].fill && (!segs || o->idx.count) &&
+		    obr_flush(o, o->cur, 1))
+			err = 1;
+	}
+	if (!err && segs && outs->idx.count && obr_seg_full())
+		err = 1;
+	for (i = 0; i < n_out; ++i) {
+		o = &outs[i];
+		while ((o->inflight || (!i && seg_ops)) && !obr_reap(o, 1))
+			;
+		if (raw && ftruncate(o->fd, st.bytes))
+			fprintf(stderr, "Cannot truncate %s: %s\n", out,
+				strerror(errno));
+		if (!raw && !segs &&
+		    obcap_index_write(o->fd, &o->idx, o->off, &o->fh))
+			fprintf(stderr, "Cannot write the index of %s: %s\n",
+				stripes ? spaths[i] : out, strerror(errno));
+	}
+	if (stripes && obcap_set_write(out, spaths, stripes, smap, smap_n))
+		fprintf(stderr, "Cannot write %s: %s\n", out, strerror(errno));
+	obr_report(t_start, &t_last, &b_last, &p_last, 1);
+	for (i = 0; stripes && i < n_out; ++i)
+		fprintf(stderr, "stripe %u: %llu pages, %llu busy, %s\n", i,
+			(unsigned long long)outs[i].pages,
+			(unsigned long long)outs[i].wait_buf, spaths[i]);
+	if (segs)
+		fprintf(stderr, "segments: %llu closed, %llu waits for a sync\n",
+			(unsigned long long)st.segs,
+			(unsigned long long)st.wait_seg);
+	if (prt)
+		obrt_lat_report(&wakeup, stderr);
+	if (segs) {
+		for (i = 0; i < n_seg; ++i)
+			close(segs[i].fd);
+		obring_close(&rg);
+	}
+	for (i = 0; i < n_out; ++i) {
+		if (!segs)
+			close(outs[i].fd);
+		obu_exit(&outs[i].ring);
+	}
+	obdev_close(&d);
+	exit(err);
+
+out:
+	obdev_run(&d, 0);
+	obdev_close(&d);
+	exit(1);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+
+#include "obsbox-common.h"
+#include "obsbox-player.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static volatile sig_atomic_t obrpt_stop;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-replay [OPTIONS] <capture-file>\"\n");
+	fprintf(stderr, " -m <recorded|x<speed>|<number>|max>: recorded cadence, scaled cadence,\n"
+			"    pages per second or as fast as the consumer reads (default recorded)\n");
+	fprintf(stderr, " -x <first>[:<last>]: pages to play, by index (default all)\n");
+	fprintf(stderr, " -l <number>: play the pages this many times, 0 forever (default 1)\n");
+	fprintf(stderr, " -o <file>: output (default stdout)\n");
+	fprintf(stderr, " -r: write only the samples, without the ZIO control\n");
+	fprintf(stderr, " -q: no report every second\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It plays a capture as the ZIO char devices would: every page is a\n"
+			"struct zio_control followed by the samples, on the same stream.\n"
+			"Consumers read it with obsbox_ctrl_read() and read(2). At the end it\n"
+			"prints the rate and how late the pages were on the schedule, that\n"
+			"is how much the consumer could not keep the pace\n");
+	exit(1);
+}
+
+static void obrpt_sighandler(int sig)
+{
+	obrpt_stop = 1;
+}
+
+static void obrpt_report(struct obrp *rp, uint64_t *p_last, uint64_t *b_last,
+			 uint64_t *t_last, int final)
+{
+	uint64_t now = final ? rp->t_end : obsbox_now_ns();
+	double dt = (now - (final ? rp->t_start : *t_last)) / 1e9;
+
+	if (dt <= 0)
+		dt = 1e-9;
+	fprintf(stderr, "%s%.1f MB/s %.1f pages/s | pages %llu | late %llu avg %llu us max %llu us\n",
+		final ? "TOTAL: " : "",
+		(rp->bytes - (final ? 0 : *b_last)) / dt / 1e6,
+		(rp->pages - (final ? 0 : *p_last)) / dt,
+		(unsigned long long)rp->pages,
+		(unsigned long long)rp->late_n,
+		(unsigned long long)(rp->late_n ? rp->late_sum / rp->late_n / 1000 : 0),
+		(unsigned long long)rp->late_max / 1000);
+	*p_last = rp->pages;
+	*b_last = rp->bytes;
+	*t_last = now;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned long long a, b;
+	uint64_t first = 0, last = 0, p_last = 0, b_last = 0, t_last;
+	unsigned int loops = 1;
+	int c, ret, raw = 0, quiet = 0, fdo = STDOUT_FILENO, fdc, err;
+	char *pace = NULL, *out = NULL;
+	struct obrp rp;
+
+	while ((c = getopt (argc, argv, "hm:x:l:o:rqV")) != -1)
+	{
+		switch(c)
+		{
+		case 'm':
+			pace = optarg;
+			break;
+		case 'x':
+			ret = sscanf(optarg, "%llu:%llu", &a, &b);
+			if (ret < 1)
+				help();
+			first = a;
+			last = ret == 2 ? b + 1 : a + 1;
+			break;
+		case 'l':
+			ret = sscanf(optarg, "%u", &loops);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'r':
+			raw = 1;
+			break;
+		case 'q':
+			quiet = 1;
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (optind != argc - 1)
+		help();
+
+	if (obrp_open(&rp, argv[optind])) {
+		fprintf(stderr, "Cannot use capture %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	if (pace && obrp_pace_parse(&rp, pace))
+		help();
+	if (last) {
+		if (last > rp.r.count)
+			last = rp.r.count;
+		if (first >= last)
+			help();
+		rp.first = first;
+		rp.last = last;
+	}
+	rp.loops = loops;
+
+	if (out) {
+		fdo = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fdo < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", out,
+				strerror(errno));
+			exit(1);
+		}
+	}
+	fdc = raw ? open("/dev/null", O_WRONLY) : fdo;
+	if (fdc < 0)
+		exit(1);
+
+	signal(SIGINT, obrpt_sighandler);
+	signal(SIGTERM, obrpt_sighandler);
+	if (obrp_start(&rp, fdc, fdo)) {
+		fprintf(stderr, "Cannot start the replay\n");
+		exit(1);
+	}
+	t_last = obsbox_now_ns();
+	while (!rp.done && !obrpt_stop) {
+		usleep(100000);
+		if (!quiet && obsbox_now_ns() - t_last >= 1000000000ULL)
+			obrpt_report(&rp, &p_last, &b_last, &t_last, 0);
+	}
+	err = obrp_wait(&rp);
+	if (err && err != EPIPE)
+		fprintf(stderr, "obsbox-replay: %s\n", strerror(err));
+	obrpt_report(&rp, &p_last, &b_last, &t_last, 1);
+	obrp_close(&rp);
+
+	exit(err && err != EPIPE);
+}
@@ -0,0 +1,204 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "obsbox-ring.h"
+
+void obring_seg_path(const struct obring *r, unsigned int i, char *path,
+		     size_t len)
+{
+	snprintf(path, len, "%s/" OBRING_SEG_FMT, r->dir, i);
+}
+
+static int obring_hdr_valid(const struct obring_hdr *h)
+{
+	return !memcmp(h->magic, OBRING_MAGIC, sizeof(h->magic)) &&
+	       h->version == OBRING_VERSION && h->n && h->align;
+}
+
+/**
+ * Read header and entries of ring.idx
+ * @return 0 on success, -1 on error or invalid file
+ */
+static int obring_load(struct obring *r)
+{
+	size_t len;
+
+	if (pread(r->fd, &r->hdr, sizeof(r->hdr), 0) != sizeof(r->hdr) ||
+	    !obring_hdr_valid(&r->hdr))
+		goto err_inval;
+	len = r->hdr.n * sizeof(*r->seg);
+	r->seg = calloc(r->hdr.n, sizeof(*r->seg));
+	if (!r->seg)
+		return -1;
+	if (pread(r->fd, r->seg, len, sizeof(r->hdr)) != len) {
+		free(r->seg);
+		r->seg = NULL;
+		goto err_inval;
+	}
+	return 0;
+
+err_inval:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Create the ring directory and preallocate the segments. An existing ring
+ * with the same geometry is continued: its entries are kept, so a restart
+ * does not lose the data already on disk.
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obring_create(struct obring *r, const char *dir, unsigned int n,
+		  uint64_t seg_size, uint32_t devid, uint32_t align)
+{
+	char path[1200];
+	unsigned int i;
+	size_t len;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	snprintf(r->dir, sizeof(r->dir), "%s", dir);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -1;
+	snprintf(path, sizeof(path), "%s/" OBRING_INDEX, dir);
+	r->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (r->fd < 0)
+		return -1;
+
+	if (obring_load(r) || r->hdr.n != n || r->hdr.seg_size != seg_size ||
+	    r->hdr.align != align) {
+		free(r->seg);
+		r->hdr = (struct obring_hdr) {
+			.magic = OBRING_MAGIC,
+			.version = OBRING_VERSION,
+			.n = n,
+			.seg_size = seg_size,
+			.align = align,
+		};
+		r->seg = calloc(n, sizeof(*r->seg));
+		if (!r->seg)
+			goto err;
+		len = n * sizeof(*r->seg);
+		if (ftruncate(r->fd, 0) ||
+		    pwrite(r->fd, r->seg, len, sizeof(r->hdr)) != len)
+			goto err;
+	}
+	r->hdr.devid = devid;
+	if (pwrite(r->fd, &r->hdr, sizeof(r->hdr), 0) != sizeof(r->hdr))
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		obring_seg_path(r, i, path, sizeof(path));
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			goto err;
+		/* blocks are allocated now, not while streaming */
+		if (fallocate(fd, 0, 0, seg_size)) {
+			close(fd);
+			goto err;
+		}
+		close(fd);
+	}
+	return 0;
+
+err:
+	obring_close(r);
+	return -1;
+}
+
+/**
+ * @return the segment to write first: the one after the last written
+ */
+unsigned int obring_next(const struct obring *r)
+{
+	unsigned int i, last = r->hdr.n - 1;
+
+	for (i = 0; i < r->hdr.n; ++i)
+		if (r->seg[i].gen > r->seg[last].gen)
+			last = i;
+	return (last + 1) % r->hdr.n;
+}
+
+/**
+ * Write the entry of a segment to ring.idx
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obring_update(struct obring *r, unsigned int i)
+{
+	off_t off = sizeof(r->hdr) + i * sizeof(*r->seg);
+
+	if (pwrite(r->fd, &r->seg[i], sizeof(*r->seg), off) != sizeof(*r->seg))
+		return -1;
+	return 0;
+}
+
+
+/**
+ * Open a ring directory for reading
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obring_open(struct obring *r, const char *dir)
+{
+	char path[1200];
+
+	memset(r, 0, sizeof(*r));
+	snprintf(r->dir, sizeof(r->dir), "%s", dir);
+	snprintf(path, sizeof(path), "%s/" OBRING_INDEX, dir);
+	r->fd = open(path, O_RDONLY);
+	if (r->fd < 0)
+		return -1;
+	if (obring_load(r)) {
+		close(r->fd);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Sort the written segments by time
+ * @order: at least hdr.n entries, where to store the segment numbers
+ * @return the number of written segments
+ */
+unsigned int obring_sorted(const struct obring *r, unsigned int *order)
+{
+	unsigned int i, j, k, n = 0;
+
+	for (i = 0; i < r->hdr.n; ++i) {
+		if (r->seg[i].state == OBRING_FREE)
+			continue;
+		/* insertion sort, rings have few segments */
+		for (j = n; j > 0; --j) {
+			k = order[j - 1];
+			if (r->seg[k].t_first < r->seg[i].t_first ||
+			    (r->seg[k].t_first == r->seg[i].t_first &&
+			     r->seg[k].gen < r->seg[i].gen))
+				break;
+			order[j] = k;
+		}
+		order[j] = i;
+		n++;
+	}
+	return n;
+}
+
+void obring_close(struct obring *r)
+{
+	if (r->fd >= 0)
+		close(r->fd);
+	r->fd = -1;
+	free(r->seg);
+	r->seg = NULL;
+}
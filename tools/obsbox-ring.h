@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_RING_H__
+#define __OBSBOX_RING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Segmented capture: a directory of 'n' capture files of a fixed size,
+ * preallocated and rewritten round-robin, so the disk keeps the most
+ * recent n * size bytes of data.
+ *
+ *   <dir>/ring.idx         header and one entry per segment
+ *   <dir>/seg-<nnnn>.obc   capture files (obsbox-capture.h)
+ *
+ * A segment is OPEN while it is written; it becomes CLOSED once its index
+ * is written and it is on disk (fsync). An OPEN segment left by a crash
+ * has no index: the reader rebuilds it and drops the pages older than
+ * 't_first', which belong to the previous generation of the segment.
+ */
+#define OBRING_MAGIC "OBRING01"
+#define OBRING_VERSION 1
+#define OBRING_INDEX "ring.idx"
+#define OBRING_SEG_FMT "seg-%04u.obc"
+
+enum obring_state {
+	OBRING_FREE = 0,
+	OBRING_OPEN,
+	OBRING_CLOSED,
+};
+
+struct obring_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t n; /**< number of segments */
+	uint64_t seg_size; /**< bytes, preallocated */
+	uint32_t devid;
+	uint32_t align;
+};
+
+struct obring_seg {
+	uint64_t gen; /**< increases at every rewrite, 0 never written */
+	uint64_t t_first; /**< obcap_page_time() of the first page */
+	uint64_t t_last; /**< of the last page, CLOSED only */
+	uint64_t count; /**< pages, CLOSED only */
+	uint32_t seq_first, seq_last; /**< ZIO sequence numbers */
+	uint32_t state; /**< enum obring_state */
+	uint32_t reserved;
+};
+
+struct obring {
+	int fd; /**< ring.idx */
+	char dir[1024];
+	struct obring_hdr hdr;
+	struct obring_seg *seg;
+};
+
+/* Writer */
+extern int obring_create(struct obring *r, const char *dir, unsigned int n,
+			 uint64_t seg_size, uint32_t devid, uint32_t align);
+extern unsigned int obring_next(const struct obring *r);
+extern int obring_update(struct obring *r, unsigned int i);
+
+/* Reader */
+extern int obring_open(struct obring *r, const char *dir);
+extern unsigned int obring_sorted(const struct obring *r, unsigned int *order);
+
+extern void obring_seg_path(const struct obring *r, unsigned int i,
+			    char *path, size_t len);
+extern void obring_close(struct obring *r);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "obsbox-rt.h"
+#include "obsbox-common.h"
+
+static int obrt_cpus_parse(struct obrt *rt, char *list)
+{
+	char *tok, *save;
+	int a, b;
+
+	for (tok = strtok_r(list, ":", &save); tok;
+	     tok = strtok_r(NULL, ":", &save)) {
+		switch (sscanf(tok, "%d-%d", &a, &b)) {
+		case 1:
+			b = a;
+			break;
+		case 2:
+			break;
+		default:
+			return -1;
+		}
+		if (a < 0 || b < a)
+			return -1;
+		for (; a <= b; ++a) {
+			if (rt->n_workers == OBRT_CPUS_MAX)
+				return -1;
+			rt->workers[rt->n_workers++] = a;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Parse a spec, see obsbox-rt.h
+ * @return 0 on success, -1 when the spec is not valid
+ */
+int obrt_parse(struct obrt *rt, const char *spec)
+{
+	char *s = strdup(spec), *tok, *save;
+	int err = 0;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->cpu = -1;
+	if (!s)
+		return -1;
+	for (tok = strtok_r(s, ",", &save); tok && !err;
+	     tok = strtok_r(NULL, ",", &save)) {
+		if (!strncmp(tok, "cpu=", 4))
+			err = sscanf(tok + 4, "%d", &rt->cpu) != 1 || rt->cpu < 0;
+		else if (!strncmp(tok, "workers=", 8))
+			err = obrt_cpus_parse(rt, tok + 8);
+		else if (!strncmp(tok, "prio=", 5))
+			err = sscanf(tok + 5, "%d", &rt->prio) != 1 ||
+			      rt->prio < sched_get_priority_min(SCHED_FIFO) ||
+			      rt->prio > sched_get_priority_max(SCHED_FIFO);
+		else if (!strcmp(tok, "lock"))
+			rt->lock = 1;
+		else if (!strcmp(tok, "huge"))
+			rt->huge = 1;
+		else if (!strcmp(tok, "busy"))
+			rt->busy = 1;
+		else
+			err = 1;
+	}
+	free(s);
+	return err ? -1 : 0;
+}
+
+/**
+ * Process wide settings, before the buffers are allocated
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obrt_setup(const struct obrt *rt)
+{
+	if (rt->lock && mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -1;
+	return 0;
+}
+
+/**
+ * Pin the calling thread to 'cpu' (-1 anywhere) and give it the real-time
+ * priority
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obrt_thread(const struct obrt *rt, int cpu)
+{
+	struct sched_param sp = {.sched_priority = rt->prio};
+	cpu_set_t set;
+	int err;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+	if (rt->prio) {
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (err) {
+			errno = err;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * @return the cpu of the i-th worker thread, -1 when they are not pinned
+ */
+int obrt_worker_cpu(const struct obrt *rt, unsigned int i)
+{
+	return rt->n_workers ? rt->workers[i % rt->n_workers] : -1;
+}
+
+
+static size_t obrt_len(const struct obrt *rt, size_t len)
+{
+	size_t unit = rt && rt->huge ? OBRT_HUGE_SIZE : 4096;
+
+	return (len + unit - 1) & ~(unit - 1);
+}
+
+/**
+ * Allocate a prefaulted, page aligned buffer. With 'huge' it comes from
+ * hugetlbfs, or from transparent huge pages when there are none reserved.
+ * 'rt' can be NULL.
+ * @return the buffer, NULL on error
+ */
+void *obrt_alloc(const struct obrt *rt, size_t len)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+	void *buf = MAP_FAILED;
+
+	len = obrt_len(rt, len);
+	if (rt && rt->huge)
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   flags | MAP_HUGETLB, -1, 0);
+	if (buf == MAP_FAILED) {
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   rt && rt->huge ? flags & ~MAP_POPULATE : flags,
+			   -1, 0);
+		if (buf == MAP_FAILED)
+			return NULL;
+		if (rt && rt->huge) {
+			/* advise before touching it, then fault it in */
+			madvise(buf, len, MADV_HUGEPAGE);
+			memset(buf, 0, len);
+		}
+	}
+	return buf;
+}
+
+void obrt_free(const struct obrt *rt, void *buf, size_t len)
+{
+	if (buf)
+		munmap(buf, obrt_len(rt, len));
+}
+
+/**
+ * Wait for 'fd' to be readable, sleeping or spinning. 'rt' can be NULL.
+ * @return as poll(2)
+ */
+int obrt_wait(const struct obrt *rt, int fd, int timeout_ms)
+{
+	struct pollfd p = {.fd = fd, .events = POLLIN};
+	uint64_t t_end;
+	int n;
+
+	if (!rt || !rt->busy)
+		return poll(&p, 1, timeout_ms);
+	t_end = obsbox_now_ns() + timeout_ms * 1000000ULL;
+	do {
+		n = poll(&p, 1, 0);
+		if (n)
+			return n;
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#endif
+	} while (obsbox_now_ns() < t_end);
+	return 0;
+}
+
+
+/**
+ * Account the wakeup latency of a page, see obsbox-rt.h
+ */
+void obrt_lat_page(struct obrt_lat *l, const struct zio_control *zctrl)
+{
+	uint64_t t = zctrl->tstamp.secs * 1000000000ULL + zctrl->tstamp.ticks;
+	uint64_t now, ns;
+
+	if (!t)
+		return;
+	now = obsbox_realtime_ns();
+	if (now < t || now - t > OBRT_LAT_MAX_NS)
+		return;
+	ns = now - t;
+	l->n++;
+	l->sum += ns;
+	if (ns > l->max)
+		l->max = ns;
+	if (ns / 1000 < OBRT_LAT_BINS)
+		l->bin[ns / 1000]++;
+	else
+		l->over++;
+}
+
+/**
+ * @return the latency in us below which there are 'pct' percent of the
+ *         pages
+ */
+double obrt_lat_pct(const struct obrt_lat *l, double pct)
+{
+	uint64_t target, acc = 0;
+	unsigned int i;
+
+	if (!l->n)
+		return 0;
+	target = l->n * pct / 100;
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < OBRT_LAT_BINS; ++i) {
+		acc += l->bin[i];
+		if (acc >= target)
+			return i + 1;
+	}
+	return l->max / 1e3;
+}
+
+void obrt_lat_report(const struct obrt_lat *l, FILE *f)
+{
+	if (!l->n) {
+		fprintf(f, "wakeup latency: no time stamped pages\n");
+		return;
+	}
+	fprintf(f, "wakeup latency us: avg %.1f p50 <%.0f p90 <%.0f p99 <%.0f p99.9 <%.0f max %.1f (%llu pages)\n",
+		l->sum / 1e3 / l->n, obrt_lat_pct(l, 50), obrt_lat_pct(l, 90),
+		obrt_lat_pct(l, 99), obrt_lat_pct(l, 99.9), l->max / 1e3,
+		(unsigned long long)l->n);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_RT_H__
+#define __OBSBOX_RT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/zio-user.h>
+
+/*
+ * Hardened run mode. The tools take a spec of comma separated items:
+ *   cpu=<n>          pin the reader thread
+ *   workers=<list>   pin the worker threads in round-robin, the list is
+ *                    made of cpus and ranges separated by ':' (2:4-6)
+ *   prio=<n>         SCHED_FIFO with this priority
+ *   lock             mlockall(2), current and future memory
+ *   huge             buffers on huge pages (transparent when hugetlbfs
+ *                    has none), always prefaulted
+ *   busy             busy-poll the control char device instead of
+ *                    sleeping in poll(2)
+ * e.g. "cpu=2,workers=3-5,prio=80,lock,huge"
+ *
+ * Wakeup latency: age of a page when the reader gets its control, that
+ * is the host time minus the ZIO time stamp. The constant part is the
+ * driver; what moves is the scheduling of the reader.
+ */
+#define OBRT_CPUS_MAX 64
+#define OBRT_LAT_BINS 1024 /* 1us bins, then only the maximum */
+#define OBRT_LAT_MAX_NS 1000000000ULL /* older pages are not fresh (replay) */
+#define OBRT_HUGE_SIZE (2 * 1024 * 1024)
+
+struct obrt {
+	int cpu; /**< reader cpu, -1 not pinned */
+	int workers[OBRT_CPUS_MAX];
+	unsigned int n_workers;
+	int prio; /**< SCHED_FIFO priority, 0 default policy */
+	int lock;
+	int huge;
+	int busy;
+};
+
+struct obrt_lat {
+	uint64_t n;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t over; /**< beyond the last bin */
+	uint32_t bin[OBRT_LAT_BINS];
+};
+
+extern int obrt_parse(struct obrt *rt, const char *spec);
+extern int obrt_setup(const struct obrt *rt);
+extern int obrt_thread(const struct obrt *rt, int cpu);
+extern int obrt_worker_cpu(const struct obrt *rt, unsigned int i);
+extern void *obrt_alloc(const struct obrt *rt, size_t len);
+extern void obrt_free(const struct obrt *rt, void *buf, size_t len);
+extern int obrt_wait(const struct obrt *rt, int fd, int timeout_ms);
+
+extern void obrt_lat_page(struct obrt_lat *l, const struct zio_control *zctrl);
+extern double obrt_lat_pct(const struct obrt_lat *l, double pct);
+extern void obrt_lat_report(const struct obrt_lat *l, FILE *f);
+
+#endif
@@ -0,0 +1,892 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-capture.h"
+#include "obsbox-serve.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBSRV_NPAGES_DEF 64
+#define OBSRV_QUEUE_DEF 16
+#define OBSRV_CLIENTS_DEF 16
+#define OBSRV_ZC_MIN 16384 /* smaller sends are cheaper copied */
+
+/**
+ * A page is shared by all the clients that queued it, it goes back to the
+ * pool when the last reference is gone. With MSG_ZEROCOPY the kernel
+ * holds a reference until it reports the completion of the send.
+ */
+struct obsrv_page {
+	struct zio_control zctrl;
+	uint8_t *data;
+	uint32_t len;
+	unsigned int ref;
+	uint64_t t_host;
+};
+
+/* A zero-copy send waiting for its completion */
+struct obsrv_zc {
+	uint32_t id;
+	struct obsrv_page *page;
+};
+
+struct obsrv_client {
+	int fd;
+	int zerocopy; /**< MSG_ZEROCOPY enabled on the socket */
+	int ready; /**< hello received */
+	struct obsrv_hello hello;
+	uint32_t hello_len;
+	unsigned int every_cnt;
+
+	/* page queue, the head is being sent */
+	struct obsrv_page **q;
+	unsigned int q_size, q_head, q_count;
+	struct obsrv_page_hdr hdr; /**< header of the head page */
+	uint32_t hdr_sent, data_sent;
+	uint32_t dropped; /**< to report in the next header */
+
+	/* zero-copy sends in flight, completions arrive in order */
+	struct obsrv_zc *zc;
+	unsigned int zc_size, zc_head, zc_count;
+	uint32_t zc_next; /**< id of the next zero-copy send */
+
+	uint64_t pages, bytes, drops, zc_copied;
+};
+
+static volatile sig_atomic_t obsrv_stop;
+static struct obsrv_page *pages, drop_page;
+static struct obsrv_page **free_pages;
+static unsigned int n_pages, n_free;
+static struct obsrv_client **clients;
+static unsigned int max_clients, queue_def = OBSRV_QUEUE_DEF;
+static int policy_def = OBSRV_DROP_OLD;
+static int epfd, zerocopy;
+static uint64_t st_pages, st_pool_drops;
+static struct obsbox_seq seq;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-serve -d 0x<devid> -p <page_size> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -f <file>: serve the pages of a capture file instead of the device\n");
+	fprintf(stderr, " -R <number>: with -f, pages per second (default: 100)\n");
+	fprintf(stderr, " -t [<addr>:]<port>: listen on TCP (default port %d)\n",
+		OBSRV_PORT_DEF);
+	fprintf(stderr, " -u <path>: listen on a Unix socket\n");
+	fprintf(stderr, " -b <number>: pages in the pool (default %d)\n",
+		OBSRV_NPAGES_DEF);
+	fprintf(stderr, " -q <number>: default client queue length in pages (default %d)\n",
+		OBSRV_QUEUE_DEF);
+	fprintf(stderr, " -D <new|old|disconnect>: default drop policy when a client queue is full (default old)\n");
+	fprintf(stderr, " -c <number>: maximum number of clients (default %d)\n",
+		OBSRV_CLIENTS_DEF);
+	fprintf(stderr, " -Z: send with MSG_ZEROCOPY (TCP only)\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Pages are read once and sent to every subscriber, see obsbox-serve.h\n"
+			"for the protocol and obsbox-client for a client\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obsrv_sighandler(int sig)
+{
+	obsrv_stop = 1;
+}
+
+
+static int obsrv_policy_parse(const char *str)
+{
+	if (!strcmp(str, "new"))
+		return OBSRV_DROP_NEW;
+	if (!strcmp(str, "old"))
+		return OBSRV_DROP_OLD;
+	if (!strcmp(str, "disconnect"))
+		return OBSRV_DISCONNECT;
+	return -1;
+}
+
+static struct obsrv_page *obsrv_page_get(void)
+{
+	struct obsrv_page *p;
+
+	if (!n_free)
+		return NULL;
+	p = free_pages[--n_free];
+	p->ref = 1;
+	return p;
+}
+
+static void obsrv_page_put(struct obsrv_page *p)
+{
+	if (--p->ref == 0)
+		free_pages[n_free++] = p;
+}
+
+
+static int obsrv_epoll_set(struct obsrv_client *c, int op)
+{
+	struct epoll_event ev;
+
+	/* EPOLLERR is always reported: zero-copy completions */
+	ev.events = EPOLLIN | (c->q_count ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	return epoll_ctl(epfd, op, c->fd, &ev);
+}
+
+static void obsrv_client_close(struct obsrv_client *c)
+{
+	unsigned int i;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	/*
+	 * The socket is gone: the kernel may still transmit from pages in
+	 * flight, it does not matter to anybody anymore
+	 */
+	for (; c->q_count; c->q_count--, c->q_head = (c->q_head + 1) % c->q_size)
+		obsrv_page_put(c->q[c->q_head]);
+	for (; c->zc_count; c->zc_count--, c->zc_head = (c->zc_head + 1) % c->zc_size)
+		obsrv_page_put(c->zc[c->zc_head].page);
+	fprintf(stderr, "client %d: closed, %llu pages %llu MB dropped %llu\n",
+		c->fd, (unsigned long long)c->pages,
+		(unsigned long long)(c->bytes / 1000000),
+		(unsigned long long)c->drops);
+	for (i = 0; i < max_clients; ++i)
+		if (clients[i] == c)
+			clients[i] = NULL;
+	free(c->q);
+	free(c->zc);
+	free(c);
+}
+
+
+static void obsrv_accept(int lfd)
+{
+	struct obsrv_client *c;
+	unsigned int i;
+	int fd, one = 1;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	for (i = 0; i < max_clients && clients[i]; ++i)
+		;
+	c = i < max_clients ? calloc(1, sizeof(*c)) : NULL;
+	if (!c) {
+		fprintf(stderr, "Too many clients, connection refused\n");
+		close(fd);
+		return;
+	}
+	c->fd = fd;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* fails on Unix sockets: they get plain copies */
+	if (zerocopy &&
+	    !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+		c->zerocopy = 1;
+	if (obsrv_epoll_set(c, EPOLL_CTL_ADD)) {
+		close(fd);
+		free(c);
+		return;
+	}
+	clients[i] = c;
+}
+
+/**
+ * Read the subscription, nothing else is expected from the client
+ * @return 0 on success, -1 when the client must be closed
+ */
+static int obsrv_client_read(struct obsrv_client *c)
+{
+	struct obsrv_hello *h = &c->hello;
+	uint8_t junk[256];
+	ssize_t n;
+
+	if (c->ready) {
+		n = read(c->fd, junk, sizeof(junk));
+		return n > 0 || (n < 0 && errno == EAGAIN) ? 0 : -1;
+	}
+	n = read(c->fd, (uint8_t *)h + c->hello_len, sizeof(*h) - c->hello_len);
+	if (n < 0 && errno == EAGAIN)
+		return 0;
+	if (n <= 0)
+		return -1;
+	c->hello_len += n;
+	if (c->hello_len < sizeof(*h))
+		return 0;
+
+	if (h->magic != OBSRV_HELLO_MAGIC || h->version != OBSRV_VERSION) {
+		fprintf(stderr, "client %d: invalid subscription\n", c->fd);
+		return -1;
+	}
+	if (!h->every)
+		h->every = 1;
+	if (!h->policy || h->policy > OBSRV_DISCONNECT)
+		h->policy = policy_def;
+	c->q_size = h->queue ? h->queue : queue_def;
+	if (c->q_size > n_pages)
+		c->q_size = n_pages;
+	/* completions may lag: several sends per page can be in flight */
+	c->zc_size = 4 * n_pages;
+	c->q = calloc(c->q_size, sizeof(*c->q));
+	c->zc = calloc(c->zc_size, sizeof(*c->zc));
+	if (!c->q || !c->zc)
+		return -1;
+	c->ready = 1;
+	fprintf(stderr, "client %d: window %u+%u, every %u, queue %u, policy %u%s\n",
+		c->fd, h->offset, h->length, h->every, c->q_size, h->policy,
+		c->zerocopy ? ", zero-copy" : "");
+
+	return 0;
+}
+
+
+static void obsrv_hdr_prepare(struct obsrv_client *c)
+{
+	struct obsrv_page *p = c->q[c->q_head];
+	struct obsrv_page_hdr *h = &c->hdr;
+	uint32_t off = c->hello.offset, len = c->hello.length;
+
+	if (off > p->len)
+		off = p->len;
+	if (!len || len > p->len - off)
+		len = p->len - off;
+	h->magic = OBSRV_PAGE_MAGIC;
+	h->len = len;
+	h->seq_num = p->zctrl.seq_num;
+	h->dropped = c->dropped;
+	h->size = p->len;
+	h->offset = off;
+	h->alarms = p->zctrl.zio_alarms | (p->zctrl.drv_alarms << 8);
+	h->marker = obsbox_ctrl_marker(&p->zctrl);
+	h->tstamp = p->zctrl.tstamp.secs * 1000000000ULL +
+		    p->zctrl.tstamp.ticks;
+	h->t_host = p->t_host;
+	c->dropped = 0;
+	c->hdr_sent = 0;
+	c->data_sent = 0;
+}
+
+/**
+ * Send as much as the socket accepts
+ * @return 0 on success, -1 when the client must be closed
+ */
+static int obsrv_client_write(struct obsrv_client *c)
+{
+	struct obsrv_page *p;
+	ssize_t n;
+	int flags;
+
+	while (c->q_count) {
+		p = c->q[c->q_head];
+		if (c->hdr_sent < sizeof(c->hdr)) {
+			/* the header is small, always copied */
+			n = send(c->fd, (uint8_t *)&c->hdr + c->hdr_sent,
+				 sizeof(c->hdr) - c->hdr_sent,
+				 MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+			if (n < 0)
+				return errno == EAGAIN ? 0 : -1;
+			c->hdr_sent += n;
+			continue;
+		}
+		if (c->data_sent < c->hdr.len) {
+			flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+			if (c->zerocopy && c->zc_count < c->zc_size &&
+			    c->hdr.len - c->data_sent >= OBSRV_ZC_MIN)
+				flags |= MSG_ZEROCOPY;
+			n = send(c->fd, p->data + c->hdr.offset + c->data_sent,
+				 c->hdr.len - c->data_sent, flags);
+			if (n < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				/* too much pinned memory, copy this time */
+				flags &= ~MSG_ZEROCOPY;
+				n = send(c->fd, p->data + c->hdr.offset +
+					 c->data_sent, c->hdr.len - c->data_sent,
+					 flags);
+			}
+			if (n < 0)
+				return errno == EAGAIN ? 0 : -1;
+			if (flags & MSG_ZEROCOPY) {
+				/* the kernel reads the page until completion */
+				c->zc[(c->zc_head + c->zc_count) % c->zc_size] =
+					(struct obsrv_zc){c->zc_next++, p};
+				c->zc_count++;
+				p->ref++;
+			}
+			c->data_sent += n;
+			c->bytes += n;
+			if (c->data_sent < c->hdr.len)
+				continue;
+		}
+
+		/* page done */
+		c->pages++;
+		obsrv_page_put(p);
+		c->q_head = (c->q_head + 1) % c->q_size;
+		if (--c->q_count)
+			obsrv_hdr_prepare(c);
+		else
+			obsrv_epoll_set(c, EPOLL_CTL_MOD);
+	}
+
+	return 0;
+}
+
+/**
+ * Collect zero-copy completions from the socket error queue
+ */
+static void obsrv_client_zc_complete(struct obsrv_client *c)
+{
+	struct sock_extended_err *serr;
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	uint32_t lo, hi;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			return;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (void *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			lo = serr->ee_info;
+			hi = serr->ee_data;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				c->zc_copied += hi - lo + 1;
+			/* ids in [lo, hi] are done, they are at the head */
+			while (c->zc_count &&
+			       c->zc[c->zc_head].id - lo <= hi - lo) {
+				obsrv_page_put(c->zc[c->zc_head].page);
+				c->zc_head = (c->zc_head + 1) % c->zc_size;
+				c->zc_count--;
+			}
+		}
+	}
+}
+
+
+/**
+ * Queue a new page to a client, apply the drop policy when it is full
+ * @return 0 on success, -1 when the client must be closed
+ */
+static int obsrv_client_queue(struct obsrv_client *c, struct obsrv_page *p)
+{
+	unsigned int victim;
+
+	if (!c->ready)
+		return 0;
+	if (++c->every_cnt < c->hello.every)
+		return 0;
+	c->every_cnt = 0;
+
+	if (c->q_count == c->q_size) {
+		switch (c->hello.policy) {
+		case OBSRV_DISCONNECT:
+			fprintf(stderr, "client %d: too slow, disconnected\n",
+				c->fd);
+			return -1;
+		case OBSRV_DROP_OLD:
+			/* the head may be partially sent, drop the next one */
+			if (c->q_size > 1) {
+				victim = (c->q_head + 1) % c->q_size;
+				obsrv_page_put(c->q[victim]);
+				for (; victim != (c->q_head + c->q_count - 1) % c->q_size;
+				     victim = (victim + 1) % c->q_size)
+					c->q[victim] = c->q[(victim + 1) % c->q_size];
+				c->q_count--;
+				break;
+			}
+			/* fall through */
+		case OBSRV_DROP_NEW:
+		default:
+			c->drops++;
+			c->dropped++;
+			return 0;
+		}
+		c->drops++;
+		c->dropped++;
+	}
+
+	p->ref++;
+	c->q[(c->q_head + c->q_count) % c->q_size] = p;
+	if (c->q_count++ == 0) {
+		obsrv_hdr_prepare(c);
+		obsrv_epoll_set(c, EPOLL_CTL_MOD);
+	}
+
+	return 0;
+}
+
+static void obsrv_dispatch(struct obsrv_page *p)
+{
+	unsigned int i;
+
+	p->t_host = obsbox_realtime_ns();
+	obsbox_seq_update(&seq, p->zctrl.seq_num);
+	st_pages++;
+	for (i = 0; i < max_clients; ++i)
+		if (clients[i] && obsrv_client_queue(clients[i], p))
+			obsrv_client_close(clients[i]);
+	obsrv_page_put(p);
+}
+
+static void obsrv_drop_all(void)
+{
+	unsigned int i;
+
+	st_pool_drops++;
+	for (i = 0; i < max_clients; ++i) {
+		if (clients[i] && clients[i]->ready) {
+			clients[i]->drops++;
+			clients[i]->dropped++;
+		}
+	}
+}
+
+
+/**
+ * Read a page from the device into the pool, into the drop page when the
+ * pool is exhausted
+ * @return 0 on success, -1 on error
+ */
+static int obsrv_dev_read(struct obdev *d)
+{
+	struct obsrv_page *p = obsrv_page_get();
+	struct obsrv_page *t = p ? p : &drop_page;
+	uint32_t len, done = 0;
+	int n;
+
+	if (obdev_ctrl_read(d, &t->zctrl))
+		goto err;
+	len = obsbox_ctrl_len(&t->zctrl);
+	if (len > drop_page.len) {
+		fprintf(stderr, "obsbox-serve: page of %u bytes, max is %u\n",
+			len, drop_page.len);
+		goto err;
+	}
+	while (done < len) {
+		n = read(d->fdd, t->data + done, len - done);
+		if (n <= 0) {
+			fprintf(stderr, "obsbox-serve: cannot read data: %s\n",
+				n < 0 ? strerror(errno) : "EOF");
+			goto err;
+		}
+		done += n;
+	}
+	if (!p) {
+		obsbox_seq_update(&seq, t->zctrl.seq_num);
+		obsrv_drop_all();
+		return 0;
+	}
+	p->len = len;
+	obsrv_dispatch(p);
+	return 0;
+
+err:
+	if (p)
+		obsrv_page_put(p);
+	return -1;
+}
+
+/**
+ * Take the next page of the capture file, in loop
+ * @return 0 on success, -1 on error
+ */
+static int obsrv_file_read(struct obcap_reader *r, uint64_t *next)
+{
+	struct obsrv_page *p;
+	struct obcap_page_hdr *ph;
+	uint8_t *data;
+
+	p = obsrv_page_get();
+	if (!p) {
+		obsrv_drop_all();
+		return 0;
+	}
+	ph = obcap_page(r, *next % r->count, &data);
+	if (ph->size > drop_page.len ||
+	    obcap_page_decode(ph, data, p->data, drop_page.data)) {
+		fprintf(stderr, "obsbox-serve: cannot use page %llu\n",
+			(unsigned long long)(*next % r->count));
+		obsrv_page_put(p);
+		return -1;
+	}
+	memset(&p->zctrl, 0, sizeof(p->zctrl));
+	p->zctrl.seq_num = ph->seq_num + (*next / r->count) * r->count;
+	p->zctrl.ssize = ph->ssize ? ph->ssize : 1;
+	p->zctrl.nsamples = ph->size / p->zctrl.ssize;
+	p->zctrl.zio_alarms = ph->alarms & 0xFF;
+	p->zctrl.drv_alarms = ph->alarms >> 8;
+	p->zctrl.tstamp.secs = ph->tstamp_s;
+	p->zctrl.tstamp.ticks = ph->tstamp_t;
+	if (ph->marker != OBCAP_NO_MARKER) {
+		p->zctrl.attr_channel.ext_mask = 1 << OBSBOX_CTRL_MARKER_OFFSET;
+		p->zctrl.attr_channel.ext_val[OBSBOX_CTRL_MARKER_OFFSET] =
+			ph->marker;
+	}
+	p->len = ph->size;
+	(*next)++;
+	obsrv_dispatch(p);
+
+	return 0;
+}
+
+
+static int obsrv_listen_tcp(const char *spec)
+{
+	struct addrinfo hints = {0}, *ai;
+	char host[128] = "", port[16];
+	const char *sep = strrchr(spec, ':');
+	int fd, one = 1;
+
+	if (sep) {
+		snprintf(host, sizeof(host), "%.*s", (int)(sep - spec), spec);
+		snprintf(port, sizeof(port), "%s", sep + 1);
+	} else {
+		snprintf(port, sizeof(port), "%s", spec);
+	}
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(host[0] ? host : NULL, port, &hints, &ai)) {
+		errno = EINVAL;
+		return -1;
+	}
+	fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16)) {
+		close(fd);
+		fd = -1;
+	}
+err:
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static int obsrv_listen_unix(const char *path)
+{
+	struct sockaddr_un sun = {.sun_family = AF_UNIX};
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) || listen(fd, 16)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static void obsrv_report(void)
+{
+	unsigned int i, n = 0;
+	uint64_t drops = 0;
+
+	for (i = 0; i < max_clients; ++i) {
+		if (!clients[i])
+			continue;
+		n++;
+		drops += clients[i]->drops;
+	}
+	fprintf(stderr, "pages %llu lost %llu pool-drops %llu | clients %u drops %llu | free pages %u\n",
+		(unsigned long long)st_pages, (unsigned long long)seq.lost,
+		(unsigned long long)st_pool_drops, n,
+		(unsigned long long)drops, n_free);
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t devid = 0, page_size = 0, vmalloc_size = 0, rate = 100;
+	struct obdev d;
+	char *tcp = NULL, *unix_path = NULL, *file = NULL;
+	struct epoll_event ev, evs[32];
+	struct obcap_reader r;
+	struct itimerspec its = {{0}};
+	int c, ret, i, n, lfd_tcp = -1, lfd_unix = -1;
+	int tfd = -1, err = 1;
+	uint64_t next = 0, t_last, ticks;
+	struct obsrv_client *cl;
+
+	n_pages = OBSRV_NPAGES_DEF;
+	max_clients = OBSRV_CLIENTS_DEF;
+	while ((c = getopt (argc, argv, "hd:p:v:f:R:t:u:b:q:D:c:ZV")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'R':
+			ret = sscanf(optarg, "%u", &rate);
+			if (ret != 1 || !rate)
+				help();
+			break;
+		case 't':
+			tcp = optarg;
+			break;
+		case 'u':
+			unix_path = optarg;
+			break;
+		case 'b':
+			ret = sscanf(optarg, "%u", &n_pages);
+			if (ret != 1 || !n_pages)
+				help();
+			break;
+		case 'q':
+			ret = sscanf(optarg, "%u", &queue_def);
+			if (ret != 1 || !queue_def)
+				help();
+			break;
+		case 'D':
+			policy_def = obsrv_policy_parse(optarg);
+			if (policy_def < 0)
+				help();
+			break;
+		case 'c':
+			ret = sscanf(optarg, "%u", &max_clients);
+			if (ret != 1 || !max_clients)
+				help();
+			break;
+		case 'Z':
+			zerocopy = 1;
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (file) {
+		if (obcap_open(&r, file) || !r.count) {
+			fprintf(stderr, "Cannot use capture %s: %s\n", file,
+				r.count ? strerror(errno) : "empty");
+			exit(1);
+		}
+		for (next = 0; next < r.count; ++next)
+			if (obcap_page(&r, next, NULL)->size > page_size)
+				page_size = obcap_page(&r, next, NULL)->size;
+		next = 0;
+	}
+	if (!page_size)
+		help();
+	if (!tcp && !unix_path)
+		tcp = "5055";
+
+	/* Pool, every page is allocated and touched now */
+	pages = calloc(n_pages, sizeof(*pages));
+	free_pages = calloc(n_pages, sizeof(*free_pages));
+	clients = calloc(max_clients, sizeof(*clients));
+	if (!pages || !free_pages || !clients)
+		exit(1);
+	for (i = 0; i <= n_pages; ++i) {
+		struct obsrv_page *p = i < n_pages ? &pages[i] : &drop_page;
+
+		if (posix_memalign((void **)&p->data, 4096, page_size))
+			exit(1);
+		memset(p->data, 0, page_size);
+		if (i < n_pages)
+			free_pages[n_free++] = p;
+	}
+	drop_page.len = page_size;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (tcp) {
+		lfd_tcp = obsrv_listen_tcp(tcp);
+		if (lfd_tcp < 0) {
+			fprintf(stderr, "Cannot listen on %s: %s\n", tcp,
+				strerror(errno));
+			exit(1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &lfd_tcp;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, lfd_tcp, &ev);
+	}
+	if (unix_path) {
+		lfd_unix = obsrv_listen_unix(unix_path);
+		if (lfd_unix < 0) {
+			fprintf(stderr, "Cannot listen on %s: %s\n", unix_path,
+				strerror(errno));
+			exit(1);
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &lfd_unix;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, lfd_unix, &ev);
+	}
+
+	signal(SIGINT, obsrv_sighandler);
+	signal(SIGTERM, obsrv_sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (file) {
+		tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		its.it_interval.tv_sec = rate == 1;
+		its.it_interval.tv_nsec = rate > 1 ? 1000000000 / rate : 0;
+		its.it_value = its.it_interval;
+		timerfd_settime(tfd, 0, &its, NULL);
+		ev.events = EPOLLIN;
+		ev.data.ptr = &tfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+	} else {
+		if (obdev_open(&d, devid)) {
+			fprintf(stderr, "Cannot open ZIO char devices: %s\n",
+				strerror(errno));
+			exit(1);
+		}
+		ret = obdev_configure(&d, 1, page_size, vmalloc_size);
+		if (ret) {
+			fprintf(stderr,
+				"Something wrong during the configuration: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &d;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, d.fdc, &ev);
+		ret = obdev_run(&d, 1);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot start acquisition: %s\n",
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	t_last = obsbox_now_ns();
+	while (!obsrv_stop) {
+		n = epoll_wait(epfd, evs, 32, 1000);
+		if (n < 0 && errno != EINTR)
+			break;
+		for (i = 0; i < n; ++i) {
+			if (evs[i].data.ptr == &lfd_tcp) {
+				obsrv_accept(lfd_tcp);
+			} else if (evs[i].data.ptr == &lfd_unix) {
+				obsrv_accept(lfd_unix);
+			} else if (evs[i].data.ptr == &d) {
+				if (obsrv_dev_read(&d))
+					goto out_stop;
+			} else if (evs[i].data.ptr == &tfd) {
+				if (read(tfd, &ticks, sizeof(ticks)) != sizeof(ticks))
+					continue;
+				while (ticks--)
+					if (obsrv_file_read(&r, &next))
+						goto out_stop;
+			} else {
+				cl = evs[i].data.ptr;
+				/* a previous event may have closed it */
+				for (ret = 0; ret < max_clients; ++ret)
+					if (clients[ret] == cl)
+						break;
+				if (ret == max_clients)
+					continue;
+				if (evs[i].events & EPOLLERR)
+					obsrv_client_zc_complete(cl);
+				if (((evs[i].events & (EPOLLIN | EPOLLHUP)) &&
+				     obsrv_client_read(cl)) ||
+				    ((evs[i].events & EPOLLOUT) &&
+				     obsrv_client_write(cl)))
+					obsrv_client_close(cl);
+			}
+		}
+		if (obsbox_now_ns() - t_last >= 1000000000ULL) {
+			t_last = obsbox_now_ns();
+			obsrv_report();
+		}
+	}
+	err = 0;
+
+out_stop:
+	if (!file) {
+		obdev_run(&d, 0);
+		obdev_close(&d);
+	}
+	obsrv_report();
+	for (i = 0; i < max_clients; ++i)
+		if (clients[i])
+			obsrv_client_close(clients[i]);
+	if (unix_path)
+		unlink(unix_path);
+	exit(err);
+
+out:
+	obdev_run(&d, 0);
+	obdev_close(&d);
+	exit(1);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_SERVE_H__
+#define __OBSBOX_SERVE_H__
+
+#include <stdint.h>
+
+/*
+ * obsbox-serve protocol, over a stream socket (TCP or Unix). The client
+ * sends one obsrv_hello, then the server sends pages: each one is an
+ * obsrv_page_hdr followed by 'len' bytes of data. All fields are in host
+ * byte order: this is meant for the local network.
+ */
+#define OBSRV_HELLO_MAGIC 0x5353424F /* "OBSS" */
+#define OBSRV_PAGE_MAGIC 0x5053424F /* "OBSP" */
+#define OBSRV_VERSION 1
+#define OBSRV_PORT_DEF 5055
+
+/* What to do when the client queue is full */
+enum obsrv_policy {
+	OBSRV_POLICY_DEFAULT = 0, /**< the server choice */
+	OBSRV_DROP_NEW, /**< the new page is not queued */
+	OBSRV_DROP_OLD, /**< the oldest page not being sent is dropped */
+	OBSRV_DISCONNECT, /**< the client is disconnected */
+};
+
+struct obsrv_hello {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t offset; /**< window: first byte of the page to send */
+	uint32_t length; /**< window: bytes to send, 0 up to the page end */
+	uint32_t every; /**< send one page every 'every', 0 or 1 all */
+	uint32_t queue; /**< pages in the queue, 0 for the server default */
+	uint32_t policy; /**< enum obsrv_policy */
+	uint32_t reserved;
+};
+
+struct obsrv_page_hdr {
+	uint32_t magic;
+	uint32_t len; /**< data bytes following this header */
+	uint32_t seq_num; /**< ZIO sequence number */
+	uint32_t dropped; /**< pages dropped for this client before this one */
+	uint32_t size; /**< full page size */
+	uint32_t offset; /**< offset of the data within the page */
+	uint32_t alarms; /**< zio_alarms | drv_alarms << 8 */
+	uint32_t marker; /**< marker offset in the page, 0xFFFFFFFF none */
+	uint64_t tstamp; /**< ZIO time stamp, ns */
+	uint64_t t_host; /**< CLOCK_REALTIME ns when the server read it */
+};
+
+#endif
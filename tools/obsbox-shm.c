@@ -0,0 +1,428 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "obsbox-common.h"
+#include "obsbox-shm.h"
+
+#define OBSHM_DESC_PER_SLOT 4
+#define OBSHM_ROUND(v, a) (((v) + (a) - 1) / (a) * (a))
+
+/* Shared (not private) futex: waiters and waker are different processes */
+static int obshm_futex(uint32_t *addr, int op, uint32_t val,
+		       const struct timespec *ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+static size_t obshm_layout(struct obshm *s, unsigned int n_slots,
+			   unsigned int n_desc, unsigned int max_readers)
+{
+	size_t off;
+
+	off = OBSHM_ROUND(sizeof(struct obshm_hdr), 64);
+	s->readers = (void *)(s->map + off);
+	off += max_readers * sizeof(struct obshm_reader_ent);
+	s->slots = (void *)(s->map + off);
+	off += OBSHM_ROUND(n_slots * sizeof(struct obshm_slot), 64);
+	s->desc = (void *)(s->map + off);
+	off += n_desc * sizeof(struct obshm_desc);
+
+	return OBSHM_ROUND(off, 4096);
+}
+
+static int obshm_map(struct obshm *s, size_t len)
+{
+	s->map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, s->fd, 0);
+	if (s->map == MAP_FAILED)
+		return -1;
+	s->map_len = len;
+	s->hdr = (void *)s->map;
+	return 0;
+}
+
+
+/**
+ * Create the ring, an old one with the same name is replaced
+ * @mode: permissions, readers need read and write access
+ * @return 0 on success, -1 on error
+ */
+int obshm_create(struct obshm *s, const char *name, unsigned int n_slots,
+		 uint32_t slot_size, unsigned int max_readers, mode_t mode)
+{
+	unsigned int n_desc = n_slots * OBSHM_DESC_PER_SLOT, i;
+	size_t data_off, len;
+
+	if (!n_slots || !slot_size || !max_readers ||
+	    n_slots >= OBSHM_WRITING || strlen(name) >= sizeof(s->name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	strcpy(s->name, name);
+	shm_unlink(name);
+	s->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+	if (s->fd < 0)
+		return -1;
+	/* exactly the requested mode, whatever the umask */
+	if (fchmod(s->fd, mode))
+		goto err;
+
+	/* offsets do not depend on the mapping address */
+	data_off = obshm_layout(s, n_slots, n_desc, max_readers);
+	slot_size = OBSHM_ROUND(slot_size, 64);
+	len = data_off + (size_t)n_slots * slot_size;
+	if (ftruncate(s->fd, len) || obshm_map(s, len))
+		goto err;
+	obshm_layout(s, n_slots, n_desc, max_readers);
+	s->data = s->map + data_off;
+
+	s->hdr->version = OBSHM_VERSION;
+	s->hdr->n_slots = n_slots;
+	s->hdr->n_desc = n_desc;
+	s->hdr->slot_size = slot_size;
+	s->hdr->max_readers = max_readers;
+	s->hdr->data_off = data_off;
+	s->hdr->writer_pid = getpid();
+	for (i = 0; i < n_slots; ++i)
+		s->slots[i].gen = ~0ULL;
+	for (i = 0; i < n_desc; ++i)
+		s->desc[i].seq = ~0ULL;
+	/* readers check the magic last */
+	__atomic_store_n(&s->hdr->magic, OBSHM_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+
+err:
+	close(s->fd);
+	shm_unlink(name);
+	return -1;
+}
+
+/**
+ * Take a slot nobody uses to read the next page into it
+ * @return the slot number, -1 when all the slots are held by readers:
+ *         the page must be dropped, the writer never waits
+ */
+int obshm_claim(struct obshm *s)
+{
+	unsigned int n = s->hdr->n_slots, i, k;
+	uint32_t ref;
+
+	for (i = 0; i < n; ++i) {
+		k = (s->cursor + i) % n;
+		ref = 0;
+		if (__atomic_compare_exchange_n(&s->slots[k].ref, &ref,
+						OBSHM_WRITING, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			s->cursor = k + 1;
+			return k;
+		}
+	}
+	__atomic_add_fetch(&s->hdr->drops, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+/**
+ * Give back a claimed slot without publishing it
+ */
+void obshm_unclaim(struct obshm *s, unsigned int slot)
+{
+	__atomic_store_n(&s->slots[slot].ref, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Publish the page in a claimed slot and wake up the readers
+ */
+void obshm_publish(struct obshm *s, unsigned int slot,
+		   const struct zio_control *zctrl, uint32_t len,
+		   uint32_t flags)
+{
+	struct obshm_hdr *h = s->hdr;
+	uint64_t idx = h->head;
+	struct obshm_desc *d = &s->desc[idx % h->n_desc];
+
+	/* the slot first: a reader that finds it must see the new gen */
+	s->slots[slot].gen = idx;
+	__atomic_store_n(&s->slots[slot].ref, 0, __ATOMIC_RELEASE);
+
+	/* then the descriptor, under its sequence lock */
+	__atomic_store_n(&d->seq, ~0ULL, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	d->slot = slot;
+	d->len = len;
+	d->seq_num = zctrl->seq_num;
+	d->alarms = zctrl->zio_alarms | (zctrl->drv_alarms << 8);
+	d->marker = obsbox_ctrl_marker(zctrl);
+	d->flags = flags;
+	d->tstamp = zctrl->tstamp.secs * 1000000000ULL + zctrl->tstamp.ticks;
+	d->t_host = obsbox_realtime_ns();
+	__atomic_store_n(&d->seq, idx, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&h->head, idx + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&h->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->waiters, __ATOMIC_SEQ_CST))
+		obshm_futex(&h->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+static void obshm_reader_clear(struct obshm *s, struct obshm_reader_ent *e)
+{
+	unsigned int i;
+
+	for (i = 0; i < OBSHM_MAX_HELD; ++i) {
+		if (!e->held[i])
+			continue;
+		__atomic_sub_fetch(&s->slots[e->held[i] - 1].ref, 1,
+				   __ATOMIC_RELEASE);
+		e->held[i] = 0;
+	}
+	__atomic_store_n(&e->pid, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Free the entries of readers that died without detaching, with the
+ * slots they were holding
+ * @return the number of readers reaped
+ */
+unsigned int obshm_reap(struct obshm *s)
+{
+	struct obshm_reader_ent *e;
+	unsigned int i, n = 0;
+	pid_t pid;
+
+	for (i = 0; i < s->hdr->max_readers; ++i) {
+		e = &s->readers[i];
+		pid = __atomic_load_n(&e->pid, __ATOMIC_ACQUIRE);
+		if (!pid || kill(pid, 0) == 0 || errno != ESRCH)
+			continue;
+		obshm_reader_clear(s, e);
+		n++;
+	}
+	return n;
+}
+
+/**
+ * Stop the ring: readers see the writer gone once they have read
+ * everything, and the name is removed
+ */
+void obshm_destroy(struct obshm *s)
+{
+	__atomic_store_n(&s->hdr->stopped, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&s->hdr->futex, 1, __ATOMIC_SEQ_CST);
+	obshm_futex(&s->hdr->futex, FUTEX_WAKE, INT_MAX, NULL);
+	shm_unlink(s->name);
+	munmap(s->map, s->map_len);
+	close(s->fd);
+}
+
+
+/**
+ * Attach to a ring as a reader, the first page is the next one published
+ * @return 0 on success, -1 on error
+ */
+int obshm_attach(struct obshm *s, const char *name)
+{
+	struct obshm_hdr *h;
+	struct stat st;
+	unsigned int i;
+	int32_t pid = 0;
+
+	if (strlen(name) >= sizeof(s->name)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(s, 0, sizeof(*s));
+	strcpy(s->name, name);
+	s->fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (s->fd < 0)
+		return -1;
+	if (fstat(s->fd, &st) || st.st_size < sizeof(*h) ||
+	    obshm_map(s, st.st_size))
+		goto err;
+	h = s->hdr;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != OBSHM_MAGIC ||
+	    h->version != OBSHM_VERSION ||
+	    h->data_off + (size_t)h->n_slots * h->slot_size > s->map_len) {
+		errno = EPROTO;
+		goto err_map;
+	}
+	obshm_layout(s, h->n_slots, h->n_desc, h->max_readers);
+	s->data = s->map + h->data_off;
+
+	for (i = 0; i < h->max_readers; ++i) {
+		s->me = &s->readers[i];
+		pid = 0;
+		if (__atomic_compare_exchange_n(&s->me->pid, &pid, getpid(), 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+	if (i == h->max_readers) {
+		errno = EBUSY;
+		goto err_map;
+	}
+	memset(s->me->held, 0, sizeof(s->me->held));
+	s->me->pages = 0;
+	s->me->gaps = 0;
+	s->me->next = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+
+	return 0;
+
+err_map:
+	munmap(s->map, s->map_len);
+err:
+	close(s->fd);
+	return -1;
+}
+
+/**
+ * Take a reference on the slot of page 'idx'
+ * @return 0 on success, -1 when the page is gone
+ */
+static int obshm_get(struct obshm *s, uint64_t idx, struct obshm_page *pg)
+{
+	struct obshm_desc *d = &s->desc[idx % s->hdr->n_desc];
+	struct obshm_slot *sl;
+	uint64_t seq;
+	uint32_t ref;
+	int i;
+
+	seq = __atomic_load_n(&d->seq, __ATOMIC_ACQUIRE);
+	if (seq != idx)
+		return -1;
+	memcpy(&pg->desc, d, sizeof(*d));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&d->seq, __ATOMIC_RELAXED) != idx ||
+	    pg->desc.slot >= s->hdr->n_slots)
+		return -1;
+
+	sl = &s->slots[pg->desc.slot];
+	ref = __atomic_load_n(&sl->ref, __ATOMIC_RELAXED);
+	do {
+		if (ref & OBSHM_WRITING)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&sl->ref, &ref, ref + 1, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+	/* the slot may have been reused between the descriptor and here */
+	if (__atomic_load_n(&sl->gen, __ATOMIC_ACQUIRE) != idx) {
+		__atomic_sub_fetch(&sl->ref, 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+	for (i = 0; i < OBSHM_MAX_HELD; ++i) {
+		if (!s->me->held[i]) {
+			s->me->held[i] = pg->desc.slot + 1;
+			break;
+		}
+	}
+	pg->data = obshm_slot_data(s, pg->desc.slot);
+	pg->index = idx;
+	return 0;
+}
+
+/**
+ * Wait for the next page and hold it, the data can be used in place
+ * until obshm_release(). When the reader is too slow, the pages that
+ * have been overwritten are skipped and counted in pg->gap.
+ * @return 1 with a page, 0 on timeout, -1 on error or when the writer
+ *         stopped and there is nothing more to read
+ */
+int obshm_next(struct obshm *s, struct obshm_page *pg, int timeout_ms)
+{
+	struct obshm_hdr *h = s->hdr;
+	struct obshm_reader_ent *me = s->me;
+	struct timespec ts = {
+		.tv_sec = timeout_ms / 1000,
+		.tv_nsec = (timeout_ms % 1000) * 1000000,
+	};
+	uint64_t idx = me->next, head, oldest;
+	uint32_t f;
+	int i;
+
+	for (i = 0; i < OBSHM_MAX_HELD && me->held[i]; ++i)
+		;
+	if (i == OBSHM_MAX_HELD) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	pg->gap = 0;
+	for (;;) {
+		f = __atomic_load_n(&h->futex, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+		if (idx >= head) {
+			if (__atomic_load_n(&h->stopped, __ATOMIC_ACQUIRE)) {
+				errno = EPIPE;
+				return -1;
+			}
+			if (!timeout_ms)
+				return 0;
+			__atomic_add_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+			i = obshm_futex(&h->futex, FUTEX_WAIT, f,
+					timeout_ms > 0 ? &ts : NULL);
+			__atomic_sub_fetch(&h->waiters, 1, __ATOMIC_SEQ_CST);
+			if (i && errno == ETIMEDOUT)
+				return 0;
+			continue;
+		}
+		if (!obshm_get(s, idx, pg))
+			break;
+		/* gone: jump to the oldest page that may still be there */
+		oldest = head > h->n_slots ? head - h->n_slots : 0;
+		oldest = oldest > idx + 1 ? oldest : idx + 1;
+		pg->gap += oldest - idx;
+		idx = oldest;
+	}
+	me->next = idx + 1;
+	me->pages++;
+	me->gaps += pg->gap;
+
+	return 1;
+}
+
+/**
+ * Release a page, its slot can be reused by the writer
+ */
+void obshm_release(struct obshm *s, struct obshm_page *pg)
+{
+	unsigned int i;
+
+	for (i = 0; i < OBSHM_MAX_HELD; ++i) {
+		if (s->me->held[i] == pg->desc.slot + 1) {
+			s->me->held[i] = 0;
+			break;
+		}
+	}
+	__atomic_sub_fetch(&s->slots[pg->desc.slot].ref, 1, __ATOMIC_RELEASE);
+	pg->data = NULL;
+}
+
+/**
+ * Release the pages still held and leave the ring
+ */
+void obshm_detach(struct obshm *s)
+{
+	obshm_reader_clear(s, s->me);
+	munmap(s->map, s->map_len);
+	close(s->fd);
+}
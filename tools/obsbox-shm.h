@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_SHM_H__
+#define __OBSBOX_SHM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/zio-user.h>
+
+/*
+ * Shared memory page ring, one writer (obsbox-shmd) and many readers.
+ *
+ *   +--------------------+ 0
+ *   | obshm_hdr          |
+ *   | readers[]          |
+ *   | slots[] (state)    |
+ *   | desc[] (ring)      |
+ *   +--------------------+ data_off, page aligned
+ *   | slot data          | n_slots * slot_size
+ *   +--------------------+
+ *
+ * Data lives in slots. A slot has a reference count: readers take a
+ * reference while they use the data in place, the writer only takes
+ * slots with no references, so it never waits for a reader. Pages are
+ * published in order through a ring of descriptors; a descriptor tells
+ * which slot holds the page. A reader that is too slow finds its next
+ * page already overwritten: it gets a gap notification and it continues
+ * from the oldest page still available.
+ */
+#define OBSHM_MAGIC 0x4D485342 /* "BSHM" */
+#define OBSHM_VERSION 1
+#define OBSHM_NAME_FMT "/obsbox-%04x"
+#define OBSHM_WRITING 0x80000000 /* slot ref: the writer owns it */
+#define OBSHM_MAX_HELD 8 /* slots a reader can hold at the same time */
+/*
+ * Readers write their references in the ring, so whoever can open it
+ * can corrupt it for everybody: by default only the owner
+ */
+#define OBSHM_MODE_DEF 0600
+
+#define OBSHM_PAGE_LOST (1 << 0) /* the writer lost pages before this */
+
+struct obshm_reader_ent {
+	int32_t pid; /**< 0 when the entry is free */
+	uint32_t held[OBSHM_MAX_HELD]; /**< slot + 1 for every held slot */
+	uint64_t next; /**< next page the reader wants */
+	uint64_t pages, gaps;
+} __attribute__((aligned(64)));
+
+struct obshm_slot {
+	uint32_t ref; /**< readers, or OBSHM_WRITING */
+	uint32_t pad;
+	uint64_t gen; /**< index of the page in the slot */
+};
+
+struct obshm_desc {
+	uint64_t seq; /**< page index, ~0 while it is updated */
+	uint32_t slot;
+	uint32_t len;
+	uint32_t seq_num; /**< ZIO sequence number */
+	uint32_t alarms; /**< zio_alarms | drv_alarms << 8 */
+	uint32_t marker;
+	uint32_t flags; /**< OBSHM_PAGE_* */
+	uint64_t tstamp; /**< ZIO time stamp, ns */
+	uint64_t t_host; /**< CLOCK_REALTIME ns */
+};
+
+struct obshm_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t n_slots;
+	uint32_t n_desc;
+	uint32_t slot_size;
+	uint32_t max_readers;
+	uint64_t data_off;
+	int32_t writer_pid;
+	uint32_t stopped; /**< the writer terminated */
+	uint64_t drops; /**< pages dropped because all slots were held */
+
+	/* written by the writer at every page, on its own cache line */
+	uint64_t head __attribute__((aligned(64))); /**< next page index */
+	uint32_t futex; /**< incremented at every page, readers sleep on it */
+	uint32_t waiters; /**< readers sleeping on futex */
+};
+
+/**
+ * A mapping of the ring, writer or reader side
+ */
+struct obshm {
+	int fd;
+	size_t map_len;
+	uint8_t *map;
+	struct obshm_hdr *hdr;
+	struct obshm_reader_ent *readers;
+	struct obshm_slot *slots;
+	struct obshm_desc *desc;
+	uint8_t *data;
+	char name[64];
+
+	/* writer */
+	unsigned int cursor; /**< where to look for the next free slot */
+	/* reader */
+	struct obshm_reader_ent *me;
+};
+
+/**
+ * A page held by a reader, data is in shared memory
+ */
+struct obshm_page {
+	struct obshm_desc desc;
+	uint8_t *data;
+	uint64_t index; /**< page index in the ring */
+	uint64_t gap; /**< pages missed just before this one */
+};
+
+static inline uint8_t *obshm_slot_data(struct obshm *s, unsigned int slot)
+{
+	return s->data + (size_t)slot * s->hdr->slot_size;
+}
+
+/* Writer */
+extern int obshm_create(struct obshm *s, const char *name,
+			unsigned int n_slots, uint32_t slot_size,
+			unsigned int max_readers, mode_t mode);
+extern int obshm_claim(struct obshm *s);
+extern void obshm_publish(struct obshm *s, unsigned int slot,
+			  const struct zio_control *zctrl, uint32_t len,
+			  uint32_t flags);
+extern void obshm_unclaim(struct obshm *s, unsigned int slot);
+extern unsigned int obshm_reap(struct obshm *s);
+extern void obshm_destroy(struct obshm *s);
+
+/* Reader */
+extern int obshm_attach(struct obshm *s, const char *name);
+extern int obshm_next(struct obshm *s, struct obshm_page *pg,
+		      int timeout_ms);
+extern void obshm_release(struct obshm *s, struct obshm_page *pg);
+extern void obshm_detach(struct obshm *s);
+
+#endif
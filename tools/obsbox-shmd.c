@@ -0,0 +1,337 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <linux/zio-user.h>
+
+#include "libobsbox.h"
+#include "obsbox-capture.h"
+#include "obsbox-shm.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+static char zio_git_version[] = "zio version: " ZIO_GIT_VERSION;
+
+#define OBSHMD_SLOTS_DEF 32
+#define OBSHMD_READERS_DEF 16
+
+static volatile sig_atomic_t obshmd_stop;
+static uint64_t st_pages;
+static struct obsbox_seq seq;
+static uint8_t *drop_buf, *tmp_buf;
+static uint32_t page_max;
+static uint32_t lost_flag; /**< OBSHM_PAGE_LOST for the next page */
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-shmd -d 0x<devid> -p <page_size> [OPTIONS]\"\n");
+	fprintf(stderr, "devid: board device id\n");
+	fprintf(stderr, " -p <number>: acquisition block page_size\n");
+	fprintf(stderr, " -v <number>: allocate <number>Bytes with vmalloc for block's pool\n");
+	fprintf(stderr, " -f <file>: publish the pages of a capture file instead of the device\n");
+	fprintf(stderr, " -R <number>: with -f, pages per second (default: 100)\n");
+	fprintf(stderr, " -s <name>: shared memory name (default " OBSHM_NAME_FMT ")\n",
+		0);
+	fprintf(stderr, " -S <number>: slots in the ring (default %d)\n",
+		OBSHMD_SLOTS_DEF);
+	fprintf(stderr, " -r <number>: maximum number of readers (default %d)\n",
+		OBSHMD_READERS_DEF);
+	fprintf(stderr, " -m <octal>: permissions of the shared memory (default %04o, owner only)\n",
+		OBSHM_MODE_DEF);
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It owns the device and publishes the pages in a shared memory ring,\n"
+			"readers use them in place (see obsbox-shm.h and obsbox-shmtap)\n");
+	exit(1);
+}
+
+static void print_version(char *pname)
+{
+	printf("%s %s\n", pname, git_version);
+	printf("%s\n", zio_git_version);
+}
+
+static void obshmd_sighandler(int sig)
+{
+	obshmd_stop = 1;
+}
+
+
+static void obshmd_publish(struct obshm *s, int slot,
+			   struct zio_control *zctrl, uint32_t len)
+{
+	uint64_t lost = seq.lost;
+
+	obsbox_seq_update(&seq, zctrl->seq_num);
+	if (seq.lost != lost)
+		lost_flag = OBSHM_PAGE_LOST;
+	if (slot < 0) {
+		lost_flag = OBSHM_PAGE_LOST;
+		return;
+	}
+	obshm_publish(s, slot, zctrl, len, lost_flag);
+	lost_flag = 0;
+	st_pages++;
+}
+
+/**
+ * Read a page from the device directly into a free slot, into the drop
+ * buffer when the readers hold all of them
+ * @return 0 on success, -1 on error
+ */
+static int obshmd_dev_read(struct obshm *s, struct obdev *d)
+{
+	struct zio_control zctrl;
+	uint32_t len, done = 0;
+	uint8_t *buf;
+	int slot, n;
+
+	if (obdev_ctrl_read(d, &zctrl))
+		return -1;
+	len = obsbox_ctrl_len(&zctrl);
+	if (len > page_max) {
+		fprintf(stderr, "obsbox-shmd: page of %u bytes, max is %u\n",
+			len, page_max);
+		return -1;
+	}
+	slot = obshm_claim(s);
+	buf = slot < 0 ? drop_buf : obshm_slot_data(s, slot);
+	while (done < len) {
+		n = read(d->fdd, buf + done, len - done);
+		if (n <= 0) {
+			fprintf(stderr, "obsbox-shmd: cannot read data: %s\n",
+				n < 0 ? strerror(errno) : "EOF");
+			if (slot >= 0)
+				obshm_unclaim(s, slot);
+			return -1;
+		}
+		done += n;
+	}
+	obshmd_publish(s, slot, &zctrl, len);
+	return 0;
+}
+
+/**
+ * Publish the next page of the capture file, in loop
+ * @return 0 on success, -1 on error
+ */
+static int obshmd_file_read(struct obshm *s, struct obcap_reader *r,
+			    uint64_t *next)
+{
+	struct obcap_page_hdr *ph;
+	struct zio_control zctrl;
+	uint8_t *data;
+	int slot;
+
+	ph = obcap_page(r, *next % r->count, &data);
+	obcap_page_ctrl(ph, &zctrl);
+	zctrl.seq_num += (*next / r->count) * r->count;
+	(*next)++;
+
+	slot = obshm_claim(s);
+	if (slot >= 0 && obcap_page_decode(ph, data, obshm_slot_data(s, slot),
+					   tmp_buf)) {
+		fprintf(stderr, "obsbox-shmd: cannot use page %llu\n",
+			(unsigned long long)((*next - 1) % r->count));
+		obshm_unclaim(s, slot);
+		return -1;
+	}
+	obshmd_publish(s, slot, &zctrl, ph->size);
+
+	return 0;
+}
+
+
+static void obshmd_report(struct obshm *s)
+{
+	struct obshm_reader_ent *e;
+	uint64_t head = s->hdr->head;
+	unsigned int i, n = 0, reaped;
+
+	reaped = obshm_reap(s);
+	fprintf(stderr, "pages %llu lost %llu slot-drops %llu | reaped %u\n",
+		(unsigned long long)st_pages, (unsigned long long)seq.lost,
+		(unsigned long long)s->hdr->drops, reaped);
+	for (i = 0; i < s->hdr->max_readers; ++i) {
+		e = &s->readers[i];
+		if (!e->pid)
+			continue;
+		fprintf(stderr, "  reader %d: pages %llu lag %llu gaps %llu\n",
+			e->pid, (unsigned long long)e->pages,
+			(unsigned long long)(head > e->next ? head - e->next : 0),
+			(unsigned long long)e->gaps);
+		n++;
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	uint32_t devid = 0, page_size = 0, vmalloc_size = 0, rate = 100;
+	unsigned int n_slots = OBSHMD_SLOTS_DEF, max_readers = OBSHMD_READERS_DEF;
+	unsigned int mode = OBSHM_MODE_DEF;
+	char *file = NULL, *name = NULL, name_def[32];
+	struct timespec t_next;
+	struct obcap_reader r;
+	struct obshm s;
+	uint64_t next = 0, t_last;
+	int c, ret, err = 1;
+	struct obdev d;
+
+	while ((c = getopt (argc, argv, "hd:p:v:f:R:s:S:r:m:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%u", &page_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'v':
+			ret = sscanf(optarg, "%u", &vmalloc_size);
+			if (ret != 1)
+				help();
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'R':
+			ret = sscanf(optarg, "%u", &rate);
+			if (ret != 1 || !rate)
+				help();
+			break;
+		case 's':
+			name = optarg;
+			break;
+		case 'S':
+			ret = sscanf(optarg, "%u", &n_slots);
+			if (ret != 1 || !n_slots)
+				help();
+			break;
+		case 'r':
+			ret = sscanf(optarg, "%u", &max_readers);
+			if (ret != 1 || !max_readers)
+				help();
+			break;
+		case 'm':
+			ret = sscanf(optarg, "%o", &mode);
+			if (ret != 1 || mode & ~0777)
+				help();
+			break;
+		case 'V':
+			print_version(argv[0]);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (file) {
+		if (obcap_open(&r, file) || !r.count) {
+			fprintf(stderr, "Cannot use capture %s: %s\n", file,
+				r.count ? strerror(errno) : "empty");
+			exit(1);
+		}
+		for (next = 0; next < r.count; ++next)
+			if (obcap_page(&r, next, NULL)->size > page_size)
+				page_size = obcap_page(&r, next, NULL)->size;
+		next = 0;
+	}
+	if (!page_size)
+		help();
+	if (!name) {
+		snprintf(name_def, sizeof(name_def), OBSHM_NAME_FMT, devid);
+		name = name_def;
+	}
+
+	page_max = page_size;
+	drop_buf = malloc(page_size);
+	tmp_buf = malloc(page_size);
+	if (!drop_buf || !tmp_buf)
+		exit(1);
+	if (obshm_create(&s, name, n_slots, page_size, max_readers, mode)) {
+		fprintf(stderr, "Cannot create shared memory %s: %s\n", name,
+			strerror(errno));
+		exit(1);
+	}
+	fprintf(stderr, "%s: %u slots of %u bytes, up to %u readers\n", name,
+		n_slots, s.hdr->slot_size, max_readers);
+
+	signal(SIGINT, obshmd_sighandler);
+	signal(SIGTERM, obshmd_sighandler);
+
+	if (!file) {
+		if (obdev_open(&d, devid)) {
+			fprintf(stderr, "Cannot open ZIO char devices: %s\n",
+				strerror(errno));
+			goto out_shm;
+		}
+		ret = obdev_configure(&d, 1, page_size, vmalloc_size);
+		if (ret) {
+			fprintf(stderr,
+				"Something wrong during the configuration: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		ret = obdev_run(&d, 1);
+		if (ret < 0) {
+			fprintf(stderr, "Cannot start acquisition: %s\n",
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_next);
+	t_last = obsbox_now_ns();
+	while (!obshmd_stop) {
+		if (file) {
+			t_next.tv_nsec += 1000000000 / rate;
+			while (t_next.tv_nsec >= 1000000000) {
+				t_next.tv_nsec -= 1000000000;
+				t_next.tv_sec++;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t_next,
+					NULL);
+			if (obshmd_file_read(&s, &r, &next))
+				break;
+		} else {
+			ret = obsbox_ctrl_wait(d.fdc, 1000);
+			if (ret < 0 && errno != EINTR)
+				break;
+			if (ret > 0 && obshmd_dev_read(&s, &d))
+				break;
+		}
+		if (obsbox_now_ns() - t_last >= 1000000000ULL) {
+			t_last = obsbox_now_ns();
+			obshmd_report(&s);
+		}
+	}
+	err = !obshmd_stop;
+
+out:
+	if (!file) {
+		obdev_run(&d, 0);
+		obdev_close(&d);
+	}
+out_shm:
+	obshmd_report(&s);
+	obshm_destroy(&s);
+	exit(err);
+}
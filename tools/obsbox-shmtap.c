@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "obsbox-common.h"
+#include "obsbox-shm.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+static volatile sig_atomic_t obtap_stop;
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-shmtap [OPTIONS]\"\n");
+	fprintf(stderr, " -d 0x<devid>: attach to the ring of this board (default 0x0000)\n");
+	fprintf(stderr, " -s <name>: attach to this shared memory instead\n");
+	fprintf(stderr, " -n <number>: number of pages to read (default: until SIGINT)\n");
+	fprintf(stderr, " -o <file>: write the pages to file ('-' for stdout)\n");
+	fprintf(stderr, " -w <usec>: hold every page this long, to play a slow reader\n");
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It reads the pages published by obsbox-shmd in place and prints\n"
+			"statistics every second\n");
+	exit(1);
+}
+
+static void obtap_sighandler(int sig)
+{
+	obtap_stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t pages = 0, bytes = 0, gaps = 0, lost = 0, t_start, t_last;
+	uint64_t p_last = 0, b_last = 0, lat_sum = 0;
+	char *name = NULL, *out = NULL, name_def[32];
+	struct obsbox_seq seq = {0};
+	struct obshm_page pg;
+	struct obshm s;
+	uint32_t devid = 0, work_us = 0;
+	int c, ret, fdo = -1;
+	long n = -1;
+
+	while ((c = getopt (argc, argv, "hd:s:n:o:w:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'd':
+			ret = sscanf(optarg, "0x%x", &devid);
+			if (ret != 1)
+				help();
+			break;
+		case 's':
+			name = optarg;
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%ld", &n);
+			if (ret != 1)
+				help();
+			break;
+		case 'o':
+			out = optarg;
+			break;
+		case 'w':
+			ret = sscanf(optarg, "%u", &work_us);
+			if (ret != 1)
+				help();
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (!name) {
+		snprintf(name_def, sizeof(name_def), OBSHM_NAME_FMT, devid);
+		name = name_def;
+	}
+	if (obshm_attach(&s, name)) {
+		fprintf(stderr, "Cannot attach to %s: %s\n", name,
+			strerror(errno));
+		exit(1);
+	}
+	if (out) {
+		fdo = strcmp(out, "-") ? open(out, O_WRONLY | O_CREAT | O_TRUNC,
+					      0644) : STDOUT_FILENO;
+		if (fdo < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n", out,
+				strerror(errno));
+			obshm_detach(&s);
+			exit(1);
+		}
+	}
+
+	signal(SIGINT, obtap_sighandler);
+	signal(SIGTERM, obtap_sighandler);
+
+	t_start = t_last = obsbox_now_ns();
+	while (n && !obtap_stop) {
+		ret = obshm_next(&s, &pg, 1000);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			if (fdo >= 0 &&
+			    write(fdo, pg.data, pg.desc.len) != pg.desc.len) {
+				fprintf(stderr, "obsbox-shmtap: write(): %s\n",
+					strerror(errno));
+				break;
+			}
+			if (work_us)
+				usleep(work_us);
+			if (!pg.gap)
+				obsbox_seq_update(&seq, pg.desc.seq_num);
+			else
+				seq.last = pg.desc.seq_num;
+			gaps += pg.gap;
+			lost += !!(pg.desc.flags & OBSHM_PAGE_LOST);
+			pages++;
+			bytes += pg.desc.len;
+			lat_sum += obsbox_realtime_ns() - pg.desc.t_host;
+			obshm_release(&s, &pg);
+			if (n > 0)
+				n--;
+		}
+
+		if (obsbox_now_ns() - t_last >= 1000000000ULL) {
+			double dt = (obsbox_now_ns() - t_last) / 1e9;
+
+			fprintf(stderr, "%.1f MB/s %.1f pages/s | pages %llu gaps %llu writer losses %llu seq holes %llu | lag %llu | latency us %llu\n",
+				(bytes - b_last) / dt / 1e6,
+				(pages - p_last) / dt,
+				(unsigned long long)pages,
+				(unsigned long long)gaps,
+				(unsigned long long)lost,
+				(unsigned long long)seq.lost,
+				(unsigned long long)(s.hdr->head - s.me->next),
+				(unsigned long long)(pages > p_last ?
+					lat_sum / (pages - p_last) / 1000 : 0));
+			lat_sum = 0;
+			t_last = obsbox_now_ns();
+			b_last = bytes;
+			p_last = pages;
+		}
+	}
+	fprintf(stderr, "TOTAL: %.1f MB/s | pages %llu gaps %llu writer losses %llu seq holes %llu\n",
+		bytes / ((obsbox_now_ns() - t_start) / 1e9) / 1e6,
+		(unsigned long long)pages, (unsigned long long)gaps,
+		(unsigned long long)lost, (unsigned long long)seq.lost);
+	obshm_detach(&s);
+
+	exit(0);
+}
@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "obsbox-stats.h"
+
+/*
+ * Turns folded together in registers by the vector kernels, before the
+ * accumulators in memory are updated. Sums of 8 bit samples over a group
+ * stay in 16 bit.
+ */
+#define OBST_GROUP 16
+
+/**
+ * A set of kernels
+ * @run: fold 'len' samples into consecutive slots from 'slot'
+ * @turns: fold 'n_turns' full turns, the first sample is slot 0
+ */
+struct obst_kernel {
+	const char *name;
+	void (*run)(struct obst *st, unsigned int slot, const uint8_t *data,
+		    unsigned int len);
+	void (*turns)(struct obst *st, const uint8_t *data,
+		      unsigned int n_turns);
+};
+
+static const struct obst_kernel *obst_k;
+
+
+/**
+ * Generic implementation, samples go to consecutive slots
+ */
+static void obst_run_generic(struct obst *st, unsigned int slot,
+			     const uint8_t *data, unsigned int len)
+{
+	uint32_t *psum = st->psum + slot, *psum2 = st->psum2 + slot;
+	uint8_t *min = st->min + slot, *max = st->max + slot;
+	unsigned int i;
+	uint32_t v;
+
+	for (i = 0; i < len; ++i) {
+		v = data[i];
+		psum[i] += v;
+		psum2[i] += v * v;
+		if (v < min[i])
+			min[i] = v;
+		if (v > max[i])
+			max[i] = v;
+	}
+}
+
+static void obst_turns_generic(struct obst *st, const uint8_t *data,
+			       unsigned int n_turns)
+{
+	unsigned int t;
+
+	for (t = 0; t < n_turns; ++t)
+		obst_run_generic(st, 0, data + (size_t)t * st->n_slots,
+				 st->n_slots);
+}
+
+#if defined(__x86_64__)
+/**
+ * SSE4.1 implementation, 16 slots at a time
+ */
+__attribute__((target("sse4.1")))
+static void obst_run_sse41(struct obst *st, unsigned int slot,
+			   const uint8_t *data, unsigned int len)
+{
+	uint32_t *psum = st->psum + slot, *psum2 = st->psum2 + slot;
+	uint8_t *min = st->min + slot, *max = st->max + slot;
+	__m128i v, w[2], q, *p;
+	unsigned int i, h, k;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(data + i));
+		p = (__m128i *)(min + i);
+		_mm_storeu_si128(p, _mm_min_epu8(_mm_loadu_si128(p), v));
+		p = (__m128i *)(max + i);
+		_mm_storeu_si128(p, _mm_max_epu8(_mm_loadu_si128(p), v));
+
+		/* 8 bit to 16 bit, the square fits in 16 bit unsigned */
+		w[0] = _mm_cvtepu8_epi16(v);
+		w[1] = _mm_cvtepu8_epi16(_mm_srli_si128(v, 8));
+		for (h = 0; h < 2; ++h) {
+			q = _mm_mullo_epi16(w[h], w[h]);
+			for (k = 0; k < 2; ++k) {
+				p = (__m128i *)(psum + i + h * 8 + k * 4);
+				_mm_storeu_si128(p, _mm_add_epi32(
+					_mm_loadu_si128(p),
+					_mm_cvtepu16_epi32(k ? _mm_srli_si128(w[h], 8) : w[h])));
+				p = (__m128i *)(psum2 + i + h * 8 + k * 4);
+				_mm_storeu_si128(p, _mm_add_epi32(
+					_mm_loadu_si128(p),
+					_mm_cvtepu16_epi32(k ? _mm_srli_si128(q, 8) : q)));
+			}
+		}
+	}
+	obst_run_generic(st, slot + i, data + i, len - i);
+}
+
+__attribute__((target("sse4.1")))
+static inline void obst_add_sse41(uint32_t *acc, __m128i v)
+{
+	_mm_storeu_si128((__m128i *)acc,
+			 _mm_add_epi32(_mm_loadu_si128((__m128i *)acc), v));
+}
+
+/**
+ * SSE4.1 implementation of full turns: groups of turns are folded in
+ * registers. The squares of two turns are interleaved, so that one
+ * multiply-add gives the sum of both for four slots.
+ */
+__attribute__((target("sse4.1")))
+static void obst_turns_sse41(struct obst *st, const uint8_t *data,
+			     unsigned int n_turns)
+{
+	unsigned int n = st->n_slots, t0, t, g, j, h;
+	const uint8_t *d;
+	__m128i a, b, a16[2], b16[2], s[2], q[4], mn, mx, x;
+
+	for (t0 = 0; t0 < n_turns; t0 += OBST_GROUP) {
+		g = n_turns - t0 < OBST_GROUP ? n_turns - t0 : OBST_GROUP;
+		d = data + (size_t)t0 * n;
+		for (j = 0; j + 16 <= n; j += 16) {
+			s[0] = s[1] = _mm_setzero_si128();
+			q[0] = q[1] = q[2] = q[3] = _mm_setzero_si128();
+			mn = _mm_loadu_si128((__m128i *)(st->min + j));
+			mx = _mm_loadu_si128((__m128i *)(st->max + j));
+			for (t = 0; t < g; t += 2) {
+				a = _mm_loadu_si128((const __m128i *)(d + (size_t)t * n + j));
+				mn = _mm_min_epu8(mn, a);
+				mx = _mm_max_epu8(mx, a);
+				if (t + 1 < g) {
+					b = _mm_loadu_si128((const __m128i *)(d + (size_t)(t + 1) * n + j));
+					mn = _mm_min_epu8(mn, b);
+					mx = _mm_max_epu8(mx, b);
+				} else {
+					b = _mm_setzero_si128();
+				}
+				a16[0] = _mm_cvtepu8_epi16(a);
+				a16[1] = _mm_cvtepu8_epi16(_mm_srli_si128(a, 8));
+				b16[0] = _mm_cvtepu8_epi16(b);
+				b16[1] = _mm_cvtepu8_epi16(_mm_srli_si128(b, 8));
+				for (h = 0; h < 2; ++h) {
+					s[h] = _mm_add_epi16(s[h], _mm_add_epi16(a16[h], b16[h]));
+					x = _mm_unpacklo_epi16(a16[h], b16[h]);
+					q[h * 2] = _mm_add_epi32(q[h * 2], _mm_madd_epi16(x, x));
+					x = _mm_unpackhi_epi16(a16[h], b16[h]);
+					q[h * 2 + 1] = _mm_add_epi32(q[h * 2 + 1], _mm_madd_epi16(x, x));
+				}
+			}
+			_mm_storeu_si128((__m128i *)(st->min + j), mn);
+			_mm_storeu_si128((__m128i *)(st->max + j), mx);
+			for (h = 0; h < 2; ++h) {
+				obst_add_sse41(st->psum + j + h * 8,
+					       _mm_cvtepu16_epi32(s[h]));
+				obst_add_sse41(st->psum + j + h * 8 + 4,
+					       _mm_cvtepu16_epi32(_mm_srli_si128(s[h], 8)));
+				obst_add_sse41(st->psum2 + j + h * 8, q[h * 2]);
+				obst_add_sse41(st->psum2 + j + h * 8 + 4, q[h * 2 + 1]);
+			}
+		}
+		for (t = 0; j < n && t < g; ++t)
+			obst_run_generic(st, j, d + (size_t)t * n + j, n - j);
+	}
+}
+
+/**
+ * AVX2 implementation, 32 slots at a time
+ */
+__attribute__((target("avx2")))
+static void obst_run_avx2(struct obst *st, unsigned int slot,
+			  const uint8_t *data, unsigned int len)
+{
+	uint32_t *psum = st->psum + slot, *psum2 = st->psum2 + slot;
+	uint8_t *min = st->min + slot, *max = st->max + slot;
+	__m256i v, w[2], q, *p;
+	unsigned int i, h, k;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(data + i));
+		p = (__m256i *)(min + i);
+		_mm256_storeu_si256(p, _mm256_min_epu8(_mm256_loadu_si256(p), v));
+		p = (__m256i *)(max + i);
+		_mm256_storeu_si256(p, _mm256_max_epu8(_mm256_loadu_si256(p), v));
+
+		w[0] = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v));
+		w[1] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1));
+		for (h = 0; h < 2; ++h) {
+			q = _mm256_mullo_epi16(w[h], w[h]);
+			for (k = 0; k < 2; ++k) {
+				p = (__m256i *)(psum + i + h * 16 + k * 8);
+				_mm256_storeu_si256(p, _mm256_add_epi32(
+					_mm256_loadu_si256(p),
+					_mm256_cvtepu16_epi32(k ?
+						_mm256_extracti128_si256(w[h], 1) :
+						_mm256_castsi256_si128(w[h]))));
+				p = (__m256i *)(psum2 + i + h * 16 + k * 8);
+				_mm256_storeu_si256(p, _mm256_add_epi32(
+					_mm256_loadu_si256(p),
+					_mm256_cvtepu16_epi32(k ?
+						_mm256_extracti128_si256(q, 1) :
+						_mm256_castsi256_si128(q))));
+			}
+		}
+	}
+	obst_run_generic(st, slot + i, data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline void obst_add_avx2(uint32_t *acc, __m256i v)
+{
+	_mm256_storeu_si256((__m256i *)acc,
+			    _mm256_add_epi32(_mm256_loadu_si256((__m256i *)acc), v));
+}
+
+/**
+ * AVX2 implementation of full turns, as the SSE4.1 one. The unpack
+ * instructions work within 128 bit lanes: the squares come out as slots
+ * 0-3 and 8-11 in one register, 4-7 and 12-15 in the other one.
+ */
+__attribute__((target("avx2")))
+static void obst_turns_avx2(struct obst *st, const uint8_t *data,
+			    unsigned int n_turns)
+{
+	unsigned int n = st->n_slots, t0, t, g, j, h;
+	const uint8_t *d;
+	__m256i a, b, a16[2], b16[2], s[2], q[4], mn, mx, x;
+
+	for (t0 = 0; t0 < n_turns; t0 += OBST_GROUP) {
+		g = n_turns - t0 < OBST_GROUP ? n_turns - t0 : OBST_GROUP;
+		d = data + (size_t)t0 * n;
+		for (j = 0; j + 32 <= n; j += 32) {
+			s[0] = s[1] = _mm256_setzero_si256();
+			q[0] = q[1] = q[2] = q[3] = _mm256_setzero_si256();
+			mn = _mm256_loadu_si256((__m256i *)(st->min + j));
+			mx = _mm256_loadu_si256((__m256i *)(st->max + j));
+			for (t = 0; t < g; t += 2) {
+				a = _mm256_loadu_si256((const __m256i *)(d + (size_t)t * n + j));
+				mn = _mm256_min_epu8(mn, a);
+				mx = _mm256_max_epu8(mx, a);
+				if (t + 1 < g) {
+					b = _mm256_loadu_si256((const __m256i *)(d + (size_t)(t + 1) * n + j));
+					mn = _mm256_min_epu8(mn, b);
+					mx = _mm256_max_epu8(mx, b);
+				} else {
+					b = _mm256_setzero_si256();
+				}
+				a16[0] = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a));
+				a16[1] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1));
+				b16[0] = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b));
+				b16[1] = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1));
+				for (h = 0; h < 2; ++h) {
+					s[h] = _mm256_add_epi16(s[h], _mm256_add_epi16(a16[h], b16[h]));
+					x = _mm256_unpacklo_epi16(a16[h], b16[h]);
+					q[h * 2] = _mm256_add_epi32(q[h * 2], _mm256_madd_epi16(x, x));
+					x = _mm256_unpackhi_epi16(a16[h], b16[h]);
+					q[h * 2 + 1] = _mm256_add_epi32(q[h * 2 + 1], _mm256_madd_epi16(x, x));
+				}
+			}
+			_mm256_storeu_si256((__m256i *)(st->min + j), mn);
+			_mm256_storeu_si256((__m256i *)(st->max + j), mx);
+			for (h = 0; h < 2; ++h) {
+				obst_add_avx2(st->psum + j + h * 16,
+					      _mm256_cvtepu16_epi32(_mm256_castsi256_si128(s[h])));
+				obst_add_avx2(st->psum + j + h * 16 + 8,
+					      _mm256_cvtepu16_epi32(_mm256_extracti128_si256(s[h], 1)));
+				obst_add_avx2(st->psum2 + j + h * 16,
+					      _mm256_permute2x128_si256(q[h * 2], q[h * 2 + 1], 0x20));
+				obst_add_avx2(st->psum2 + j + h * 16 + 8,
+					      _mm256_permute2x128_si256(q[h * 2], q[h * 2 + 1], 0x31));
+			}
+		}
+		for (t = 0; j < n && t < g; ++t)
+			obst_run_generic(st, j, d + (size_t)t * n + j, n - j);
+	}
+}
+#endif
+
+static const struct obst_kernel obst_kernels[] = {
+	{"generic", obst_run_generic, obst_turns_generic},
+#if defined(__x86_64__)
+	{"sse4.1", obst_run_sse41, obst_turns_sse41},
+	{"avx2", obst_run_avx2, obst_turns_avx2},
+#endif
+	{NULL},
+};
+
+static int obst_kernel_supported(const struct obst_kernel *k)
+{
+#if defined(__x86_64__)
+	if (k->run == obst_run_sse41)
+		return __builtin_cpu_supports("sse4.1");
+	if (k->run == obst_run_avx2)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+/* the last supported kernel in the table is the best one */
+static void obst_kernel_init(void)
+{
+	const struct obst_kernel *k;
+
+	if (obst_k)
+		return;
+	for (k = obst_kernels; k->name; ++k)
+		if (obst_kernel_supported(k))
+			obst_k = k;
+}
+
+const char *obst_impl(void)
+{
+	obst_kernel_init();
+	return obst_k->name;
+}
+
+/**
+ * Force a kernel, for benchmarks
+ * @return 0 on success, -1 when it is unknown or the CPU lacks it
+ */
+int obst_impl_set(const char *name)
+{
+	const struct obst_kernel *k;
+
+	for (k = obst_kernels; k->name; ++k) {
+		if (strcmp(k->name, name) || !obst_kernel_supported(k))
+			continue;
+		obst_k = k;
+		return 0;
+	}
+	errno = ENOTSUP;
+	return -1;
+}
+
+
+/**
+ * Allocate the accumulators for a turn of n_slots samples
+ * @return 0 on success, -1 on error
+ */
+int obst_init(struct obst *st, unsigned int n_slots)
+{
+	memset(st, 0, sizeof(*st));
+	if (!n_slots) {
+		errno = EINVAL;
+		return -1;
+	}
+	obst_kernel_init();
+	st->n_slots = n_slots;
+	st->psum = calloc(n_slots, sizeof(*st->psum));
+	st->psum2 = calloc(n_slots, sizeof(*st->psum2));
+	st->sum = calloc(n_slots, sizeof(*st->sum));
+	st->sum2 = calloc(n_slots, sizeof(*st->sum2));
+	st->count = calloc(n_slots, sizeof(*st->count));
+	st->min = malloc(n_slots);
+	st->max = malloc(n_slots);
+	if (!st->psum || !st->psum2 || !st->sum || !st->sum2 || !st->count ||
+	    !st->min || !st->max) {
+		obst_free(st);
+		errno = ENOMEM;
+		return -1;
+	}
+	obst_reset(st);
+
+	return 0;
+}
+
+void obst_free(struct obst *st)
+{
+	free(st->psum);
+	free(st->psum2);
+	free(st->sum);
+	free(st->sum2);
+	free(st->count);
+	free(st->min);
+	free(st->max);
+	memset(st, 0, sizeof(*st));
+}
+
+/**
+ * Clear the statistics, the turn phase does not change
+ */
+void obst_reset(struct obst *st)
+{
+	size_t n = st->n_slots;
+
+	memset(st->psum, 0, n * sizeof(*st->psum));
+	memset(st->psum2, 0, n * sizeof(*st->psum2));
+	memset(st->sum, 0, n * sizeof(*st->sum));
+	memset(st->sum2, 0, n * sizeof(*st->sum2));
+	memset(st->count, 0, n * sizeof(*st->count));
+	memset(st->min, 0xFF, n);
+	memset(st->max, 0, n);
+	st->pending = 0;
+	st->turns = 0;
+}
+
+/**
+ * The next page has the first sample of a turn (slot 0) at 'offset'
+ */
+void obst_align(struct obst *st, uint32_t offset)
+{
+	st->pos = (st->n_slots - offset % st->n_slots) % st->n_slots;
+}
+
+static void obst_flush(struct obst *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->n_slots; ++i) {
+		st->sum[i] += st->psum[i];
+		st->sum2[i] += st->psum2[i];
+	}
+	memset(st->psum, 0, st->n_slots * sizeof(*st->psum));
+	memset(st->psum2, 0, st->n_slots * sizeof(*st->psum2));
+	st->pending = 0;
+}
+
+/**
+ * Add the samples of a page to the statistics
+ */
+void obst_fold(struct obst *st, const uint8_t *data, size_t len)
+{
+	unsigned int n, i;
+
+	while (len) {
+		/* every segment adds at most one sample per slot */
+		if (st->pending == OBST_FLUSH_TURNS)
+			obst_flush(st);
+		if (!st->pos && len >= 2 * st->n_slots) {
+			n = len / st->n_slots;
+			if (n > OBST_FLUSH_TURNS - st->pending)
+				n = OBST_FLUSH_TURNS - st->pending;
+			obst_k->turns(st, data, n);
+			st->turns += n;
+			st->pending += n;
+			data += (size_t)n * st->n_slots;
+			len -= (size_t)n * st->n_slots;
+			continue;
+		}
+		n = st->n_slots - st->pos;
+		if (n > len)
+			n = len;
+		obst_k->run(st, st->pos, data, n);
+		if (n == st->n_slots) {
+			st->turns++;
+		} else {
+			for (i = st->pos; i < st->pos + n; ++i)
+				st->count[i]++;
+		}
+		st->pending++;
+		st->pos = (st->pos + n) % st->n_slots;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * Compute the statistics of every slot, it can be called at any time
+ * @out: n_slots entries
+ */
+void obst_read(struct obst *st, struct obst_slot *out)
+{
+	unsigned int i;
+	double m2;
+
+	obst_flush(st);
+	for (i = 0; i < st->n_slots; ++i) {
+		out[i].count = st->turns + st->count[i];
+		out[i].min = st->min[i];
+		out[i].max = st->max[i];
+		if (!out[i].count) {
+			out[i].mean = out[i].rms = out[i].std = 0;
+			continue;
+		}
+		out[i].mean = (double)st->sum[i] / out[i].count;
+		m2 = (double)st->sum2[i] / out[i].count;
+		out[i].rms = sqrt(m2);
+		m2 -= out[i].mean * out[i].mean;
+		out[i].std = m2 > 0 ? sqrt(m2) : 0;
+	}
+}
+
+/**
+ * Add the statistics of 'src' to 'dst', e.g. the partial results of
+ * several threads. The sums are integers: the result does not depend on
+ * the order of the merges.
+ * @return 0 on success, -1 when the turns are not the same
+ */
+int obst_merge(struct obst *dst, struct obst *src)
+{
+	unsigned int i;
+
+	if (dst->n_slots != src->n_slots) {
+		errno = EINVAL;
+		return -1;
+	}
+	obst_flush(dst);
+	obst_flush(src);
+	for (i = 0; i < dst->n_slots; ++i) {
+		dst->sum[i] += src->sum[i];
+		dst->sum2[i] += src->sum2[i];
+		dst->count[i] += src->count[i];
+		if (src->min[i] < dst->min[i])
+			dst->min[i] = src->min[i];
+		if (src->max[i] > dst->max[i])
+			dst->max[i] = src->max[i];
+	}
+	dst->turns += src->turns;
+	return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_STATS_H__
+#define __OBSBOX_STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Per bunch slot statistics over many turns. Samples are 8 bit unsigned
+ * (ssize 1); a turn has 'n_slots' samples and the sample following the
+ * last slot is slot 0 again. Pages are folded one after the other: the
+ * turn phase goes on from a page to the next one, obst_align() sets it
+ * from a marker.
+ *
+ * Sums are kept in 32 bit partial accumulators, that the vector kernels
+ * update in place, and they are flushed into 64 bit totals before they
+ * can overflow (a 8 bit square is at most 65025).
+ */
+#define OBST_FLUSH_TURNS 65536
+
+struct obst {
+	unsigned int n_slots;
+	unsigned int pos; /**< slot of the next sample */
+	unsigned int pending; /**< turns in the partial sums */
+	uint64_t turns; /**< full turns folded */
+	uint32_t *psum, *psum2; /**< partial sums */
+	uint64_t *sum, *sum2;
+	uint32_t *count; /**< samples on top of 'turns', per slot */
+	uint8_t *min, *max;
+};
+
+/**
+ * Statistics of one slot
+ */
+struct obst_slot {
+	uint64_t count;
+	double mean;
+	double rms; /**< root mean square */
+	double std; /**< standard deviation */
+	uint8_t min, max;
+};
+
+extern int obst_init(struct obst *st, unsigned int n_slots);
+extern void obst_free(struct obst *st);
+extern void obst_reset(struct obst *st);
+extern void obst_align(struct obst *st, uint32_t offset);
+extern void obst_fold(struct obst *st, const uint8_t *data, size_t len);
+extern void obst_read(struct obst *st, struct obst_slot *out);
+extern int obst_merge(struct obst *dst, struct obst *src);
+
+/* Kernel selection: "generic", "sse4.1", "avx2"; the best one by default */
+extern const char *obst_impl(void);
+extern int obst_impl_set(const char *name);
+
+#endif
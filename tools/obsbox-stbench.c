@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+#include "obsbox-common.h"
+#include "obsbox-stats.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+#define OBSB_PAGE_DEF (2 * 1024 * 1024)
+#define OBSB_NPAGES_DEF 64
+#define OBSB_TURN_DEF 3564
+#define OBSB_ROUNDS_DEF 4
+
+static const char *obsb_kernels[] = {"generic", "sse4.1", "avx2", NULL};
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-stbench [OPTIONS]\"\n");
+	fprintf(stderr, " -f <file>: raw pages to use (default: random samples)\n");
+	fprintf(stderr, " -p <number>: page size (default %d)\n", OBSB_PAGE_DEF);
+	fprintf(stderr, " -n <number>: number of pages (default %d)\n",
+		OBSB_NPAGES_DEF);
+	fprintf(stderr, " -T <number>: slots per turn (default %d)\n",
+		OBSB_TURN_DEF);
+	fprintf(stderr, " -r <number>: rounds over the pages (default %d)\n",
+		OBSB_ROUNDS_DEF);
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It measures the per slot statistics kernels against a plain scalar\n"
+			"loop and against reading the same memory, and checks the results\n");
+	exit(1);
+}
+
+
+/**
+ * The loop users write on top of obsbox-dump, the reference
+ */
+static void obsb_scalar(const uint8_t *data, size_t len, unsigned int turn,
+			uint64_t *pos, uint64_t *sum, uint64_t *sum2,
+			uint8_t *min, uint8_t *max, uint64_t *count)
+{
+	unsigned int s;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		s = (*pos)++ % turn;
+		sum[s] += data[i];
+		sum2[s] += data[i] * data[i];
+		if (data[i] < min[s])
+			min[s] = data[i];
+		if (data[i] > max[s])
+			max[s] = data[i];
+		count[s]++;
+	}
+}
+
+/**
+ * Read every byte, the bandwidth to compare with
+ */
+static uint64_t obsb_read(const uint8_t *data, size_t len)
+{
+	uint64_t acc = 0, v;
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&v, data + i, 8);
+		acc += v;
+	}
+	return acc;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int n_pages = OBSB_NPAGES_DEF, turn = OBSB_TURN_DEF;
+	unsigned int rounds = OBSB_ROUNDS_DEF, i, k, s;
+	size_t page_size = OBSB_PAGE_DEF, done;
+	uint64_t *sum, *sum2, *count, pos = 0, t, acc = 0;
+	uint8_t **pages, *min, *max;
+	struct obst_slot *res;
+	struct obst st;
+	uint32_t rnd = 12345;
+	const char *file = NULL;
+	double bytes, base;
+	int c, ret, fd, err = 0;
+	ssize_t r;
+
+	while ((c = getopt (argc, argv, "hf:p:n:T:r:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%zu", &page_size);
+			if (ret != 1 || !page_size)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%u", &n_pages);
+			if (ret != 1 || !n_pages)
+				help();
+			break;
+		case 'T':
+			ret = sscanf(optarg, "%u", &turn);
+			if (ret != 1 || !turn)
+				help();
+			break;
+		case 'r':
+			ret = sscanf(optarg, "%u", &rounds);
+			if (ret != 1 || !rounds)
+				help();
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+
+	fd = file ? open(file, O_RDONLY) : -1;
+	if (file && fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+		exit(1);
+	}
+	pages = calloc(n_pages, sizeof(*pages));
+	if (!pages)
+		exit(1);
+	for (i = 0; i < n_pages; ++i) {
+		if (posix_memalign((void **)&pages[i], 64, page_size))
+			exit(1);
+		for (done = 0; fd >= 0 && done < page_size; done += r) {
+			r = read(fd, pages[i] + done, page_size - done);
+			if (r <= 0) {
+				fprintf(stderr, "Cannot read %u pages from %s\n",
+					n_pages, file);
+				exit(1);
+			}
+		}
+		for (done = 0; fd < 0 && done < page_size; ++done) {
+			rnd = rnd * 1103515245 + 12345;
+			pages[i][done] = rnd >> 16;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	sum = calloc(turn, sizeof(*sum));
+	sum2 = calloc(turn, sizeof(*sum2));
+	count = calloc(turn, sizeof(*count));
+	min = malloc(turn);
+	max = calloc(turn, 1);
+	res = calloc(turn, sizeof(*res));
+	if (!sum || !sum2 || !count || !min || !max || !res ||
+	    obst_init(&st, turn))
+		exit(1);
+	memset(min, 0xFF, turn);
+
+	bytes = (double)n_pages * page_size * rounds;
+	printf("%u pages of %zu bytes, %u slots per turn, %u rounds\n",
+	       n_pages, page_size, turn, rounds);
+	printf("%-10s %10s %8s %s\n", "kernel", "MB/s", "x-read", "check");
+
+	t = obsbox_now_ns();
+	for (k = 0; k < rounds; ++k)
+		for (i = 0; i < n_pages; ++i)
+			acc += obsb_read(pages[i], page_size);
+	base = bytes / ((obsbox_now_ns() - t) / 1e3);
+	printf("%-10s %10.1f %8.2f (%llx)\n", "read", base, 1.0,
+	       (unsigned long long)(acc & 0xF));
+
+	t = obsbox_now_ns();
+	for (k = 0; k < rounds; ++k)
+		for (i = 0; i < n_pages; ++i)
+			obsb_scalar(pages[i], page_size, turn, &pos, sum, sum2,
+				    min, max, count);
+	t = obsbox_now_ns() - t;
+	printf("%-10s %10.1f %8.2f reference\n", "scalar", bytes / (t / 1e3),
+	       bytes / (t / 1e3) / base);
+
+	for (c = 0; obsb_kernels[c]; ++c) {
+		if (obst_impl_set(obsb_kernels[c])) {
+			printf("%-10s %10s\n", obsb_kernels[c], "n/a");
+			continue;
+		}
+		obst_reset(&st);
+		obst_align(&st, 0);
+		t = obsbox_now_ns();
+		for (k = 0; k < rounds; ++k)
+			for (i = 0; i < n_pages; ++i)
+				obst_fold(&st, pages[i], page_size);
+		obst_read(&st, res);
+		t = obsbox_now_ns() - t;
+
+		for (s = 0; s < turn; ++s)
+			if (res[s].count != count[s] || res[s].min != min[s] ||
+			    res[s].max != max[s] ||
+			    res[s].mean != (double)sum[s] / count[s] ||
+			    (uint64_t)(res[s].rms * res[s].rms * count[s] + 0.5) !=
+			    sum2[s])
+				break;
+		printf("%-10s %10.1f %8.2f %s\n", obsb_kernels[c],
+		       bytes / (t / 1e3), bytes / (t / 1e3) / base,
+		       s == turn ? "ok" : "MISMATCH");
+		if (s != turn)
+			err = 1;
+	}
+
+	exit(err);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "obsbox-uring.h"
+
+static int obu_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int obu_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		     unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+
+/**
+ * Create a ring with the given number of submission entries
+ * @return 0 on success, -1 on error and errno is appropriately set.
+ */
+int obu_init(struct obu_ring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int err;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = obu_setup(entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->sq_entries = p.sq_entries;
+	ring->cq_entries = p.cq_entries;
+
+	ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_sz = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		goto err_sq;
+	ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_CQ_RING);
+	if (ring->cq_ring == MAP_FAILED)
+		goto err_cq;
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto err_sqes;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	return 0;
+
+err_sqes:
+	err = errno;
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+	errno = err;
+err_cq:
+	err = errno;
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	errno = err;
+err_sq:
+	err = errno;
+	close(ring->fd);
+	errno = err;
+	return -1;
+}
+
+
+void obu_exit(struct obu_ring *ring)
+{
+	munmap(ring->sqes, ring->sqes_sz);
+	munmap(ring->cq_ring, ring->cq_ring_sz);
+	munmap(ring->sq_ring, ring->sq_ring_sz);
+	close(ring->fd);
+}
+
+
+/**
+ * Get the next free submission entry
+ * @return the entry, NULL when the submission queue is full
+ */
+struct io_uring_sqe *obu_get_sqe(struct obu_ring *ring)
+{
+	unsigned int head, idx;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries)
+		return NULL;
+
+	idx = ring->sq_local_tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	ring->sq_array[idx] = idx;
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+
+void obu_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf,
+		    unsigned int len, uint64_t offset, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+}
+
+
+void obu_prep_fsync(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_FSYNC;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+}
+
+
+/**
+ * Publish the prepared entries and optionally wait for completions
+ * @return number of submitted entries, -1 on error and errno is set
+ */
+int obu_submit(struct obu_ring *ring, unsigned int wait_nr)
+{
+	unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	/* Entries must be visible before the kernel sees the new tail */
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	do {
+		ret = obu_enter(ring->fd, ring->to_submit, wait_nr, flags);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	ring->to_submit -= ret;
+
+	return ret;
+}
+
+
+/**
+ * Consume one completion entry if any
+ * @return 1 when cqe is valid, 0 when the completion queue is empty
+ */
+int obu_peek_cqe(struct obu_ring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned int head, tail;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	if (head == tail)
+		return 0;
+
+	*cqe = ring->cqes[head & *ring->cq_mask];
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __OBSBOX_URING_H__
+#define __OBSBOX_URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/**
+ * Minimal io_uring wrapper built on the raw system calls, so the tools do
+ * not depend on liburing. It is not thread safe: one ring per thread.
+ */
+struct obu_ring {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int cq_entries;
+
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int sq_local_tail; /**< prepared but not yet submitted */
+	unsigned int to_submit;
+
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+extern int obu_init(struct obu_ring *ring, unsigned int entries);
+extern void obu_exit(struct obu_ring *ring);
+extern struct io_uring_sqe *obu_get_sqe(struct obu_ring *ring);
+extern void obu_prep_write(struct io_uring_sqe *sqe, int fd, const void *buf,
+			   unsigned int len, uint64_t offset,
+			   uint64_t user_data);
+extern void obu_prep_fsync(struct io_uring_sqe *sqe, int fd,
+			   uint64_t user_data);
+extern int obu_submit(struct obu_ring *ring, unsigned int wait_nr);
+extern int obu_peek_cqe(struct obu_ring *ring, struct io_uring_cqe *cqe);
+
+#endif
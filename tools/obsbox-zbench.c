@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) CERN 2014
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+
+#include "obsbox-common.h"
+#include "obsbox-compress.h"
+
+static char git_version[] = "version: " GIT_VERSION;
+
+#define OBZB_PAGE_DEF (2 * 1024 * 1024)
+#define OBZB_NPAGES_DEF 32
+#define OBZB_TURN_DEF 3564
+#define OBZB_ROUNDS_DEF 4
+
+static const char *obzb_specs_def[] = {
+	"lz", "delta", "shuffle", "delta+shuffle", NULL,
+};
+
+struct obzb_thread {
+	pthread_t thread;
+	const struct obz_params *p;
+	uint8_t **pages;
+	unsigned int first, n_pages, step, rounds;
+	size_t page_size;
+	uint8_t *out, *tmp;
+	uint64_t in, stored;
+	uint64_t cpu_ns; /**< thread CPU time */
+} __attribute__((aligned(64)));
+
+static void help()
+{
+	fprintf(stderr,
+		"Use: \"obsbox-zbench [OPTIONS]\"\n");
+	fprintf(stderr, " -f <file>: raw pages to compress (default: synthetic turns)\n");
+	fprintf(stderr, " -p <number>: page size (default %d)\n", OBZB_PAGE_DEF);
+	fprintf(stderr, " -n <number>: number of pages (default %d)\n",
+		OBZB_NPAGES_DEF);
+	fprintf(stderr, " -T <number>: synthetic data, samples per turn (default %d)\n",
+		OBZB_TURN_DEF);
+	fprintf(stderr, " -z <filter>[:<stride>]: compression to measure, it can be repeated\n"
+			"    (default: all the filters, delta stride is the turn length)\n");
+	fprintf(stderr, " -j <number>: compression threads (default 1)\n");
+	fprintf(stderr, " -r <number>: rounds over the pages (default %d)\n",
+		OBZB_ROUNDS_DEF);
+	fprintf(stderr, " -V: print version\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "It reports the compression ratio, the throughput and the throughput per\n"
+			"core (bytes over the CPU time of the threads). Every page is then\n"
+			"decompressed and checked once\n");
+	exit(1);
+}
+
+
+/**
+ * Synthetic 8 bit samples of a beam position monitor: the same filling
+ * pattern every turn, a slow betatron oscillation and some noise
+ */
+static void obzb_synth(uint8_t *buf, size_t len, unsigned int turn,
+		       uint64_t first_sample)
+{
+	static int8_t *pattern;
+	static unsigned int pattern_len;
+	uint32_t rnd = 0x12345678 ^ first_sample;
+	uint64_t s, t;
+	unsigned int b;
+	size_t i;
+
+	if (pattern_len != turn) {
+		free(pattern);
+		pattern = malloc(turn);
+		for (b = 0; b < turn; ++b) {
+			rnd = rnd * 1103515245 + 12345;
+			/* trains of bunches and gaps */
+			pattern[b] = (b % 80) < 72 ? 20 + ((rnd >> 16) & 7) : 0;
+		}
+		pattern_len = turn;
+	}
+	for (i = 0; i < len; ++i) {
+		s = first_sample + i;
+		t = s / turn;
+		b = s % turn;
+		rnd = rnd * 1103515245 + 12345;
+		buf[i] = 128 + (pattern[b] ?
+				pattern[b] * sin(t * 2 * M_PI * 0.31) : 0) +
+			 ((rnd >> 16) & 3) - 1;
+	}
+}
+
+static int obzb_load(const char *path, uint8_t **pages, unsigned int n,
+		     size_t page_size)
+{
+	unsigned int i;
+	size_t done;
+	ssize_t r;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < n; ++i) {
+		for (done = 0; done < page_size; done += r) {
+			r = read(fd, pages[i] + done, page_size - done);
+			if (r <= 0) {
+				close(fd);
+				errno = r ? errno : ENODATA;
+				return -1;
+			}
+		}
+	}
+	close(fd);
+
+	return 0;
+}
+
+
+static void *obzb_compress(void *arg)
+{
+	struct obzb_thread *th = arg;
+	struct timespec ts;
+	unsigned int r, i;
+	size_t n;
+
+	for (r = 0; r < th->rounds; ++r) {
+		for (i = th->first; i < th->n_pages; i += th->step) {
+			n = obz_compress(th->p, th->pages[i], th->page_size,
+					 th->out, th->tmp);
+			th->in += th->page_size;
+			th->stored += n ? n : th->page_size;
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	th->cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	return NULL;
+}
+
+/**
+ * Decompress every page once and compare it with the original
+ * @return the decompression time in ns, 0 on mismatch
+ */
+static uint64_t obzb_check(const struct obz_params *p, uint8_t **pages,
+			   unsigned int n_pages, size_t page_size)
+{
+	uint8_t *out, *back, *tmp;
+	uint64_t t, t_tot = 0;
+	unsigned int i;
+	size_t n;
+	int err = 0;
+
+	out = malloc(obz_bound(page_size));
+	back = malloc(page_size);
+	tmp = malloc(page_size);
+	if (!out || !back || !tmp)
+		exit(1);
+	for (i = 0; i < n_pages && !err; ++i) {
+		n = obz_compress(p, pages[i], page_size, out, tmp);
+		if (!n)
+			continue; /* stored as it is */
+		t = obsbox_now_ns();
+		err = obz_decompress(p, out, n, back, page_size, tmp);
+		t_tot += obsbox_now_ns() - t;
+		if (!err && memcmp(back, pages[i], page_size))
+			err = 1;
+	}
+	free(out);
+	free(back);
+	free(tmp);
+
+	return err ? 0 : t_tot + 1;
+}
+
+
+static int obzb_run(const char *spec, unsigned int turn, uint8_t **pages,
+		    unsigned int n_pages, size_t page_size,
+		    unsigned int n_threads, unsigned int rounds)
+{
+	struct obzb_thread *th;
+	struct obz_params p;
+	uint64_t t, in = 0, stored = 0, cpu_ns = 0, t_dec;
+	unsigned int i;
+	double dt;
+
+	if (obz_parse(&p, spec)) {
+		fprintf(stderr, "Invalid compression \"%s\"\n", spec);
+		return -1;
+	}
+	if ((p.filter & OBZ_DELTA) && !strchr(spec, ':'))
+		p.stride = turn;
+
+	/* one cache line per thread counters */
+	if (posix_memalign((void **)&th, 64, n_threads * sizeof(*th)))
+		return -1;
+	memset(th, 0, n_threads * sizeof(*th));
+	t = obsbox_now_ns();
+	for (i = 0; i < n_threads; ++i) {
+		th[i].p = &p;
+		th[i].pages = pages;
+		th[i].first = i;
+		th[i].step = n_threads;
+		th[i].n_pages = n_pages;
+		th[i].rounds = rounds;
+		th[i].page_size = page_size;
+		th[i].out = malloc(obz_bound(page_size));
+		th[i].tmp = malloc(page_size);
+		if (!th[i].out || !th[i].tmp)
+			exit(1);
+		if (pthread_create(&th[i].thread, NULL, obzb_compress, &th[i])) {
+			fprintf(stderr, "Cannot create thread\n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < n_threads; ++i) {
+		pthread_join(th[i].thread, NULL);
+		in += th[i].in;
+		stored += th[i].stored;
+		cpu_ns += th[i].cpu_ns;
+		free(th[i].out);
+		free(th[i].tmp);
+	}
+	dt = (obsbox_now_ns() - t) / 1e9;
+	free(th);
+
+	t_dec = obzb_check(&p, pages, n_pages, page_size);
+	printf("%-20s %7.2f %12.1f %12.1f %12.1f %s\n", spec,
+	       stored ? (double)in / stored : 0.0, in / dt / 1e6,
+	       cpu_ns ? in / (cpu_ns / 1e9) / 1e6 : 0.0,
+	       t_dec > 1 ? (double)n_pages * page_size / (t_dec / 1e9) / 1e6 : 0.0,
+	       t_dec ? "ok" : "MISMATCH");
+
+	return t_dec ? 0 : -1;
+}
+
+
+int main(int argc, char **argv)
+{
+	unsigned int n_pages = OBZB_NPAGES_DEF, turn = OBZB_TURN_DEF;
+	unsigned int n_threads = 1, rounds = OBZB_ROUNDS_DEF, i;
+	size_t page_size = OBZB_PAGE_DEF;
+	const char *specs[16], *file = NULL;
+	int c, ret, n_specs = 0, err = 0;
+	uint8_t **pages;
+
+	while ((c = getopt (argc, argv, "hf:p:n:T:z:j:r:V")) != -1)
+	{
+		switch(c)
+		{
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			ret = sscanf(optarg, "%zu", &page_size);
+			if (ret != 1 || !page_size)
+				help();
+			break;
+		case 'n':
+			ret = sscanf(optarg, "%u", &n_pages);
+			if (ret != 1 || !n_pages)
+				help();
+			break;
+		case 'T':
+			ret = sscanf(optarg, "%u", &turn);
+			if (ret != 1 || !turn || turn > 0xFFFF)
+				help();
+			break;
+		case 'z':
+			if (n_specs == 15)
+				help();
+			specs[n_specs++] = optarg;
+			break;
+		case 'j':
+			ret = sscanf(optarg, "%u", &n_threads);
+			if (ret != 1 || !n_threads)
+				help();
+			break;
+		case 'r':
+			ret = sscanf(optarg, "%u", &rounds);
+			if (ret != 1 || !rounds)
+				help();
+			break;
+		case 'V':
+			printf("%s %s\n", argv[0], git_version);
+			exit(0);
+		default:
+			help();
+		}
+	}
+	if (!n_specs)
+		for (; obzb_specs_def[n_specs]; ++n_specs)
+			specs[n_specs] = obzb_specs_def[n_specs];
+
+	pages = calloc(n_pages, sizeof(*pages));
+	if (!pages)
+		exit(1);
+	for (i = 0; i < n_pages; ++i) {
+		pages[i] = malloc(page_size);
+		if (!pages[i])
+			exit(1);
+		if (!file)
+			obzb_synth(pages[i], page_size, turn,
+				   (uint64_t)i * page_size);
+	}
+	if (file && obzb_load(file, pages, n_pages, page_size)) {
+		fprintf(stderr, "Cannot read %u pages from %s: %s\n", n_pages,
+			file, strerror(errno));
+		exit(1);
+	}
+
+	printf("%u pages of %zu bytes, %u threads\n", n_pages, page_size,
+	       n_threads);
+	printf("%-20s %7s %12s %12s %12s\n", "compression", "ratio",
+	       "comp-MB/s", "MB/s/core", "decomp-MB/s");
+	for (c = 0; c < n_specs; ++c)
+		if (obzb_run(specs[c], turn, pages, n_pages, page_size,
+			     n_threads, rounds))
+			err = 1;
+
+	exit(err);
+}